@@ -0,0 +1,473 @@
+#!/usr/bin/env python3
+"""Push a script or bytecode image to one or more devices over UDP or HTTP.
+
+Implements the host side of the deploy protocol described in include/deploy.h:
+chunks go out in small bursts, each followed by a STATUS request; the device
+answers with the chunks it is missing, which are resent before the next burst.
+Once everything is stored, COMMIT makes the device check the image CRC,
+install it and, unless --no-launch is given, start it.
+
+    ./deploy.py 192.168.1.40 blink.js
+    ./deploy.py 192.168.1.40 192.168.1.41 blink.js
+    ./deploy.py --drop 0.2 192.168.1.40 blink.js    # exercise retransmission
+
+With --rollout the image goes to every device in the fleet at once over
+multicast, signed with the fleet key, optionally in waves; the chunks are
+sent once and only the ones some device missed are repeated:
+
+    ./deploy.py --rollout --key-file fleet.key --waves 4 blink.js
+    ./deploy.py --rollout --key-file fleet.key --name /app.jsbc build/app.jsbc
+
+Once a device has a fleet key it refuses unsigned deployments. Given a key,
+the hosts form sends each device a signed rollout of its own, and --http
+signs the upload. HTTP VM control must be signed too; --post sends it:
+
+    ./deploy.py --key-file fleet.key 192.168.1.40 blink.js
+    ./deploy.py --http --key-file fleet.key 192.168.1.40 blink.js
+    ./deploy.py --http --key-file fleet.key --post /vms/0/stop 192.168.1.40
+
+Every signed request carries a counter that must be newer than the last one
+the device accepted; it is the time in microseconds, so keep the clock sane.
+Bytecode (.jsbc) is only accepted from a signed rollout.
+"""
+
+import argparse
+import collections
+import hashlib
+import hmac
+import http.client
+import json
+import os
+import random
+import socket
+import struct
+import sys
+import time
+import urllib.parse
+import zlib
+
+MAGIC = 0x4A44
+VERSION = 2
+
+BEGIN, CHUNK, STATUS, COMMIT, ABORT, ANNOUNCE = 1, 2, 3, 4, 5, 6
+ACK, MISSING, DONE, ERROR, REPORT = 0x81, 0x82, 0x83, 0x84, 0x85
+RECEIVING, FINISHED, FAILED = 1, 2, 3
+
+GROUP = "239.255.74.68"
+GROUP_PORT = 1338
+
+FLAG_LAUNCH = 0x01
+ANNOUNCE_ROUNDS = 3
+MAX_IMAGE = 256 * 1024
+
+ERRORS = {
+    1: "device busy with another deployment",
+    2: "invalid name, size or chunk size",
+    3: "not enough space",
+    4: "flash write failed",
+    5: "image CRC mismatch",
+    6: "installed, but the VM failed to start; see the device log",
+    7: "session unknown to the device",
+    8: "fleet key not set on the device, a different one, or unsigned bytecode",
+    9: "counter not newer than the device's last signed request; check the clock",
+}
+
+
+class DeployError(Exception):
+    pass
+
+
+class Session:
+    def __init__(self, host, port, timeout, retries, drop):
+        self.address = (host, port)
+        self.id = random.randint(1, 0xFFFFFFFF)
+        self.retries = retries
+        self.drop = drop
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.settimeout(timeout)
+
+    def send(self, kind, payload=b""):
+        self.sock.sendto(struct.pack("<HBBI", MAGIC, VERSION, kind, self.id) + payload, self.address)
+
+    def request(self, kind, payload=b""):
+        """Sends a request until a reply for this session arrives."""
+        for _ in range(self.retries):
+            self.send(kind, payload)
+            try:
+                while True:
+                    data, _ = self.sock.recvfrom(2048)
+                    if len(data) < 8:
+                        continue
+                    magic, version, reply, session = struct.unpack_from("<HBBI", data)
+                    if magic == MAGIC and version == VERSION and session == self.id:
+                        if reply == ERROR:
+                            raise DeployError(ERRORS.get(data[8], "error %d" % data[8]))
+                        return reply, data[8:]
+            except socket.timeout:
+                continue
+        raise DeployError("no reply from %s:%d" % self.address)
+
+    def missing(self, kind, payload=b""):
+        reply, body = self.request(kind, payload)
+        if reply != MISSING:
+            return reply, body, []
+        stored, count = struct.unpack_from("<IH", body)
+        return reply, stored, list(struct.unpack_from("<%dI" % count, body, 6))
+
+
+def deploy(host, args, image, name):
+    session = Session(host, args.port, args.timeout, args.retries, args.drop)
+    flags = 0 if args.no_launch else FLAG_LAUNCH
+    chunks = [image[i:i + args.chunk] for i in range(0, len(image), args.chunk)]
+    encoded = name.encode()
+    begin = struct.pack("<IIHBB", len(image), zlib.crc32(image), args.chunk, flags, len(encoded)) + encoded
+    if session.request(BEGIN, begin)[0] != ACK:
+        raise DeployError("unexpected reply to BEGIN")
+
+    def send_chunk(index):
+        if random.random() >= session.drop:
+            data = chunks[index]
+            session.send(CHUNK, struct.pack("<II", index, zlib.crc32(data)) + data)
+
+    sent = 0
+    resend = []
+    retransmitted = 0
+    try:
+        while True:
+            # A burst is sized to fit the device's 4 KB receive queue
+            burst = resend[:args.window]
+            retransmitted += len(burst)
+            while len(burst) < args.window and sent < len(chunks):
+                burst.append(sent)
+                sent += 1
+            for index in burst:
+                send_chunk(index)
+
+            if burst:
+                _, _, resend = session.missing(STATUS, struct.pack("<I", sent))
+                if resend or sent < len(chunks):
+                    continue
+
+            reply, body, resend = session.missing(COMMIT)
+            if reply == DONE:
+                return struct.unpack_from("<b", body)[0], retransmitted
+            if reply != MISSING:
+                raise DeployError("unexpected reply to COMMIT")
+    except BaseException:
+        session.send(ABORT)
+        raise
+
+
+def next_counter():
+    """A counter for a signed request; devices only accept ever larger ones."""
+    return time.time_ns() // 1000
+
+
+class Rollout:
+    """One wave of a multicast rollout; devices are told apart by their id.
+
+    Sent to a single device's group port instead, it is a signed deployment
+    to that device alone.
+    """
+
+    def __init__(self, args, image, name, key, wave, waves, destination, counter):
+        self.args = args
+        self.group = destination
+        self.id = random.randint(1, 0xFFFFFFFF)
+        self.chunks = [image[i:i + args.chunk] for i in range(0, len(image), args.chunk)]
+        self.devices = {}      # device id -> (state, value)
+        self.last_sent = {}     # chunk index -> time it was last multicast
+        self.repairs = collections.OrderedDict()
+        self.repaired = 0
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, args.ttl)
+        if args.interface:
+            self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+
+        flags = 0 if args.no_launch else FLAG_LAUNCH
+        encoded = name.encode()
+        announce = self.header(ANNOUNCE) + struct.pack("<QIHBBBB", counter, len(image), args.chunk, flags,
+                                                       len(encoded), wave, waves) + hashlib.sha256(image).digest() + encoded
+        self.announcement = announce + hmac.new(key, announce, hashlib.sha256).digest()
+
+    def header(self, kind):
+        return struct.pack("<HBBI", MAGIC, VERSION, kind, self.id)
+
+    def send(self, kind, payload=b""):
+        self.sock.sendto(self.header(kind) + payload, self.group)
+
+    def send_chunk(self, index):
+        self.last_sent[index] = time.monotonic()
+        if random.random() >= self.args.drop:
+            data = self.chunks[index]
+            self.send(CHUNK, struct.pack("<II", index, zlib.crc32(data)) + data)
+
+    def collect(self, timeout):
+        """Reads reports for up to timeout seconds, queueing the chunks devices miss."""
+        deadline = time.monotonic() + timeout
+        while True:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return
+            self.sock.settimeout(remaining)
+            try:
+                data, _ = self.sock.recvfrom(2048)
+            except socket.timeout:
+                return
+            if len(data) < 14:
+                continue
+            magic, version, kind, session, device, state, value = struct.unpack_from("<HBBIIBb", data)
+            if magic != MAGIC or version != VERSION or kind != REPORT or session != self.id:
+                continue
+            if self.devices.get(device, (RECEIVING,))[0] == RECEIVING:
+                self.devices[device] = (state, value)
+            if state == RECEIVING and len(data) >= 20:
+                count = struct.unpack_from("<H", data, 18)[0]
+                now = time.monotonic()
+                for index in struct.unpack_from("<%dI" % count, data, 20):
+                    # Several devices usually miss the same chunk; send it once
+                    if index < len(self.chunks) and now - self.last_sent.get(index, 0) > self.args.timeout:
+                        self.repairs[index] = True
+
+    def receiving(self):
+        return [device for device, (state, _) in self.devices.items() if state == RECEIVING]
+
+    def stream(self, indexes):
+        """Multicasts chunks at the configured rate, asking for NAKs as it goes."""
+        interval = self.args.chunk / (self.args.rate * 1024.0)
+        for n, index in enumerate(indexes):
+            self.send_chunk(index)
+            if n % 16 == 15:
+                self.send(STATUS, struct.pack("<I", index + 1))
+            self.collect(interval)
+
+    def repair(self):
+        while self.repairs:
+            batch = list(self.repairs)
+            self.repairs.clear()
+            self.repaired += len(batch)
+            self.stream(batch)
+
+    def run(self):
+        try:
+            # Devices answer every announcement, so a few rounds find the wave
+            for _ in range(ANNOUNCE_ROUNDS):
+                self.sock.sendto(self.announcement, self.group)
+                self.collect(self.args.timeout)
+            # Devices that refused the announcement take no further part
+            if not self.receiving():
+                return
+
+            self.stream(range(len(self.chunks)))
+            for _ in range(self.args.retries):
+                self.repair()
+                self.send(STATUS, struct.pack("<I", len(self.chunks)))
+                self.collect(self.args.timeout)
+                if not self.repairs:
+                    break
+
+            for _ in range(self.args.retries):
+                if not self.receiving():
+                    break
+                self.repair()
+                self.send(COMMIT)
+                self.collect(self.args.timeout)
+        except BaseException:
+            self.send(ABORT)
+            raise
+        if self.receiving():
+            self.send(ABORT)
+
+
+def load_key(args):
+    """The fleet key from --key-file or DEPLOY_KEY, or None if neither is given."""
+    key_hex = open(args.key_file).read().strip() if args.key_file else os.environ.get("DEPLOY_KEY", "")
+    if not key_hex:
+        return None
+    try:
+        key = bytes.fromhex(key_hex)
+    except ValueError:
+        key = b""
+    if len(key) != 32:
+        raise DeployError("the fleet key must be 64 hex digits, from --key-file or DEPLOY_KEY")
+    return key
+
+
+def signed_deploy(host, args, image, name, key):
+    """A rollout sent to one device, for devices that have a fleet key."""
+    session = Rollout(args, image, name, key, 0, 1, (host, args.group_port), next_counter())
+    session.run()
+    if not session.devices:
+        raise DeployError("no reply from %s:%d" % session.group)
+    state, value = next(iter(session.devices.values()))
+    if state == FAILED:
+        raise DeployError(ERRORS.get(value, "error %d" % value))
+    if state != FINISHED:
+        raise DeployError("no answer to COMMIT")
+    return value, session.repaired
+
+
+def http_deploy(host, args, image, name, key):
+    """Uploads with PUT /files, signed when there is a key."""
+    start = 0 if args.no_launch else 1
+    target = "/files" + urllib.parse.quote(name) + ("?start=1" if start else "")
+    headers = {"Content-Type": "application/octet-stream"}
+    if key:
+        counter = next_counter()
+        message = ("PUT %s\n%d\n%d\n" % (name, start, counter)).encode() + hashlib.sha256(image).digest()
+        headers["X-Deploy-Counter"] = str(counter)
+        headers["X-Deploy-Signature"] = hmac.new(key, message, hashlib.sha256).hexdigest()
+    connection = http.client.HTTPConnection(host, args.http_port, timeout=30)
+    try:
+        connection.request("PUT", target, image, headers)
+        response = connection.getresponse()
+        body = json.loads(response.read() or b"{}")
+    finally:
+        connection.close()
+    if response.status != 201:
+        raise DeployError("HTTP %d: %s" % (response.status, body.get("error", response.reason)))
+    return body.get("vm", -1), 0
+
+
+def http_post(host, args, target, key):
+    """Sends a VM control request such as POST /vms/0/stop, signed when there is a key."""
+    headers = {}
+    if key:
+        counter = next_counter()
+        message = ("POST %s\n%d\n" % (target, counter)).encode()
+        headers["X-Deploy-Counter"] = str(counter)
+        headers["X-Deploy-Signature"] = hmac.new(key, message, hashlib.sha256).hexdigest()
+    connection = http.client.HTTPConnection(host, args.http_port, timeout=30)
+    try:
+        connection.request("POST", target, headers=headers)
+        response = connection.getresponse()
+        body = json.loads(response.read() or b"{}")
+    finally:
+        connection.close()
+    if response.status not in (200, 201):
+        raise DeployError("HTTP %d: %s" % (response.status, body.get("error", response.reason)))
+    return body
+
+
+def rollout(args, image, name, key):
+    if not key:
+        raise DeployError("a rollout needs the fleet key, from --key-file or DEPLOY_KEY")
+
+    failed = 0
+    counter = next_counter()
+    for wave in range(args.waves):
+        started = time.monotonic()
+        session = Rollout(args, image, name, key, wave, args.waves, (args.group, args.group_port), counter)
+        session.run()
+        done = 0
+        for device, (state, value) in sorted(session.devices.items()):
+            if state == FINISHED:
+                done += 1
+                result = "started as VM %d" % value if value >= 0 else "installed"
+            elif state == FAILED:
+                result = ERRORS.get(value, "error %d" % value)
+            else:
+                result = "no answer to COMMIT"
+            print("  %08x: %s" % (device, result))
+        failed += len(session.devices) - done
+        print("wave %d/%d: %d of %d devices updated in %.1f s (%d chunks, %d repaired)" % (
+            wave + 1, args.waves, done, len(session.devices), time.monotonic() - started,
+            len(session.chunks), session.repaired))
+        if len(session.devices) > done and not args.keep_going:
+            raise DeployError("stopping after wave %d; use --keep-going to continue past failures" % (wave + 1))
+    return failed
+
+
+def post(parser, args):
+    if not args.http or args.rollout:
+        parser.error("--post needs --http and hosts")
+    try:
+        key = load_key(args)
+    except DeployError as e:
+        parser.error(str(e))
+    failed = 0
+    for host in args.hosts + [args.file]:
+        try:
+            vm = http_post(host, args, args.post, key)
+            print("%s: VM %d %s %s" % (host, vm["id"], vm["file"], "running" if vm["running"] else "stopped"))
+        except DeployError as e:
+            print("%s: %s" % (host, e), file=sys.stderr)
+            failed += 1
+    sys.exit(1 if failed else 0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("hosts", nargs="*", metavar="host")
+    parser.add_argument("file")
+    parser.add_argument("--name", help="path on the device (default: /<file name>); .jsbc means bytecode")
+    parser.add_argument("--port", type=int, default=1337)
+    parser.add_argument("--chunk", type=int, default=1024, help="chunk size, 128..1024 bytes")
+    parser.add_argument("--window", type=int, default=3, help="chunks per burst")
+    parser.add_argument("--timeout", type=float, default=0.5, help="seconds to wait for a reply")
+    parser.add_argument("--retries", type=int, default=10)
+    parser.add_argument("--no-launch", action="store_true", help="install without starting")
+    parser.add_argument("--drop", type=float, default=0.0, help="fraction of chunks to drop on purpose")
+    parser.add_argument("--http", action="store_true", help="upload to the hosts with HTTP PUT instead")
+    parser.add_argument("--http-port", type=int, default=80)
+    parser.add_argument("--post", metavar="TARGET", help="with --http, send a VM control request such as /vms/0/stop "
+                        "instead of a file; every argument is then a host")
+    rollout_options = parser.add_argument_group("fleet rollout")
+    rollout_options.add_argument("--rollout", action="store_true", help="multicast to every device instead of hosts")
+    rollout_options.add_argument("--key-file", help="file holding the 64 hex digit fleet key (default: $DEPLOY_KEY); "
+                                 "with hosts, deployments are signed")
+    rollout_options.add_argument("--waves", type=int, default=1, help="split the fleet into this many waves")
+    rollout_options.add_argument("--keep-going", action="store_true", help="start the next wave despite failures")
+    rollout_options.add_argument("--rate", type=float, default=64, help="multicast rate in KB/s")
+    rollout_options.add_argument("--group", default=GROUP)
+    rollout_options.add_argument("--group-port", type=int, default=GROUP_PORT)
+    rollout_options.add_argument("--interface", help="local address to multicast from")
+    rollout_options.add_argument("--ttl", type=int, default=1)
+    args = parser.parse_args()
+    if args.post:
+        post(parser, args)
+    if args.rollout == bool(args.hosts):
+        parser.error("give either hosts or --rollout")
+    if args.rollout and args.http:
+        parser.error("--http needs hosts")
+    if not 1 <= args.waves <= 255:
+        parser.error("--waves must be 1..255")
+
+    with open(args.file, "rb") as f:
+        image = f.read()
+    name = args.name or "/" + os.path.basename(args.file)
+    if not 128 <= args.chunk <= 1024 or len(image) > MAX_IMAGE:
+        parser.error("chunk size must be 128..1024 and the image at most %d bytes" % MAX_IMAGE)
+    try:
+        key = load_key(args)
+    except DeployError as e:
+        parser.error(str(e))
+    if name.endswith(".jsbc") and (args.http or not key):
+        parser.error("bytecode is only accepted from a signed rollout; give the fleet key and no --http")
+
+    if args.rollout:
+        try:
+            sys.exit(1 if rollout(args, image, name, key) else 0)
+        except DeployError as e:
+            print(e, file=sys.stderr)
+            sys.exit(1)
+
+    failed = 0
+    for host in args.hosts:
+        try:
+            if args.http:
+                vm, retransmitted = http_deploy(host, args, image, name, key)
+            elif key:
+                vm, retransmitted = signed_deploy(host, args, image, name, key)
+            else:
+                vm, retransmitted = deploy(host, args, image, name)
+            started = "started as VM %d" % vm if vm >= 0 else "installed"
+            print("%s: %s %s (%d bytes, %d chunks resent)" % (host, name, started, len(image), retransmitted))
+        except DeployError as e:
+            print("%s: %s" % (host, e), file=sys.stderr)
+            failed += 1
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
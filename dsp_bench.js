@@ -0,0 +1,202 @@
+// dsp_bench.js
+// Times each dsp kernel against the same computation written in plain
+// JavaScript, on the device, and prints the per-block cost of both. Upload it
+// like any other script; results appear on the serial console.
+
+var BLOCK = 256;
+var TAPS = 32;
+var FFT_POINTS = 256;
+var RUNS = 20;
+
+var input = new Float32Array(BLOCK);
+for (var i = 0; i < BLOCK; i++) {
+  input[i] = Math.sin(i * 0.1) + 0.25 * Math.sin(i * 1.7);
+}
+
+// Runs fn RUNS times on a fresh copy of input and returns microseconds per run
+function timeBlock(fn, data) {
+  var total = 0;
+  for (var run = 0; run < RUNS; run++) {
+    data.set(input);
+    var start = micros();
+    fn(data);
+    total += micros() - start;
+  }
+  return total / RUNS;
+}
+
+function report(name, nativeUs, jsUs) {
+  print(name + ": native " + nativeUs.toFixed(1) + " us, js " + jsUs.toFixed(1) +
+    " us, " + (jsUs / nativeUs).toFixed(1) + "x");
+}
+
+// === JS reference kernels ===
+
+function jsFir(data, out, coeffs, state) {
+  var taps = coeffs.length;
+  for (var i = 0; i < data.length; i++) {
+    var acc = 0;
+    for (var k = 0; k < taps; k++) {
+      var j = i - k;
+      acc += coeffs[k] * (j >= 0 ? data[j] : state[taps - 1 + j]);
+    }
+    out[i] = acc;
+  }
+  for (var k = 0; k < taps - 1; k++) {
+    state[k] = data[data.length - taps + 1 + k];
+  }
+}
+
+function jsBiquad(data, c, state) {
+  var w0 = state[0], w1 = state[1];
+  for (var i = 0; i < data.length; i++) {
+    var d0 = data[i] - c[3] * w0 - c[4] * w1;
+    data[i] = c[0] * d0 + c[1] * w0 + c[2] * w1;
+    w1 = w0;
+    w0 = d0;
+  }
+  state[0] = w0;
+  state[1] = w1;
+}
+
+function jsFft(data) {
+  var n = data.length / 2;
+  for (var i = 1, j = 0; i < n; i++) {
+    var bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      var t = data[2 * i]; data[2 * i] = data[2 * j]; data[2 * j] = t;
+      t = data[2 * i + 1]; data[2 * i + 1] = data[2 * j + 1]; data[2 * j + 1] = t;
+    }
+  }
+  for (var len = 2; len <= n; len <<= 1) {
+    var angle = -2 * Math.PI / len;
+    for (var start = 0; start < n; start += len) {
+      for (var k = 0; k < len / 2; k++) {
+        var wr = Math.cos(angle * k), wi = Math.sin(angle * k);
+        var a = 2 * (start + k), b = 2 * (start + k + len / 2);
+        var xr = data[b] * wr - data[b + 1] * wi;
+        var xi = data[b] * wi + data[b + 1] * wr;
+        data[b] = data[a] - xr;
+        data[b + 1] = data[a + 1] - xi;
+        data[a] += xr;
+        data[a + 1] += xi;
+      }
+    }
+  }
+}
+
+function jsWindow(data) {
+  var n = data.length;
+  for (var i = 0; i < n; i++) {
+    data[i] *= 0.5 - 0.5 * Math.cos(2 * Math.PI * i / (n - 1));
+  }
+}
+
+function jsDecimate(data, out, factor) {
+  var count = Math.floor(data.length / factor);
+  for (var i = 0; i < count; i++) {
+    var sum = 0;
+    for (var k = 0; k < factor; k++) {
+      sum += data[i * factor + k];
+    }
+    out[i] = sum / factor;
+  }
+  return count;
+}
+
+function jsRms(data) {
+  var sum = 0;
+  for (var i = 0; i < data.length; i++) {
+    sum += data[i] * data[i];
+  }
+  return Math.sqrt(sum / data.length);
+}
+
+function jsMinMaxMean(data) {
+  var lo = data[0], hi = data[0], sum = 0;
+  for (var i = 0; i < data.length; i++) {
+    if (data[i] < lo) lo = data[i];
+    if (data[i] > hi) hi = data[i];
+    sum += data[i];
+  }
+  return [lo, hi, sum / data.length];
+}
+
+// === Benchmarks ===
+
+var data = new Float32Array(BLOCK);
+var out = new Float32Array(BLOCK);
+var coeffs = new Float32Array(TAPS);
+for (var i = 0; i < TAPS; i++) {
+  coeffs[i] = 1 / TAPS;
+}
+var firState = new Float32Array(TAPS - 1);
+var firScratch = new Float32Array(2 * TAPS + BLOCK - 1);
+var biquad = new Float32Array([0.0675, 0.1349, 0.0675, -1.1430, 0.4128]);
+var biquadState = new Float32Array(2);
+var complex = new Float32Array(2 * FFT_POINTS);
+var decimated = new Float32Array(BLOCK / 4);
+
+print("dsp benchmark: " + BLOCK + " samples, " + TAPS + " taps, " + FFT_POINTS +
+  "-point FFT, " + RUNS + " runs each");
+
+report("fir", timeBlock(function (d) {
+  dsp.fir(d, out, coeffs, firState, firScratch);
+}, data), timeBlock(function (d) {
+  jsFir(d, out, coeffs, firState);
+}, data));
+
+report("biquad", timeBlock(function (d) {
+  dsp.biquad(d, biquad, biquadState);
+}, data), timeBlock(function (d) {
+  jsBiquad(d, biquad, biquadState);
+}, data));
+
+report("window", timeBlock(function (d) {
+  dsp.window(d, "hann");
+}, data), timeBlock(jsWindow, data));
+
+// The FFT copies the block into the real parts of a complex buffer first
+function fillComplex(d) {
+  for (var i = 0; i < FFT_POINTS; i++) {
+    complex[2 * i] = d[i % BLOCK];
+    complex[2 * i + 1] = 0;
+  }
+}
+report("fft", timeBlock(function (d) {
+  fillComplex(d);
+  dsp.fft(complex);
+}, data), timeBlock(function (d) {
+  fillComplex(d);
+  jsFft(complex);
+}, data));
+
+report("decimate", timeBlock(function (d) {
+  dsp.decimate(d, decimated, 4);
+}, data), timeBlock(function (d) {
+  jsDecimate(d, decimated, 4);
+}, data));
+
+report("rms", timeBlock(dsp.rms, data), timeBlock(jsRms, data));
+
+report("min/max/mean", timeBlock(function (d) {
+  dsp.min(d);
+  dsp.max(d);
+  dsp.mean(d);
+}, data), timeBlock(jsMinMaxMean, data));
+
+// The first samples of the JS FIR read history from the previous run, so
+// compare a fresh block from both implementations as a sanity check
+var nativeOut = new Float32Array(BLOCK);
+var jsOut = new Float32Array(BLOCK);
+dsp.fir(input, nativeOut, coeffs, new Float32Array(TAPS - 1), firScratch);
+jsFir(input, jsOut, coeffs, new Float32Array(TAPS - 1));
+var worst = 0;
+for (var i = 0; i < BLOCK; i++) {
+  worst = Math.max(worst, Math.abs(nativeOut[i] - jsOut[i]));
+}
+print("fir max difference native vs js: " + worst);
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Measure FTP upload and download throughput against a device.
+
+Uploads a file of random bytes, downloads it again, checks that the copy is
+identical and prints the rate of each transfer, then removes the file. Run it
+again after changing the device's buffer size with the `ftp buffer` serial
+command to compare settings; the device log shows how long each transfer
+spent waiting for the flash.
+
+    ./ftp_bench.py 192.168.1.40
+    ./ftp_bench.py --size 1024 --runs 5 192.168.1.40
+"""
+
+import argparse
+import ftplib
+import io
+import os
+import statistics
+import sys
+import time
+
+
+def timed(action):
+    start = time.monotonic()
+    action()
+    return time.monotonic() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=21)
+    parser.add_argument("--user", default="esp32")
+    parser.add_argument("--password", default="esp32")
+    parser.add_argument("--size", type=int, default=256, help="file size in KB")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--name", default="bench.bin", help="file name on the device")
+    parser.add_argument("--active", action="store_true", help="use active instead of passive mode")
+    parser.add_argument("--block", type=int, default=8192, help="bytes handed to the socket per write")
+    args = parser.parse_args()
+
+    data = os.urandom(args.size * 1024)
+    ftp = ftplib.FTP()
+    ftp.connect(args.host, args.port, timeout=30)
+    ftp.login(args.user, args.password)
+    ftp.set_pasv(not args.active)
+
+    uploads, downloads = [], []
+    try:
+        for run in range(1, args.runs + 1):
+            seconds = timed(lambda: ftp.storbinary("STOR " + args.name, io.BytesIO(data), args.block))
+            uploads.append(len(data) / seconds / 1024)
+
+            received = io.BytesIO()
+            seconds = timed(lambda: ftp.retrbinary("RETR " + args.name, received.write, args.block))
+            downloads.append(len(data) / seconds / 1024)
+            if received.getvalue() != data:
+                print("run %d: downloaded file differs from the upload" % run, file=sys.stderr)
+                return 1
+
+            print("run %d: upload %.1f KB/s, download %.1f KB/s" % (run, uploads[-1], downloads[-1]))
+        ftp.delete(args.name)
+    finally:
+        ftp.close()
+
+    print("%d KB, median of %d runs: upload %.1f KB/s, download %.1f KB/s"
+          % (args.size, args.runs, statistics.median(uploads), statistics.median(downloads)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,185 @@
+// log_test.cpp
+// Runs the firmware's src/log_shipper.cpp against collectors listening on
+// 127.0.0.1: one RFC 5424 message per UDP datagram, RFC 6587 octet counting
+// over TCP, repeat folding and switching shipping off. Lines go in through
+// the vm_log sink, as the log drain task would feed them. See
+// host/run_tests.py.
+#include "include/log_shipper.h"
+#include "include/vm_log.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static bool check(const char* description, bool passed, const std::string& detail = "") {
+  printf("%s: %s%s\n", description, passed ? "ok" : "FAILED ", passed ? "" : detail.c_str());
+  fflush(stdout);
+  failures += !passed;
+  return passed;
+}
+
+// Settings are kept in the working directory, which host/run_tests.py
+// makes a fresh one
+const std::string& hostFsRoot() {
+  static const std::string root = ".";
+  return root;
+}
+
+static VMLogSink sink = nullptr;
+
+void vmLogSetSink(VMLogSink newSink) {
+  sink = newSink;
+}
+
+// One line through the sink, followed by the end of the drain pass
+static void logLine(int source, VMLogLevel level, const char* text) {
+  sink(source, level, millis(), "app", text, strlen(text));
+  sink(-1, VM_LOG_INFO, millis(), "", "", 0);
+}
+
+// === Collectors ===
+
+static int listener(int type, uint16_t* port) {
+  int fd = socket(AF_INET, type, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(fd, (sockaddr*)&address, sizeof(address));
+  socklen_t length = sizeof(address);
+  getsockname(fd, (sockaddr*)&address, &length);
+  *port = ntohs(address.sin_port);
+  if (type == SOCK_STREAM) {
+    listen(fd, 1);
+  }
+  return fd;
+}
+
+static bool readable(int fd, int timeoutMs) {
+  pollfd entry = { fd, POLLIN, 0 };
+  return poll(&entry, 1, timeoutMs) > 0;
+}
+
+// Waits for the next datagram; empty if none arrives
+static std::string datagram(int fd, int timeoutMs = 2000) {
+  char buffer[2048];
+  if (!readable(fd, timeoutMs)) {
+    return "";
+  }
+  int length = recv(fd, buffer, sizeof(buffer), 0);
+  return std::string(buffer, length > 0 ? length : 0);
+}
+
+static void configure(LogShipTransport transport, uint16_t port) {
+  LogShipConfig config = { transport, "127.0.0.1", port, 64, 100 };
+  logShipperConfigure(config);
+}
+
+static bool endsWith(const std::string& text, const std::string& suffix) {
+  return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// === Tests ===
+
+static void testUdp() {
+  uint16_t port;
+  int collector = listener(SOCK_DGRAM, &port);
+  configure(LOG_SHIP_UDP, port);
+
+  const int count = 6;
+  for (int i = 0; i < count; i++) {
+    logLine(i % 2, VM_LOG_INFO, ("line " + std::to_string(i)).c_str());
+  }
+  for (int i = 0; i < count; i++) {
+    std::string message = datagram(collector);
+    std::string expected = " host app vm" + std::to_string(i % 2) + " - - line " + std::to_string(i);
+    check("udp: each line is one datagram", message.rfind("<134>1 ", 0) == 0 && endsWith(message, expected), message);
+    check("udp: no line separators", message.find('\n') == std::string::npos, message);
+  }
+  check("udp: nothing more", datagram(collector, 300).empty());
+
+  logLine(0, VM_LOG_WARN, "warning");
+  check("udp: severity in the priority", datagram(collector).rfind("<132>1 ", 0) == 0);
+
+  // Identical lines fold into a repeat count, sent before the next line
+  for (int i = 0; i < 3; i++) {
+    logLine(1, VM_LOG_INFO, "again");
+  }
+  logLine(1, VM_LOG_INFO, "after");
+  check("udp: first of a run", endsWith(datagram(collector), " - - again"));
+  std::string repeat = datagram(collector);
+  check("udp: repeat count", endsWith(repeat, " - - last message repeated 2 times"), repeat);
+  check("udp: line after the run", endsWith(datagram(collector), " - - after"));
+
+  LogShipStats stats;
+  logShipperGetStats(&stats);
+  check("udp: counters", stats.lines == count + 4 && stats.folded == 2 && stats.dropped == 0 && stats.pendingBytes == 0,
+        std::to_string(stats.lines) + " lines, " + std::to_string(stats.folded) + " folded");
+
+  configure(LOG_SHIP_OFF, 0);
+  logLine(0, VM_LOG_INFO, "unshipped");
+  check("off: nothing sent", datagram(collector, 500).empty());
+  close(collector);
+}
+
+static void testTcp() {
+  uint16_t port;
+  int collector = listener(SOCK_STREAM, &port);
+  configure(LOG_SHIP_TCP, port);
+
+  const int count = 8;
+  for (int i = 0; i < count; i++) {
+    logLine(2, VM_LOG_INFO, ("stream " + std::to_string(i)).c_str());
+  }
+  int fd = readable(collector, 2000) ? accept(collector, nullptr, nullptr) : -1;
+  if (!check("tcp: connected", fd >= 0)) {
+    close(collector);
+    return;
+  }
+
+  // Read until every frame has arrived, then take the stream apart
+  std::string stream;
+  std::vector<std::string> messages;
+  char buffer[1024];
+  while (messages.size() < count && readable(fd, 2000)) {
+    int length = recv(fd, buffer, sizeof(buffer), 0);
+    if (length <= 0) {
+      break;
+    }
+    stream.append(buffer, length);
+    size_t space;
+    while ((space = stream.find(' ')) != std::string::npos) {
+      size_t size = strtoul(stream.c_str(), nullptr, 10);
+      if (stream.size() < space + 1 + size) {
+        break;
+      }
+      messages.push_back(stream.substr(space + 1, size));
+      stream.erase(0, space + 1 + size);
+    }
+  }
+  check("tcp: every frame", messages.size() == count, std::to_string(messages.size()) + " frames");
+  for (size_t i = 0; i < messages.size(); i++) {
+    check("tcp: octet-counted message", messages[i].rfind("<134>1 ", 0) == 0 &&
+          endsWith(messages[i], " host app vm2 - - stream " + std::to_string(i)), messages[i]);
+  }
+  check("tcp: no stray bytes", stream.empty(), stream);
+
+  configure(LOG_SHIP_OFF, 0);
+  close(fd);
+  close(collector);
+}
+
+int main() {
+  // lwIP has no SIGPIPE; a send to a closed peer just fails
+  signal(SIGPIPE, SIG_IGN);
+  logShipperBegin();
+  testUdp();
+  testTcp();
+  printf("%s\n", failures ? "FAILED" : "all passed");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""Run the firmware's deploy and message link code on this machine.
+
+There is no Linux build of the firmware, so this compiles src/deploy.cpp,
+src/msg_link.cpp and src/file_system.cpp against the stand-ins in host/ into
+a simulated device (host/node.cpp) and runs instances of it on loopback
+addresses with simulated loss. Each instance keeps its flash in a directory
+of its own. Needs g++ and the zlib and OpenSSL headers.
+
+    host/loopback.py rollout                 # fleet rollout time against fleet size
+    host/loopback.py rollout --devices 3 24 --loss 0.1
+    host/loopback.py deploy                  # signed, unsigned and replayed deployments
+    host/loopback.py link --messages 2000 --loss 0.3
+"""
+
+import argparse
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HOST = os.path.dirname(os.path.abspath(__file__))
+REPO = os.path.dirname(HOST)
+sys.path.insert(0, REPO)
+import deploy  # noqa: E402
+
+SOURCES = ["host/node.cpp", "host/stubs.cpp", "host/rtos.cpp", "host/net_loopback.cpp",
+           "src/deploy.cpp", "src/msg_link.cpp", "src/file_system.cpp"]
+KEY = "5e" * 32
+
+
+def build(work):
+    binary = os.path.join(work, "node")
+    command = ["g++", "-std=gnu++17", "-O2", "-Wall", "-Wno-unused-parameter", "-Wno-deprecated-declarations",
+               "-I" + os.path.join(HOST, "sdk"), "-I" + REPO, "-I" + os.path.join(REPO, "components/duktape/include"),
+               "-o", binary] + [os.path.join(REPO, source) for source in SOURCES] + ["-lz", "-lcrypto"]
+    subprocess.run(command, check=True)
+    return binary
+
+
+class Node:
+    """One simulated device on its own loopback address."""
+
+    def __init__(self, work, binary, address, mac, options, loss=0.0, run_ms=60000):
+        self.address = address
+        self.root = os.path.join(work, address)
+        os.makedirs(self.root, exist_ok=True)
+        # The device id is bytes 2..5 of the MAC
+        environment = dict(os.environ, FS_ROOT=self.root, MAC="%012x" % (mac << 16), HOST_ADDRESS=address,
+                           LOSS=str(loss))
+        self.log = open(self.root + ".log", "w+")
+        self.process = subprocess.Popen([binary, "--run-ms", str(run_ms)] + options, env=environment,
+                                        stdout=self.log, stderr=subprocess.STDOUT)
+
+    def file(self, name):
+        path = self.root + name
+        return open(path, "rb").read() if os.path.exists(path) else None
+
+    def stop(self):
+        if self.process.poll() is None:
+            self.process.terminate()
+        self.process.wait()
+        self.log.seek(0)
+        return self.log.read()
+
+
+def run_deploy(*arguments, key=None):
+    environment = dict(os.environ)
+    environment.pop("DEPLOY_KEY", None)
+    if key:
+        environment["DEPLOY_KEY"] = key
+    return subprocess.run([sys.executable, os.path.join(REPO, "deploy.py")] + list(arguments),
+                          env=environment, capture_output=True, text=True)
+
+
+def image(work, name, size):
+    path = os.path.join(work, name)
+    with open(path, "wb") as f:
+        f.write(bytes(random.getrandbits(8) for _ in range(size)))
+    return path
+
+
+def rollout(args, work, binary):
+    path = image(work, "image.js", args.size * 1024)
+    data = open(path, "rb").read()
+    for count in args.devices:
+        nodes = [Node(work, binary, "127.0.1.%d" % (i + 1), 0x1000 + i, ["--key", KEY], args.loss)
+                 for i in range(count)]
+        time.sleep(0.5)
+        started = time.monotonic()
+        result = run_deploy("--rollout", "--interface", "127.0.0.1", "--drop", str(args.loss), "--rate",
+                            str(args.rate), path, key=KEY)
+        seconds = time.monotonic() - started
+        updated = sum(node.file("/image.js") == data for node in nodes)
+        for node in nodes:
+            node.stop()
+        for i in range(count):
+            shutil.rmtree(os.path.join(work, "127.0.1.%d" % (i + 1)), ignore_errors=True)
+        print("%d devices, %d KB, %.0f%% loss: %d updated in %.1f s" % (count, args.size, args.loss * 100, updated,
+                                                                       seconds))
+        if updated != count:
+            print(result.stdout + result.stderr)
+            return False
+    return True
+
+
+def check(description, passed, detail=""):
+    print("%s: %s" % (description, "ok" if passed else "FAILED " + detail))
+    return passed
+
+
+def deployments(args, work, binary):
+    node = Node(work, binary, "127.0.1.1", 0x1000, [], args.loss)
+    time.sleep(0.3)
+    script = image(work, "app.js", 4096)
+    bytecode = image(work, "app.jsbc", 4096)
+    key_file = os.path.join(work, "fleet.key")
+    with open(key_file, "w") as f:
+        f.write(KEY)
+    passed = check("unsigned BEGIN without a key", run_deploy("127.0.1.1", script).returncode == 0)
+    passed &= check("unsigned bytecode refused by deploy.py", run_deploy("127.0.1.1", bytecode).returncode != 0)
+    output = node.stop()
+    passed &= check("bytecode not loaded without a rollout", "Started bytecode" not in output)
+
+    node = Node(work, binary, "127.0.1.1", 0x1000, ["--key", KEY], args.loss)
+    time.sleep(0.3)
+    result = run_deploy("127.0.1.1", script)
+    passed &= check("unsigned BEGIN refused once a key is set", result.returncode != 0 and "fleet key" in result.stderr,
+                    result.stderr)
+    result = run_deploy("--key-file", key_file, "127.0.1.1", script)
+    passed &= check("signed deployment to one device", result.returncode == 0, result.stderr)
+    result = run_deploy("--key-file", key_file, "127.0.1.1", bytecode)
+    passed &= check("signed bytecode deployment", result.returncode == 0, result.stderr)
+
+    # Signed with an old counter, like a recorded announcement played back
+    options = argparse.Namespace(chunk=1024, no_launch=False, ttl=1, interface=None, timeout=0.5, rate=64,
+                                 drop=0.0, retries=5)
+    stale = deploy.Rollout(options, open(script, "rb").read(), "/app.js", bytes.fromhex(KEY), 0, 1,
+                           ("127.0.1.1", deploy.GROUP_PORT), deploy.next_counter() - 10 ** 9)
+    stale.run()
+    states = list(stale.devices.values())
+    passed &= check("stale counter refused", states == [(deploy.FAILED, 9)], str(states))
+    output = node.stop()
+    passed &= check("signed bytecode loaded", "Started bytecode /app.jsbc" in output, output)
+    return passed
+
+
+def link(args, work, binary):
+    a, b = "127.0.2.1", "127.0.2.2"
+    port = 1339
+    common = ["--sink", "/apps/sink.js", "--queue", str(args.messages * 2)]
+    nodes = [
+        Node(work, binary, a, 0x2001, ["--name", "a", "--peer", "b=%s:%d" % (b, port), "--send", "b:sink",
+                                       str(args.messages)] + common, args.loss, args.run_ms),
+        Node(work, binary, b, 0x2002, ["--name", "b", "--peer", "a=%s:%d" % (a, port), "--send", "a:sink",
+                                       str(args.messages)] + common, args.loss, args.run_ms),
+    ]
+    passed = True
+    gave_up = 0
+    for node in nodes:
+        node.process.wait()
+        summary = node.stop().splitlines()[-1]
+        print("%s %s" % (node.address, summary))
+        counts = dict((key, int(value)) for key, value in re.findall(r"(\w+) (\d+)", summary))
+        passed &= counts["sent"] == args.messages and counts["received"] == args.messages
+        passed &= counts["duplicates"] == 0 and counts["undeliverable"] == 0
+        gave_up += counts["failed"]
+    # A sender also gives up on a datagram that arrived when every ACK for it
+    # was lost, so "failed" counts messages whose fate it does not know
+    print("%d messages each way at %.0f%% loss: %s, %d reported failed by the sender" % (
+        args.messages, args.loss * 100, "all delivered exactly once" if passed else "FAILED", gave_up))
+    return passed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--work", help="directory for the build and the devices' flash (default: temporary)")
+    commands = parser.add_subparsers(dest="command", required=True)
+    rollout_parser = commands.add_parser("rollout", help="time a multicast rollout to several devices")
+    rollout_parser.add_argument("--devices", type=int, nargs="+", default=[3, 24])
+    rollout_parser.add_argument("--size", type=int, default=64, help="image size in KB")
+    rollout_parser.add_argument("--loss", type=float, default=0.05)
+    rollout_parser.add_argument("--rate", type=float, default=64, help="multicast rate in KB/s")
+    deploy_parser = commands.add_parser("deploy", help="check signed and unsigned deployments to one device")
+    deploy_parser.add_argument("--loss", type=float, default=0.0)
+    link_parser = commands.add_parser("link", help="send messages both ways between two nodes")
+    link_parser.add_argument("--messages", type=int, default=2000)
+    link_parser.add_argument("--loss", type=float, default=0.3)
+    link_parser.add_argument("--run-ms", type=int, default=20000)
+    args = parser.parse_args()
+
+    work = args.work or tempfile.mkdtemp(prefix="jsvm-host-")
+    os.makedirs(work, exist_ok=True)
+    binary = build(work)
+    passed = {"rollout": rollout, "deploy": deployments, "link": link}[args.command](args, work, binary)
+    if not args.work:
+        shutil.rmtree(work)
+    sys.exit(0 if passed else 1)
+
+
+if __name__ == "__main__":
+    main()
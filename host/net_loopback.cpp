@@ -0,0 +1,136 @@
+// net_loopback.cpp
+// Host stand-in for the UDP half of net_manager. Every instance binds its
+// ports on its own loopback address ($HOST_ADDRESS, default 127.0.0.1), so
+// several can run side by side; a port that joins a multicast group gets a
+// second, shared socket on the wildcard address for the group traffic.
+// $LOSS is the fraction of received datagrams dropped on purpose.
+#include "include/net_manager.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HOST_SOCKETS 8
+
+struct HostSocket {
+  int fd;
+  uint16_t port;
+};
+
+static HostSocket sockets[HOST_SOCKETS];
+static int socketCount = 0;
+static uint8_t received[NET_MAX_DATAGRAM];
+
+static in_addr_t hostAddress() {
+  static in_addr_t address = inet_addr(getenv("HOST_ADDRESS") ? getenv("HOST_ADDRESS") : "127.0.0.1");
+  return address;
+}
+
+static double lossRate() {
+  static double loss = getenv("LOSS") ? atof(getenv("LOSS")) : 0;
+  return loss;
+}
+
+static int openSocket(in_addr_t address, uint16_t port) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = address;
+  local.sin_port = htons(port);
+  if (fd < 0 || bind(fd, (sockaddr*)&local, sizeof(local)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+static int findSocket(uint16_t port) {
+  for (int i = 0; i < socketCount; i++) {
+    if (sockets[i].port == port) {
+      return sockets[i].fd;
+    }
+  }
+  return -1;
+}
+
+bool netUdpBind(int owner, uint16_t port) {
+  int fd = socketCount < HOST_SOCKETS ? openSocket(hostAddress(), port) : -1;
+  if (fd < 0) {
+    return false;
+  }
+  sockets[socketCount++] = { fd, port };
+  return true;
+}
+
+bool netUdpJoinGroup(int owner, uint16_t port, uint32_t group) {
+  int fd = socketCount < HOST_SOCKETS ? openSocket(INADDR_ANY, port) : -1;
+  ip_mreq request = {};
+  request.imr_multiaddr.s_addr = group;
+  request.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) != 0) {
+    return false;
+  }
+  sockets[socketCount++] = { fd, port };
+  return true;
+}
+
+int netUdpSend(int owner, uint16_t localPort, uint32_t address, uint16_t port, const void* data, size_t length) {
+  sockaddr_in to = {};
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = address;
+  to.sin_port = htons(port);
+  return sendto(findSocket(localPort), data, length, 0, (sockaddr*)&to, sizeof(to));
+}
+
+// Waits up to timeoutMs for a datagram on any socket; the data stays valid
+// until the next call
+bool netUdpReceive(int owner, NetDatagram* datagram, uint32_t timeoutMs) {
+  fd_set readable;
+  FD_ZERO(&readable);
+  int highest = -1;
+  for (int i = 0; i < socketCount; i++) {
+    FD_SET(sockets[i].fd, &readable);
+    highest = max(highest, sockets[i].fd);
+  }
+  timeval timeout = { (time_t)(timeoutMs / 1000), (suseconds_t)(timeoutMs % 1000 * 1000) };
+  if (select(highest + 1, &readable, nullptr, nullptr, &timeout) <= 0) {
+    return false;
+  }
+
+  for (int i = 0; i < socketCount; i++) {
+    if (!FD_ISSET(sockets[i].fd, &readable)) {
+      continue;
+    }
+    sockaddr_in from;
+    socklen_t fromLength = sizeof(from);
+    int length = recvfrom(sockets[i].fd, received, sizeof(received), 0, (sockaddr*)&from, &fromLength);
+    if (length < 0 || (double)rand() / RAND_MAX < lossRate()) {
+      continue;
+    }
+    *datagram = { from.sin_addr.s_addr, ntohs(from.sin_port), sockets[i].port, received, (size_t)length };
+    return true;
+  }
+  return false;
+}
+
+void netUdpRelease(int owner, const NetDatagram& datagram) {
+}
+
+bool netParseAddress(const char* text, uint32_t* address) {
+  in_addr parsed;
+  if (inet_pton(AF_INET, text, &parsed) != 1) {
+    return false;
+  }
+  *address = parsed.s_addr;
+  return true;
+}
+
+void netFormatAddress(uint32_t address, char* text, size_t size) {
+  in_addr value = { address };
+  inet_ntop(AF_INET, &value, text, size);
+}
@@ -0,0 +1,386 @@
+// net_test.cpp
+// Runs the firmware's src/net_manager.cpp over the host's sockets and
+// checks it from the outside with plain POSIX peers on 127.0.0.1: per-VM
+// UDP ports and their receive queues, and TCP connect, listen/accept,
+// write backpressure and close events. See host/run_tests.py.
+#include "include/net_manager.h"
+#include "include/vm_events.h"
+#include "include/vm_log.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <deque>
+#include <mutex>
+#include <string>
+
+static int failures = 0;
+
+static bool check(const char* description, bool passed, const std::string& detail = "") {
+  printf("%s: %s%s\n", description, passed ? "ok" : "FAILED ", passed ? "" : detail.c_str());
+  fflush(stdout);
+  failures += !passed;
+  return passed;
+}
+
+bool vmLogPrintf(int source, VMLogLevel level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  printf("  log: ");
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+  return true;
+}
+
+// === VM event stand-ins ===
+
+// Events wait here until a check takes them, as they would in a VM's queue
+static std::mutex eventMutex;
+static std::deque<VMEvent> events[MAX_VMS];
+static VMEventFinalizer finalizers[VM_EVENT_TYPES];
+
+bool vmEventPost(int vmIndex, const VMEvent& event) {
+  std::lock_guard<std::mutex> lock(eventMutex);
+  events[vmIndex].push_back(event);
+  return true;
+}
+
+void vmEventsSetFinalizer(uint8_t type, VMEventFinalizer finalizer) {
+  finalizers[type] = finalizer;
+}
+
+// Takes the VM's oldest event of a type and finalizes it the way
+// vmEventsDispatch() does before calling the handler
+static bool takeEvent(int vm, uint8_t type, VMEvent* event, uint32_t timeoutMs = 2000) {
+  unsigned long started = millis();
+  bool found = false;
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(eventMutex);
+      for (auto it = events[vm].begin(); it != events[vm].end() && !found; ++it) {
+        if (it->type == type) {
+          *event = *it;
+          events[vm].erase(it);
+          found = true;
+        }
+      }
+    }
+    if (found || millis() - started >= timeoutMs) {
+      break;
+    }
+    delay(5);
+  }
+  if (found && finalizers[type]) {
+    finalizers[type](event);
+  }
+  return found;
+}
+
+static bool pendingEvent(int vm, uint8_t type) {
+  std::lock_guard<std::mutex> lock(eventMutex);
+  for (const VMEvent& event : events[vm]) {
+    if (event.type == type) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// === POSIX peers ===
+
+static sockaddr_in loopback(uint16_t port) {
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return address;
+}
+
+static uint16_t localPort(int fd) {
+  sockaddr_in address;
+  socklen_t length = sizeof(address);
+  getsockname(fd, (sockaddr*)&address, &length);
+  return ntohs(address.sin_port);
+}
+
+// A port nothing is bound to right now
+static uint16_t freePort(int type) {
+  int fd = socket(AF_INET, type, 0);
+  sockaddr_in address = loopback(0);
+  bind(fd, (sockaddr*)&address, sizeof(address));
+  uint16_t port = localPort(fd);
+  close(fd);
+  return port;
+}
+
+static int udpPeer() {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address = loopback(0);
+  bind(fd, (sockaddr*)&address, sizeof(address));
+  return fd;
+}
+
+static void sendTo(int fd, uint16_t port, const std::string& text) {
+  sockaddr_in to = loopback(port);
+  sendto(fd, text.data(), text.size(), 0, (sockaddr*)&to, sizeof(to));
+}
+
+static bool readable(int fd, int timeoutMs) {
+  pollfd entry = { fd, POLLIN, 0 };
+  return poll(&entry, 1, timeoutMs) > 0;
+}
+
+// Receives one datagram as a VM would and checks where it came from
+static std::string receive(int owner, uint16_t fromPort, uint16_t toPort, uint32_t timeoutMs = 1000) {
+  NetDatagram datagram;
+  if (!netUdpReceive(owner, &datagram, timeoutMs)) {
+    return "(nothing)";
+  }
+  std::string text((const char*)datagram.data, datagram.length);
+  char address[16];
+  netFormatAddress(datagram.address, address, sizeof(address));
+  if (strcmp(address, "127.0.0.1") != 0 || datagram.port != fromPort || datagram.localPort != toPort) {
+    text += " from " + std::string(address) + ":" + std::to_string(datagram.port) + " on " +
+            std::to_string(datagram.localPort);
+  }
+  netUdpRelease(owner, datagram);
+  return text;
+}
+
+// === UDP ===
+
+static void testUdp() {
+  uint16_t port0 = freePort(SOCK_DGRAM);
+  uint16_t port1 = freePort(SOCK_DGRAM);
+  check("VM 0 binds a port", netUdpBind(0, port0));
+  check("VM 1 binds another", netUdpBind(1, port1));
+  check("VM 1 cannot take VM 0's port", !netUdpBind(1, port0));
+  check("binding an owned port again succeeds", netUdpBind(0, port0));
+
+  int peer = udpPeer();
+  uint16_t peerPort = localPort(peer);
+  sendTo(peer, port0, "to vm 0");
+  sendTo(peer, port1, "to vm 1");
+  sendTo(peer, port0, "to vm 0 again");
+  std::string text = receive(0, peerPort, port0);
+  check("VM 0 gets its datagram with the sender's address and port", text == "to vm 0", text);
+  text = receive(0, peerPort, port0);
+  check("in order", text == "to vm 0 again", text);
+  text = receive(1, peerPort, port1);
+  check("VM 1 gets only its own", text == "to vm 1", text);
+  text = receive(0, peerPort, port0, 100);
+  check("nothing else queued for VM 0", text == "(nothing)", text);
+
+  // A reply leaves from the VM's bound port, so the peer can answer it
+  const char reply[] = "reply";
+  netUdpSend(1, port1, htonl(INADDR_LOOPBACK), peerPort, reply, strlen(reply));
+  char buffer[64];
+  sockaddr_in from;
+  socklen_t fromLength = sizeof(from);
+  int length = readable(peer, 1000) ? recvfrom(peer, buffer, sizeof(buffer), 0, (sockaddr*)&from, &fromLength) : -1;
+  check("a send leaves from the bound port", length == 5 && ntohs(from.sin_port) == port1);
+
+  // Fill VM 1's queue without reading it; the overflow is counted, not kept
+  std::string large(1000, 'x');
+  for (int i = 0; i < 8; i++) {
+    sendTo(peer, port1, large);
+  }
+  delay(200);
+  NetStats stats;
+  netManagerGetStats(1, &stats);
+  check("a full receive queue drops and counts", stats.dropped > 0 && stats.received == 1 + 8 - stats.dropped,
+        std::to_string(stats.received) + " received, " + std::to_string(stats.dropped) + " dropped");
+  check("pending bytes are reported", stats.pendingBytes > 1000 && stats.pendingBytes <= NET_RX_QUEUE_BYTES,
+        std::to_string(stats.pendingBytes));
+
+  NetDatagram datagram;
+  while (netUdpReceive(1, &datagram, 0)) {
+    netUdpRelease(1, datagram);
+  }
+
+  netManagerRelease(0);
+  netManagerGetStats(0, &stats);
+  check("releasing a VM closes its sockets", stats.sockets == 0);
+  // Unlike lwIP, Linux keeps a closed socket's port until the network
+  // task's select() lets go of it
+  delay(NET_POLL_MS * 2);
+  check("and frees its ports for others", netUdpBind(1, port0));
+  sendTo(peer, port0, "to vm 1 now");
+  text = receive(1, peerPort, port0);
+  check("which then deliver to the new owner", text == "to vm 1 now", text);
+
+  netManagerRelease(1);
+  close(peer);
+}
+
+// === TCP ===
+
+static std::string readAll(int owner, int id) {
+  std::string text;
+  char buffer[256];
+  int length;
+  while ((length = netTcpRead(owner, id, buffer, sizeof(buffer))) > 0) {
+    text.append(buffer, length);
+  }
+  return text;
+}
+
+static void testListen() {
+  uint16_t port = freePort(SOCK_STREAM);
+  int listener = netTcpListen(0, port, 2);
+  check("VM 0 listens", listener >= 0);
+
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = loopback(port);
+  connect(client, (sockaddr*)&address, sizeof(address));
+  VMEvent event = {};
+  bool accepted = takeEvent(0, VM_EVENT_TCP_ACCEPT, &event);
+  check("an incoming connection posts an accept event", accepted && event.source == listener);
+  int id = event.value;
+
+  send(client, "hello", 5, 0);
+  delay(50);
+  send(client, " world", 6, 0);
+  delay(50);
+  event = {};
+  bool data = takeEvent(0, VM_EVENT_TCP_DATA, &event);
+  check("received data posts one event", data && event.source == id && !pendingEvent(0, VM_EVENT_TCP_DATA));
+  check("finalized with everything that arrived since", event.value == 11, std::to_string(event.value));
+  std::string text = readAll(0, id);
+  check("the VM reads it", text == "hello world", text);
+  check("another VM cannot", netTcpRead(1, id, nullptr, 0) == -1);
+
+  // A close with unsent data flushes it before the FIN
+  netTcpWrite(0, id, "bye", 3);
+  netTcpClose(0, id);
+  char buffer[16];
+  int length = readable(client, 1000) ? recv(client, buffer, sizeof(buffer), MSG_WAITALL) : -1;
+  check("closing flushes pending data, then the peer sees EOF", length == 3 && memcmp(buffer, "bye", 3) == 0);
+  close(client);
+
+  netManagerRelease(0);
+  delay(NET_POLL_MS * 2);
+  client = socket(AF_INET, SOCK_STREAM, 0);
+  check("releasing the VM closes its listener", connect(client, (sockaddr*)&address, sizeof(address)) != 0);
+  close(client);
+}
+
+static int tcpServer(uint16_t* port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  // A small receive window makes the VM's writes back up quickly
+  int size = 4096;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  sockaddr_in address = loopback(0);
+  bind(fd, (sockaddr*)&address, sizeof(address));
+  listen(fd, 1);
+  *port = localPort(fd);
+  return fd;
+}
+
+static void testConnect() {
+  uint16_t port;
+  int server = tcpServer(&port);
+  int id = netTcpConnect(1, "127.0.0.1", port);
+  check("VM 1 connects", id >= 0);
+  int peer = readable(server, 1000) ? accept(server, nullptr, nullptr) : -1;
+  check("the server accepts", peer >= 0);
+  // Until the network task sees the connect complete, writes only fill the buffer
+  delay(NET_POLL_MS * 2);
+
+  // Write until the socket and the connection's buffer are both full. The
+  // kernel grows its send buffer as it goes, draining the connection's a
+  // few more times on the way.
+  uint8_t chunk[1024];
+  uint32_t total = 0;
+  int accepted = 1;
+  unsigned long started = millis();
+  while (accepted > 0 && millis() - started < 5000) {
+    for (size_t i = 0; i < sizeof(chunk); i++) {
+      chunk[i] = (uint8_t)(total + i);
+    }
+    accepted = netTcpWrite(1, id, chunk, sizeof(chunk));
+    total += max(accepted, 0);
+    if (accepted > 0 && accepted < (int)sizeof(chunk)) {
+      delay(NET_POLL_MS * 2);
+    }
+  }
+  check("writes stop being accepted once the peer stops reading", accepted == 0, std::to_string(accepted));
+  VMEvent event;
+  while (takeEvent(1, VM_EVENT_TCP_DRAIN, &event, 0)) {
+  }
+  delay(100);
+  check("no drain event while it stays full", !pendingEvent(1, VM_EVENT_TCP_DRAIN));
+
+  uint32_t received = 0;
+  bool intact = true;
+  uint8_t buffer[4096];
+  while (received < total && readable(peer, 2000)) {
+    int length = recv(peer, buffer, sizeof(buffer), 0);
+    if (length <= 0) {
+      break;
+    }
+    for (int i = 0; i < length; i++) {
+      intact &= buffer[i] == (uint8_t)(received + i);
+    }
+    received += length;
+  }
+  check("the peer gets every accepted byte in order", received == total && intact,
+        std::to_string(received) + " of " + std::to_string(total));
+  event = {};
+  bool drained = takeEvent(1, VM_EVENT_TCP_DRAIN, &event);
+  check("then a drain event", drained && event.source == id && event.value == NET_TCP_BUFFER_BYTES,
+        drained ? std::to_string(event.source) + " " + std::to_string(event.value) : "none");
+  check("and the buffer takes writes again", netTcpWrite(1, id, chunk, sizeof(chunk)) == (int)sizeof(chunk));
+  recv(peer, buffer, sizeof(chunk), MSG_WAITALL);
+
+  // The peer's FIN: data sent before it stays readable after the close event
+  send(peer, "last", 4, 0);
+  close(peer);
+  event = {};
+  bool closed = takeEvent(1, VM_EVENT_TCP_CLOSE, &event);
+  check("an orderly close posts a close event with errno 0", closed && event.source == id && event.value == 0);
+  std::string text = readAll(1, id);
+  check("data received before the FIN is still readable", text == "last", text);
+  check("then reads report the close", netTcpRead(1, id, buffer, sizeof(buffer)) == -1);
+  check("and writes fail", netTcpWrite(1, id, "x", 1) == -1);
+  check("the script's close frees the id", netTcpClose(1, id) && netTcpAvailable(1, id) == -1);
+
+  // A reset carries its errno
+  id = netTcpConnect(1, "127.0.0.1", port);
+  peer = readable(server, 1000) ? accept(server, nullptr, nullptr) : -1;
+  linger abort = { 1, 0 };
+  setsockopt(peer, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+  close(peer);
+  event = {};
+  closed = takeEvent(1, VM_EVENT_TCP_CLOSE, &event);
+  check("a reset posts a close event with its errno", closed && event.value == ECONNRESET,
+        std::to_string(event.value));
+  netTcpClose(1, id);
+
+  // Nothing listening: the connect fails asynchronously
+  close(server);
+  id = netTcpConnect(1, "127.0.0.1", port);
+  event = {};
+  closed = takeEvent(1, VM_EVENT_TCP_CLOSE, &event);
+  check("a refused connect posts a close event", id >= 0 && closed && event.value == ECONNREFUSED,
+        std::to_string(event.value));
+  netManagerRelease(1);
+  NetStats stats;
+  netManagerGetStats(1, &stats);
+  check("releasing the VM frees its connections", stats.tcpConnections == 0);
+}
+
+int main() {
+  // lwIP has no SIGPIPE; a send to a closed peer just fails
+  signal(SIGPIPE, SIG_IGN);
+  netManagerBegin();
+  testUdp();
+  testListen();
+  testConnect();
+  printf("%s\n", failures ? "FAILED" : "all passed");
+  return failures ? 1 : 0;
+}
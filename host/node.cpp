@@ -0,0 +1,153 @@
+// node.cpp
+// One simulated device: the firmware's deploy and message link modules on
+// the loopback stand-ins, driven by the same loop as handleUDP(). Options:
+//
+//   --key <64 hex digits>     Set the fleet key first
+//   --name <node>             Message link node name
+//   --peer <node>=<ip>:<port> Add a message link peer
+//   --sink <file>             Run a VM stand-in for <file>; it counts what arrives
+//   --queue <n>               Its message queue length (default 10, as on the device)
+//   --send <address> <count>  Send count numbered messages to address
+//   --run-ms <ms>             How long to run (default 30000)
+//
+// $FS_ROOT is the flash, $MAC the device id, $HOST_ADDRESS the address to
+// bind and $LOSS the fraction of datagrams to drop. A summary line is
+// printed on exit.
+#include <Arduino.h>
+#include <FFat.h>
+#include "include/deploy.h"
+#include "include/msg_link.h"
+#include "include/vm_log.h"
+#include <set>
+#include <string>
+#include <unistd.h>
+
+bool netUdpReceive(int owner, NetDatagram* datagram, uint32_t timeoutMs);
+void netUdpRelease(int owner, const NetDatagram& datagram);
+
+static bool parseKey(const char* text, uint8_t* key) {
+  if (strlen(text) != DEPLOY_KEY_BYTES * 2) {
+    return false;
+  }
+  for (int i = 0; i < DEPLOY_KEY_BYTES; i++) {
+    if (sscanf(text + 2 * i, "%2hhx", &key[i]) != 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool addPeer(const char* spec) {
+  char name[MSG_LINK_NAME_LENGTH], address[16];
+  unsigned port;
+  uint32_t parsed;
+  return sscanf(spec, "%15[^=]=%15[^:]:%u", name, address, &port) == 3 && netParseAddress(address, &parsed) &&
+         msgLinkAddPeer(name, parsed, port);
+}
+
+// The same dispatch as handleUDP() in networking.cpp
+static void handleUDP(uint32_t waitMs) {
+  NetDatagram datagram;
+  while (netUdpReceive(NET_OWNER_SYSTEM, &datagram, waitMs)) {
+    if (datagram.localPort == MSG_LINK_PORT) {
+      msgLinkHandleDatagram(datagram);
+    } else {
+      deployHandleDatagram(datagram);
+    }
+    netUdpRelease(NET_OWNER_SYSTEM, datagram);
+    waitMs = 0;
+  }
+  deployPoll();
+  msgLinkPoll();
+}
+
+int main(int argc, char** argv) {
+  srand(getpid());
+  FFat.begin();
+  uint8_t key[DEPLOY_KEY_BYTES];
+  const char* name = nullptr;
+  const char* sink = nullptr;
+  const char* target = nullptr;
+  int queueLength = 10, count = 0;
+  unsigned long runMs = 30000;
+  bool haveKey = false;
+
+  msgLinkBegin();
+  for (int i = 1; i < argc; i++) {
+    bool more = i + 1 < argc;
+    if (strcmp(argv[i], "--key") == 0 && more) {
+      haveKey = parseKey(argv[++i], key);
+      if (!haveKey) {
+        fprintf(stderr, "bad key\n");
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--name") == 0 && more) {
+      name = argv[++i];
+      msgLinkSetName(name);
+    } else if (strcmp(argv[i], "--peer") == 0 && more) {
+      if (!addPeer(argv[++i])) {
+        fprintf(stderr, "bad peer %s\n", argv[i]);
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--sink") == 0 && more) {
+      sink = argv[++i];
+    } else if (strcmp(argv[i], "--queue") == 0 && more) {
+      queueLength = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--send") == 0 && i + 2 < argc) {
+      target = argv[++i];
+      count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--run-ms") == 0 && more) {
+      runMs = strtoul(argv[++i], nullptr, 10);
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (haveKey) {
+    deploySetKey(key);
+  }
+  // The firmware binds the deploy port in initUDP()
+  netUdpBind(NET_OWNER_SYSTEM, 1337);
+  deployBegin();
+
+  int sinkVM = -1;
+  if (sink) {
+    sinkVM = createVM(sink, "", sink);
+    vms[sinkVM].messageQueue = xQueueCreate(queueLength, MAX_MESSAGE_LENGTH);
+    msgLinkAttachVM(sinkVM, sink, vms[sinkVM].messageQueue);
+  }
+
+  std::set<std::string> seen;
+  int duplicates = 0, sent = 0, refused = 0;
+  unsigned long end = millis() + runMs;
+  while (millis() < end) {
+    // A burst per pass, as a VM calling sendMessage() in a loop would
+    for (int burst = 0; burst < 20 && sent < count; burst++) {
+      char text[48];
+      snprintf(text, sizeof(text), "%s-%d", name ? name : "node", sent);
+      if (!msgLinkSend(target, text)) {
+        refused++;
+        break;
+      }
+      sent++;
+    }
+    handleUDP(5);
+
+    char message[MAX_MESSAGE_LENGTH];
+    while (sinkVM >= 0 && xQueueReceive(vms[sinkVM].messageQueue, message, 0) == pdTRUE) {
+      if (!seen.insert(message).second) {
+        duplicates++;
+      }
+    }
+  }
+
+  printf("summary: sent %d refused %d received %zu duplicates %d", sent, refused, seen.size(), duplicates);
+  MsgLinkStats stats;
+  for (int i = 0; msgLinkGetStats(i, &stats); i++) {
+    printf(" | %s acked %lu failed %lu retransmits %lu undeliverable %lu pending %lu", stats.name,
+      (unsigned long)stats.sent, (unsigned long)stats.failed, (unsigned long)stats.retransmits,
+      (unsigned long)stats.undeliverable, (unsigned long)stats.pending);
+  }
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,238 @@
+// rtos.cpp
+// Host stand-ins for the Arduino core and FreeRTOS: mutexes, queues, tasks
+// and no-split ring buffers over the C++ standard library.
+#include <Arduino.h>
+#include <freertos/semphr.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <freertos/ringbuf.h>
+#include <esp_timer.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+HardwareSerial Serial;
+
+// === Arduino core ===
+
+unsigned long millis() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+int64_t esp_timer_get_time() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+size_t strlcpy(char* dest, const char* src, size_t size) {
+  size_t length = strlen(src);
+  if (size > 0) {
+    size_t copied = min(length, size - 1);
+    memcpy(dest, src, copied);
+    dest[copied] = '\0';
+  }
+  return length;
+}
+
+// === Mutexes and queues ===
+
+struct HostMutex {
+  std::mutex mutex;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return new HostMutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t) {
+  mutex->mutex.lock();
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex) {
+  mutex->mutex.unlock();
+  return pdTRUE;
+}
+
+struct HostQueue {
+  std::mutex mutex;
+  std::condition_variable changed;
+  size_t length;
+  size_t itemSize;
+  std::deque<std::string> items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  QueueHandle_t queue = new HostQueue;
+  queue->length = length;
+  queue->itemSize = itemSize;
+  return queue;
+}
+
+static std::chrono::milliseconds hostTicks(TickType_t ticks) {
+  return std::chrono::milliseconds(ticks == portMAX_DELAY ? 24 * 3600 * 1000 : ticks);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t timeout) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!queue->changed.wait_for(lock, hostTicks(timeout), [queue] { return queue->items.size() < queue->length; })) {
+    return pdFALSE;
+  }
+  queue->items.emplace_back((const char*)item, queue->itemSize);
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t timeout) {
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!queue->changed.wait_for(lock, hostTicks(timeout), [queue] { return !queue->items.empty(); })) {
+    return pdFALSE;
+  }
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  queue->changed.notify_all();
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> lock(queue->mutex);
+  return queue->items.size();
+}
+
+// === Tasks ===
+
+struct HostTask {
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable notified;
+  uint32_t notifications = 0;
+};
+
+static thread_local TaskHandle_t currentTask = nullptr;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stackDepth, void* parameter,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core) {
+  TaskHandle_t created = new HostTask;
+  created->thread = std::thread([=] {
+    currentTask = created;
+    task(parameter);
+  });
+  created->thread.detach();
+  if (handle) {
+    *handle = created;
+  }
+  return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  delay(ticks);
+}
+
+void xTaskNotifyGive(TaskHandle_t task) {
+  std::lock_guard<std::mutex> lock(task->mutex);
+  task->notifications++;
+  task->notified.notify_all();
+}
+
+// Only tasks made by xTaskCreatePinnedToCore() can wait for notifications
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t timeout) {
+  TaskHandle_t task = currentTask;
+  std::unique_lock<std::mutex> lock(task->mutex);
+  task->notified.wait_for(lock, hostTicks(timeout), [task] { return task->notifications > 0; });
+  uint32_t value = task->notifications;
+  if (value > 0) {
+    task->notifications = clearOnExit ? 0 : value - 1;
+  }
+  return value;
+}
+
+// === Ring buffers ===
+
+// Items leave in order but may be returned in any order; their space is
+// reclaimed once everything in front of them has been returned
+struct HostRingItem {
+  std::vector<uint8_t> data;
+  bool received;
+  bool returned;
+};
+
+struct HostRingbuf {
+  std::mutex mutex;
+  std::condition_variable ready;
+  size_t capacity;
+  size_t used;
+  std::deque<HostRingItem> items;
+};
+
+// The IDF stores an 8 byte header in front of each item, padded to 4 bytes
+static size_t ringFootprint(size_t size) {
+  return ((size + 3) & ~(size_t)3) + 8;
+}
+
+RingbufHandle_t xRingbufferCreate(size_t size, RingbufferType_t) {
+  RingbufHandle_t ring = new HostRingbuf;
+  ring->capacity = size;
+  ring->used = 0;
+  return ring;
+}
+
+void vRingbufferDelete(RingbufHandle_t ring) {
+  delete ring;
+}
+
+BaseType_t xRingbufferSend(RingbufHandle_t ring, const void* data, size_t size, TickType_t) {
+  std::lock_guard<std::mutex> lock(ring->mutex);
+  if (ring->used + ringFootprint(size) > ring->capacity) {
+    return pdFALSE;
+  }
+  const uint8_t* bytes = (const uint8_t*)data;
+  ring->items.push_back({ std::vector<uint8_t>(bytes, bytes + size), false, false });
+  ring->used += ringFootprint(size);
+  ring->ready.notify_one();
+  return pdTRUE;
+}
+
+void* xRingbufferReceive(RingbufHandle_t ring, size_t* size, TickType_t timeout) {
+  std::unique_lock<std::mutex> lock(ring->mutex);
+  auto next = [ring]() -> HostRingItem* {
+    for (HostRingItem& item : ring->items) {
+      if (!item.received) {
+        return &item;
+      }
+    }
+    return nullptr;
+  };
+  if (!ring->ready.wait_for(lock, hostTicks(timeout), [&] { return next() != nullptr; })) {
+    return nullptr;
+  }
+  HostRingItem* item = next();
+  item->received = true;
+  *size = item->data.size();
+  return item->data.data();
+}
+
+void vRingbufferReturnItem(RingbufHandle_t ring, void* data) {
+  std::lock_guard<std::mutex> lock(ring->mutex);
+  for (HostRingItem& item : ring->items) {
+    if (item.data.data() == data) {
+      item.returned = true;
+    }
+  }
+  while (!ring->items.empty() && ring->items.front().returned) {
+    ring->used -= ringFootprint(ring->items.front().data.size());
+    ring->items.pop_front();
+  }
+}
+
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t ring) {
+  std::lock_guard<std::mutex> lock(ring->mutex);
+  return ring->capacity - ring->used;
+}
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Run firmware modules against this machine's sockets.
+
+Each test compiles a module from src/, unchanged, with host/sdk mapping lwIP's
+socket calls onto the BSD ones and host/rtos.cpp standing in for FreeRTOS,
+and drives it from plain POSIX peers on 127.0.0.1. Needs g++.
+
+    host/run_tests.py [test...]
+
+log_shipper  syslog over UDP and TCP to a local collector (host/log_test.cpp)
+net_manager  per-VM UDP ports and TCP connections (host/net_test.cpp)
+"""
+
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+HOST = os.path.dirname(os.path.abspath(__file__))
+REPO = os.path.dirname(HOST)
+TESTS = {
+    "log_shipper": ["host/log_test.cpp", "host/rtos.cpp", "src/log_shipper.cpp"],
+    "net_manager": ["host/net_test.cpp", "host/rtos.cpp", "src/net_manager.cpp"],
+}
+
+
+def run(name, work):
+    binary = os.path.join(work, name)
+    command = ["g++", "-std=gnu++17", "-O2", "-Wall", "-Wno-unused-parameter", "-pthread",
+               "-I" + os.path.join(HOST, "sdk"), "-I" + REPO, "-I" + os.path.join(REPO, "components/duktape/include"),
+               "-o", binary] + [os.path.join(REPO, source) for source in TESTS[name]]
+    print("== " + name, flush=True)
+    if subprocess.run(command).returncode != 0:
+        return False
+    try:
+        return subprocess.run([binary], cwd=work, timeout=120).returncode == 0
+    except subprocess.TimeoutExpired:
+        print("timed out")
+        return False
+
+
+def main():
+    names = sys.argv[1:] or list(TESTS)
+    unknown = [name for name in names if name not in TESTS]
+    if unknown:
+        sys.exit("unknown test: " + ", ".join(unknown))
+    failed = []
+    for name in names:
+        work = tempfile.mkdtemp(prefix="jsvm-" + name + "-")
+        try:
+            if not run(name, work):
+                failed.append(name)
+        finally:
+            shutil.rmtree(work)
+    print("failed: " + ", ".join(failed) if failed else "all tests passed")
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,75 @@
+// Arduino.h
+// Host stand-in: just enough of the Arduino core for the firmware modules
+// that host/loopback.py and host/run_tests.py run on a PC.
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <algorithm>
+#include <string>
+
+using std::max;
+using std::min;
+
+unsigned long millis();
+void delay(unsigned long ms);
+size_t strlcpy(char* dest, const char* src, size_t size);
+
+#define constrain(value, low, high) ((value) < (low) ? (low) : ((value) > (high) ? (high) : (value)))
+
+class String : public std::string {
+ public:
+  String() {}
+  String(const char* text) : std::string(text ? text : "") {}
+  String(const std::string& text) : std::string(text) {}
+  String(int value) : std::string(std::to_string(value)) {}
+  String(unsigned long value) : std::string(std::to_string(value)) {}
+
+  unsigned length() const { return size(); }
+  bool startsWith(const char* prefix) const { return rfind(prefix, 0) == 0; }
+  bool endsWith(const char* suffix) const {
+    size_t n = strlen(suffix);
+    return size() >= n && compare(size() - n, n, suffix) == 0;
+  }
+  int indexOf(const char* text) const {
+    size_t at = find(text);
+    return at == npos ? -1 : (int)at;
+  }
+  int toInt() const { return atoi(c_str()); }
+
+  String& operator+=(const char* text) { append(text); return *this; }
+  String& operator+=(const String& text) { append(text); return *this; }
+  String& operator+=(char c) { push_back(c); return *this; }
+  String& operator+=(int value) { append(std::to_string(value)); return *this; }
+  String& operator+=(unsigned long value) { append(std::to_string(value)); return *this; }
+};
+
+inline String operator+(const String& a, const char* b) { return String(std::string(a) + b); }
+inline String operator+(const char* a, const String& b) { return String(a + std::string(b)); }
+inline String operator+(const String& a, const String& b) { return String(std::string(a) + std::string(b)); }
+
+#define DEC 10
+
+struct HardwareSerial {
+  void print(const char* text) { fputs(text, stdout); }
+  void print(const String& text) { fputs(text.c_str(), stdout); }
+  void print(unsigned long value, int base = DEC) { printf("%lu", value); }
+  void println(const char* text = "") { puts(text); }
+  void println(const String& text) { puts(text.c_str()); }
+};
+extern HardwareSerial Serial;
+
+// The device id comes from $MAC, so several instances can tell themselves apart
+struct EspClass {
+  uint64_t getEfuseMac();
+};
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,20 @@
+// FFat.h
+// Host stand-in: the FFat partition is the directory $FS_ROOT
+#ifndef HOST_FFAT_H
+#define HOST_FFAT_H
+
+#include <FS.h>
+
+struct FFatFS {
+  bool begin(bool formatOnFail = false);
+  bool format() { return false; }
+  File open(const String& path, const char* mode = "r");
+  bool exists(const String& path);
+  bool remove(const String& path);
+  bool rename(const String& from, const String& to);
+  size_t totalBytes() { return 1 << 20; }
+  size_t usedBytes() { return 0; }
+};
+extern FFatFS FFat;
+
+#endif
@@ -0,0 +1,39 @@
+// FS.h
+// Host stand-in: File over stdio, rooted at $FS_ROOT (default ./fs)
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+#include <Arduino.h>
+#include <dirent.h>
+#include <time.h>
+
+class File {
+ public:
+  File() {}
+  File(FILE* file, DIR* dir, const std::string& path) : file_(file), dir_(dir), path_(path) {}
+
+  operator bool() const { return file_ || dir_; }
+  size_t write(const uint8_t* data, size_t length) { return fwrite(data, 1, length, file_); }
+  size_t read(uint8_t* data, size_t length) { return fread(data, 1, length, file_); }
+  bool seek(uint32_t position) { return fseek(file_, position, SEEK_SET) == 0; }
+  size_t print(const char* text) { return fputs(text, file_) >= 0 ? strlen(text) : 0; }
+  size_t println(const char* text) { return fprintf(file_, "%s\n", text); }
+  String readString();
+  size_t size();
+  time_t getLastWrite();
+  bool isDirectory() { return dir_ != nullptr; }
+  const char* path() { return path_.c_str(); }
+  const char* name();
+  File openNextFile();
+  void close();
+
+ private:
+  FILE* file_ = nullptr;
+  DIR* dir_ = nullptr;
+  std::string path_;
+};
+
+// The directory paths are relative to
+const std::string& hostFsRoot();
+
+#endif
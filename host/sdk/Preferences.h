@@ -0,0 +1,71 @@
+// Preferences.h
+// Host stand-in: each key is a file $FS_ROOT/.prefs-<namespace>-<key>, so
+// settings survive restarting an instance like they survive a reboot
+#ifndef HOST_PREFERENCES_H
+#define HOST_PREFERENCES_H
+
+#include <Arduino.h>
+
+// The FFat stand-in's directory, or one a test picks
+const std::string& hostFsRoot();
+
+class Preferences {
+ public:
+  bool begin(const char* name, bool readOnly = false) {
+    prefix_ = hostFsRoot() + "/.prefs-" + name + "-";
+    return true;
+  }
+  void end() {}
+
+  size_t getBytes(const char* key, void* data, size_t length) {
+    FILE* file = fopen((prefix_ + key).c_str(), "rb");
+    if (!file) {
+      return 0;
+    }
+    size_t read = fread(data, 1, length, file);
+    fclose(file);
+    return read;
+  }
+  size_t putBytes(const char* key, const void* data, size_t length) {
+    FILE* file = fopen((prefix_ + key).c_str(), "wb");
+    if (!file) {
+      return 0;
+    }
+    size_t written = fwrite(data, 1, length, file);
+    fclose(file);
+    return written;
+  }
+  size_t getString(const char* key, char* value, size_t size) {
+    size_t length = getBytes(key, value, size - 1);
+    value[length] = '\0';
+    return length;
+  }
+  size_t putString(const char* key, const char* value) { return putBytes(key, value, strlen(value)); }
+  uint8_t getUChar(const char* key, uint8_t fallback = 0) { return get(key, fallback); }
+  size_t putUChar(const char* key, uint8_t value) { return putBytes(key, &value, sizeof(value)); }
+  uint16_t getUShort(const char* key, uint16_t fallback = 0) { return get(key, fallback); }
+  size_t putUShort(const char* key, uint16_t value) { return putBytes(key, &value, sizeof(value)); }
+  uint32_t getULong(const char* key, uint32_t fallback = 0) { return get(key, fallback); }
+  size_t putULong(const char* key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+  uint64_t getULong64(const char* key, uint64_t fallback = 0) { return get(key, fallback); }
+  size_t putULong64(const char* key, uint64_t value) { return putBytes(key, &value, sizeof(value)); }
+  bool isKey(const char* key) {
+    FILE* file = fopen((prefix_ + key).c_str(), "rb");
+    if (file) {
+      fclose(file);
+    }
+    return file != nullptr;
+  }
+  bool remove(const char* key) { return ::remove((prefix_ + key).c_str()) == 0; }
+
+ private:
+  template <typename T>
+  T get(const char* key, T fallback) {
+    T value;
+    return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : fallback;
+  }
+
+  std::string prefix_;
+};
+
+#endif
@@ -0,0 +1,14 @@
+// WiFi.h
+// Host stand-in
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+enum wl_status_t { WL_CONNECTED = 3 };
+
+struct WiFiClass {
+  wl_status_t status() { return WL_CONNECTED; }
+  const char* getHostname() { return "host"; }
+};
+static WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,13 @@
+// esp_random.h
+// Host stand-in
+#ifndef HOST_ESP_RANDOM_H
+#define HOST_ESP_RANDOM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+inline uint32_t esp_random() {
+  return (uint32_t)rand() << 16 ^ (uint32_t)rand();
+}
+
+#endif
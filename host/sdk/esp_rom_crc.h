@@ -0,0 +1,13 @@
+// esp_rom_crc.h
+// Host stand-in: the ROM CRC-32 is the zlib one
+#ifndef HOST_ESP_ROM_CRC_H
+#define HOST_ESP_ROM_CRC_H
+
+#include <stdint.h>
+#include <zlib.h>
+
+inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* data, uint32_t length) {
+  return crc32(crc, data, length);
+}
+
+#endif
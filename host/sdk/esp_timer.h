@@ -0,0 +1,10 @@
+// esp_timer.h
+// Host stand-in
+#ifndef HOST_ESP_TIMER_H
+#define HOST_ESP_TIMER_H
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time();
+
+#endif
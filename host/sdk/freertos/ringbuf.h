@@ -0,0 +1,22 @@
+// freertos/ringbuf.h
+// Host stand-in: no-split ring buffers with the IDF's per-item overhead
+#ifndef HOST_FREERTOS_RINGBUF_H
+#define HOST_FREERTOS_RINGBUF_H
+
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct HostRingbuf* RingbufHandle_t;
+
+typedef enum {
+  RINGBUF_TYPE_NOSPLIT = 0,
+} RingbufferType_t;
+
+RingbufHandle_t xRingbufferCreate(size_t size, RingbufferType_t type);
+void vRingbufferDelete(RingbufHandle_t ring);
+BaseType_t xRingbufferSend(RingbufHandle_t ring, const void* data, size_t size, TickType_t timeout);
+void* xRingbufferReceive(RingbufHandle_t ring, size_t* size, TickType_t timeout);
+void vRingbufferReturnItem(RingbufHandle_t ring, void* item);
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t ring);
+
+#endif
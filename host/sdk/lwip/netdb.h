@@ -0,0 +1,8 @@
+// lwip/netdb.h
+// Host stand-in
+#ifndef HOST_LWIP_NETDB_H
+#define HOST_LWIP_NETDB_H
+
+#include <netdb.h>
+
+#endif
@@ -0,0 +1,17 @@
+// lwip/sockets.h
+// Host stand-in: lwIP's socket API is the BSD one
+#ifndef HOST_LWIP_SOCKETS_H
+#define HOST_LWIP_SOCKETS_H
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+inline char* inet_ntoa_r(struct in_addr address, char* text, int size) {
+  return (char*)inet_ntop(AF_INET, &address, text, size);
+}
+
+#endif
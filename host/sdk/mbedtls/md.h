@@ -0,0 +1,22 @@
+// mbedtls/md.h
+// Host stand-in: HMAC-SHA256 from OpenSSL
+#ifndef HOST_MBEDTLS_MD_H
+#define HOST_MBEDTLS_MD_H
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+typedef EVP_MD mbedtls_md_info_t;
+enum mbedtls_md_type_t { MBEDTLS_MD_SHA256 };
+
+inline const mbedtls_md_info_t* mbedtls_md_info_from_type(mbedtls_md_type_t) {
+  return EVP_sha256();
+}
+
+inline int mbedtls_md_hmac(const mbedtls_md_info_t* md, const unsigned char* key, size_t keyLength,
+                           const unsigned char* input, size_t length, unsigned char* output) {
+  unsigned int outputLength;
+  return HMAC(md, key, keyLength, input, length, output, &outputLength) ? 0 : -1;
+}
+
+#endif
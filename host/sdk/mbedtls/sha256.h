@@ -0,0 +1,26 @@
+// mbedtls/sha256.h
+// Host stand-in: SHA-256 from OpenSSL
+#ifndef HOST_MBEDTLS_SHA256_H
+#define HOST_MBEDTLS_SHA256_H
+
+#include <openssl/sha.h>
+
+typedef SHA256_CTX mbedtls_sha256_context;
+
+inline void mbedtls_sha256_init(mbedtls_sha256_context*) {}
+inline void mbedtls_sha256_free(mbedtls_sha256_context*) {}
+inline int mbedtls_sha256_starts(mbedtls_sha256_context* context, int) {
+  return SHA256_Init(context) ? 0 : -1;
+}
+inline int mbedtls_sha256_update(mbedtls_sha256_context* context, const unsigned char* data, size_t length) {
+  return SHA256_Update(context, data, length) ? 0 : -1;
+}
+inline int mbedtls_sha256_finish(mbedtls_sha256_context* context, unsigned char* output) {
+  return SHA256_Final(output, context) ? 0 : -1;
+}
+inline int mbedtls_sha256(const unsigned char* data, size_t length, unsigned char* output, int) {
+  SHA256(data, length, output);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,167 @@
+// stubs.cpp
+// Host stand-ins for FFat, the device id and the parts of the VM manager
+// that the deploy and message link modules call. host/rtos.cpp has the
+// Arduino core and FreeRTOS.
+#include <Arduino.h>
+#include <FFat.h>
+#include <freertos/queue.h>
+#include "include/vm_manager.h"
+#include "include/vm_log.h"
+#include "include/msg_link.h"
+#include <stdarg.h>
+#include <sys/stat.h>
+
+EspClass ESP;
+FFatFS FFat;
+VM vms[MAX_VMS];
+int vmCount = 0;
+
+// === Device id ===
+
+uint64_t EspClass::getEfuseMac() {
+  const char* mac = getenv("MAC");
+  return mac ? strtoull(mac, nullptr, 16) : 0;
+}
+
+// === FFat over a directory ===
+
+const std::string& hostFsRoot() {
+  static std::string root = getenv("FS_ROOT") ? getenv("FS_ROOT") : "fs";
+  return root;
+}
+
+static std::string hostPath(const String& path) {
+  return hostFsRoot() + std::string(path);
+}
+
+String File::readString() {
+  String text;
+  char buffer[256];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file_)) > 0) {
+    text.append(buffer, length);
+  }
+  return text;
+}
+
+size_t File::size() {
+  struct stat info;
+  return stat(hostPath(path_).c_str(), &info) == 0 ? info.st_size : 0;
+}
+
+time_t File::getLastWrite() {
+  struct stat info;
+  return stat(hostPath(path_).c_str(), &info) == 0 ? info.st_mtime : 0;
+}
+
+const char* File::name() {
+  size_t slash = path_.rfind('/');
+  return path_.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+File File::openNextFile() {
+  struct dirent* entry;
+  while (dir_ && (entry = readdir(dir_))) {
+    if (entry->d_name[0] != '.') {
+      return FFat.open(path_ == "/" ? "/" + std::string(entry->d_name) : path_ + "/" + entry->d_name);
+    }
+  }
+  return File();
+}
+
+void File::close() {
+  if (file_) {
+    fclose(file_);
+  }
+  if (dir_) {
+    closedir(dir_);
+  }
+  file_ = nullptr;
+  dir_ = nullptr;
+}
+
+bool FFatFS::begin(bool) {
+  return mkdir(hostFsRoot().c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+File FFatFS::open(const String& path, const char* mode) {
+  struct stat info;
+  std::string full = hostPath(path);
+  if (stat(full.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+    return File(nullptr, opendir(full.c_str()), path);
+  }
+  // FatFs opens "w" files for reading too, and lets them seek past the end
+  FILE* file = fopen(full.c_str(), strcmp(mode, "w") == 0 ? "w+b" : "rb");
+  return file ? File(file, nullptr, path) : File();
+}
+
+bool FFatFS::exists(const String& path) {
+  struct stat info;
+  return stat(hostPath(path).c_str(), &info) == 0;
+}
+
+bool FFatFS::remove(const String& path) {
+  return ::remove(hostPath(path).c_str()) == 0;
+}
+
+// FatFs refuses to rename onto an existing file
+bool FFatFS::rename(const String& from, const String& to) {
+  return !exists(to) && ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+// === VM manager ===
+
+// A script "runs" as soon as it is loaded; node.cpp drains the queues
+static int hostLaunch(const String& filename, const String& fullPath, const char* kind) {
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (!vms[i].running) {
+      vms[i].filename = filename;
+      vms[i].fullPath = fullPath;
+      vms[i].running = true;
+      vms[i].ctx = (duk_context*)&vms[i];
+      vms[i].starts++;
+      if (!vms[i].messageQueue) {
+        vms[i].messageQueue = xQueueCreate(10, MAX_MESSAGE_LENGTH);
+      }
+      msgLinkAttachVM(i, filename.c_str(), vms[i].messageQueue);
+      vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "Started %s %s as VM %d", kind, fullPath.c_str(), i);
+      return i;
+    }
+  }
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "No free VM slots");
+  return -1;
+}
+
+int createVM(const String& filename, const char* content, const String& fullPath) {
+  return hostLaunch(filename, fullPath, "script");
+}
+
+int createVMFromBytecode(const String& filename, const uint8_t* bytecode, size_t length, const String& fullPath) {
+  return hostLaunch(filename, fullPath, "bytecode");
+}
+
+void stopVM(int vmIndex) {
+  msgLinkDetachVM(vmIndex);
+  vms[vmIndex].running = false;
+}
+
+void destroyVM(int vmIndex) {
+  msgLinkDetachVM(vmIndex);
+  vms[vmIndex].running = false;
+  vms[vmIndex].ctx = nullptr;
+}
+
+bool vmLogPrintf(int source, VMLogLevel level, const char* format, ...) {
+  static const char* levels[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+  va_list args;
+  va_start(args, format);
+  printf("[%s] ", levels[min((int)level, 3)]);
+  vprintf(format, args);
+  printf("\n");
+  fflush(stdout);
+  va_end(args);
+  return true;
+}
+
+void ftpServerInvalidateListings() {
+}
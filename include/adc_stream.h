@@ -0,0 +1,27 @@
+// adc_stream.h
+#ifndef ADC_STREAM_H
+#define ADC_STREAM_H
+
+#include <Arduino.h>
+
+#define ADC_STREAM_RING_SAMPLES 8192   // Native ring capacity, in samples
+#define ADC_STREAM_MAX_CHANNELS 8
+#define ADC_STREAM_FRAME_SAMPLES 64    // Approximate samples per DMA frame
+
+struct AdcStreamStats {
+  int owner;                 // VM index, -1 when idle
+  uint32_t sampleRate;       // Per channel, in Hz
+  uint8_t channels;
+  uint32_t samples;          // Samples accepted into the ring
+  uint32_t overruns;         // Samples dropped because the VM fell behind
+  uint32_t driverOverruns;   // DMA frames dropped by the driver
+  uint32_t badFrames;        // Frames discarded for an invalid result or partial round
+  size_t available;          // Samples waiting to be read
+};
+
+bool adcStreamStart(int vmIndex, const int* pins, size_t pinCount, uint32_t sampleRate, int attenuation);
+void adcStreamStop(int vmIndex);
+size_t adcStreamRead(int vmIndex, int16_t* out, size_t maxSamples);
+void adcStreamGetStats(AdcStreamStats* stats);
+
+#endif
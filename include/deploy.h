@@ -0,0 +1,160 @@
+// deploy.h
+#ifndef DEPLOY_H
+#define DEPLOY_H
+
+#include <Arduino.h>
+#include "include/net_manager.h"
+
+// Chunked code deployment over the firmware's UDP port. The host opens a
+// session, sends numbered chunks, asks which are missing, resends those and
+// commits. The image is written to <path>.part and only replaces <path> once
+// every chunk and the whole-image CRC check out; then it is optionally
+// launched. Names ending in .jsbc are Duktape bytecode, anything else is
+// source. Duktape does not validate bytecode, so BEGIN refuses .jsbc names:
+// bytecode only arrives through a signed rollout, and only images a rollout
+// installed are ever loaded. deploy.py in the repository root is the host side.
+//
+// Every datagram starts with a DeployHeader; all fields are little-endian
+// and CRCs are CRC-32 (as zlib). Host to device:
+//   BEGIN    DeployBegin + name            -> ACK, or ERROR
+//   CHUNK    DeployChunk + data            -> nothing; bad CRCs are dropped
+//   STATUS   u32 chunks sent so far        -> MISSING
+//   COMMIT                                 -> DONE, MISSING or ERROR
+//   ABORT                                  -> nothing
+// Device to host:
+//   MISSING  u32 chunks stored, u16 count, u32 index[count]
+//   DONE     i8 VM index, -1 if not launched
+//   ERROR    u8 DeployError
+// Repeated BEGINs and COMMITs get the same answer again, so the host can
+// simply retry after a lost reply. Once a fleet key is set BEGIN is refused
+// with DEPLOY_ERR_AUTH, and a single device is updated with a rollout sent
+// to its group port directly.
+//
+// Fleet rollouts use the same session on the multicast group instead, so an
+// image is sent once however many devices take it. The host multicasts:
+//   ANNOUNCE DeployAnnounce + name + tag   -> REPORT, RECEIVING or FAILED
+//   CHUNK, STATUS, COMMIT, ABORT           as above
+// and every device in the announced wave answers the sender directly:
+//   REPORT   DeployReport, then for RECEIVING a MISSING payload
+// The tag is an HMAC-SHA256 of everything before it, keyed with the fleet key
+// set over serial, and the image must match the announced SHA-256 before it
+// is installed. The signed counter must exceed the last one the device
+// accepted, which is saved, so a recorded announcement cannot be replayed.
+// After a STATUS only devices that are missing chunks answer, so feedback
+// grows with loss rather than with the fleet; COMMIT is answered by every
+// device with DONE, FAILED, or RECEIVING if chunks are still missing.
+
+#define DEPLOY_MAGIC 0x4A44           // "DJ"
+#define DEPLOY_VERSION 2
+#define DEPLOY_MAX_IMAGE (256 * 1024)
+#define DEPLOY_MIN_CHUNK 128
+#define DEPLOY_MAX_CHUNK 1024
+#define DEPLOY_MAX_MISSING 64         // Chunk indexes per MISSING reply
+#define DEPLOY_TIMEOUT_MS 15000       // An idle session is abandoned
+#define DEPLOY_GROUP_ADDRESS "239.255.74.68"
+#define DEPLOY_GROUP_PORT 1338
+#define DEPLOY_KEY_BYTES 32
+#define DEPLOY_TAG_BYTES 32           // HMAC-SHA256
+#define DEPLOY_DIGEST_BYTES 32        // SHA-256
+#define DEPLOY_TRUSTED_IMAGES 8       // Bytecode digests remembered from signed rollouts
+
+enum DeployType : uint8_t {
+  DEPLOY_BEGIN = 1,
+  DEPLOY_CHUNK,
+  DEPLOY_STATUS,
+  DEPLOY_COMMIT,
+  DEPLOY_ABORT,
+  DEPLOY_ANNOUNCE,
+  DEPLOY_ACK = 0x81,
+  DEPLOY_MISSING,
+  DEPLOY_DONE,
+  DEPLOY_ERROR,
+  DEPLOY_REPORT,
+};
+
+enum DeployError : uint8_t {
+  DEPLOY_ERR_BUSY = 1,      // Another session is in progress
+  DEPLOY_ERR_INVALID,       // Bad name, size or chunk size
+  DEPLOY_ERR_NO_SPACE,
+  DEPLOY_ERR_IO,            // Flash write or rename failed
+  DEPLOY_ERR_CRC,           // Image CRC or digest mismatch; the session is dropped
+  DEPLOY_ERR_LAUNCH,        // Installed, but the VM failed to compile or start
+  DEPLOY_ERR_NO_SESSION,
+  DEPLOY_ERR_AUTH,          // No fleet key, the announcement is not signed with it, or unsigned bytecode
+  DEPLOY_ERR_REPLAY,        // Signed, but the counter is not newer than the last one accepted
+};
+
+enum DeployState : uint8_t {
+  DEPLOY_STATE_RECEIVING = 1,   // Followed by the missing chunks
+  DEPLOY_STATE_DONE,            // value is the VM index, -1 if not launched
+  DEPLOY_STATE_FAILED,          // value is a DeployError
+};
+
+#define DEPLOY_FLAG_LAUNCH 0x01       // Start the image once installed, replacing any VM running it
+
+struct __attribute__((packed)) DeployHeader {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t type;
+  uint32_t session;     // Chosen by the host, non-zero
+};
+
+struct __attribute__((packed)) DeployBegin {
+  uint32_t imageSize;
+  uint32_t imageCrc;
+  uint16_t chunkSize;   // DEPLOY_MIN_CHUNK..DEPLOY_MAX_CHUNK; every chunk but the last is this long
+  uint8_t flags;
+  uint8_t nameLength;   // Absolute path, under 64 bytes
+};
+
+struct __attribute__((packed)) DeployAnnounce {
+  uint64_t counter;     // Must exceed the last counter the device accepted
+  uint32_t imageSize;
+  uint16_t chunkSize;
+  uint8_t flags;
+  uint8_t nameLength;
+  uint8_t wave;         // Only devices whose id % waves equals wave take part
+  uint8_t waves;
+  uint8_t digest[DEPLOY_DIGEST_BYTES];
+};
+
+struct __attribute__((packed)) DeployReport {
+  uint32_t device;      // Last four bytes of the MAC address
+  uint8_t state;
+  int8_t value;
+};
+
+struct __attribute__((packed)) DeployChunk {
+  uint32_t index;
+  uint32_t crc;         // Of this chunk's data
+};
+
+// Loads the fleet key and joins the rollout group. Call after initUDP().
+void deployBegin();
+
+// Sets and saves the key rollout announcements must be signed with;
+// nullptr removes it, so the device takes no part in rollouts
+bool deploySetKey(const uint8_t* key);
+bool deployHasKey();
+uint32_t deployDeviceId();
+
+// Signed requests outside this protocol: HTTP uploads and VM control. The
+// tag is the HMAC-SHA256 of data under the fleet key; false without a key.
+bool deployVerifySignature(const uint8_t* data, size_t length, const uint8_t* tag);
+// Counters are shared with rollouts. A signed request is only acted on if
+// its counter is newer; accepting it saves it, so it cannot be used again.
+bool deployCounterIsNew(uint64_t counter);
+bool deployAcceptCounter(uint64_t counter);
+
+// True if a signed rollout installed exactly this bytecode image. The loader
+// refuses anything else, whether it came over FTP, HTTP or BEGIN.
+bool deployIsTrustedBytecode(const uint8_t* data, size_t length);
+
+// Handles one datagram received on the deploy port or the rollout group.
+// Runs on the loop task, which also launches the VM.
+void deployHandleDatagram(const NetDatagram& datagram);
+
+// Abandons a session that has gone quiet
+void deployPoll();
+
+#endif
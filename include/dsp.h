@@ -0,0 +1,40 @@
+// dsp.h
+#ifndef DSP_H
+#define DSP_H
+
+#include <Arduino.h>
+
+#if __has_include(<esp_dsp.h>)
+#define DSP_USE_ESP_DSP 1        // esp-dsp kernels, SIMD on the ESP32-S3
+#else
+#define DSP_USE_ESP_DSP 0        // Portable scalar kernels
+#endif
+
+#define DSP_MAX_FFT_SIZE 4096    // Complex points
+
+enum DspWindow {
+  DSP_WINDOW_HANN,
+  DSP_WINDOW_HAMMING,
+  DSP_WINDOW_BLACKMAN
+};
+
+// Filters. All buffers are float32; in and out may be the same buffer.
+// history holds the last taps - 1 inputs; scratch must hold 2 * taps + n - 1 floats.
+void dspFir(const float* in, float* out, size_t n, const float* coeffs, size_t taps, float* history, float* scratch);
+// coeffs are { b0, b1, b2, a1, a2 }, state holds 2 floats
+void dspBiquad(float* data, size_t n, const float* coeffs, float* state);
+
+// Spectral. data holds n interleaved complex values (2 * n floats).
+bool dspFft(float* data, size_t n);
+void dspMagnitude(const float* data, float* out, size_t n);
+void dspWindow(float* data, size_t n, DspWindow type);
+
+// Reduction
+size_t dspDecimate(const float* in, size_t n, float* out, size_t outLength, size_t factor);
+float dspMean(const float* data, size_t n);
+float dspRms(const float* data, size_t n);
+float dspMin(const float* data, size_t n);
+float dspMax(const float* data, size_t n);
+void dspFromInt16(const int16_t* in, float* out, size_t n, float scale);
+
+#endif
@@ -0,0 +1,247 @@
+// duk_binding.h
+#ifndef DUK_BINDING_H
+#define DUK_BINDING_H
+
+// Compile-time glue between Duktape and plain C++ natives. A binding is an
+// ordinary function whose parameter types say how each JS argument is read:
+//
+//   static bool native_ledcFade(CallerVM vm, int channel, uint32_t duty, uint32_t ms);
+//   static const duk_function_list_entry ledcBindings[] = {
+//     DUK_BINDING("ledcFade", native_ledcFade),
+//     DUK_BINDING_END
+//   };
+//
+// The thunk reads each argument with the matching duk_require_* call, calls
+// the native and pushes its return value. nargs comes from the signature.
+// Errors surface the way hand-written bindings raise them: duk_require_*
+// throws TypeError, and range and ownership checks throw RangeError or
+// Error.
+
+#include <Arduino.h>
+#include <duktape.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "include/vm_manager.h"
+
+// Pseudo-arguments, filled from the call itself; they consume no JS argument
+struct CallerVM { int index; };          // Throws if not called from a VM
+struct DukContext { duk_context* ctx; };
+
+// Argument wrappers
+struct Pin { int number; };              // 0..NUM_PINS-1, claimed for the caller
+struct Function { duk_idx_t index; };    // Any callable; stays on the value stack
+template <typename T> struct TypedArray { T* data; size_t count; };
+template <typename T, auto Default = T{}> struct Optional { T value; };
+
+namespace duk_binding {
+
+struct Call {
+  duk_context* ctx;
+  int vm;
+
+  // The VM lookup is done at most once per call, however many arguments need it
+  int caller() {
+    if (vm == -2) {
+      vm = -1;
+      for (int i = 0; i < MAX_VMS; i++) {
+        if (vms[i].ctx == ctx) {
+          vm = i;
+          break;
+        }
+      }
+    }
+    return vm;
+  }
+};
+
+template <typename T, typename = void> struct Arg;
+
+template <typename T>
+struct Arg<T, std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>>> {
+  static constexpr bool consumes = true;
+  static T get(Call& call, duk_idx_t idx) { return (T)duk_require_int(call.ctx, idx); }
+};
+
+template <typename T>
+struct Arg<T, std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T> && !std::is_same_v<T, bool>>> {
+  static constexpr bool consumes = true;
+  static T get(Call& call, duk_idx_t idx) { return (T)duk_require_uint(call.ctx, idx); }
+};
+
+template <>
+struct Arg<bool> {
+  static constexpr bool consumes = true;
+  static bool get(Call& call, duk_idx_t idx) { return duk_require_boolean(call.ctx, idx); }
+};
+
+template <typename T>
+struct Arg<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+  static constexpr bool consumes = true;
+  static T get(Call& call, duk_idx_t idx) { return (T)duk_require_number(call.ctx, idx); }
+};
+
+template <>
+struct Arg<const char*> {
+  static constexpr bool consumes = true;
+  static const char* get(Call& call, duk_idx_t idx) { return duk_require_string(call.ctx, idx); }
+};
+
+template <>
+struct Arg<CallerVM> {
+  static constexpr bool consumes = false;
+  static CallerVM get(Call& call, duk_idx_t) {
+    if (call.caller() < 0) {
+      duk_error(call.ctx, DUK_ERR_ERROR, "Not called from a VM");
+    }
+    return { call.vm };
+  }
+};
+
+template <>
+struct Arg<DukContext> {
+  static constexpr bool consumes = false;
+  static DukContext get(Call& call, duk_idx_t) { return { call.ctx }; }
+};
+
+template <>
+struct Arg<Pin> {
+  static constexpr bool consumes = true;
+  static Pin get(Call& call, duk_idx_t idx) {
+    int pin = duk_require_int(call.ctx, idx);
+    if (pin < 0 || pin >= NUM_PINS) {
+      duk_error(call.ctx, DUK_ERR_RANGE_ERROR, "Pin %d out of range", pin);
+    }
+    int vm = Arg<CallerVM>::get(call, idx).index;
+    if (!claimPin(pin, vm)) {
+      duk_error(call.ctx, DUK_ERR_ERROR, "Pin %d is in use by VM %d", pin, getPinOwner(pin));
+    }
+    return { pin };
+  }
+};
+
+template <>
+struct Arg<Function> {
+  static constexpr bool consumes = true;
+  static Function get(Call& call, duk_idx_t idx) {
+    duk_require_function(call.ctx, idx);
+    return { idx };
+  }
+};
+
+template <typename T>
+struct Arg<TypedArray<T>> {
+  static constexpr bool consumes = true;
+  static TypedArray<T> get(Call& call, duk_idx_t idx) {
+    duk_size_t bytes;
+    void* data = duk_require_buffer_data(call.ctx, idx, &bytes);
+    return { (T*)data, bytes / sizeof(T) };
+  }
+};
+
+template <typename T, auto Default>
+struct Arg<Optional<T, Default>> {
+  static constexpr bool consumes = true;
+  static Optional<T, Default> get(Call& call, duk_idx_t idx) {
+    if (duk_is_undefined(call.ctx, idx)) {
+      return { (T)Default };
+    }
+    return { Arg<T>::get(call, idx) };
+  }
+};
+
+template <typename R, typename = void> struct Ret;
+
+template <>
+struct Ret<bool> {
+  static void push(duk_context* ctx, bool value) { duk_push_boolean(ctx, value); }
+};
+
+template <typename R>
+struct Ret<R, std::enable_if_t<std::is_integral_v<R> && std::is_signed_v<R>>> {
+  static void push(duk_context* ctx, R value) { duk_push_int(ctx, value); }
+};
+
+template <typename R>
+struct Ret<R, std::enable_if_t<std::is_integral_v<R> && std::is_unsigned_v<R> && !std::is_same_v<R, bool>>> {
+  static void push(duk_context* ctx, R value) { duk_push_uint(ctx, value); }
+};
+
+template <typename R>
+struct Ret<R, std::enable_if_t<std::is_floating_point_v<R>>> {
+  static void push(duk_context* ctx, R value) { duk_push_number(ctx, value); }
+};
+
+template <>
+struct Ret<const char*> {
+  static void push(duk_context* ctx, const char* value) { duk_push_string(ctx, value); }
+};
+
+template <>
+struct Ret<String> {
+  static void push(duk_context* ctx, const String& value) { duk_push_lstring(ctx, value.c_str(), value.length()); }
+};
+
+// Position of the k-th native parameter among the JS arguments
+template <size_t N>
+constexpr duk_idx_t jsIndex(const bool (&consumes)[N], size_t k) {
+  duk_idx_t index = 0;
+  for (size_t i = 0; i < k; i++) {
+    index += consumes[i] ? 1 : 0;
+  }
+  return index;
+}
+
+template <typename Fn> struct Signature;
+
+template <typename R, typename... A>
+struct Signature<R (*)(A...)> {
+  static constexpr size_t arity = sizeof...(A);
+  static constexpr duk_idx_t nargs = (0 + ... + (Arg<std::decay_t<A>>::consumes ? 1 : 0));
+
+  template <auto Fn, size_t... I>
+  static duk_ret_t call(duk_context* ctx, std::index_sequence<I...>) {
+    [[maybe_unused]] constexpr bool consumes[] = { Arg<std::decay_t<A>>::consumes..., false };
+    [[maybe_unused]] Call state = { ctx, -2 };
+    // Braced initialisation reads the arguments strictly left to right
+    std::tuple<std::decay_t<A>...> args{ Arg<std::decay_t<A>>::get(state, jsIndex(consumes, I))... };
+    if constexpr (std::is_void_v<R>) {
+      std::apply(Fn, args);
+      return 0;
+    } else {
+      Ret<std::decay_t<R>>::push(ctx, std::apply(Fn, args));
+      return 1;
+    }
+  }
+};
+
+template <auto Fn>
+duk_ret_t thunk(duk_context* ctx) {
+  using Sig = Signature<decltype(Fn)>;
+  return Sig::template call<Fn>(ctx, std::make_index_sequence<Sig::arity>());
+}
+
+}  // namespace duk_binding
+
+#define DUK_BINDING(name, fn) { name, duk_binding::thunk<&fn>, duk_binding::Signature<decltype(&fn)>::nargs }
+#define DUK_BINDING_END { NULL, NULL, 0 }
+
+// Puts every entry of a function table on an object as a lightfunc: a tagged
+// value holding the C pointer and nargs, with no heap object behind it.
+// Lightfuncs have no own properties, so natives must not rely on magic.
+inline void dukPutLightFunctions(duk_context* ctx, duk_idx_t obj, const duk_function_list_entry* bindings) {
+  obj = duk_normalize_index(ctx, obj);
+  for (; bindings->key; bindings++) {
+    duk_idx_t length = bindings->nargs == DUK_VARARGS ? 0 : bindings->nargs;
+    duk_push_c_lightfunc(ctx, bindings->value, bindings->nargs, length, 0);
+    duk_put_prop_string(ctx, obj, bindings->key);
+  }
+}
+
+inline void dukRegisterGlobals(duk_context* ctx, const duk_function_list_entry* bindings) {
+  duk_push_global_object(ctx);
+  dukPutLightFunctions(ctx, -1, bindings);
+  duk_pop(ctx);
+}
+
+#endif
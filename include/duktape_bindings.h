@@ -20,11 +20,16 @@ duk_ret_t duk_delay(duk_context *ctx);
 duk_ret_t duk_wait(duk_context *ctx);
 
 // GPIO bindings
-duk_ret_t duk_digitalWrite(duk_context *ctx);
-duk_ret_t duk_digitalRead(duk_context *ctx);
-duk_ret_t duk_analogRead(duk_context *ctx);
-duk_ret_t duk_analogWrite(duk_context *ctx);
-duk_ret_t duk_pinMode(duk_context *ctx);
+duk_ret_t duk_attachInterrupt(duk_context *ctx);
+duk_ret_t duk_detachInterrupt(duk_context *ctx);
+duk_ret_t duk_eventStats(duk_context *ctx);
+
+// Logging bindings
+duk_ret_t duk_logWrite(duk_context *ctx);
+duk_ret_t duk_logLevel(duk_context *ctx);
+duk_ret_t duk_logPolicy(duk_context *ctx);
+duk_ret_t duk_logTag(duk_context *ctx);
+duk_ret_t duk_logStats(duk_context *ctx);
 
 // WiFi bindings
 duk_ret_t duk_wifiConnect(duk_context *ctx);
@@ -35,36 +40,55 @@ duk_ret_t duk_getIP(duk_context *ctx);
 duk_ret_t duk_i2cBegin(duk_context *ctx);
 duk_ret_t duk_i2cWrite(duk_context *ctx);
 duk_ret_t duk_i2cRead(duk_context *ctx);
+duk_ret_t duk_i2cWriteRead(duk_context *ctx);
+duk_ret_t duk_i2cReadRegister(duk_context *ctx);
+duk_ret_t duk_i2cWriteRegister(duk_context *ctx);
+duk_ret_t duk_i2cBatch(duk_context *ctx);
 
 // SPI bindings
 duk_ret_t duk_spiBegin(duk_context *ctx);
 duk_ret_t duk_spiTransfer(duk_context *ctx);
+duk_ret_t duk_spiQueue(duk_context *ctx);
 
 // ADC bindings
 duk_ret_t duk_adcConfig(duk_context *ctx);
+duk_ret_t duk_adcStreamStart(duk_context *ctx);
+duk_ret_t duk_adcStreamRead(duk_context *ctx);
+duk_ret_t duk_adcStreamStop(duk_context *ctx);
+duk_ret_t duk_adcStreamStats(duk_context *ctx);
+
+// DSP bindings (registered on the global "dsp" object)
+duk_ret_t duk_dspFir(duk_context *ctx);
+duk_ret_t duk_dspBiquad(duk_context *ctx);
+duk_ret_t duk_dspIir(duk_context *ctx);
+duk_ret_t duk_dspFft(duk_context *ctx);
+duk_ret_t duk_dspMagnitude(duk_context *ctx);
+duk_ret_t duk_dspWindow(duk_context *ctx);
+duk_ret_t duk_dspDecimate(duk_context *ctx);
+duk_ret_t duk_dspMean(duk_context *ctx);
+duk_ret_t duk_dspRms(duk_context *ctx);
+duk_ret_t duk_dspMin(duk_context *ctx);
+duk_ret_t duk_dspMax(duk_context *ctx);
+duk_ret_t duk_dspFromInt16(duk_context *ctx);
 
 // Touch sensor bindings
-duk_ret_t duk_touchRead(duk_context *ctx);
 duk_ret_t duk_touchAttachInterrupt(duk_context *ctx);
+duk_ret_t duk_touchDetachInterrupt(duk_context *ctx);
 
 // RTC bindings
 duk_ret_t duk_rtcGetTime(duk_context *ctx);
 
-// Sleep bindings
-duk_ret_t duk_deepSleep(duk_context *ctx);
-duk_ret_t duk_lightSleep(duk_context *ctx);
-
-// LED bindings
-duk_ret_t duk_ledcSetup(duk_context *ctx);
-duk_ret_t duk_ledcAttachPin(duk_context *ctx);
-duk_ret_t duk_ledcWrite(duk_context *ctx);
-
-// Timer bindings
-duk_ret_t duk_timerAttach(duk_context *ctx);
+// GPIO, touch, sleep, LEDC, RMT and timer bindings are DUK_BINDING tables
+// local to duktape_bindings.cpp. Every table is registered as lightfuncs,
+// either directly on the global object or in a namespace object created on
+// first access.
 
 // Communication bindings
 duk_ret_t duk_udpSend(duk_context *ctx);
+duk_ret_t duk_udpSendMany(duk_context *ctx);
 duk_ret_t duk_udpReceive(duk_context *ctx);
+duk_ret_t duk_tcpWrite(duk_context *ctx);
+duk_ret_t duk_tcpRead(duk_context *ctx);
 duk_ret_t duk_sendMessage(duk_context *ctx);
 duk_ret_t duk_receiveMessage(duk_context *ctx);
 
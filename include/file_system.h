@@ -10,6 +10,11 @@
 bool initFS();
 void checkFileChanges(int vmIndex);
 bool isJSFile(const char* filename);
+// Starts a VM from a script, or from a bytecode image if the name ends in
+// .jsbc; returns the VM index or -1
+int createVMFromFile(const String& path);
+// Destroys any VM running path, then starts it from the current file
+int relaunchVMFromFile(const String& path);
 void listFiles(File dir, int indent);
 
 #endif
\ No newline at end of file
@@ -1,40 +1,62 @@
-#pragma once
-
-#include <WiFi.h>
-#include <WiFiClient.h>
-
-class FTPServer {
-public:
-    static bool begin(const char* ssid, const char* password);
-    static void handle();
-    
-private:
-    static WiFiServer controlServer;
-    static WiFiServer dataServer;
-    static WiFiClient controlClient;
-    static WiFiClient dataClient;
-    static bool initialized;
-    static void handleClient();
-    static void sendResponse(int code, const char* message);
-    static void processCommand();
-    static void handlePASV();
-    static void handlePORT();
-    static void handleLIST();
-    static void handleRETR(const char* filename);
-    static void handleSTOR(const char* filename);
-    static void handleDELE(const char* filename);
-    static char cmdBuffer[256];
-    static char username[32];
-    static char password[32];
-    static bool loggedIn;
-    static bool dataMode;
-    static bool passiveMode;
-    static IPAddress dataIp;
-    static uint16_t dataPort;
-    static void setupDataConnection();
-    static bool connectToClient();
-    static void resetState();
-    static void cleanupDataConnection();
-    static unsigned long lastCmdTime;
-    static const unsigned long CMD_TIMEOUT = 300000; // 5 minutes
+// ftp_server.h
+#ifndef FTP_SERVER_H
+#define FTP_SERVER_H
+
+#include <Arduino.h>
+
+#define FTP_CONTROL_PORT 21
+#define FTP_USERNAME "esp32"
+#define FTP_PASSWORD "esp32"
+#define FTP_MAX_SESSIONS 2            // Simultaneous clients, each with its own data connection
+#define FTP_INDEX_DIRS 4              // Directory listings kept cached
+#define FTP_COMMAND_BYTES 256         // Longer command lines are rejected
+#define FTP_REPLY_BYTES 512           // Replies queued while the control socket is full
+#define FTP_BUFFER_BYTES 8192         // Default size of each of the two transfer buffers
+#define FTP_MAX_BUFFER_BYTES 32768
+#define FTP_IDLE_TIMEOUT_MS 300000    // Control connection without a command
+#define FTP_DATA_TIMEOUT_MS 10000     // Waiting for the data connection, or for it to make progress
+#define FTP_POLL_MS 50
+
+// lwIP sockets held at most: the listener, and a control socket plus a
+// passive listener or data socket per session. Further clients wait in the
+// listen backlog, which takes no socket.
+#define FTP_LWIP_SOCKETS (1 + 2 * FTP_MAX_SESSIONS)
+
+// FTP server running in its own low-priority task. The control and data
+// connections of up to FTP_MAX_SESSIONS clients are non-blocking sockets
+// driven by one select() loop, so a transfer never holds up loop(), and a
+// slow client never holds up a VM or another client.
+// Uploads are written to <path>.part and renamed once complete, so the file
+// watcher never reloads a half-written script. Call once WiFi is connected.
+//
+// File data goes through two buffers: while one is being written to or read
+// from flash by a separate task, the other is filled from or sent to the
+// socket. Buffers are whole FAT clusters, so every flash access but the last
+// covers whole, aligned clusters.
+bool ftpServerBegin();
+
+// Sets the size of each transfer buffer for transfers that start afterwards,
+// rounded up to whole clusters. Saved across reboots.
+bool ftpServerSetBufferSize(size_t bytes);
+size_t ftpServerBufferSize();
+size_t ftpServerClusterSize();
+
+// Listings come from a cached index of each directory, which FTP drops when
+// it changes the directory itself. Call this after changing files any other
+// way, so the next listings are read afresh.
+void ftpServerInvalidateListings();
+
+struct FtpStats {
+  uint32_t uploads;          // Completed STOR
+  uint32_t downloads;        // Completed RETR
+  uint32_t failed;           // Uploads and downloads that ended in an error or ABOR
+  uint64_t uploadBytes;
+  uint64_t downloadBytes;
+  uint64_t uploadUs;         // From the data connection opening to the last byte, over uploads
+  uint64_t downloadUs;
+  uint64_t flashWaitUs;      // Time the network side sat idle waiting for the flash
 };
+
+void ftpServerGetStats(FtpStats* stats);
+
+#endif
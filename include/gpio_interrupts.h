@@ -0,0 +1,14 @@
+// gpio_interrupts.h
+#ifndef GPIO_INTERRUPTS_H
+#define GPIO_INTERRUPTS_H
+
+#include <Arduino.h>
+
+// Posts a VM_EVENT_GPIO event per edge. Edges closer than debounceUs to the
+// last accepted edge are ignored. With coalesce set, edges arriving while an
+// event is still queued are counted into that event instead of posting more.
+bool gpioInterruptAttach(int vmIndex, int pin, int mode, uint32_t debounceUs, bool coalesce);
+bool gpioInterruptDetach(int vmIndex, int pin);
+void gpioInterruptsRelease(int vmIndex);
+
+#endif
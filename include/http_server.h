@@ -0,0 +1,36 @@
+// http_server.h
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include <Arduino.h>
+
+#define HTTP_MAX_CLIENTS 2            // Keep-alive connections served at once
+#define HTTP_HEADER_BYTES 1024        // Request line and headers must fit
+#define HTTP_CHUNK_BYTES 4096         // Upload bytes read and written to flash at a time
+#define HTTP_READ_BUDGET 16384        // Upload bytes taken per connection per poll
+#define HTTP_IDLE_TIMEOUT_MS 15000    // Idle and stalled connections are closed
+
+// lwIP sockets held at most: the listener and one per connection
+#define HTTP_LWIP_SOCKETS (1 + HTTP_MAX_CLIENTS)
+
+// Management API and metrics. Requests are served from loop(), the same task
+// as the serial console, so VM control never races it:
+//
+//   GET  /vms                      VM slots as JSON
+//   POST /vms?file=/x.js           Create and start a VM
+//   POST /vms/<id>/stop            Stop a VM
+//   POST /vms/<id>/start           Restart a stopped VM
+//   GET  /files                    Files as JSON
+//   PUT  /files/<path>[?start=1]   Stream a file to flash, then optionally
+//                                  compile and start it, replacing any VM
+//                                  running it
+//   GET  /metrics                  Prometheus text exposition
+//
+// Once a fleet key is set (see deploy.h), every PUT and POST must carry
+// X-Deploy-Counter and X-Deploy-Signature headers; deploy.py --http adds them.
+bool httpServerBegin(uint16_t port);
+
+// Accepts and services connections without blocking; call from loop()
+void httpServerHandle();
+
+#endif
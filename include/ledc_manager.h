@@ -0,0 +1,25 @@
+// ledc_manager.h
+#ifndef LEDC_MANAGER_H
+#define LEDC_MANAGER_H
+
+#include <Arduino.h>
+#include <driver/ledc.h>
+
+#define LEDC_SPEED_MODE LEDC_LOW_SPEED_MODE
+
+// Clears the channel table and creates its lock; call once from setup()
+// before any VM starts
+void ledcManagerBegin();
+
+// Reserves a channel for the VM (channel -1 picks a free one) and binds it to
+// a timer running at frequency/resolution, sharing a timer with any other
+// channel already using the same settings. Returns the channel or -1.
+int ledcManagerSetup(int vmIndex, int channel, uint32_t frequency, uint8_t resolution);
+bool ledcManagerAttachPin(int vmIndex, int channel, int pin);
+bool ledcManagerWrite(int vmIndex, int channel, uint32_t duty);
+bool ledcManagerFade(int vmIndex, int channel, uint32_t duty, uint32_t ms);
+// Sets every duty first and then latches them all, so the channels change together
+int ledcManagerWriteMany(int vmIndex, const uint8_t* channels, const uint32_t* duties, size_t count);
+void ledcManagerRelease(int vmIndex);
+
+#endif
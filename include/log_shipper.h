@@ -0,0 +1,46 @@
+// log_shipper.h
+#ifndef LOG_SHIPPER_H
+#define LOG_SHIPPER_H
+
+#include <Arduino.h>
+
+#define LOG_SHIP_BUFFER_BYTES 8192     // Lines kept while the collector is unreachable
+#define LOG_SHIP_MAX_BATCH 1400        // Largest batchBytes and TCP write
+#define LOG_SHIP_MAX_LINE 320
+#define LOG_SHIP_HOST_LENGTH 64
+#define LOG_SHIP_LWIP_SOCKETS 1        // The UDP or TCP socket to the collector
+
+enum LogShipTransport : uint8_t {
+  LOG_SHIP_OFF = 0,
+  LOG_SHIP_UDP,    // RFC 5426, one syslog message per datagram
+  LOG_SHIP_TCP,    // RFC 6587 octet-counted syslog over a persistent connection
+};
+
+struct LogShipConfig {
+  LogShipTransport transport;
+  char host[LOG_SHIP_HOST_LENGTH];
+  uint16_t port;
+  uint16_t batchBytes;     // Send as soon as this much is queued...
+  uint32_t flushMs;        // ...and at least this often otherwise
+};
+
+// Loads the saved configuration, starts the shipping task and hooks into the
+// log drain task. Call after vmLogBegin().
+void logShipperBegin();
+// Applies and saves a new configuration
+bool logShipperConfigure(const LogShipConfig& config);
+void logShipperGetConfig(LogShipConfig* config);
+
+struct LogShipStats {
+  uint32_t batches;         // Flushes that sent at least one line
+  uint32_t lines;
+  uint32_t bytes;
+  uint32_t folded;          // Repeated lines replaced by a repeat count
+  uint32_t dropped;         // Lines lost because the buffer was full
+  uint32_t sendFailures;
+  uint32_t pendingBytes;
+};
+
+void logShipperGetStats(LogShipStats* stats);
+
+#endif
@@ -0,0 +1,78 @@
+// msg_link.h
+#ifndef MSG_LINK_H
+#define MSG_LINK_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include "include/net_manager.h"
+
+// Carries sendMessage() to VMs on other devices. A string address is "vm",
+// "node:vm" or "node:<slot>", where vm is the script's file name without
+// directory and extension. Messages for this node go straight into the VM's
+// queue. The rest are batched per peer into datagrams that the peer
+// acknowledges; unacknowledged datagrams are sent again until the peer
+// answers or MSG_LINK_RETRIES run out. A message is delivered at most once,
+// but a retransmitted one can overtake later messages.
+//
+// Wire format, little-endian: a LinkHeader, then for DATA any number of
+// records (u8 slot or MSG_LINK_BY_NAME, u8 name length, u8 text length,
+// name, text), and for ACK the u32 sequence numbers being acknowledged.
+
+#define MSG_LINK_PORT 1339
+#define MSG_LINK_MAX_PEERS 4
+#define MSG_LINK_NAME_LENGTH 16       // Node and VM names, including the terminator
+#define MSG_LINK_DATAGRAM_BYTES 1024  // A batch is closed once the next message would not fit
+#define MSG_LINK_WINDOW 4             // Datagrams per peer being filled or awaiting an ACK
+#define MSG_LINK_RTO_MS 100           // First retransmission timeout, doubled on every retry
+#define MSG_LINK_RETRIES 5
+#define MSG_LINK_MAX_ACKS 32          // Acknowledgements gathered per peer between polls
+#define MSG_LINK_BY_NAME 0xFF
+
+// Loads the node name and peers and binds MSG_LINK_PORT. Call after initUDP().
+void msgLinkBegin();
+
+// Makes a VM reachable by slot and by the base name of filename once its
+// task runs, and unreachable again before its queue is deleted. The VM
+// manager calls these; msgLinkSend() never looks at the VM table itself.
+void msgLinkAttachVM(int vmIndex, const char* filename, QueueHandle_t queue);
+void msgLinkDetachVM(int vmIndex);
+
+// Queues text for a string address. Returns false if the node or VM is
+// unknown, or the VM's queue or the peer's window is full.
+bool msgLinkSend(const char* address, const char* text);
+
+// Handles a datagram received on MSG_LINK_PORT; runs on the loop task
+void msgLinkHandleDatagram(const NetDatagram& datagram);
+
+// Sends pending batches and acknowledgements and retransmits what timed out.
+// Call from the loop after the datagrams have been handled; the time between
+// calls is the batching window.
+void msgLinkPoll();
+
+// Configuration, saved across reboots
+bool msgLinkSetName(const char* name);
+const char* msgLinkName();
+bool msgLinkAddPeer(const char* name, uint32_t address, uint16_t port);
+bool msgLinkRemovePeer(const char* name);
+
+struct MsgLinkStats {
+  char name[MSG_LINK_NAME_LENGTH];
+  uint32_t address;         // Network byte order
+  uint16_t port;
+  uint32_t sent;            // Messages the peer acknowledged
+  uint32_t received;        // Messages from the peer delivered to local VMs
+  uint32_t datagrams;       // Datagrams sent, retransmissions included
+  uint32_t retransmits;
+  uint32_t failed;          // Messages given up on after MSG_LINK_RETRIES
+  uint32_t undeliverable;   // Received for a VM that is not running or has a full queue
+  uint32_t duplicates;      // Retransmitted datagrams that had already arrived
+  uint32_t pending;         // Messages queued or awaiting acknowledgement
+  uint64_t latencySumUs;    // From sendMessage() to the acknowledgement, over sent
+  uint32_t latencyMaxUs;
+};
+
+// Fills in the counters of the peer-th configured peer; false past the last one
+bool msgLinkGetStats(int peer, MsgLinkStats* stats);
+
+#endif
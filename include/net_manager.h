@@ -0,0 +1,96 @@
+// net_manager.h
+#ifndef NET_MANAGER_H
+#define NET_MANAGER_H
+
+#include <Arduino.h>
+#include "include/vm_manager.h"
+
+#define NET_MAX_SOCKETS 4             // UDP ports; code deploy, rollouts and the message link take three
+#define NET_MAX_TCP 2                 // Listeners and connections, ids 0..NET_MAX_TCP-1
+#define NET_TCP_BUFFER_BYTES 2048     // Per direction and connection, must be a power of two
+#define NET_MAX_DATAGRAM 1472         // Largest UDP payload that fits a 1500 byte MTU
+#define NET_RX_QUEUE_BYTES 4096       // Per owner; datagrams that do not fit are dropped
+#define NET_POLL_MS 20                // New sockets are picked up within this time
+#define NET_OWNER_SYSTEM MAX_VMS      // Firmware sockets such as code deploy
+#define NET_OWNERS (MAX_VMS + 1)
+
+// lwIP sockets held at most, counting the one unbound sockets send from
+#define NET_LWIP_SOCKETS (NET_MAX_SOCKETS + NET_MAX_TCP + 1)
+
+// A received datagram, still inside its owner's receive queue. data stays
+// valid until netUdpRelease().
+struct NetDatagram {
+  uint32_t address;     // Sender IPv4 address, network byte order
+  uint16_t port;        // Sender port
+  uint16_t localPort;   // Port it arrived on
+  const uint8_t* data;
+  size_t length;
+};
+
+// Starts the network task, which owns every socket's receive side and sorts
+// incoming datagrams into per-owner queues
+void netManagerBegin();
+
+// Binds a UDP port for an owner (a VM index or NET_OWNER_SYSTEM). Fails if
+// the port is bound by anyone else or no socket is free.
+bool netUdpBind(int owner, uint16_t port);
+bool netUdpUnbind(int owner, uint16_t port);
+// Adds a multicast group (network byte order) to the owner's socket on port
+bool netUdpJoinGroup(int owner, uint16_t port, uint32_t group);
+
+// Sends from the owner's socket on localPort, or from its first socket when
+// localPort is 0 (an ephemeral one if it has none). Returns bytes sent or -1.
+int netUdpSend(int owner, uint16_t localPort, uint32_t address, uint16_t port, const void* data, size_t length);
+
+struct NetBuffer {
+  const void* data;
+  size_t length;
+};
+
+// Sends several datagrams to one destination under a single lock and socket
+// lookup. Stops at the first failure; returns how many were sent.
+int netUdpSendMany(int owner, uint16_t localPort, uint32_t address, uint16_t port, const NetBuffer* buffers, size_t count);
+
+// Takes the owner's oldest datagram without copying it; every successful
+// call must be followed by netUdpRelease()
+bool netUdpReceive(int owner, NetDatagram* datagram, uint32_t timeoutMs);
+void netUdpRelease(int owner, const NetDatagram& datagram);
+
+// TCP. Every socket is non-blocking and serviced by the network task, so
+// these never wait on the network, with one exception: netTcpConnect() given
+// a host name resolves it with a blocking DNS lookup on the caller's task.
+// A dotted-quad address skips the lookup. Events (VM_EVENT_TCP_*) are posted
+// to the owning VM. Ids stay valid until netTcpClose(), even after the peer
+// closes, so buffered data can still be read.
+int netTcpConnect(int owner, const char* host, uint16_t port);
+int netTcpListen(int owner, uint16_t port, int backlog);
+// Queues as much of data as fits in the send buffer; returns bytes accepted,
+// or -1 if the connection is closed. A VM_EVENT_TCP_DRAIN event follows a
+// short write once the buffer has room again.
+int netTcpWrite(int owner, int id, const void* data, size_t length);
+// Returns bytes copied, or -1 once closed with nothing left to read
+int netTcpRead(int owner, int id, void* data, size_t length);
+int netTcpAvailable(int owner, int id);
+// Flushes queued data in the background, then closes; the id is invalid at once
+bool netTcpClose(int owner, int id);
+
+// Dotted-quad IPv4 conversions, addresses in network byte order
+bool netParseAddress(const char* text, uint32_t* address);
+void netFormatAddress(uint32_t address, char* text, size_t size);
+
+// Closes the owner's sockets and frees its queue
+void netManagerRelease(int owner);
+
+struct NetStats {
+  uint32_t received;
+  uint32_t dropped;        // Receive queue full
+  uint32_t sent;
+  uint32_t sendFailures;
+  uint32_t pendingBytes;   // Approximate, including per-item overhead
+  uint8_t sockets;
+  uint8_t tcpConnections;
+};
+
+void netManagerGetStats(int owner, NetStats* stats);
+
+#endif
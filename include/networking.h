@@ -4,13 +4,12 @@
 
 #include <Arduino.h>
 #include <WiFi.h>
-#include <WiFiUdp.h>
-
-// Declare externally as it's used in other modules
-extern WiFiUDP udp;
 
 void initWiFi(const char* ssid, const char* password);
+// Binds the code-deploy port for the firmware; handleUDP() feeds datagrams
+// sent to it to the deploy protocol (deploy.h) and those for MSG_LINK_PORT
+// to the message link (msg_link.h)
 void initUDP(uint16_t port);
 void handleUDP();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,35 @@
+// rmt_output.h
+#ifndef RMT_OUTPUT_H
+#define RMT_OUTPUT_H
+
+#include <Arduino.h>
+
+#define RMT_OUTPUT_SLOTS 4
+#define RMT_OUTPUT_MAX_BYTES 4096      // Staging buffer cap: 1365 RGB pixels or 1024 pulse symbols
+
+enum RmtOutputKind {
+  RMT_OUTPUT_WS2812 = 0,   // RGB input, GRB on the wire
+  RMT_OUTPUT_SK6812,       // RGBW input, GRBW on the wire
+  RMT_OUTPUT_PULSES        // Alternating high/low durations in ticks
+};
+
+// Clears the slot table and creates its lock; call once from setup() before
+// any VM starts
+void rmtOutputInit();
+
+// Claims an RMT TX channel on pin. resolutionHz only applies to pulse
+// outputs; pixel outputs always run at 10 MHz. Returns a slot or -1.
+int rmtOutputBegin(int vmIndex, int pin, RmtOutputKind kind, uint32_t resolutionHz);
+// Scales and reorders pixels (or packs pulses) into a native staging buffer
+// and queues it. Returns without waiting for the transmission; only blocks
+// if both staging buffers are still on the wire.
+// Pixel data is bytes; pulse data is uint32 durations, length in bytes.
+bool rmtOutputWrite(int vmIndex, int slot, const void* data, size_t length);
+bool rmtOutputSetBrightness(int vmIndex, int slot, uint8_t brightness);
+bool rmtOutputSetGamma(int vmIndex, int slot, bool enabled);
+bool rmtOutputBusy(int vmIndex, int slot);
+bool rmtOutputWait(int vmIndex, int slot, uint32_t timeoutMs);
+bool rmtOutputEnd(int vmIndex, int slot);
+void rmtOutputRelease(int vmIndex);
+
+#endif
@@ -0,0 +1,30 @@
+// spi_bus.h
+#ifndef SPI_BUS_H
+#define SPI_BUS_H
+
+#include <Arduino.h>
+#include <driver/spi_master.h>
+
+#define SPI_BUS_HOST SPI2_HOST
+#define SPI_MAX_TRANSFER 32768   // Largest single transaction in bytes
+#define SPI_POLL_THRESHOLD 64    // Shorter transfers busy-wait for completion instead of taking an interrupt
+#define SPI_QUEUE_SIZE 8         // Transactions in flight for spiBusQueue()
+
+// One leg of a queued transfer; rx may be null for write-only segments
+struct SpiSegment {
+  const uint8_t* tx;
+  uint8_t* rx;
+  size_t length;
+};
+
+// Creates the bus lock; call once from setup() before any VM starts
+void spiBusInit();
+
+// The bus has a single owner: the VM that began it, which also claims its
+// pins. Other VMs cannot begin or use it until the owner exits.
+bool spiBusBegin(int vmIndex, int sck, int miso, int mosi, int ss, uint32_t frequency, uint8_t mode);
+void spiBusRelease(int vmIndex);
+bool spiBusTransfer(int vmIndex, const uint8_t* tx, uint8_t* rx, size_t length);
+int spiBusQueue(int vmIndex, const SpiSegment* segments, size_t count);
+
+#endif
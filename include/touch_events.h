@@ -0,0 +1,23 @@
+// touch_events.h
+#ifndef TOUCH_EVENTS_H
+#define TOUCH_EVENTS_H
+
+#include <Arduino.h>
+
+#define TOUCH_SCAN_INTERVAL_MS 20   // Baseline refresh and release detection
+#define TOUCH_BASELINE_SHIFT 6      // Baseline follows drift with weight 1/64
+
+// Initialises the pad table and starts the scan task; call once from setup()
+bool touchEventsBegin();
+
+// Posts VM_EVENT_TOUCH with value 1 when the reading moves more than
+// threshold away from the pad's tracked baseline, and 0 when it falls back
+// below half the threshold
+bool touchEventsAttach(int vmIndex, int pin, uint32_t threshold);
+bool touchEventsDetach(int vmIndex, int pin);
+void touchEventsRelease(int vmIndex);
+
+// Reads every touch-capable pin in one call, in ascending touch channel order
+size_t touchReadAllPads(uint32_t* out, size_t maxPads);
+
+#endif
@@ -0,0 +1,64 @@
+// vm_events.h
+#ifndef VM_EVENTS_H
+#define VM_EVENTS_H
+
+#include <Arduino.h>
+#include <duktape.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define VM_EVENT_QUEUE_SIZE 64   // Per VM, must be a power of two
+#define VM_EVENT_TYPES 16
+
+enum VMEventType : uint8_t {
+  VM_EVENT_TIMER = 1,
+  VM_EVENT_GPIO,
+  VM_EVENT_TOUCH,
+  VM_EVENT_TCP_ACCEPT,   // Source: listener id, value: new connection id
+  VM_EVENT_TCP_DATA,     // Source: connection id, value: bytes available
+  VM_EVENT_TCP_DRAIN,    // Source: connection id, value: free send buffer space
+  VM_EVENT_TCP_CLOSE,    // Source: connection id, value: errno, 0 for an orderly close
+};
+
+// Fixed-size record posted from ISRs and native tasks to a VM. Handlers are
+// called as handler(timestamp, value, count).
+struct VMEvent {
+  uint8_t type;
+  uint8_t source;       // Timer slot, pin, channel... depending on type
+  uint16_t count;       // Occurrences folded into this event
+  int32_t value;
+  int64_t timestamp;    // esp_timer_get_time() microseconds
+};
+
+// Lifecycle, called by the VM manager
+void vmEventsAttach(int vmIndex, TaskHandle_t task);
+void vmEventsDetach(int vmIndex);
+
+// Producers. Both are lock-free and safe from any core; the ISR variant
+// lives in IRAM. They return false when the VM's queue is full.
+bool vmEventPost(int vmIndex, const VMEvent& event);
+bool vmEventPostFromISR(int vmIndex, const VMEvent& event, BaseType_t* woken);
+
+// Optional per-type hook run on the VM task just before an event is handed
+// to JS, e.g. to fold in occurrences coalesced since the event was posted
+typedef void (*VMEventFinalizer)(VMEvent* event);
+void vmEventsSetFinalizer(uint8_t type, VMEventFinalizer finalizer);
+
+// Consumer side, called on the VM's own task
+void vmEventsSetHandler(duk_context* ctx, uint8_t type, uint8_t source, duk_idx_t fnIdx);
+int vmEventsDispatch(duk_context* ctx, int vmIndex);
+void vmEventsWait(duk_context* ctx, int vmIndex, uint32_t ms);
+
+struct VMEventStats {
+  uint32_t dispatched;
+  uint32_t dropped;          // Posts rejected because the queue was full
+  uint32_t pending;
+  uint32_t avgLatencyUs;     // Interrupt timestamp to handler call
+  uint32_t maxLatencyUs;
+  uint64_t busyUs;           // Time the VM task spent outside wait(); an upper
+                             // bound on its CPU time when VMs share a core
+};
+
+void vmEventsGetStats(int vmIndex, VMEventStats* stats);
+
+#endif
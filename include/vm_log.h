@@ -0,0 +1,68 @@
+// vm_log.h
+#ifndef VM_LOG_H
+#define VM_LOG_H
+
+#include <Arduino.h>
+#include "include/vm_manager.h"
+
+#define VM_LOG_RING_BYTES 2048     // Per source, must be a power of two
+#define VM_LOG_MAX_LINE 200        // Longer messages are truncated
+#define VM_LOG_TAG_LENGTH 16
+#define VM_LOG_SYSTEM MAX_VMS      // Source for firmware messages
+#define VM_LOG_SOURCES (MAX_VMS + 1)
+
+enum VMLogLevel : uint8_t {
+  VM_LOG_DEBUG = 0,
+  VM_LOG_INFO,
+  VM_LOG_WARN,
+  VM_LOG_ERROR,
+};
+
+enum VMLogPolicy : uint8_t {
+  VM_LOG_DROP = 0,   // Discard new lines while the ring is full
+  VM_LOG_BLOCK,      // Wait up to VM_LOG_BLOCK_MS for the drain task, then drop
+};
+
+#define VM_LOG_BLOCK_MS 100
+
+// Starts the drain task that writes every source's lines to Serial
+void vmLogBegin();
+
+// Resets a source's tag, level, policy and counters; called when a VM starts.
+// Lines still queued from the previous VM in the slot are drained as usual.
+void vmLogAttach(int source, const char* tag);
+
+// Producers. Each VM writes only to its own source, so VM rings are
+// single-producer and lock-free; the system source takes a short lock.
+// Return false when the line was filtered, rate limited or dropped.
+bool vmLogWrite(int source, VMLogLevel level, const char* message, size_t length);
+bool vmLogPrintf(int source, VMLogLevel level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+void vmLogSetLevel(int source, VMLogLevel level);
+// linesPerSecond 0 disables rate limiting; bursts of up to one second's
+// worth of lines are allowed
+void vmLogSetPolicy(int source, VMLogPolicy policy, uint16_t linesPerSecond);
+void vmLogSetTag(int source, const char* tag);
+
+bool vmLogParseLevel(const char* name, VMLogLevel* level);
+const char* vmLogLevelName(VMLogLevel level);
+
+// Optional consumer fed every line on the drain task, after it is queued for
+// Serial. It is called with source -1 at the end of each drain pass.
+typedef void (*VMLogSink)(int source, VMLogLevel level, uint32_t timestamp, const char* tag, const char* text, size_t length);
+void vmLogSetSink(VMLogSink sink);
+
+struct VMLogStats {
+  uint32_t written;
+  uint32_t dropped;        // Ring full
+  uint32_t rateLimited;
+  uint32_t pendingBytes;
+  VMLogLevel level;
+  VMLogPolicy policy;
+  uint16_t linesPerSecond;
+  char tag[VM_LOG_TAG_LENGTH];
+};
+
+void vmLogGetStats(int source, VMLogStats* stats);
+
+#endif
@@ -12,12 +12,12 @@
 #define MAX_MESSAGE_LENGTH 256
 #define FS_CHECK_INTERVAL 5000
 #define VM_STACK_SIZE 8192
+#define NUM_PINS 40
 
 // VM structure
 struct VM {
   duk_context* ctx = nullptr;
   TaskHandle_t taskHandle = nullptr;
-  SemaphoreHandle_t pinMutex = nullptr;
   QueueHandle_t messageQueue = nullptr;
   String filename;
   String fullPath;
@@ -26,7 +26,8 @@ struct VM {
   bool forceTerminate = false;
   unsigned long lastFileCheckTime = 0;
   unsigned long lastRunTime = 0;
-  size_t memoryAllocated = 0;
+  size_t memoryAllocated = 0;   // Live Duktape heap bytes
+  uint32_t starts = 0;          // Task starts in this slot, reloads included
   size_t fileSize = 0;
   time_t lastModified = 0;
 };
@@ -34,17 +35,24 @@ struct VM {
 // Extern declarations
 extern VM vms[MAX_VMS];
 extern int vmCount;
-extern SemaphoreHandle_t pinMutexes[40];
-extern bool pinInUse[40];
 
 // Function declarations
 bool isEnoughMemoryAvailable(size_t memoryNeeded);
 int findFreeVMSlot();
 void destroyVM(int vmIndex);
 int createVM(const String& filename, const char* content, const String& fullPath);
+// Starts a function saved with duk_dump_function() by the same Duktape build.
+// Duktape does not validate bytecode, so it must come from a trusted source.
+int createVMFromBytecode(const String& filename, const uint8_t* bytecode, size_t length, const String& fullPath);
 void executeVM(int vmIndex);
 int startVM(int vmIndex);
 void stopVM(int vmIndex);
 void monitorAndRescheduleVMs();
 
+// Pin ownership
+bool claimPin(int pin, int vmIndex);
+bool releasePin(int pin, int vmIndex);
+void releasePins(int vmIndex);
+int getPinOwner(int pin);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,34 @@
+// vm_perf.h
+#ifndef VM_PERF_H
+#define VM_PERF_H
+
+#include <Arduino.h>
+
+#define VM_PERF_MARKS 16          // Named marks per VM; the oldest is reused
+#define VM_PERF_SPANS 64          // Measured spans kept per VM, must be a power of two
+#define VM_PERF_NAME_LENGTH 24    // Longer names are truncated
+
+struct VMPerfSpan {
+  char name[VM_PERF_NAME_LENGTH];
+  int64_t startUs;                // esp_timer_get_time() at the start mark
+  uint32_t durationUs;
+};
+
+// Resets a VM's marks and spans and sets its time origin; called on the VM's
+// own task when it starts
+void vmPerfAttach(int vmIndex);
+
+// Milliseconds since the VM's time origin, with microsecond resolution
+double vmPerfNow(int vmIndex);
+
+// Marks and measures are only called from the VM's own task. A missing start
+// mark means the time origin and a missing end mark means now. Returns the
+// duration in microseconds, or -1 if a named mark does not exist.
+void vmPerfMark(int vmIndex, const char* name);
+int64_t vmPerfMeasure(int vmIndex, const char* name, const char* startMark, const char* endMark);
+void vmPerfClear(int vmIndex);
+
+// Prints the kept spans and a per-name summary; safe from any task
+void vmPerfDump(int vmIndex, Print& out);
+
+#endif
@@ -0,0 +1,16 @@
+// vm_timers.h
+#ifndef VM_TIMERS_H
+#define VM_TIMERS_H
+
+#include <Arduino.h>
+
+#define VM_TIMER_COUNT 4   // Hardware general-purpose timers available to scripts
+
+// Periodic or one-shot timer whose ISR posts a VM_EVENT_TIMER event
+bool vmTimerAttach(int vmIndex, int slot, uint64_t periodUs, bool oneShot);
+// Periodic timer that toggles a pin from the ISR without involving the VM
+bool vmTimerToggle(int vmIndex, int slot, uint64_t periodUs, int pin);
+bool vmTimerDetach(int vmIndex, int slot);
+void vmTimersRelease(int vmIndex);
+
+#endif
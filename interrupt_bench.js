@@ -0,0 +1,52 @@
+// interrupt_bench.js
+// Measures edge-to-handler latency on the device. A hardware timer toggles
+// OUT_PIN from its interrupt, with no JavaScript involved; a jumper wire
+// carries the edges to IN_PIN, where an attachInterrupt() handler counts
+// them. For each edge rate, with and without coalescing, the event
+// statistics give the time from the edge's interrupt timestamp to the
+// handler call and how many edges were handled or dropped. Wire OUT_PIN to
+// IN_PIN, upload the script and read the results on the serial console.
+
+var OUT_PIN = 4;
+var IN_PIN = 5;
+var TIMER = 0;
+var SECONDS = 3;
+var PERIODS_US = [5000, 1000, 250, 100, 50];  // Time between toggles; one rising edge every two
+
+var edges = 0;
+var calls = 0;
+
+function onEdge(timestampUs, level, edgeCount) {
+  edges += edgeCount;
+  calls++;
+}
+
+// eventStats() only keeps totals, so each run's average comes from the
+// difference between two snapshots; the maximum is over all runs so far
+function run(periodUs, coalesce) {
+  edges = 0;
+  calls = 0;
+  attachInterrupt(IN_PIN, "rising", onEdge, 0, coalesce);
+  var before = eventStats();
+  timer.toggle(TIMER, periodUs, OUT_PIN);
+  wait(SECONDS * 1000);
+  timer.detach(TIMER);
+  wait(100);
+  var after = eventStats();
+  detachInterrupt(IN_PIN);
+
+  var dispatched = after.dispatched - before.dispatched;
+  var latencySum = after.avgLatencyUs * after.dispatched - before.avgLatencyUs * before.dispatched;
+  var expected = Math.round(SECONDS * 1000000 / (2 * periodUs));
+  print((1000000 / (2 * periodUs)).toFixed(0) + " edges/s" + (coalesce ? ", coalesced" : "") + ": " +
+    edges + " of ~" + expected + " edges in " + calls + " calls, " +
+    (after.dropped - before.dropped) + " dropped, latency avg " +
+    (dispatched ? (latencySum / dispatched).toFixed(0) : "-") + " us, max so far " + after.maxLatencyUs + " us");
+}
+
+pinMode(IN_PIN, 0x01);  // INPUT
+for (var i = 0; i < PERIODS_US.length; i++) {
+  run(PERIODS_US[i], false);
+  run(PERIODS_US[i], true);
+}
+print("interrupt_bench done");
@@ -7,17 +7,38 @@
 #include "include/duktape_bindings.h"
 #include "include/file_system.h"
 #include "include/networking.h"
+#include "include/net_manager.h"
 #include "include/serial_handler.h"
 #include "include/ftp_server.h"
+#include "include/vm_log.h"
+#include "include/log_shipper.h"
+#include "include/http_server.h"
+#include "include/deploy.h"
+#include "include/msg_link.h"
+#include "include/spi_bus.h"
+#include "include/touch_events.h"
+#include "include/ledc_manager.h"
+#include "include/rmt_output.h"
 
 // Configuration (Adjust as needed)
 #define WIFI_SSID "Lastditchwifi-2.4"
 #define WIFI_PASSWORD "Mune0420"
 #define UDP_PORT 1337
+#define HTTP_PORT 80
+
+// Every socket pool can be full at once, and lwIP has no more to give
+static_assert(NET_LWIP_SOCKETS + FTP_LWIP_SOCKETS + HTTP_LWIP_SOCKETS + LOG_SHIP_LWIP_SOCKETS <= CONFIG_LWIP_MAX_SOCKETS,
+              "Socket pools exceed CONFIG_LWIP_MAX_SOCKETS");
 
 void setup() {
   Serial.begin(115200);
   delay(100);
+  vmLogBegin();
+  logShipperBegin();
+  spiBusInit();
+  touchEventsBegin();
+  ledcManagerBegin();
+  rmtOutputInit();
 
   // Initialize filesystem
   if (!initFS()) {
@@ -29,19 +50,26 @@ void setup() {
   // Initialize WiFi, UDP, and FTP
   initWiFi(WIFI_SSID, WIFI_PASSWORD);
   initUDP(UDP_PORT);
-  if (FTPServer::begin(WIFI_SSID, WIFI_PASSWORD)) {
+  deployBegin();
+  msgLinkBegin();
+  if (ftpServerBegin()) {
     Serial.println("FTP server started successfully");
   } else {
     Serial.println("Failed to start FTP server");
   }
   Serial.println("Connected! IP address: " + WiFi.localIP().toString());
   Serial.printf("UDP Server listening on port %d\n", UDP_PORT);
+  Serial.printf("Rollout group %s:%d, device id %08lx\n", DEPLOY_GROUP_ADDRESS, DEPLOY_GROUP_PORT,
+    (unsigned long)deployDeviceId());
+  if (httpServerBegin(HTTP_PORT)) {
+    Serial.printf("HTTP management API on port %d\n", HTTP_PORT);
+  }
 }
 
 void loop() {
   handleUDP();
   handleSerial();
-  FTPServer::handle();
+  httpServerHandle();
   monitorAndRescheduleVMs();
   
   // Small delay to prevent watchdog triggers
@@ -0,0 +1,226 @@
+// adc_stream.cpp
+#include "include/adc_stream.h"
+#include "include/vm_log.h"
+#include <esp_adc/adc_continuous.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <atomic>
+
+// Single-producer (drain task) / single-consumer (owning VM) sample ring
+static int16_t ring[ADC_STREAM_RING_SAMPLES];
+static std::atomic<uint32_t> ringHead(0);
+static std::atomic<uint32_t> ringTail(0);
+
+static adc_continuous_handle_t adcHandle = nullptr;
+static TaskHandle_t drainTask = nullptr;
+static SemaphoreHandle_t streamMutex = nullptr;
+static size_t frameBytes = 0;
+
+static std::atomic<int> owner(-1);
+static uint32_t streamRate = 0;
+static uint8_t streamChannels = 0;
+static std::atomic<uint32_t> acceptedSamples(0);
+static std::atomic<uint32_t> droppedSamples(0);
+static std::atomic<uint32_t> droppedFrames(0);
+static std::atomic<uint32_t> badFrames(0);
+
+static bool IRAM_ATTR onConversionDone(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* edata, void* arg) {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(drainTask, &woken);
+  return woken == pdTRUE;
+}
+
+static bool IRAM_ATTR onPoolOverflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* edata, void* arg) {
+  droppedFrames.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+// Frames always hold whole scan rounds, so a frame is either stored in full
+// or dropped in full and the channel interleaving never slips. A frame with
+// an invalid result or a partial round is dropped rather than stored with
+// a gap.
+static void storeFrame(const uint8_t* frame, uint32_t length) {
+  int16_t samples[ADC_STREAM_FRAME_SAMPLES + ADC_STREAM_MAX_CHANNELS];
+  size_t count = 0;
+
+  for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES) {
+    const adc_digi_output_data_t* result = (const adc_digi_output_data_t*)&frame[i];
+    if (result->type2.channel >= SOC_ADC_CHANNEL_NUM(ADC_UNIT_1)) {
+      badFrames.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    samples[count++] = result->type2.data;
+  }
+
+  if (count % streamChannels != 0) {
+    badFrames.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  uint32_t head = ringHead.load(std::memory_order_relaxed);
+  uint32_t tail = ringTail.load(std::memory_order_acquire);
+  if (ADC_STREAM_RING_SAMPLES - (head - tail) < count) {
+    droppedSamples.fetch_add(count, std::memory_order_relaxed);
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    ring[(head + i) % ADC_STREAM_RING_SAMPLES] = samples[i];
+  }
+  ringHead.store(head + count, std::memory_order_release);
+  acceptedSamples.fetch_add(count, std::memory_order_relaxed);
+}
+
+static void adcDrainTask(void* parameter) {
+  uint8_t frame[(ADC_STREAM_FRAME_SAMPLES + ADC_STREAM_MAX_CHANNELS) * SOC_ADC_DIGI_RESULT_BYTES];
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    xSemaphoreTake(streamMutex, portMAX_DELAY);
+    if (adcHandle) {
+      uint32_t length = 0;
+      while (adc_continuous_read(adcHandle, frame, frameBytes, &length, 0) == ESP_OK) {
+        storeFrame(frame, length);
+      }
+    }
+    xSemaphoreGive(streamMutex);
+  }
+}
+
+bool adcStreamStart(int vmIndex, const int* pins, size_t pinCount, uint32_t sampleRate, int attenuation) {
+  if (pinCount == 0 || pinCount > ADC_STREAM_MAX_CHANNELS || pinCount > SOC_ADC_PATT_LEN_MAX) {
+    return false;
+  }
+
+  uint32_t totalRate = sampleRate * pinCount;
+  if (totalRate < SOC_ADC_SAMPLE_FREQ_THRES_LOW || totalRate > SOC_ADC_SAMPLE_FREQ_THRES_HIGH) {
+    vmLogPrintf(vmIndex, VM_LOG_ERROR, "ADC stream rate %lu Hz out of range", (unsigned long)totalRate);
+    return false;
+  }
+
+  int expected = -1;
+  if (!owner.compare_exchange_strong(expected, vmIndex)) {
+    return false;
+  }
+
+  if (!streamMutex) {
+    streamMutex = xSemaphoreCreateMutex();
+  }
+  if (!drainTask) {
+    xTaskCreatePinnedToCore(adcDrainTask, "ADC_Drain", 4096, nullptr, 5, &drainTask, 0);
+  }
+  if (!streamMutex || !drainTask) {
+    owner.store(-1);
+    return false;
+  }
+
+  adc_digi_pattern_config_t pattern[ADC_STREAM_MAX_CHANNELS] = {};
+  for (size_t i = 0; i < pinCount; i++) {
+    adc_unit_t unit;
+    adc_channel_t channel;
+    if (adc_continuous_io_to_channel(pins[i], &unit, &channel) != ESP_OK || unit != ADC_UNIT_1) {
+      vmLogPrintf(vmIndex, VM_LOG_ERROR, "GPIO %d is not an ADC1 pin", pins[i]);
+      owner.store(-1);
+      return false;
+    }
+    pattern[i].atten = attenuation;
+    pattern[i].channel = channel;
+    pattern[i].unit = ADC_UNIT_1;
+    pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  }
+
+  // Round the frame to whole scan rounds
+  size_t rounds = max((size_t)1, ADC_STREAM_FRAME_SAMPLES / pinCount);
+  frameBytes = rounds * pinCount * SOC_ADC_DIGI_RESULT_BYTES;
+
+  adc_continuous_handle_cfg_t handleConfig = {};
+  handleConfig.max_store_buf_size = frameBytes * 8;
+  handleConfig.conv_frame_size = frameBytes;
+
+  adc_continuous_config_t config = {};
+  config.pattern_num = pinCount;
+  config.adc_pattern = pattern;
+  config.sample_freq_hz = totalRate;
+  config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE2;
+
+  adc_continuous_evt_cbs_t callbacks = {};
+  callbacks.on_conv_done = onConversionDone;
+  callbacks.on_pool_ovf = onPoolOverflow;
+
+  ringHead.store(0);
+  ringTail.store(0);
+  acceptedSamples.store(0);
+  droppedSamples.store(0);
+  droppedFrames.store(0);
+  badFrames.store(0);
+  streamRate = sampleRate;
+  streamChannels = pinCount;
+
+  xSemaphoreTake(streamMutex, portMAX_DELAY);
+  adc_continuous_handle_t handle = nullptr;
+  bool ok = adc_continuous_new_handle(&handleConfig, &handle) == ESP_OK;
+  ok = ok && adc_continuous_config(handle, &config) == ESP_OK;
+  ok = ok && adc_continuous_register_event_callbacks(handle, &callbacks, nullptr) == ESP_OK;
+  ok = ok && adc_continuous_start(handle) == ESP_OK;
+  if (ok) {
+    adcHandle = handle;
+  } else if (handle) {
+    adc_continuous_deinit(handle);
+  }
+  xSemaphoreGive(streamMutex);
+
+  if (!ok) {
+    vmLogPrintf(vmIndex, VM_LOG_ERROR, "Failed to start ADC stream");
+    owner.store(-1);
+  }
+  return ok;
+}
+
+void adcStreamStop(int vmIndex) {
+  if (owner.load() != vmIndex || !streamMutex) {
+    return;
+  }
+
+  xSemaphoreTake(streamMutex, portMAX_DELAY);
+  if (adcHandle) {
+    adc_continuous_stop(adcHandle);
+    adc_continuous_deinit(adcHandle);
+    adcHandle = nullptr;
+  }
+  xSemaphoreGive(streamMutex);
+
+  owner.store(-1);
+}
+
+// Copies up to maxSamples, rounded down to whole scan rounds
+size_t adcStreamRead(int vmIndex, int16_t* out, size_t maxSamples) {
+  if (owner.load(std::memory_order_relaxed) != vmIndex) {
+    return 0;
+  }
+
+  uint32_t tail = ringTail.load(std::memory_order_relaxed);
+  uint32_t head = ringHead.load(std::memory_order_acquire);
+  size_t count = min((size_t)(head - tail), maxSamples);
+  count -= count % streamChannels;
+
+  size_t first = min(count, (size_t)(ADC_STREAM_RING_SAMPLES - tail % ADC_STREAM_RING_SAMPLES));
+  memcpy(out, &ring[tail % ADC_STREAM_RING_SAMPLES], first * sizeof(int16_t));
+  memcpy(out + first, ring, (count - first) * sizeof(int16_t));
+
+  ringTail.store(tail + count, std::memory_order_release);
+  return count;
+}
+
+void adcStreamGetStats(AdcStreamStats* stats) {
+  stats->owner = owner.load();
+  stats->sampleRate = stats->owner >= 0 ? streamRate : 0;
+  stats->channels = stats->owner >= 0 ? streamChannels : 0;
+  stats->samples = acceptedSamples.load();
+  stats->overruns = droppedSamples.load();
+  stats->driverOverruns = droppedFrames.load();
+  stats->badFrames = badFrames.load();
+  stats->available = ringHead.load() - ringTail.load();
+}
@@ -0,0 +1,550 @@
+// deploy.cpp
+#include "include/deploy.h"
+#include "include/vm_manager.h"
+#include "include/file_system.h"
+#include "include/vm_log.h"
+#include "include/ftp_server.h"
+#include <FFat.h>
+#include <Preferences.h>
+#include <esp_rom_crc.h>
+#include <mbedtls/md.h>
+#include <mbedtls/sha256.h>
+
+struct DeploySession {
+  uint32_t id;              // 0 when idle
+  bool rollout;             // Announced to the group rather than begun by one host
+  String path;
+  File file;                // <path>.part, open for writing
+  uint32_t imageSize;
+  uint32_t imageCrc;        // Checked for direct sessions...
+  uint8_t digest[DEPLOY_DIGEST_BYTES];   // ...and the signed SHA-256 for rollouts
+  uint16_t chunkSize;
+  uint8_t flags;
+  uint32_t chunkCount;
+  uint32_t stored;
+  uint8_t received[DEPLOY_MAX_IMAGE / DEPLOY_MIN_CHUNK / 8];   // One bit per chunk
+  unsigned long lastActive;
+};
+
+// The outcome of the last session, replayed if its COMMIT is repeated
+struct DeployResult {
+  uint32_t id;
+  uint8_t type;
+  uint8_t value;
+};
+
+// Only the loop task touches these. The device is little-endian like the
+// wire format, so packets are read and written with memcpy.
+static DeploySession session;
+static DeployResult lastResult;
+static uint8_t packet[sizeof(DeployHeader) + sizeof(DeployReport) + 6 + DEPLOY_MAX_MISSING * 4];
+static uint8_t verifyBuffer[DEPLOY_MAX_CHUNK];
+static uint8_t fleetKey[DEPLOY_KEY_BYTES];
+static bool hasKey = false;
+static uint64_t lastCounter = 0;   // Of the last signed request accepted
+static uint32_t deviceId = 0;
+// SHA-256 of the last bytecode images signed rollouts installed, newest
+// first; all-zero entries are unused
+static uint8_t trustedImages[DEPLOY_TRUSTED_IMAGES][DEPLOY_DIGEST_BYTES];
+
+static bool fromGroup(const NetDatagram& datagram) {
+  return datagram.localPort == DEPLOY_GROUP_PORT;
+}
+
+static void reply(const NetDatagram& to, uint32_t id, uint8_t type, const void* payload, size_t length) {
+  DeployHeader header = { DEPLOY_MAGIC, DEPLOY_VERSION, type, id };
+  memcpy(packet, &header, sizeof(header));
+  if (length > 0) {
+    memcpy(packet + sizeof(header), payload, length);
+  }
+  netUdpSend(NET_OWNER_SYSTEM, to.localPort, to.address, to.port, packet, sizeof(header) + length);
+}
+
+// Answers a rollout request; body is a MISSING payload for RECEIVING
+static void report(const NetDatagram& to, uint32_t id, DeployState state, int8_t value, const uint8_t* body, size_t length) {
+  uint8_t payload[sizeof(DeployReport) + 6 + DEPLOY_MAX_MISSING * 4];
+  DeployReport header = { deviceId, state, value };
+  memcpy(payload, &header, sizeof(header));
+  if (length > 0) {
+    memcpy(payload + sizeof(header), body, length);
+  }
+  reply(to, id, DEPLOY_REPORT, payload, sizeof(header) + length);
+}
+
+static void replyError(const NetDatagram& to, uint32_t id, DeployError error) {
+  uint8_t code = error;
+  if (fromGroup(to)) {
+    report(to, id, DEPLOY_STATE_FAILED, code, nullptr, 0);
+  } else {
+    reply(to, id, DEPLOY_ERROR, &code, 1);
+  }
+}
+
+// Sends a DONE or ERROR outcome in the form the request arrived in
+static void replyOutcome(const NetDatagram& to, uint32_t id, uint8_t type, uint8_t value) {
+  if (!fromGroup(to)) {
+    reply(to, id, type, &value, 1);
+  } else if (type == DEPLOY_DONE) {
+    report(to, id, DEPLOY_STATE_DONE, (int8_t)value, nullptr, 0);
+  } else {
+    report(to, id, DEPLOY_STATE_FAILED, value, nullptr, 0);
+  }
+}
+
+static void dropSession() {
+  if (session.file) {
+    session.file.close();
+  }
+  String part = session.path + ".part";
+  if (FFat.exists(part)) {
+    FFat.remove(part);
+  }
+  session.id = 0;
+  session.rollout = false;
+  session.path = String();
+}
+
+// Ends the session with a DONE or ERROR reply that is kept for repeats
+static void finish(const NetDatagram& to, uint8_t type, uint8_t value) {
+  lastResult = { session.id, type, value };
+  replyOutcome(to, session.id, type, value);
+  dropSession();
+}
+
+static bool isStored(uint32_t index) {
+  return session.received[index / 8] & (1 << (index % 8));
+}
+
+// Lists missing chunks below upTo, lowest first. Unless always is set, a
+// rollout device with nothing missing stays quiet.
+static void sendMissing(const NetDatagram& to, uint32_t upTo, bool always) {
+  uint8_t payload[6 + DEPLOY_MAX_MISSING * 4];
+  uint16_t count = 0;
+  for (uint32_t i = 0; i < min(upTo, session.chunkCount) && count < DEPLOY_MAX_MISSING; i++) {
+    if (!isStored(i)) {
+      memcpy(payload + 6 + count * 4, &i, 4);
+      count++;
+    }
+  }
+  memcpy(payload, &session.stored, 4);
+  memcpy(payload + 4, &count, 2);
+  if (!fromGroup(to)) {
+    reply(to, session.id, DEPLOY_MISSING, payload, 6 + count * 4);
+  } else if (count > 0 || always) {
+    report(to, session.id, DEPLOY_STATE_RECEIVING, 0, payload, 6 + count * 4);
+  }
+}
+
+// Opens a session for a validated request, abandoning one that went quiet.
+// Bytecode is only taken from signed announcements. Returns 0 or the error
+// to report.
+static uint8_t openSession(uint32_t id, const uint8_t* nameData, uint8_t nameLength, uint32_t imageSize,
+                           uint16_t chunkSize, uint8_t flags, bool isSigned) {
+  if (session.id && millis() - session.lastActive < DEPLOY_TIMEOUT_MS) {
+    return DEPLOY_ERR_BUSY;
+  }
+  if (session.id) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Deploy %08lx: abandoned", (unsigned long)session.id);
+    dropSession();
+  }
+
+  char name[64];
+  if (nameLength == 0 || nameLength >= sizeof(name)) {
+    return DEPLOY_ERR_INVALID;
+  }
+  memcpy(name, nameData, nameLength);
+  name[nameLength] = '\0';
+  if (name[0] != '/' || strstr(name, "..") || strlen(name) != nameLength ||
+      imageSize > DEPLOY_MAX_IMAGE || chunkSize < DEPLOY_MIN_CHUNK || chunkSize > DEPLOY_MAX_CHUNK) {
+    return DEPLOY_ERR_INVALID;
+  }
+  if (!isSigned && String(name).endsWith(".jsbc")) {
+    return DEPLOY_ERR_AUTH;
+  }
+  if (imageSize > FFat.totalBytes() - FFat.usedBytes()) {
+    return DEPLOY_ERR_NO_SPACE;
+  }
+
+  session.path = name;
+  session.file = FFat.open(session.path + ".part", "w");
+  if (!session.file) {
+    session.path = String();
+    return DEPLOY_ERR_IO;
+  }
+
+  session.id = id;
+  session.rollout = false;
+  session.imageSize = imageSize;
+  session.imageCrc = 0;
+  session.chunkSize = chunkSize;
+  session.flags = flags;
+  session.chunkCount = (imageSize + chunkSize - 1) / chunkSize;
+  session.stored = 0;
+  memset(session.received, 0, sizeof(session.received));
+  session.lastActive = millis();
+  return 0;
+}
+
+static void handleBegin(const NetDatagram& from, uint32_t id, const uint8_t* payload, size_t length) {
+  // With a fleet key every deployment has to be signed
+  if (hasKey) {
+    char address[16];
+    netFormatAddress(from.address, address, sizeof(address));
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Deploy %08lx from %s: unsigned, but a fleet key is set", (unsigned long)id, address);
+    replyError(from, id, DEPLOY_ERR_AUTH);
+    return;
+  }
+  if (session.id == id) {
+    reply(from, id, DEPLOY_ACK, nullptr, 0);
+    return;
+  }
+
+  DeployBegin begin;
+  if (length < sizeof(begin)) {
+    replyError(from, id, DEPLOY_ERR_INVALID);
+    return;
+  }
+  memcpy(&begin, payload, sizeof(begin));
+  if (length < sizeof(begin) + begin.nameLength) {
+    replyError(from, id, DEPLOY_ERR_INVALID);
+    return;
+  }
+
+  uint8_t error = openSession(id, payload + sizeof(begin), begin.nameLength, begin.imageSize, begin.chunkSize,
+                              begin.flags, false);
+  if (error) {
+    replyError(from, id, (DeployError)error);
+    return;
+  }
+  session.imageCrc = begin.imageCrc;
+
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "Deploy %08lx: %s, %lu bytes in %lu chunks", (unsigned long)id,
+    session.path.c_str(), (unsigned long)session.imageSize, (unsigned long)session.chunkCount);
+  reply(from, id, DEPLOY_ACK, nullptr, 0);
+}
+
+// Checks the HMAC-SHA256 tag at the end of an announcement
+static bool verifyTag(const uint8_t* data, size_t length) {
+  return deployVerifySignature(data, length - DEPLOY_TAG_BYTES, data + length - DEPLOY_TAG_BYTES);
+}
+
+static void handleAnnounce(const NetDatagram& from, uint32_t id, const uint8_t* payload, size_t length) {
+  DeployAnnounce announce;
+  if (length < sizeof(announce) + DEPLOY_TAG_BYTES) {
+    return;
+  }
+  memcpy(&announce, payload, sizeof(announce));
+  if (length != sizeof(announce) + announce.nameLength + DEPLOY_TAG_BYTES) {
+    return;
+  }
+  // Waves split the fleet by device id, so every device knows its own
+  if (announce.waves > 1 && deviceId % announce.waves != announce.wave) {
+    return;
+  }
+
+  if (!hasKey || !verifyTag(from.data, from.length)) {
+    char address[16];
+    netFormatAddress(from.address, address, sizeof(address));
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Rollout %08lx from %s: %s", (unsigned long)id, address,
+      hasKey ? "bad signature" : "no fleet key set");
+    replyError(from, id, DEPLOY_ERR_AUTH);
+    return;
+  }
+
+  // The host repeats the announcement until it has heard from the wave
+  if (session.id == id) {
+    sendMissing(from, 0, true);
+    return;
+  }
+  if (lastResult.id == id) {
+    replyOutcome(from, id, lastResult.type, lastResult.value);
+    return;
+  }
+  if (!deployCounterIsNew(announce.counter)) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Rollout %08lx: counter %llu is not newer than %llu, replayed?",
+      (unsigned long)id, (unsigned long long)announce.counter, (unsigned long long)lastCounter);
+    replyError(from, id, DEPLOY_ERR_REPLAY);
+    return;
+  }
+  if (!deployAcceptCounter(announce.counter)) {
+    replyError(from, id, DEPLOY_ERR_IO);
+    return;
+  }
+
+  uint8_t error = openSession(id, payload + sizeof(announce), announce.nameLength, announce.imageSize,
+                              announce.chunkSize, announce.flags, true);
+  if (error) {
+    replyError(from, id, (DeployError)error);
+    return;
+  }
+  session.rollout = true;
+  memcpy(session.digest, announce.digest, sizeof(session.digest));
+
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "Rollout %08lx: %s, %lu bytes in %lu chunks, wave %u of %u",
+    (unsigned long)id, session.path.c_str(), (unsigned long)session.imageSize, (unsigned long)session.chunkCount,
+    announce.wave + 1, max(announce.waves, (uint8_t)1));
+  sendMissing(from, 0, true);
+}
+
+// Remembers a bytecode image a signed rollout installed, so it may be loaded
+static void trustImage(const uint8_t* digest) {
+  for (int i = 0; i < DEPLOY_TRUSTED_IMAGES; i++) {
+    if (memcmp(trustedImages[i], digest, DEPLOY_DIGEST_BYTES) == 0) {
+      return;
+    }
+  }
+  memmove(trustedImages[1], trustedImages[0], (DEPLOY_TRUSTED_IMAGES - 1) * DEPLOY_DIGEST_BYTES);
+  memcpy(trustedImages[0], digest, DEPLOY_DIGEST_BYTES);
+
+  Preferences prefs;
+  if (!prefs.begin("deploy", false) || prefs.putBytes("bytecode", trustedImages, sizeof(trustedImages)) != sizeof(trustedImages)) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Rollout: cannot save bytecode digest; it will not load after a reboot");
+  }
+  prefs.end();
+}
+
+static void handleChunk(const NetDatagram& from, const uint8_t* payload, size_t length) {
+  DeployChunk chunk;
+  if (length < sizeof(chunk)) {
+    return;
+  }
+  memcpy(&chunk, payload, sizeof(chunk));
+  if (chunk.index >= session.chunkCount || isStored(chunk.index)) {
+    return;
+  }
+
+  // A chunk with the wrong length or CRC is dropped and reported missing later
+  const uint8_t* data = payload + sizeof(chunk);
+  uint32_t offset = chunk.index * session.chunkSize;
+  size_t expected = min((uint32_t)session.chunkSize, session.imageSize - offset);
+  if (length - sizeof(chunk) != expected || esp_rom_crc32_le(0, data, expected) != chunk.crc) {
+    return;
+  }
+
+  // FatFs extends a file opened for writing when seeking past its end, so
+  // chunks can be written in whatever order they arrive
+  if (!session.file.seek(offset) || session.file.write(data, expected) != expected) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Deploy %08lx: write failed", (unsigned long)session.id);
+    finish(from, DEPLOY_ERROR, DEPLOY_ERR_IO);
+    return;
+  }
+  session.received[chunk.index / 8] |= 1 << (chunk.index % 8);
+  session.stored++;
+}
+
+static void handleCommit(const NetDatagram& from) {
+  if (session.stored < session.chunkCount) {
+    sendMissing(from, session.chunkCount, true);
+    return;
+  }
+  session.file.close();
+
+  // The checksum is computed over what was read back, so flash errors are
+  // caught too
+  String part = session.path + ".part";
+  File image = FFat.open(part, "r");
+  uint32_t crc = 0, total = 0;
+  size_t length;
+  mbedtls_sha256_context sha;
+  uint8_t digest[DEPLOY_DIGEST_BYTES];
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  while (image && (length = image.read(verifyBuffer, sizeof(verifyBuffer))) > 0) {
+    if (session.rollout) {
+      mbedtls_sha256_update(&sha, verifyBuffer, length);
+    } else {
+      crc = esp_rom_crc32_le(crc, verifyBuffer, length);
+    }
+    total += length;
+  }
+  image.close();
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+
+  bool valid = session.rollout ? memcmp(digest, session.digest, sizeof(digest)) == 0 : crc == session.imageCrc;
+  if (total != session.imageSize || !valid) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Deploy %08lx: image checksum mismatch", (unsigned long)session.id);
+    finish(from, DEPLOY_ERROR, DEPLOY_ERR_CRC);
+    return;
+  }
+  if ((FFat.exists(session.path) && !FFat.remove(session.path)) || !FFat.rename(part, session.path)) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Deploy %08lx: cannot replace %s", (unsigned long)session.id, session.path.c_str());
+    finish(from, DEPLOY_ERROR, DEPLOY_ERR_IO);
+    return;
+  }
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "Deploy %08lx: installed %s", (unsigned long)session.id, session.path.c_str());
+  ftpServerInvalidateListings();
+  if (session.rollout && session.path.endsWith(".jsbc")) {
+    trustImage(digest);
+  }
+
+  int8_t vmIndex = -1;
+  if (session.flags & DEPLOY_FLAG_LAUNCH) {
+    vmIndex = relaunchVMFromFile(session.path);
+    if (vmIndex < 0) {
+      finish(from, DEPLOY_ERROR, DEPLOY_ERR_LAUNCH);
+      return;
+    }
+  }
+  finish(from, DEPLOY_DONE, (uint8_t)vmIndex);
+}
+
+void deployHandleDatagram(const NetDatagram& datagram) {
+  DeployHeader header;
+  if (datagram.length < sizeof(header)) {
+    return;
+  }
+  memcpy(&header, datagram.data, sizeof(header));
+  if (header.magic != DEPLOY_MAGIC || header.version != DEPLOY_VERSION || header.session == 0) {
+    char address[16];
+    netFormatAddress(datagram.address, address, sizeof(address));
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Ignoring non-deploy datagram from %s", address);
+    return;
+  }
+
+  const uint8_t* payload = datagram.data + sizeof(header);
+  size_t length = datagram.length - sizeof(header);
+  if (header.type == DEPLOY_BEGIN && !fromGroup(datagram)) {
+    handleBegin(datagram, header.session, payload, length);
+    return;
+  }
+  if (header.type == DEPLOY_ANNOUNCE && fromGroup(datagram)) {
+    handleAnnounce(datagram, header.session, payload, length);
+    return;
+  }
+
+  if (header.session != session.id) {
+    // Stale chunks and aborts are ignored; repeated commits get their answer
+    // again. Rollouts for other waves are none of this device's business.
+    if (header.type == DEPLOY_COMMIT && header.session == lastResult.id) {
+      replyOutcome(datagram, lastResult.id, lastResult.type, lastResult.value);
+    } else if ((header.type == DEPLOY_STATUS || header.type == DEPLOY_COMMIT) && !fromGroup(datagram)) {
+      replyError(datagram, header.session, DEPLOY_ERR_NO_SESSION);
+    }
+    return;
+  }
+
+  session.lastActive = millis();
+  if (header.type == DEPLOY_CHUNK) {
+    handleChunk(datagram, payload, length);
+  } else if (header.type == DEPLOY_STATUS) {
+    uint32_t upTo = 0;
+    if (length >= sizeof(upTo)) {
+      memcpy(&upTo, payload, sizeof(upTo));
+    }
+    sendMissing(datagram, upTo, !fromGroup(datagram));
+  } else if (header.type == DEPLOY_COMMIT) {
+    handleCommit(datagram);
+  } else if (header.type == DEPLOY_ABORT) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "Deploy %08lx: aborted", (unsigned long)session.id);
+    dropSession();
+  }
+}
+
+void deployPoll() {
+  if (session.id && millis() - session.lastActive > DEPLOY_TIMEOUT_MS) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Deploy %08lx: timed out", (unsigned long)session.id);
+    dropSession();
+  }
+}
+
+void deployBegin() {
+  // The same digits as the end of the MAC address, so operators can match
+  // rollout reports to devices
+  uint64_t mac = ESP.getEfuseMac();
+  const uint8_t* bytes = (const uint8_t*)&mac;
+  deviceId = (uint32_t)bytes[2] << 24 | (uint32_t)bytes[3] << 16 | (uint32_t)bytes[4] << 8 | bytes[5];
+
+  Preferences prefs;
+  if (prefs.begin("deploy", true)) {
+    hasKey = prefs.getBytes("key", fleetKey, sizeof(fleetKey)) == sizeof(fleetKey);
+    lastCounter = prefs.getULong64("counter", 0);
+    if (prefs.getBytes("bytecode", trustedImages, sizeof(trustedImages)) != sizeof(trustedImages)) {
+      memset(trustedImages, 0, sizeof(trustedImages));
+    }
+    prefs.end();
+  }
+
+  uint32_t group;
+  netParseAddress(DEPLOY_GROUP_ADDRESS, &group);
+  if (!netUdpBind(NET_OWNER_SYSTEM, DEPLOY_GROUP_PORT) || !netUdpJoinGroup(NET_OWNER_SYSTEM, DEPLOY_GROUP_PORT, group)) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Rollout: cannot join %s:%u", DEPLOY_GROUP_ADDRESS, DEPLOY_GROUP_PORT);
+  }
+}
+
+bool deploySetKey(const uint8_t* key) {
+  Preferences prefs;
+  if (!prefs.begin("deploy", false)) {
+    return false;
+  }
+  bool saved;
+  if (key) {
+    saved = prefs.putBytes("key", key, DEPLOY_KEY_BYTES) == DEPLOY_KEY_BYTES;
+  } else {
+    saved = !prefs.isKey("key") || prefs.remove("key");
+  }
+  prefs.end();
+  if (saved) {
+    hasKey = key != nullptr;
+    memset(fleetKey, 0, sizeof(fleetKey));
+    if (key) {
+      memcpy(fleetKey, key, sizeof(fleetKey));
+    }
+  }
+  return saved;
+}
+
+bool deployHasKey() {
+  return hasKey;
+}
+
+uint32_t deployDeviceId() {
+  return deviceId;
+}
+
+// Constant time, so the tag cannot be guessed byte by byte
+bool deployVerifySignature(const uint8_t* data, size_t length, const uint8_t* tag) {
+  uint8_t expected[DEPLOY_TAG_BYTES];
+  if (!hasKey || mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), fleetKey, sizeof(fleetKey),
+                                 data, length, expected) != 0) {
+    return false;
+  }
+  uint8_t difference = 0;
+  for (size_t i = 0; i < DEPLOY_TAG_BYTES; i++) {
+    difference |= expected[i] ^ tag[i];
+  }
+  return difference == 0;
+}
+
+bool deployCounterIsNew(uint64_t counter) {
+  return counter > lastCounter;
+}
+
+bool deployAcceptCounter(uint64_t counter) {
+  if (counter <= lastCounter) {
+    return false;
+  }
+  Preferences prefs;
+  if (!prefs.begin("deploy", false) || prefs.putULong64("counter", counter) != sizeof(counter)) {
+    prefs.end();
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Deploy: cannot save the request counter");
+    return false;
+  }
+  prefs.end();
+  lastCounter = counter;
+  return true;
+}
+
+bool deployIsTrustedBytecode(const uint8_t* data, size_t length) {
+  static const uint8_t unused[DEPLOY_DIGEST_BYTES] = {};
+  uint8_t digest[DEPLOY_DIGEST_BYTES];
+  if (mbedtls_sha256(data, length, digest, 0) != 0 || memcmp(digest, unused, sizeof(digest)) == 0) {
+    return false;
+  }
+  for (int i = 0; i < DEPLOY_TRUSTED_IMAGES; i++) {
+    if (memcmp(trustedImages[i], digest, sizeof(digest)) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,210 @@
+// dsp.cpp
+#include "include/dsp.h"
+#include <math.h>
+#include <float.h>
+#include <mutex>
+
+#if DSP_USE_ESP_DSP
+#include <esp_dsp.h>
+#endif
+
+// === Filters ===
+void dspFir(const float* in, float* out, size_t n, const float* coeffs, size_t taps, float* history, float* scratch) {
+  // scratch = [reversed coeffs | history | input], so each output is one
+  // contiguous dot product over the last taps samples
+  float* reversed = scratch;
+  float* window = scratch + taps;
+  size_t keep = taps - 1;
+
+  for (size_t k = 0; k < taps; k++) {
+    reversed[k] = coeffs[taps - 1 - k];
+  }
+  memcpy(window, history, keep * sizeof(float));
+  memcpy(window + keep, in, n * sizeof(float));
+
+  for (size_t i = 0; i < n; i++) {
+#if DSP_USE_ESP_DSP
+    dsps_dotprod_f32(&window[i], reversed, &out[i], taps);
+#else
+    float acc = 0;
+    for (size_t k = 0; k < taps; k++) {
+      acc += window[i + k] * reversed[k];
+    }
+    out[i] = acc;
+#endif
+  }
+
+  memcpy(history, window + n, keep * sizeof(float));
+}
+
+void dspBiquad(float* data, size_t n, const float* coeffs, float* state) {
+#if DSP_USE_ESP_DSP
+  dsps_biquad_f32(data, data, n, (float*)coeffs, state);
+#else
+  // Direct form II, matching esp-dsp so state is interchangeable
+  float w0 = state[0], w1 = state[1];
+  for (size_t i = 0; i < n; i++) {
+    float d0 = data[i] - coeffs[3] * w0 - coeffs[4] * w1;
+    data[i] = coeffs[0] * d0 + coeffs[1] * w0 + coeffs[2] * w1;
+    w1 = w0;
+    w0 = d0;
+  }
+  state[0] = w0;
+  state[1] = w1;
+#endif
+}
+
+// === Spectral ===
+bool dspFft(float* data, size_t n) {
+  if (n < 2 || n > DSP_MAX_FFT_SIZE || (n & (n - 1)) != 0) {
+    return false;
+  }
+
+#if DSP_USE_ESP_DSP
+  // Twiddle tables are shared by all VMs and built on first use
+  static std::once_flag tablesReady;
+  static bool tablesOk = false;
+  std::call_once(tablesReady, []() {
+    tablesOk = dsps_fft2r_init_fc32(NULL, DSP_MAX_FFT_SIZE) == ESP_OK;
+  });
+  if (!tablesOk) {
+    return false;
+  }
+  dsps_fft2r_fc32(data, n);
+  dsps_bit_rev_fc32(data, n);
+#else
+  // Bit-reversal permutation
+  for (size_t i = 1, j = 0; i < n; i++) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      float re = data[2 * i], im = data[2 * i + 1];
+      data[2 * i] = data[2 * j];
+      data[2 * i + 1] = data[2 * j + 1];
+      data[2 * j] = re;
+      data[2 * j + 1] = im;
+    }
+  }
+
+  // Iterative radix-2 butterflies
+  for (size_t len = 2; len <= n; len <<= 1) {
+    float angle = -2.0f * (float)M_PI / len;
+    float stepRe = cosf(angle), stepIm = sinf(angle);
+    for (size_t start = 0; start < n; start += len) {
+      float wRe = 1.0f, wIm = 0.0f;
+      for (size_t k = 0; k < len / 2; k++) {
+        float* a = &data[2 * (start + k)];
+        float* b = &data[2 * (start + k + len / 2)];
+        float tRe = b[0] * wRe - b[1] * wIm;
+        float tIm = b[0] * wIm + b[1] * wRe;
+        b[0] = a[0] - tRe;
+        b[1] = a[1] - tIm;
+        a[0] += tRe;
+        a[1] += tIm;
+        float nextRe = wRe * stepRe - wIm * stepIm;
+        wIm = wRe * stepIm + wIm * stepRe;
+        wRe = nextRe;
+      }
+    }
+  }
+#endif
+  return true;
+}
+
+void dspMagnitude(const float* data, float* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    float re = data[2 * i], im = data[2 * i + 1];
+    out[i] = sqrtf(re * re + im * im);
+  }
+}
+
+void dspWindow(float* data, size_t n, DspWindow type) {
+  if (n < 2) {
+    return;
+  }
+
+  float step = 2.0f * (float)M_PI / (n - 1);
+  for (size_t i = 0; i < n; i++) {
+    float c = cosf(step * i);
+    float w;
+    switch (type) {
+      case DSP_WINDOW_HAMMING:
+        w = 0.54f - 0.46f * c;
+        break;
+      case DSP_WINDOW_BLACKMAN:
+        w = 0.42f - 0.5f * c + 0.08f * cosf(2.0f * step * i);
+        break;
+      default:
+        w = 0.5f - 0.5f * c;
+        break;
+    }
+    data[i] *= w;
+  }
+}
+
+// === Reduction ===
+
+// Averages each group of factor samples into one output sample
+size_t dspDecimate(const float* in, size_t n, float* out, size_t outLength, size_t factor) {
+  size_t count = min(n / factor, outLength);
+  float scale = 1.0f / factor;
+  for (size_t i = 0; i < count; i++) {
+    float acc = 0;
+    for (size_t k = 0; k < factor; k++) {
+      acc += in[i * factor + k];
+    }
+    out[i] = acc * scale;
+  }
+  return count;
+}
+
+float dspMean(const float* data, size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+  float acc = 0;
+  for (size_t i = 0; i < n; i++) {
+    acc += data[i];
+  }
+  return acc / n;
+}
+
+float dspRms(const float* data, size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+  float acc = 0;
+#if DSP_USE_ESP_DSP
+  dsps_dotprod_f32(data, data, &acc, n);
+#else
+  for (size_t i = 0; i < n; i++) {
+    acc += data[i] * data[i];
+  }
+#endif
+  return sqrtf(acc / n);
+}
+
+float dspMin(const float* data, size_t n) {
+  float result = FLT_MAX;
+  for (size_t i = 0; i < n; i++) {
+    result = min(result, data[i]);
+  }
+  return result;
+}
+
+float dspMax(const float* data, size_t n) {
+  float result = -FLT_MAX;
+  for (size_t i = 0; i < n; i++) {
+    result = max(result, data[i]);
+  }
+  return result;
+}
+
+void dspFromInt16(const int16_t* in, float* out, size_t n, float scale) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = in[i] * scale;
+  }
+}
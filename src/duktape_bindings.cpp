@@ -1,11 +1,44 @@
 #include "include/duktape_bindings.h"
 #include "include/vm_manager.h"
 #include "include/networking.h"
+#include "include/net_manager.h"
+#include "include/spi_bus.h"
+#include "include/adc_stream.h"
+#include "include/dsp.h"
+#include "include/vm_events.h"
+#include "include/vm_timers.h"
+#include "include/gpio_interrupts.h"
+#include "include/touch_events.h"
+#include "include/ledc_manager.h"
+#include "include/rmt_output.h"
+#include "include/vm_log.h"
+#include "include/duk_binding.h"
+#include "include/vm_perf.h"
+#include "include/msg_link.h"
+#include <esp_timer.h>
+
+// Returns the index of the VM that owns ctx, or -1
+static int getVMIndex(duk_context *ctx) {
+    for (int i = 0; i < MAX_VMS; i++) {
+        if (vms[i].ctx == ctx) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 // === Core Bindings ===
+// Returns the VM's log source, or the system source outside a VM
+static int getLogSource(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    return vmIndex >= 0 ? vmIndex : VM_LOG_SYSTEM;
+}
+
+// Queues the line for the log drain task instead of waiting on the UART
 duk_ret_t native_print(duk_context *ctx) {
-    const char* message = duk_safe_to_string(ctx, -1);
-    Serial.println(message);
+    duk_size_t length;
+    const char* message = duk_safe_to_lstring(ctx, 0, &length);
+    vmLogWrite(getLogSource(ctx), VM_LOG_INFO, message, length);
     return 0;
 }
 
@@ -15,8 +48,14 @@ duk_ret_t native_wait(duk_context *ctx) {
         return DUK_RET_TYPE_ERROR;
     }
     
+    // Event handlers run while the script sleeps
     duk_int_t duration = duk_get_int(ctx, -1);
-    delay(duration);
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        delay(duration);
+        return 0;
+    }
+    vmEventsWait(ctx, vmIndex, duration > 0 ? duration : 0);
     return 0;
 }
 
@@ -26,146 +65,218 @@ duk_ret_t duk_delay(duk_context *ctx) {
     return 0;
 }
 
-duk_ret_t duk_digitalWrite(duk_context *ctx) {
-    int vmIndex = -1;
-    for (int i = 0; i < MAX_VMS; i++) {
-        if (vms[i].ctx == ctx) {
-            vmIndex = i;
-            break;
-        }
+// Throws unless the calling VM owns the pin; the first use of a free pin claims it
+static void requirePinOwnership(duk_context *ctx, int vmIndex, int pin) {
+    if (!claimPin(pin, vmIndex)) {
+        duk_error(ctx, DUK_ERR_ERROR, "Pin %d is in use by VM %d", pin, getPinOwner(pin));
     }
+}
 
-    if (vmIndex < 0) {
-        return DUK_ERR_ERROR;
-    }
+// === GPIO Functions ===
+static void native_digitalWrite(Pin pin, int value) {
+    digitalWrite(pin.number, value);
+}
 
-    int pin = duk_require_int(ctx, 0);
-    int value = duk_require_int(ctx, 1);
+static int native_digitalRead(Pin pin) {
+    return digitalRead(pin.number);
+}
 
-    if (pin < 0 || pin >= 40) {
-        return DUK_ERR_RANGE_ERROR;
-    }
+static int native_analogRead(Pin pin) {
+    return analogRead(pin.number);
+}
 
-    if (xSemaphoreTake(vms[vmIndex].pinMutex, portMAX_DELAY) == pdTRUE) {
-        digitalWrite(pin, value);
-        xSemaphoreGive(vms[vmIndex].pinMutex);
-    }
+static void native_analogWrite(Pin pin, int value) {
+    analogWrite(pin.number, value);
+}
 
-    return 0;
+static void native_pinMode(Pin pin, int mode) {
+    pinMode(pin.number, mode);
 }
 
-duk_ret_t duk_digitalRead(duk_context *ctx) {
-    int vmIndex = -1;
-    for (int i = 0; i < MAX_VMS; i++) {
-        if (vms[i].ctx == ctx) {
-            vmIndex = i;
-            break;
-        }
-    }
+static bool native_releasePin(CallerVM vm, int pin) {
+    return releasePin(pin, vm.index);
+}
 
+duk_ret_t duk_attachInterrupt(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
     if (vmIndex < 0) {
         return DUK_ERR_ERROR;
     }
 
     int pin = duk_require_int(ctx, 0);
-    if (pin < 0 || pin >= 40) {
-        return DUK_ERR_RANGE_ERROR;
+    int mode = CHANGE;
+    if (duk_is_string(ctx, 1)) {
+        const char* edge = duk_get_string(ctx, 1);
+        if (strcmp(edge, "rising") == 0) {
+            mode = RISING;
+        } else if (strcmp(edge, "falling") == 0) {
+            mode = FALLING;
+        } else if (strcmp(edge, "change") != 0) {
+            duk_error(ctx, DUK_ERR_TYPE_ERROR, "Edge must be 'rising', 'falling' or 'change'");
+            return DUK_RET_TYPE_ERROR;
+        }
+    } else {
+        mode = duk_require_int(ctx, 1);
     }
+    duk_require_function(ctx, 2);
+    int debounceUs = duk_get_int_default(ctx, 3, 0);
+    bool coalesce = duk_get_boolean_default(ctx, 4, false);
 
-    int value = 0;
-    if (xSemaphoreTake(vms[vmIndex].pinMutex, portMAX_DELAY) == pdTRUE) {
-        value = digitalRead(pin);
-        xSemaphoreGive(vms[vmIndex].pinMutex);
+    if (pin < 0 || pin >= NUM_PINS) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "Pin must be 0-%d", NUM_PINS - 1);
+        return DUK_RET_RANGE_ERROR;
     }
+    requirePinOwnership(ctx, vmIndex, pin);
 
-    duk_push_int(ctx, value);
+    vmEventsSetHandler(ctx, VM_EVENT_GPIO, pin, 2);
+    duk_push_boolean(ctx, gpioInterruptAttach(vmIndex, pin, mode, debounceUs, coalesce));
     return 1;
 }
 
-duk_ret_t duk_analogRead(duk_context *ctx) {
-    int vmIndex = -1;
-    for (int i = 0; i < MAX_VMS; i++) {
-        if (vms[i].ctx == ctx) {
-            vmIndex = i;
-            break;
-        }
-    }
-
+duk_ret_t duk_detachInterrupt(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
     if (vmIndex < 0) {
         return DUK_ERR_ERROR;
     }
 
     int pin = duk_require_int(ctx, 0);
-    if (pin < 0 || pin >= 40) {
-        return DUK_ERR_RANGE_ERROR;
+    bool detached = gpioInterruptDetach(vmIndex, pin);
+    if (detached) {
+        duk_push_undefined(ctx);
+        vmEventsSetHandler(ctx, VM_EVENT_GPIO, pin, -1);
+        duk_pop(ctx);
     }
+    duk_push_boolean(ctx, detached);
+    return 1;
+}
 
-    int value = 0;
-    if (xSemaphoreTake(vms[vmIndex].pinMutex, portMAX_DELAY) == pdTRUE) {
-        value = analogRead(pin);
-        xSemaphoreGive(vms[vmIndex].pinMutex);
-    }
+duk_ret_t duk_eventStats(duk_context *ctx) {
+    VMEventStats stats;
+    vmEventsGetStats(getVMIndex(ctx), &stats);
+
+    duk_idx_t obj_idx = duk_push_object(ctx);
+
+    duk_push_uint(ctx, stats.dispatched);
+    duk_put_prop_string(ctx, obj_idx, "dispatched");
+
+    duk_push_uint(ctx, stats.dropped);
+    duk_put_prop_string(ctx, obj_idx, "dropped");
+
+    duk_push_uint(ctx, stats.pending);
+    duk_put_prop_string(ctx, obj_idx, "pending");
+
+    duk_push_uint(ctx, stats.avgLatencyUs);
+    duk_put_prop_string(ctx, obj_idx, "avgLatencyUs");
+
+    duk_push_uint(ctx, stats.maxLatencyUs);
+    duk_put_prop_string(ctx, obj_idx, "maxLatencyUs");
 
-    duk_push_int(ctx, value);
     return 1;
 }
 
-duk_ret_t duk_analogWrite(duk_context *ctx) {
-    int vmIndex = -1;
-    for (int i = 0; i < MAX_VMS; i++) {
-        if (vms[i].ctx == ctx) {
-            vmIndex = i;
-            break;
-        }
+// Flat globals, kept because nearly every script uses them
+static const duk_function_list_entry gpioGlobals[] = {
+    DUK_BINDING("digitalWrite", native_digitalWrite),
+    DUK_BINDING("digitalRead", native_digitalRead),
+    DUK_BINDING("analogRead", native_analogRead),
+    DUK_BINDING("analogWrite", native_analogWrite),
+    DUK_BINDING("pinMode", native_pinMode),
+    DUK_BINDING("releasePin", native_releasePin),
+    { "attachInterrupt", duk_attachInterrupt, 5 },
+    { "detachInterrupt", duk_detachInterrupt, 1 },
+    { "eventStats", duk_eventStats, 0 },
+    DUK_BINDING_END
+};
+
+static const duk_function_list_entry gpioBindings[] = {
+    DUK_BINDING("mode", native_pinMode),
+    DUK_BINDING("write", native_digitalWrite),
+    DUK_BINDING("read", native_digitalRead),
+    DUK_BINDING("analogRead", native_analogRead),
+    DUK_BINDING("analogWrite", native_analogWrite),
+    DUK_BINDING("release", native_releasePin),
+    { "attachInterrupt", duk_attachInterrupt, 5 },
+    { "detachInterrupt", duk_detachInterrupt, 1 },
+    DUK_BINDING_END
+};
+
+// === Logging Functions ===
+static VMLogLevel requireLogLevel(duk_context *ctx, duk_idx_t idx) {
+    VMLogLevel level = VM_LOG_INFO;
+    if (!vmLogParseLevel(duk_require_string(ctx, idx), &level)) {
+        duk_error(ctx, DUK_ERR_TYPE_ERROR, "Level must be 'debug', 'info', 'warn' or 'error'");
     }
+    return level;
+}
 
-    if (vmIndex < 0) {
-        return DUK_ERR_ERROR;
-    }
+// logWrite(level, message)
+duk_ret_t duk_logWrite(duk_context *ctx) {
+    VMLogLevel level = requireLogLevel(ctx, 0);
+    duk_size_t length;
+    const char* message = duk_safe_to_lstring(ctx, 1, &length);
 
-    int pin = duk_require_int(ctx, 0);
-    int value = duk_require_int(ctx, 1);
+    duk_push_boolean(ctx, vmLogWrite(getLogSource(ctx), level, message, length));
+    return 1;
+}
 
-    if (pin < 0 || pin >= 40) {
-        return DUK_ERR_RANGE_ERROR;
-    }
+duk_ret_t duk_logLevel(duk_context *ctx) {
+    vmLogSetLevel(getLogSource(ctx), requireLogLevel(ctx, 0));
+    return 0;
+}
 
-    if (xSemaphoreTake(vms[vmIndex].pinMutex, portMAX_DELAY) == pdTRUE) {
-        analogWrite(pin, value);
-        xSemaphoreGive(vms[vmIndex].pinMutex);
+// logPolicy("drop" | "block"[, linesPerSecond])
+duk_ret_t duk_logPolicy(duk_context *ctx) {
+    const char* name = duk_require_string(ctx, 0);
+    VMLogPolicy policy;
+    if (strcmp(name, "drop") == 0) {
+        policy = VM_LOG_DROP;
+    } else if (strcmp(name, "block") == 0) {
+        policy = VM_LOG_BLOCK;
+    } else {
+        duk_error(ctx, DUK_ERR_TYPE_ERROR, "Policy must be 'drop' or 'block'");
+        return DUK_RET_TYPE_ERROR;
     }
+    uint16_t linesPerSecond = duk_get_uint_default(ctx, 1, 0);
 
+    vmLogSetPolicy(getLogSource(ctx), policy, linesPerSecond);
     return 0;
 }
 
-duk_ret_t duk_pinMode(duk_context *ctx) {
-    int vmIndex = -1;
-    for (int i = 0; i < MAX_VMS; i++) {
-        if (vms[i].ctx == ctx) {
-            vmIndex = i;
-            break;
-        }
-    }
+duk_ret_t duk_logTag(duk_context *ctx) {
+    vmLogSetTag(getLogSource(ctx), duk_require_string(ctx, 0));
+    return 0;
+}
 
-    if (vmIndex < 0) {
-        return DUK_ERR_ERROR;
-    }
+duk_ret_t duk_logStats(duk_context *ctx) {
+    VMLogStats stats;
+    vmLogGetStats(getLogSource(ctx), &stats);
 
-    int pin = duk_require_int(ctx, 0);
-    int mode = duk_require_int(ctx, 1);
+    duk_idx_t obj_idx = duk_push_object(ctx);
 
-    if (pin < 0 || pin >= 40) {
-        return DUK_ERR_RANGE_ERROR;
-    }
+    duk_push_uint(ctx, stats.written);
+    duk_put_prop_string(ctx, obj_idx, "written");
 
-    if (xSemaphoreTake(vms[vmIndex].pinMutex, portMAX_DELAY) == pdTRUE) {
-        pinMode(pin, mode);
-        xSemaphoreGive(vms[vmIndex].pinMutex);
-    }
+    duk_push_uint(ctx, stats.dropped);
+    duk_put_prop_string(ctx, obj_idx, "dropped");
 
-    return 0;
+    duk_push_uint(ctx, stats.rateLimited);
+    duk_put_prop_string(ctx, obj_idx, "rateLimited");
+
+    duk_push_uint(ctx, stats.pendingBytes);
+    duk_put_prop_string(ctx, obj_idx, "pendingBytes");
+
+    return 1;
 }
 
+static const duk_function_list_entry logBindings[] = {
+    { "write", duk_logWrite, 2 },
+    { "level", duk_logLevel, 1 },
+    { "policy", duk_logPolicy, 2 },
+    { "tag", duk_logTag, 1 },
+    { "stats", duk_logStats, 0 },
+    { NULL, NULL, 0 }
+};
+
 // === WiFi Functions ===
 duk_ret_t duk_wifiConnect(duk_context *ctx) {
     const char* ssid = duk_require_string(ctx, 0);
@@ -199,6 +310,13 @@ duk_ret_t duk_getIP(duk_context *ctx) {
     return 1;
 }
 
+static const duk_function_list_entry wifiBindings[] = {
+    { "connect", duk_wifiConnect, 2 },
+    { "disconnect", duk_wifiDisconnect, 0 },
+    { "getIP", duk_getIP, 0 },
+    { NULL, NULL, 0 }
+};
+
 // === I2C Functions ===
 duk_ret_t duk_i2cBegin(duk_context *ctx) {
     int sda = duk_require_int(ctx, 0);
@@ -209,22 +327,60 @@ duk_ret_t duk_i2cBegin(duk_context *ctx) {
     return 0;
 }
 
+// Writes prefix + tx (either may be empty) and then, if rxLength is non-zero,
+// reads rxLength bytes after a repeated start. Returns 0 on success or the
+// Wire error code (1 = data too long, 2/3 = NACK, 4 = other, 5 = timeout).
+static int i2cTransaction(int address, const uint8_t* prefix, size_t prefixLength,
+                          const uint8_t* tx, size_t txLength, uint8_t* rx, size_t rxLength) {
+    if (prefixLength + txLength > 0 || rxLength == 0) {
+        Wire.beginTransmission(address);
+        if (Wire.write(prefix, prefixLength) != prefixLength || Wire.write(tx, txLength) != txLength) {
+            Wire.endTransmission();
+            return 1;
+        }
+        int error = Wire.endTransmission(rxLength == 0);
+        if (error != 0) {
+            return error;
+        }
+    }
+
+    if (rxLength > 0) {
+        size_t received = Wire.requestFrom((uint16_t)address, rxLength);
+        if (received != rxLength || Wire.readBytes(rx, rxLength) != rxLength) {
+            return 4;
+        }
+    }
+    return 0;
+}
+
 duk_ret_t duk_i2cWrite(duk_context *ctx) {
     int address = duk_require_int(ctx, 0);
-    int value = duk_require_int(ctx, 1);
-    
-    Wire.beginTransmission(address);
-    Wire.write(value);
-    int error = Wire.endTransmission();
-    
-    duk_push_int(ctx, error);
+
+    if (duk_is_number(ctx, 1)) {
+        uint8_t value = duk_get_int(ctx, 1);
+        duk_push_int(ctx, i2cTransaction(address, nullptr, 0, &value, 1, nullptr, 0));
+        return 1;
+    }
+
+    duk_size_t length;
+    const uint8_t* data = (const uint8_t*)duk_require_buffer_data(ctx, 1, &length);
+    duk_push_int(ctx, i2cTransaction(address, nullptr, 0, data, length, nullptr, 0));
     return 1;
 }
 
 duk_ret_t duk_i2cRead(duk_context *ctx) {
     int address = duk_require_int(ctx, 0);
+
+    // Buffer form: fill the caller's buffer, return bytes read
+    if (!duk_is_number(ctx, 1)) {
+        duk_size_t length;
+        uint8_t* data = (uint8_t*)duk_require_buffer_data(ctx, 1, &length);
+        size_t received = Wire.requestFrom((uint16_t)address, (size_t)length);
+        duk_push_int(ctx, Wire.readBytes(data, received));
+        return 1;
+    }
+
     int bytes = duk_require_int(ctx, 1);
-    
     Wire.requestFrom(address, bytes);
     
     duk_idx_t arr_idx = duk_push_array(ctx);
@@ -238,46 +394,216 @@ duk_ret_t duk_i2cRead(duk_context *ctx) {
     return 1;
 }
 
+duk_ret_t duk_i2cWriteRead(duk_context *ctx) {
+    int address = duk_require_int(ctx, 0);
+    duk_size_t txLength, rxLength;
+    const uint8_t* tx = (const uint8_t*)duk_require_buffer_data(ctx, 1, &txLength);
+    uint8_t* rx = (uint8_t*)duk_require_buffer_data(ctx, 2, &rxLength);
+
+    duk_push_int(ctx, i2cTransaction(address, nullptr, 0, tx, txLength, rx, rxLength));
+    return 1;
+}
+
+duk_ret_t duk_i2cReadRegister(duk_context *ctx) {
+    int address = duk_require_int(ctx, 0);
+    uint8_t reg = duk_require_int(ctx, 1);
+
+    // Without a buffer, read and return a single register byte (-1 on error)
+    if (duk_is_null_or_undefined(ctx, 2)) {
+        uint8_t value;
+        int error = i2cTransaction(address, &reg, 1, nullptr, 0, &value, 1);
+        duk_push_int(ctx, error == 0 ? value : -1);
+        return 1;
+    }
+
+    duk_size_t length;
+    uint8_t* data = (uint8_t*)duk_require_buffer_data(ctx, 2, &length);
+    duk_push_int(ctx, i2cTransaction(address, &reg, 1, nullptr, 0, data, length));
+    return 1;
+}
+
+duk_ret_t duk_i2cWriteRegister(duk_context *ctx) {
+    int address = duk_require_int(ctx, 0);
+    uint8_t reg = duk_require_int(ctx, 1);
+
+    if (duk_is_number(ctx, 2)) {
+        uint8_t value = duk_get_int(ctx, 2);
+        duk_push_int(ctx, i2cTransaction(address, &reg, 1, &value, 1, nullptr, 0));
+        return 1;
+    }
+
+    duk_size_t length;
+    const uint8_t* data = (const uint8_t*)duk_require_buffer_data(ctx, 2, &length);
+    duk_push_int(ctx, i2cTransaction(address, &reg, 1, data, length, nullptr, 0));
+    return 1;
+}
+
+// Runs a list of { address, write, read } transactions in one call. Either
+// buffer may be omitted. Returns the number of transactions that succeeded,
+// stopping at the first failure.
+duk_ret_t duk_i2cBatch(duk_context *ctx) {
+    if (!duk_is_array(ctx, 0)) {
+        duk_error(ctx, DUK_ERR_TYPE_ERROR, "i2cBatch() requires an array of transactions");
+        return DUK_RET_TYPE_ERROR;
+    }
+
+    int count = duk_get_length(ctx, 0);
+    int completed = 0;
+
+    for (int i = 0; i < count; i++) {
+        duk_get_prop_index(ctx, 0, i);
+
+        duk_get_prop_string(ctx, -1, "address");
+        int address = duk_require_int(ctx, -1);
+        duk_pop(ctx);
+
+        duk_size_t txLength = 0, rxLength = 0;
+        duk_get_prop_string(ctx, -1, "write");
+        const uint8_t* tx = (const uint8_t*)duk_get_buffer_data(ctx, -1, &txLength);
+        duk_pop(ctx);
+
+        duk_get_prop_string(ctx, -1, "read");
+        uint8_t* rx = (uint8_t*)duk_get_buffer_data(ctx, -1, &rxLength);
+        duk_pop(ctx);
+
+        duk_pop(ctx);
+
+        if (i2cTransaction(address, nullptr, 0, tx, txLength, rx, rxLength) != 0) {
+            break;
+        }
+        completed++;
+    }
+
+    duk_push_int(ctx, completed);
+    return 1;
+}
+
+static const duk_function_list_entry i2cBindings[] = {
+    { "begin", duk_i2cBegin, 3 },
+    { "write", duk_i2cWrite, 2 },
+    { "read", duk_i2cRead, 2 },
+    { "writeRead", duk_i2cWriteRead, 3 },
+    { "readRegister", duk_i2cReadRegister, 3 },
+    { "writeRegister", duk_i2cWriteRegister, 3 },
+    { "batch", duk_i2cBatch, 1 },
+    { NULL, NULL, 0 }
+};
+
 // === SPI Functions ===
 duk_ret_t duk_spiBegin(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
     int sck = duk_require_int(ctx, 0);
     int miso = duk_require_int(ctx, 1);
     int mosi = duk_require_int(ctx, 2);
     int ss = duk_require_int(ctx, 3);
-    
-    SPI.begin(sck, miso, mosi, ss);
-    return 0;
+    int freq = duk_get_int_default(ctx, 4, 1000000);
+    int mode = duk_get_int_default(ctx, 5, 0);
+
+    if (mode < 0 || mode > 3) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "SPI mode must be 0-3");
+        return DUK_RET_RANGE_ERROR;
+    }
+
+    duk_push_boolean(ctx, spiBusBegin(vmIndex, sck, miso, mosi, ss, freq, mode));
+    return 1;
 }
 
 duk_ret_t duk_spiTransfer(duk_context *ctx) {
-    if (!duk_is_array(ctx, 0)) return -1;
-    
-    duk_get_prop_string(ctx, 0, "length");
-    int length = duk_get_int(ctx, -1);
-    duk_pop(ctx);
-    
-    uint8_t* txData = (uint8_t*)malloc(length);
-    uint8_t* rxData = (uint8_t*)malloc(length);
-    
-    for (int i = 0; i < length; i++) {
+    int vmIndex = getVMIndex(ctx);
+
+    // Legacy form: plain array in, new array out
+    if (duk_is_array(ctx, 0)) {
+        int length = duk_get_length(ctx, 0);
+        uint8_t* data = (uint8_t*)duk_push_fixed_buffer(ctx, length);
+
+        for (int i = 0; i < length; i++) {
+            duk_get_prop_index(ctx, 0, i);
+            data[i] = duk_get_int(ctx, -1);
+            duk_pop(ctx);
+        }
+
+        if (length > 0 && !spiBusTransfer(vmIndex, data, data, length)) {
+            duk_push_null(ctx);
+            return 1;
+        }
+
+        duk_idx_t arr_idx = duk_push_array(ctx);
+        for (int i = 0; i < length; i++) {
+            duk_push_int(ctx, data[i]);
+            duk_put_prop_index(ctx, arr_idx, i);
+        }
+        return 1;
+    }
+
+    // Buffer form: transmit from tx and receive into rx in place (rx optional)
+    duk_size_t txLength;
+    const uint8_t* tx = (const uint8_t*)duk_require_buffer_data(ctx, 0, &txLength);
+    uint8_t* rx = nullptr;
+
+    if (!duk_is_null_or_undefined(ctx, 1)) {
+        duk_size_t rxLength;
+        rx = (uint8_t*)duk_require_buffer_data(ctx, 1, &rxLength);
+        if (rxLength < txLength) {
+            duk_error(ctx, DUK_ERR_RANGE_ERROR, "Receive buffer is shorter than transmit buffer");
+            return DUK_RET_RANGE_ERROR;
+        }
+    }
+
+    if (txLength > SPI_MAX_TRANSFER) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "SPI transfer exceeds %d bytes", SPI_MAX_TRANSFER);
+        return DUK_RET_RANGE_ERROR;
+    }
+
+    duk_push_int(ctx, spiBusTransfer(vmIndex, tx, rx, txLength) ? (int)txLength : -1);
+    return 1;
+}
+
+duk_ret_t duk_spiQueue(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (!duk_is_array(ctx, 0)) {
+        duk_error(ctx, DUK_ERR_TYPE_ERROR, "spiQueue() requires an array of buffers");
+        return DUK_RET_TYPE_ERROR;
+    }
+    bool haveRx = duk_is_array(ctx, 1);
+
+    size_t count = duk_get_length(ctx, 0);
+    SpiSegment* segments = (SpiSegment*)duk_push_fixed_buffer(ctx, count * sizeof(SpiSegment));
+
+    // The buffers stay reachable through the argument arrays, so their data
+    // pointers remain valid for the whole call
+    for (size_t i = 0; i < count; i++) {
+        duk_size_t txLength;
         duk_get_prop_index(ctx, 0, i);
-        txData[i] = duk_get_int(ctx, -1);
+        segments[i].tx = (const uint8_t*)duk_require_buffer_data(ctx, -1, &txLength);
+        segments[i].length = txLength;
+        segments[i].rx = nullptr;
         duk_pop(ctx);
+
+        if (haveRx) {
+            duk_get_prop_index(ctx, 1, i);
+            if (!duk_is_null_or_undefined(ctx, -1)) {
+                duk_size_t rxLength;
+                segments[i].rx = (uint8_t*)duk_require_buffer_data(ctx, -1, &rxLength);
+                if (rxLength < txLength) {
+                    duk_error(ctx, DUK_ERR_RANGE_ERROR, "Receive buffer %d is shorter than its transmit buffer", (int)i);
+                    return DUK_RET_RANGE_ERROR;
+                }
+            }
+            duk_pop(ctx);
+        }
     }
-    
-    SPI.transferBytes(txData, rxData, length);
-    
-    duk_idx_t arr_idx = duk_push_array(ctx);
-    for (int i = 0; i < length; i++) {
-        duk_push_int(ctx, rxData[i]);
-        duk_put_prop_index(ctx, arr_idx, i);
-    }
-    
-    free(txData);
-    free(rxData);
+
+    duk_push_int(ctx, spiBusQueue(vmIndex, segments, count));
     return 1;
 }
 
+static const duk_function_list_entry spiBindings[] = {
+    { "begin", duk_spiBegin, 6 },
+    { "transfer", duk_spiTransfer, 2 },
+    { "queue", duk_spiQueue, 2 },
+    { NULL, NULL, 0 }
+};
+
 // === ADC Functions ===
 duk_ret_t duk_adcConfig(duk_context *ctx) {
     int pin = duk_require_int(ctx, 0);
@@ -290,21 +616,337 @@ duk_ret_t duk_adcConfig(duk_context *ctx) {
     return 0;
 }
 
-// === Touch Sensor Functions ===
-duk_ret_t duk_touchRead(duk_context *ctx) {
-    int pin = duk_require_int(ctx, 0);
-    duk_push_int(ctx, touchRead(pin));
+duk_ret_t duk_adcStreamStart(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        return DUK_ERR_ERROR;
+    }
+
+    if (!duk_is_array(ctx, 0)) {
+        duk_error(ctx, DUK_ERR_TYPE_ERROR, "adcStreamStart() requires an array of pins");
+        return DUK_RET_TYPE_ERROR;
+    }
+    int sampleRate = duk_require_int(ctx, 1);
+    int attenuation = duk_get_int_default(ctx, 2, ADC_11db);
+
+    int pins[ADC_STREAM_MAX_CHANNELS];
+    int pinCount = duk_get_length(ctx, 0);
+    if (pinCount < 1 || pinCount > ADC_STREAM_MAX_CHANNELS) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "ADC stream takes 1-%d pins", ADC_STREAM_MAX_CHANNELS);
+        return DUK_RET_RANGE_ERROR;
+    }
+    for (int i = 0; i < pinCount; i++) {
+        duk_get_prop_index(ctx, 0, i);
+        pins[i] = duk_require_int(ctx, -1);
+        duk_pop(ctx);
+        requirePinOwnership(ctx, vmIndex, pins[i]);
+    }
+
+    duk_push_boolean(ctx, adcStreamStart(vmIndex, pins, pinCount, sampleRate, attenuation));
+    return 1;
+}
+
+duk_ret_t duk_adcStreamRead(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        return DUK_ERR_ERROR;
+    }
+
+    duk_size_t length;
+    int16_t* out = (int16_t*)duk_require_buffer_data(ctx, 0, &length);
+    duk_push_int(ctx, adcStreamRead(vmIndex, out, length / sizeof(int16_t)));
     return 1;
 }
 
+duk_ret_t duk_adcStreamStop(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex >= 0) {
+        adcStreamStop(vmIndex);
+    }
+    return 0;
+}
+
+duk_ret_t duk_adcStreamStats(duk_context *ctx) {
+    AdcStreamStats stats;
+    adcStreamGetStats(&stats);
+
+    duk_idx_t obj_idx = duk_push_object(ctx);
+
+    duk_push_boolean(ctx, stats.owner >= 0 && stats.owner == getVMIndex(ctx));
+    duk_put_prop_string(ctx, obj_idx, "running");
+
+    duk_push_uint(ctx, stats.sampleRate);
+    duk_put_prop_string(ctx, obj_idx, "sampleRate");
+
+    duk_push_uint(ctx, stats.channels);
+    duk_put_prop_string(ctx, obj_idx, "channels");
+
+    duk_push_uint(ctx, stats.samples);
+    duk_put_prop_string(ctx, obj_idx, "samples");
+
+    duk_push_uint(ctx, stats.overruns);
+    duk_put_prop_string(ctx, obj_idx, "overruns");
+
+    duk_push_uint(ctx, stats.driverOverruns);
+    duk_put_prop_string(ctx, obj_idx, "driverOverruns");
+
+    duk_push_uint(ctx, stats.badFrames);
+    duk_put_prop_string(ctx, obj_idx, "badFrames");
+
+    duk_push_uint(ctx, stats.available);
+    duk_put_prop_string(ctx, obj_idx, "available");
+
+    return 1;
+}
+
+static const duk_function_list_entry adcBindings[] = {
+    { "config", duk_adcConfig, 3 },
+    DUK_BINDING("read", native_analogRead),
+    { "streamStart", duk_adcStreamStart, 3 },
+    { "streamRead", duk_adcStreamRead, 1 },
+    { "streamStop", duk_adcStreamStop, 0 },
+    { "streamStats", duk_adcStreamStats, 0 },
+    { NULL, NULL, 0 }
+};
+
+// === DSP Functions ===
+
+// Returns the float32 elements backing a Float32Array/ArrayBuffer argument
+static float* requireFloats(duk_context *ctx, duk_idx_t idx, size_t* count) {
+    duk_size_t length;
+    float* data = (float*)duk_require_buffer_data(ctx, idx, &length);
+    *count = length / sizeof(float);
+    return data;
+}
+
+duk_ret_t duk_dspFir(duk_context *ctx) {
+    size_t n, outLength, taps, historyLength;
+    float* in = requireFloats(ctx, 0, &n);
+    float* out = requireFloats(ctx, 1, &outLength);
+    float* coeffs = requireFloats(ctx, 2, &taps);
+    float* history = requireFloats(ctx, 3, &historyLength);
+
+    if (taps == 0 || historyLength < taps - 1 || outLength < n) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "fir() needs out >= input and state >= taps - 1");
+        return DUK_RET_RANGE_ERROR;
+    }
+
+    // A caller-supplied scratch array keeps the per-block path free of
+    // allocations; without one a temporary buffer is pushed for this call
+    size_t scratchNeeded = 2 * taps + n - 1;
+    float* scratch;
+    if (duk_is_null_or_undefined(ctx, 4)) {
+        scratch = (float*)duk_push_fixed_buffer(ctx, scratchNeeded * sizeof(float));
+    } else {
+        size_t scratchLength;
+        scratch = requireFloats(ctx, 4, &scratchLength);
+        if (scratchLength < scratchNeeded) {
+            duk_error(ctx, DUK_ERR_RANGE_ERROR, "fir() scratch needs 2 * taps + input - 1 floats");
+            return DUK_RET_RANGE_ERROR;
+        }
+    }
+    dspFir(in, out, n, coeffs, taps, history, scratch);
+    duk_push_uint(ctx, n);
+    return 1;
+}
+
+duk_ret_t duk_dspBiquad(duk_context *ctx) {
+    size_t n, coeffCount, stateCount;
+    float* data = requireFloats(ctx, 0, &n);
+    float* coeffs = requireFloats(ctx, 1, &coeffCount);
+    float* state = requireFloats(ctx, 2, &stateCount);
+
+    if (coeffCount < 5 || stateCount < 2) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "biquad() needs 5 coefficients and 2 state values");
+        return DUK_RET_RANGE_ERROR;
+    }
+
+    dspBiquad(data, n, coeffs, state);
+    return 0;
+}
+
+// Cascade of biquad sections: 5 coefficients and 2 state values per section
+duk_ret_t duk_dspIir(duk_context *ctx) {
+    size_t n, coeffCount, stateCount;
+    float* data = requireFloats(ctx, 0, &n);
+    float* coeffs = requireFloats(ctx, 1, &coeffCount);
+    float* state = requireFloats(ctx, 2, &stateCount);
+
+    size_t sections = coeffCount / 5;
+    if (sections == 0 || stateCount < sections * 2) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "iir() needs 5 coefficients and 2 state values per section");
+        return DUK_RET_RANGE_ERROR;
+    }
+
+    for (size_t i = 0; i < sections; i++) {
+        dspBiquad(data, n, &coeffs[i * 5], &state[i * 2]);
+    }
+    return 0;
+}
+
+duk_ret_t duk_dspFft(duk_context *ctx) {
+    size_t count;
+    float* data = requireFloats(ctx, 0, &count);
+
+    if (!dspFft(data, count / 2)) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "fft() size must be a power of two up to %d points", DSP_MAX_FFT_SIZE);
+        return DUK_RET_RANGE_ERROR;
+    }
+    return 0;
+}
+
+duk_ret_t duk_dspMagnitude(duk_context *ctx) {
+    size_t count, outLength;
+    float* data = requireFloats(ctx, 0, &count);
+    float* out = requireFloats(ctx, 1, &outLength);
+
+    size_t n = min(count / 2, outLength);
+    dspMagnitude(data, out, n);
+    duk_push_uint(ctx, n);
+    return 1;
+}
+
+duk_ret_t duk_dspWindow(duk_context *ctx) {
+    size_t n;
+    float* data = requireFloats(ctx, 0, &n);
+    const char* name = duk_get_string_default(ctx, 1, "hann");
+
+    DspWindow type = DSP_WINDOW_HANN;
+    if (strcmp(name, "hamming") == 0) {
+        type = DSP_WINDOW_HAMMING;
+    } else if (strcmp(name, "blackman") == 0) {
+        type = DSP_WINDOW_BLACKMAN;
+    } else if (strcmp(name, "hann") != 0) {
+        duk_error(ctx, DUK_ERR_TYPE_ERROR, "Unknown window '%s'", name);
+        return DUK_RET_TYPE_ERROR;
+    }
+
+    dspWindow(data, n, type);
+    return 0;
+}
+
+duk_ret_t duk_dspDecimate(duk_context *ctx) {
+    size_t n, outLength;
+    float* in = requireFloats(ctx, 0, &n);
+    float* out = requireFloats(ctx, 1, &outLength);
+    int factor = duk_require_int(ctx, 2);
+
+    if (factor < 1) {
+        duk_error(ctx, DUK_ERR_RANGE_ERROR, "decimate() factor must be at least 1");
+        return DUK_RET_RANGE_ERROR;
+    }
+
+    duk_push_uint(ctx, dspDecimate(in, n, out, outLength, factor));
+    return 1;
+}
+
+duk_ret_t duk_dspMean(duk_context *ctx) {
+    size_t n;
+    float* data = requireFloats(ctx, 0, &n);
+    duk_push_number(ctx, dspMean(data, n));
+    return 1;
+}
+
+duk_ret_t duk_dspRms(duk_context *ctx) {
+    size_t n;
+    float* data = requireFloats(ctx, 0, &n);
+    duk_push_number(ctx, dspRms(data, n));
+    return 1;
+}
+
+duk_ret_t duk_dspMin(duk_context *ctx) {
+    size_t n;
+    float* data = requireFloats(ctx, 0, &n);
+    duk_push_number(ctx, dspMin(data, n));
+    return 1;
+}
+
+duk_ret_t duk_dspMax(duk_context *ctx) {
+    size_t n;
+    float* data = requireFloats(ctx, 0, &n);
+    duk_push_number(ctx, dspMax(data, n));
+    return 1;
+}
+
+duk_ret_t duk_dspFromInt16(duk_context *ctx) {
+    duk_size_t inBytes;
+    int16_t* in = (int16_t*)duk_require_buffer_data(ctx, 0, &inBytes);
+    size_t outLength;
+    float* out = requireFloats(ctx, 1, &outLength);
+    float scale = duk_get_number_default(ctx, 2, 1.0);
+
+    size_t n = min(inBytes / sizeof(int16_t), outLength);
+    dspFromInt16(in, out, n, scale);
+    duk_push_uint(ctx, n);
+    return 1;
+}
+
+static const duk_function_list_entry dspFunctions[] = {
+    { "fir", duk_dspFir, 5 },
+    { "biquad", duk_dspBiquad, 3 },
+    { "iir", duk_dspIir, 3 },
+    { "fft", duk_dspFft, 1 },
+    { "magnitude", duk_dspMagnitude, 2 },
+    { "window", duk_dspWindow, 2 },
+    { "decimate", duk_dspDecimate, 3 },
+    { "mean", duk_dspMean, 1 },
+    { "rms", duk_dspRms, 1 },
+    { "min", duk_dspMin, 1 },
+    { "max", duk_dspMax, 1 },
+    { "fromInt16", duk_dspFromInt16, 3 },
+    { NULL, NULL, 0 }
+};
+
+// === Touch Sensor Functions ===
+static int native_touchRead(int pin) {
+    return touchRead(pin);
+}
+
 duk_ret_t duk_touchAttachInterrupt(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        return DUK_ERR_ERROR;
+    }
+
     int pin = duk_require_int(ctx, 0);
     int threshold = duk_require_int(ctx, 1);
-    
-    touchAttachInterrupt(pin, [](){}, threshold);
-    return 0;
+    duk_require_function(ctx, 2);
+
+    requirePinOwnership(ctx, vmIndex, pin);
+    vmEventsSetHandler(ctx, VM_EVENT_TOUCH, pin, 2);
+    duk_push_boolean(ctx, touchEventsAttach(vmIndex, pin, threshold));
+    return 1;
 }
 
+duk_ret_t duk_touchDetachInterrupt(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        return DUK_ERR_ERROR;
+    }
+
+    int pin = duk_require_int(ctx, 0);
+    bool detached = touchEventsDetach(vmIndex, pin);
+    if (detached) {
+        duk_push_undefined(ctx);
+        vmEventsSetHandler(ctx, VM_EVENT_TOUCH, pin, -1);
+        duk_pop(ctx);
+    }
+    duk_push_boolean(ctx, detached);
+    return 1;
+}
+
+static uint32_t native_touchReadAll(TypedArray<uint32_t> out) {
+    return touchReadAllPads(out.data, out.count);
+}
+
+static const duk_function_list_entry touchGlobals[] = {
+    DUK_BINDING("touchRead", native_touchRead),
+    DUK_BINDING("touchReadAll", native_touchReadAll),
+    { "touchAttachInterrupt", duk_touchAttachInterrupt, 3 },
+    { "touchDetachInterrupt", duk_touchDetachInterrupt, 1 },
+    DUK_BINDING_END
+};
+
 // === RTC Functions ===
 duk_ret_t duk_rtcGetTime(duk_context *ctx) {
     struct timeval tv;
@@ -321,112 +963,451 @@ duk_ret_t duk_rtcGetTime(duk_context *ctx) {
     return 1;
 }
 
+static const duk_function_list_entry rtcBindings[] = {
+    { "getTime", duk_rtcGetTime, 0 },
+    { NULL, NULL, 0 }
+};
+
 // === Sleep Functions ===
-duk_ret_t duk_deepSleep(duk_context *ctx) {
-    uint64_t sleepTime = duk_require_int(ctx, 0);
-    esp_sleep_enable_timer_wakeup(sleepTime * 1000000ULL);
+static void native_deepSleep(uint32_t seconds) {
+    esp_sleep_enable_timer_wakeup(seconds * 1000000ULL);
     esp_deep_sleep_start();
-    return 0;
 }
 
-duk_ret_t duk_lightSleep(duk_context *ctx) {
-    uint64_t sleepTime = duk_require_int(ctx, 0);
-    esp_sleep_enable_timer_wakeup(sleepTime * 1000000ULL);
+static void native_lightSleep(uint32_t seconds) {
+    esp_sleep_enable_timer_wakeup(seconds * 1000000ULL);
     esp_light_sleep_start();
-    return 0;
 }
 
+static const duk_function_list_entry sleepGlobals[] = {
+    DUK_BINDING("deepSleep", native_deepSleep),
+    DUK_BINDING("lightSleep", native_lightSleep),
+    DUK_BINDING_END
+};
+
 // === LED Control Functions ===
-duk_ret_t duk_ledcSetup(duk_context *ctx) {
-    int channel = duk_require_int(ctx, 0);
-    int frequency = duk_require_int(ctx, 1);
-    int resolution = duk_require_int(ctx, 2);
-    
-    ledc_timer_config_t ledc_timer = {
-        .speed_mode = LEDC_LOW_SPEED_MODE,
-        .duty_resolution = (ledc_timer_bit_t)resolution,
-        .timer_num = LEDC_TIMER_0,
-        .freq_hz = frequency,
-        .clk_cfg = LEDC_AUTO_CLK
-    };
-    ledc_timer_config(&ledc_timer);
-    return 0;
+static int native_ledcSetup(CallerVM vm, int channel, uint32_t frequency, uint8_t resolution) {
+    return ledcManagerSetup(vm.index, channel, frequency, resolution);
 }
 
-duk_ret_t duk_ledcAttachPin(duk_context *ctx) {
-    int pin = duk_require_int(ctx, 0);
-    int channel = duk_require_int(ctx, 1);
-    
-    ledc_channel_config_t ledc_channel = {
-        .gpio_num = pin,
-        .speed_mode = LEDC_LOW_SPEED_MODE,
-        .channel = (ledc_channel_t)channel,
-        .timer_sel = LEDC_TIMER_0,
-        .duty = 0,
-        .hpoint = 0
-    };
-    ledc_channel_config(&ledc_channel);
-    return 0;
+static bool native_ledcAttachPin(CallerVM vm, Pin pin, int channel) {
+    return ledcManagerAttachPin(vm.index, channel, pin.number);
 }
 
-duk_ret_t duk_ledcWrite(duk_context *ctx) {
-    int channel = duk_require_int(ctx, 0);
-    int duty = duk_require_int(ctx, 1);
-    
-    ledc_set_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel, duty);
-    ledc_update_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t)channel);
-    return 0;
+static bool native_ledcWrite(CallerVM vm, int channel, uint32_t duty) {
+    return ledcManagerWrite(vm.index, channel, duty);
+}
+
+static bool native_ledcFade(CallerVM vm, int channel, uint32_t duty, uint32_t ms) {
+    return ledcManagerFade(vm.index, channel, duty, ms);
+}
+
+// ledcWriteMany(Uint8Array channels, Uint32Array duties)
+static int native_ledcWriteMany(DukContext js, CallerVM vm, TypedArray<const uint8_t> channels, TypedArray<const uint32_t> duties) {
+    if (duties.count < channels.count) {
+        duk_error(js.ctx, DUK_ERR_RANGE_ERROR, "ledcWriteMany() needs one duty per channel");
+    }
+    return ledcManagerWriteMany(vm.index, channels.data, duties.data, channels.count);
+}
+
+static const duk_function_list_entry ledcBindings[] = {
+    DUK_BINDING("setup", native_ledcSetup),
+    DUK_BINDING("attachPin", native_ledcAttachPin),
+    DUK_BINDING("write", native_ledcWrite),
+    DUK_BINDING("fade", native_ledcFade),
+    DUK_BINDING("writeMany", native_ledcWriteMany),
+    DUK_BINDING_END
+};
+
+// === RMT Output Functions ===
+// rmtPixels(pin[, "ws2812" | "sk6812"]) -> output id or -1
+static int native_rmtPixels(DukContext js, CallerVM vm, Pin pin, Optional<const char*> type) {
+    RmtOutputKind kind = RMT_OUTPUT_WS2812;
+    if (type.value && strcmp(type.value, "sk6812") == 0) {
+        kind = RMT_OUTPUT_SK6812;
+    } else if (type.value && strcmp(type.value, "ws2812") != 0) {
+        duk_error(js.ctx, DUK_ERR_TYPE_ERROR, "Pixel type must be 'ws2812' or 'sk6812'");
+    }
+    return rmtOutputBegin(vm.index, pin.number, kind, 0);
+}
+
+// rmtPulses(pin[, resolutionHz]) -> output id or -1
+static int native_rmtPulses(CallerVM vm, Pin pin, Optional<uint32_t, 1000000> resolution) {
+    return rmtOutputBegin(vm.index, pin.number, RMT_OUTPUT_PULSES, resolution.value);
+}
+
+// rmtWrite(id, Uint8Array pixels | Uint32Array durations)
+static bool native_rmtWrite(CallerVM vm, int id, TypedArray<const uint8_t> data) {
+    return rmtOutputWrite(vm.index, id, data.data, data.count);
+}
+
+static bool native_rmtBrightness(CallerVM vm, int id, int level) {
+    return rmtOutputSetBrightness(vm.index, id, constrain(level, 0, 255));
 }
 
+static bool native_rmtGamma(CallerVM vm, int id, bool enabled) {
+    return rmtOutputSetGamma(vm.index, id, enabled);
+}
+
+static bool native_rmtBusy(CallerVM vm, int id) {
+    return rmtOutputBusy(vm.index, id);
+}
+
+static bool native_rmtWait(CallerVM vm, int id, Optional<uint32_t, 1000> timeoutMs) {
+    return rmtOutputWait(vm.index, id, timeoutMs.value);
+}
+
+static bool native_rmtEnd(CallerVM vm, int id) {
+    return rmtOutputEnd(vm.index, id);
+}
+
+static const duk_function_list_entry rmtBindings[] = {
+    DUK_BINDING("pixels", native_rmtPixels),
+    DUK_BINDING("pulses", native_rmtPulses),
+    DUK_BINDING("write", native_rmtWrite),
+    DUK_BINDING("brightness", native_rmtBrightness),
+    DUK_BINDING("gamma", native_rmtGamma),
+    DUK_BINDING("busy", native_rmtBusy),
+    DUK_BINDING("wait", native_rmtWait),
+    DUK_BINDING("end", native_rmtEnd),
+    DUK_BINDING_END
+};
+
 // === Timer Functions ===
-duk_ret_t duk_timerAttach(duk_context *ctx) {
-    int timerNum = duk_require_int(ctx, 0);
-    int divider = duk_require_int(ctx, 1);
-    bool countUp = duk_require_boolean(ctx, 2);
-    
-    hw_timer_t* timer = timerBegin(80000000 / divider); // Convert divider to frequency
-    if (timer == NULL) {
-        duk_push_false(ctx);
-    } else {
-        duk_push_true(ctx);
+static void requireTimer(DukContext js, int timerNum, double periodUs) {
+    if (timerNum < 0 || timerNum >= VM_TIMER_COUNT || periodUs < 1) {
+        duk_error(js.ctx, DUK_ERR_RANGE_ERROR, "Timer must be 0-%d with a period of at least 1 us", VM_TIMER_COUNT - 1);
     }
-    return 1;
 }
 
+static bool native_timerAttach(DukContext js, CallerVM vm, int timerNum, double periodUs, Function handler, Optional<bool> oneShot) {
+    requireTimer(js, timerNum, periodUs);
+    vmEventsSetHandler(js.ctx, VM_EVENT_TIMER, timerNum, handler.index);
+    return vmTimerAttach(vm.index, timerNum, (uint64_t)periodUs, oneShot.value);
+}
+
+static bool native_timerToggle(DukContext js, CallerVM vm, int timerNum, double periodUs, Pin pin) {
+    requireTimer(js, timerNum, periodUs);
+    return vmTimerToggle(vm.index, timerNum, (uint64_t)periodUs, pin.number);
+}
+
+static bool native_timerDetach(DukContext js, CallerVM vm, int timerNum) {
+    bool detached = vmTimerDetach(vm.index, timerNum);
+    if (detached) {
+        duk_push_undefined(js.ctx);
+        vmEventsSetHandler(js.ctx, VM_EVENT_TIMER, timerNum, -1);
+        duk_pop(js.ctx);
+    }
+    return detached;
+}
+
+static const duk_function_list_entry timerBindings[] = {
+    DUK_BINDING("attach", native_timerAttach),
+    DUK_BINDING("toggle", native_timerToggle),
+    DUK_BINDING("detach", native_timerDetach),
+    DUK_BINDING_END
+};
+
+// === Timing Functions ===
+// All of these return plain numbers, so timing a hot loop allocates nothing
+static uint32_t native_millis() {
+    return millis();
+}
+
+static double native_micros() {
+    return (double)esp_timer_get_time();
+}
+
+static double native_performanceNow(CallerVM vm) {
+    return vmPerfNow(vm.index);
+}
+
+static void native_performanceMark(CallerVM vm, const char* name) {
+    vmPerfMark(vm.index, name);
+}
+
+// performance.measure(name[, startMark[, endMark]]) -> duration in ms
+static double native_performanceMeasure(DukContext js, CallerVM vm, const char* name,
+                                        Optional<const char*> startMark, Optional<const char*> endMark) {
+    int64_t duration = vmPerfMeasure(vm.index, name, startMark.value, endMark.value);
+    if (duration < 0) {
+        duk_error(js.ctx, DUK_ERR_ERROR, "performance.measure('%s'): no such mark", name);
+    }
+    return duration / 1000.0;
+}
+
+static void native_performanceClear(CallerVM vm) {
+    vmPerfClear(vm.index);
+}
+
+static const duk_function_list_entry performanceBindings[] = {
+    DUK_BINDING("now", native_performanceNow),
+    DUK_BINDING("mark", native_performanceMark),
+    DUK_BINDING("measure", native_performanceMeasure),
+    DUK_BINDING("clear", native_performanceClear),
+    DUK_BINDING_END
+};
+
 // === Communication Functions ===
+static bool native_udpBind(CallerVM vm, uint16_t port) {
+    return netUdpBind(vm.index, port);
+}
+
+static bool native_udpUnbind(CallerVM vm, uint16_t port) {
+    return netUdpUnbind(vm.index, port);
+}
+
+// Strings are sent as their bytes, buffers without copying them first
+static const void* requirePayload(duk_context *ctx, duk_idx_t idx, duk_size_t *length) {
+    if (duk_is_buffer_data(ctx, idx)) {
+        return duk_get_buffer_data(ctx, idx, length);
+    }
+    return duk_require_lstring(ctx, idx, length);
+}
+
+static uint32_t requireAddress(duk_context *ctx, duk_idx_t idx) {
+    const char* ip = duk_require_string(ctx, idx);
+    uint32_t address;
+    if (!netParseAddress(ip, &address)) {
+        duk_error(ctx, DUK_ERR_TYPE_ERROR, "Invalid IP address %s", ip);
+    }
+    return address;
+}
+
+// udp.send(ip, port, stringOrBuffer[, localPort])
 duk_ret_t duk_udpSend(duk_context *ctx) {
-    const char *ipStr = duk_require_string(ctx, 0);
-    uint16_t port = duk_require_int(ctx, 1);
-    const char *msg = duk_require_string(ctx, 2);
-    int vmIndex = duk_require_int(ctx, 3);
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        return DUK_ERR_ERROR;
+    }
+
+    uint32_t address = requireAddress(ctx, 0);
+    uint16_t port = duk_require_uint(ctx, 1);
+    duk_size_t length;
+    const void* data = requirePayload(ctx, 2, &length);
+    uint16_t localPort = duk_get_uint_default(ctx, 3, 0);
 
-    IPAddress ip;
-    if (!ip.fromString(ipStr)) {
-        Serial.printf("VM %d: Invalid IP address\n", vmIndex);
-        return -1;
+    duk_push_boolean(ctx, netUdpSend(vmIndex, localPort, address, port, data, length) >= 0);
+    return 1;
+}
+
+// udp.sendMany(ip, port, [stringOrBuffer, ...][, localPort]) -> datagrams sent
+duk_ret_t duk_udpSendMany(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        return DUK_ERR_ERROR;
     }
 
-    udp.beginPacket(ip, port);
-    udp.write((const uint8_t *)msg, strlen(msg));
-    udp.endPacket();
-    return 0;
+    uint32_t address = requireAddress(ctx, 0);
+    uint16_t port = duk_require_uint(ctx, 1);
+    if (!duk_is_array(ctx, 2)) {
+        duk_error(ctx, DUK_ERR_TYPE_ERROR, "sendMany() expects an array of datagrams");
+        return DUK_RET_TYPE_ERROR;
+    }
+    uint16_t localPort = duk_get_uint_default(ctx, 3, 0);
+
+    // The array keeps every payload alive, so only pointers are collected
+    NetBuffer batch[16];
+    duk_size_t total = duk_get_length(ctx, 2);
+    duk_size_t sent = 0;
+    while (sent < total) {
+        size_t count = min((size_t)(total - sent), sizeof(batch) / sizeof(batch[0]));
+        for (size_t i = 0; i < count; i++) {
+            duk_get_prop_index(ctx, 2, sent + i);
+            batch[i].data = requirePayload(ctx, -1, &batch[i].length);
+            duk_pop(ctx);
+        }
+
+        int done = netUdpSendMany(vmIndex, localPort, address, port, batch, count);
+        sent += done;
+        if (done < (int)count) {
+            break;
+        }
+    }
+
+    duk_push_uint(ctx, sent);
+    return 1;
+}
+
+static void putDatagramInfo(duk_context *ctx, duk_idx_t obj, const NetDatagram& datagram) {
+    char address[16];
+    netFormatAddress(datagram.address, address, sizeof(address));
+    obj = duk_normalize_index(ctx, obj);
+    duk_push_string(ctx, address);
+    duk_put_prop_string(ctx, obj, "address");
+    duk_push_uint(ctx, datagram.port);
+    duk_put_prop_string(ctx, obj, "port");
+    duk_push_uint(ctx, datagram.localPort);
+    duk_put_prop_string(ctx, obj, "localPort");
+    duk_push_uint(ctx, datagram.length);
+    duk_put_prop_string(ctx, obj, "length");
 }
 
+// udp.receive() -> { data, address, port, localPort, length } or null
+// udp.receive(buffer[, info]) -> bytes copied into buffer, or -1 if none;
+// info, if given, is filled with address, port, localPort and length
 duk_ret_t duk_udpReceive(duk_context *ctx) {
-    if (udp.parsePacket()) {
-        char packetBuffer[MAX_MESSAGE_LENGTH];
-        int bytesRead = udp.read(packetBuffer, MAX_MESSAGE_LENGTH - 1);
-        if (bytesRead > 0) {
-            packetBuffer[bytesRead] = '\0';
-            duk_push_string(ctx, packetBuffer);
-            return 1;
+    int vmIndex = getVMIndex(ctx);
+    bool intoBuffer = duk_is_buffer_data(ctx, 0);
+    NetDatagram datagram;
+    if (vmIndex < 0 || !netUdpReceive(vmIndex, &datagram, 0)) {
+        if (intoBuffer) {
+            duk_push_int(ctx, -1);
+        } else {
+            duk_push_null(ctx);
+        }
+        return 1;
+    }
+
+    if (intoBuffer) {
+        duk_size_t capacity;
+        void* out = duk_get_buffer_data(ctx, 0, &capacity);
+        size_t copied = min((size_t)capacity, datagram.length);
+        memcpy(out, datagram.data, copied);
+        if (duk_is_object(ctx, 1)) {
+            putDatagramInfo(ctx, 1, datagram);
         }
+        netUdpRelease(vmIndex, datagram);
+        duk_push_uint(ctx, copied);
+        return 1;
+    }
+
+    duk_push_object(ctx);
+    duk_push_lstring(ctx, (const char*)datagram.data, datagram.length);
+    duk_put_prop_string(ctx, -2, "data");
+    putDatagramInfo(ctx, -1, datagram);
+    netUdpRelease(vmIndex, datagram);
+    return 1;
+}
+
+static const duk_function_list_entry udpBindings[] = {
+    DUK_BINDING("bind", native_udpBind),
+    DUK_BINDING("unbind", native_udpUnbind),
+    { "send", duk_udpSend, 4 },
+    { "sendMany", duk_udpSendMany, 4 },
+    { "receive", duk_udpReceive, 2 },
+    DUK_BINDING_END
+};
+
+static int native_tcpConnect(CallerVM vm, const char* host, uint16_t port) {
+    return netTcpConnect(vm.index, host, port);
+}
+
+static int native_tcpListen(CallerVM vm, uint16_t port, Optional<int, 4> backlog) {
+    return netTcpListen(vm.index, port, backlog.value);
+}
+
+static int native_tcpAvailable(CallerVM vm, int id) {
+    return netTcpAvailable(vm.index, id);
+}
+
+// tcp.write(id, stringOrBuffer) -> bytes queued, fewer when the send buffer
+// is full, or -1 once closed
+duk_ret_t duk_tcpWrite(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        return DUK_ERR_ERROR;
     }
-    duk_push_null(ctx);
+
+    int id = duk_require_int(ctx, 0);
+    duk_size_t length;
+    const void* data = requirePayload(ctx, 1, &length);
+    duk_push_int(ctx, netTcpWrite(vmIndex, id, data, length));
     return 1;
 }
 
+// tcp.read(id, buffer) -> bytes copied, or -1 once closed and empty
+// tcp.read(id) -> everything buffered as a string, or null once closed and empty
+duk_ret_t duk_tcpRead(duk_context *ctx) {
+    int vmIndex = getVMIndex(ctx);
+    if (vmIndex < 0) {
+        return DUK_ERR_ERROR;
+    }
+
+    int id = duk_require_int(ctx, 0);
+    if (duk_is_buffer_data(ctx, 1)) {
+        duk_size_t capacity;
+        void* out = duk_get_buffer_data(ctx, 1, &capacity);
+        duk_push_int(ctx, netTcpRead(vmIndex, id, out, capacity));
+        return 1;
+    }
+
+    int available = netTcpAvailable(vmIndex, id);
+    if (available <= 0) {
+        int result = netTcpRead(vmIndex, id, nullptr, 0);
+        if (result < 0) {
+            duk_push_null(ctx);
+        } else {
+            duk_push_string(ctx, "");
+        }
+        return 1;
+    }
+
+    // This VM is the only reader, so everything available is copied
+    void* out = duk_push_fixed_buffer(ctx, available);
+    netTcpRead(vmIndex, id, out, available);
+    duk_buffer_to_string(ctx, -1);
+    return 1;
+}
+
+static void setTcpHandler(DukContext js, CallerVM vm, int id, uint8_t type, Function handler) {
+    if (netTcpAvailable(vm.index, id) < 0) {
+        duk_error(js.ctx, DUK_ERR_RANGE_ERROR, "%d is not an open TCP id of this VM", id);
+    }
+    vmEventsSetHandler(js.ctx, type, id, handler.index);
+}
+
+static void native_tcpOnAccept(DukContext js, CallerVM vm, int id, Function handler) {
+    setTcpHandler(js, vm, id, VM_EVENT_TCP_ACCEPT, handler);
+}
+
+static void native_tcpOnData(DukContext js, CallerVM vm, int id, Function handler) {
+    setTcpHandler(js, vm, id, VM_EVENT_TCP_DATA, handler);
+}
+
+static void native_tcpOnDrain(DukContext js, CallerVM vm, int id, Function handler) {
+    setTcpHandler(js, vm, id, VM_EVENT_TCP_DRAIN, handler);
+}
+
+static void native_tcpOnClose(DukContext js, CallerVM vm, int id, Function handler) {
+    setTcpHandler(js, vm, id, VM_EVENT_TCP_CLOSE, handler);
+}
+
+static bool native_tcpClose(DukContext js, CallerVM vm, int id) {
+    bool closed = netTcpClose(vm.index, id);
+    if (closed) {
+        // The id may be reused by the next connection
+        duk_push_undefined(js.ctx);
+        for (uint8_t type = VM_EVENT_TCP_ACCEPT; type <= VM_EVENT_TCP_CLOSE; type++) {
+            vmEventsSetHandler(js.ctx, type, id, -1);
+        }
+        duk_pop(js.ctx);
+    }
+    return closed;
+}
+
+static const duk_function_list_entry tcpBindings[] = {
+    DUK_BINDING("connect", native_tcpConnect),
+    DUK_BINDING("listen", native_tcpListen),
+    { "write", duk_tcpWrite, 2 },
+    { "read", duk_tcpRead, 2 },
+    DUK_BINDING("available", native_tcpAvailable),
+    DUK_BINDING("onAccept", native_tcpOnAccept),
+    DUK_BINDING("onData", native_tcpOnData),
+    DUK_BINDING("onDrain", native_tcpOnDrain),
+    DUK_BINDING("onClose", native_tcpOnClose),
+    DUK_BINDING("close", native_tcpClose),
+    DUK_BINDING_END
+};
+
 duk_ret_t duk_sendMessage(duk_context *ctx) {
+    // "vm", "node:vm" or "node:slot" go through the message link
+    if (duk_is_string(ctx, 0)) {
+        const char* message = duk_require_string(ctx, 1);
+        duk_push_boolean(ctx, msgLinkSend(duk_get_string(ctx, 0), message));
+        return 1;
+    }
+
     int receiverID = duk_require_int(ctx, 0);
     const char* message = duk_require_string(ctx, 1);
 
@@ -476,109 +1457,95 @@ duk_ret_t duk_receiveMessage(duk_context *ctx) {
     return 1;
 }
 
-// === Register All Bindings ===
-void registerDuktapeBindings(duk_context *ctx, int vmIndex) {
-    // Register print function
-    duk_push_c_function(ctx, native_print, 1);
-    duk_put_global_string(ctx, "print");
-    
-    // Register wait/delay functions
-    duk_push_c_function(ctx, native_wait, 1);
-    duk_put_global_string(ctx, "wait");
-    duk_push_c_function(ctx, native_wait, 1);
-    duk_put_global_string(ctx, "delay");
-
-    // GPIO bindings
-    duk_push_c_function(ctx, duk_digitalWrite, 2);
-    duk_put_global_string(ctx, "digitalWrite");
-
-    duk_push_c_function(ctx, duk_digitalRead, 1);
-    duk_put_global_string(ctx, "digitalRead");
-
-    duk_push_c_function(ctx, duk_analogRead, 1);
-    duk_put_global_string(ctx, "analogRead");
-
-    duk_push_c_function(ctx, duk_analogWrite, 2);
-    duk_put_global_string(ctx, "analogWrite");
-
-    duk_push_c_function(ctx, duk_pinMode, 2);
-    duk_put_global_string(ctx, "pinMode");
-
-    // WiFi bindings
-    duk_push_c_function(ctx, duk_wifiConnect, 2);
-    duk_put_global_string(ctx, "wifiConnect");
-    
-    duk_push_c_function(ctx, duk_wifiDisconnect, 0);
-    duk_put_global_string(ctx, "wifiDisconnect");
-    
-    duk_push_c_function(ctx, duk_getIP, 0);
-    duk_put_global_string(ctx, "getIP");
-    
-    // I2C bindings
-    duk_push_c_function(ctx, duk_i2cBegin, 3);
-    duk_put_global_string(ctx, "i2cBegin");
-    
-    duk_push_c_function(ctx, duk_i2cWrite, 2);
-    duk_put_global_string(ctx, "i2cWrite");
-    
-    duk_push_c_function(ctx, duk_i2cRead, 2);
-    duk_put_global_string(ctx, "i2cRead");
-    
-    // SPI bindings
-    duk_push_c_function(ctx, duk_spiBegin, 4);
-    duk_put_global_string(ctx, "spiBegin");
-    
-    duk_push_c_function(ctx, duk_spiTransfer, 1);
-    duk_put_global_string(ctx, "spiTransfer");
-    
-    // ADC bindings
-    duk_push_c_function(ctx, duk_adcConfig, 3);
-    duk_put_global_string(ctx, "adcConfig");
-    
-    // Touch sensor bindings
-    duk_push_c_function(ctx, duk_touchRead, 1);
-    duk_put_global_string(ctx, "touchRead");
-    
-    duk_push_c_function(ctx, duk_touchAttachInterrupt, 2);
-    duk_put_global_string(ctx, "touchAttachInterrupt");
-    
-    // RTC bindings
-    duk_push_c_function(ctx, duk_rtcGetTime, 0);
-    duk_put_global_string(ctx, "rtcGetTime");
-    
-    // Sleep bindings
-    duk_push_c_function(ctx, duk_deepSleep, 1);
-    duk_put_global_string(ctx, "deepSleep");
-    
-    duk_push_c_function(ctx, duk_lightSleep, 1);
-    duk_put_global_string(ctx, "lightSleep");
-    
-    // LED bindings
-    duk_push_c_function(ctx, duk_ledcSetup, 3);
-    duk_put_global_string(ctx, "ledcSetup");
-    
-    duk_push_c_function(ctx, duk_ledcAttachPin, 2);
-    duk_put_global_string(ctx, "ledcAttachPin");
-    
-    duk_push_c_function(ctx, duk_ledcWrite, 2);
-    duk_put_global_string(ctx, "ledcWrite");
-    
-    // Timer bindings
-    duk_push_c_function(ctx, duk_timerAttach, 3);
-    duk_put_global_string(ctx, "timerAttach");
+static const duk_function_list_entry coreGlobals[] = {
+    { "print", native_print, 1 },
+    { "wait", native_wait, 1 },
+    { "delay", native_wait, 1 },
+    DUK_BINDING("millis", native_millis),
+    DUK_BINDING("micros", native_micros),
+    { "sendMessage", duk_sendMessage, 2 },
+    { "receiveMessage", duk_receiveMessage, 1 },
+    { NULL, NULL, 0 }
+};
+
+// === Namespaces ===
+// Each namespace global starts as an accessor and is only turned into an
+// object of lightfuncs the first time a script reads it, so a script pays
+// only for the namespaces it uses.
+struct BindingNamespace {
+    const char* name;
+    const duk_function_list_entry* functions;
+};
+
+static const BindingNamespace bindingNamespaces[] = {
+    { "gpio", gpioBindings },
+    { "log", logBindings },
+    { "wifi", wifiBindings },
+    { "i2c", i2cBindings },
+    { "spi", spiBindings },
+    { "adc", adcBindings },
+    { "dsp", dspFunctions },
+    { "rtc", rtcBindings },
+    { "ledc", ledcBindings },
+    { "rmt", rmtBindings },
+    { "timer", timerBindings },
+    { "performance", performanceBindings },
+    { "udp", udpBindings },
+    { "tcp", tcpBindings },
+};
+
+// Replaces the accessor for a namespace with the value on top of the stack
+static void settleNamespace(duk_context *ctx, const char* name) {
+    duk_push_global_object(ctx);
+    duk_push_string(ctx, name);
+    duk_dup(ctx, -3);
+    duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_SET_WRITABLE |
+                          DUK_DEFPROP_SET_ENUMERABLE | DUK_DEFPROP_SET_CONFIGURABLE);
+    duk_pop(ctx);
+}
 
-    // Communication bindings
-    duk_push_c_function(ctx, duk_udpSend, 4);
-    duk_put_global_string(ctx, "udpSend");
+// Getter; Duktape passes the property name as the first argument
+static duk_ret_t namespaceGet(duk_context *ctx) {
+    const char* name = duk_require_string(ctx, 0);
+    for (const BindingNamespace& ns : bindingNamespaces) {
+        if (strcmp(ns.name, name) == 0) {
+            duk_push_object(ctx);
+            dukPutLightFunctions(ctx, -1, ns.functions);
+            settleNamespace(ctx, name);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    duk_push_c_function(ctx, duk_udpReceive, 0);
-    duk_put_global_string(ctx, "udpReceive");
+// Setter, so scripts can still use a namespace name as their own variable
+static duk_ret_t namespaceSet(duk_context *ctx) {
+    const char* name = duk_require_string(ctx, 1);
+    duk_dup(ctx, 0);
+    settleNamespace(ctx, name);
+    return 0;
+}
 
-    duk_push_c_function(ctx, duk_sendMessage, 2);
-    duk_put_global_string(ctx, "sendMessage");
+// === Register All Bindings ===
+void registerDuktapeBindings(duk_context *ctx, int vmIndex) {
+    // Flat globals are lightfuncs, which cost no heap object each
+    dukRegisterGlobals(ctx, coreGlobals);
+    dukRegisterGlobals(ctx, gpioGlobals);
+    dukRegisterGlobals(ctx, touchGlobals);
+    dukRegisterGlobals(ctx, sleepGlobals);
 
-    duk_push_c_function(ctx, duk_receiveMessage, 1);
-    duk_put_global_string(ctx, "receiveMessage");
+    // One getter and one setter object serve every namespace
+    duk_push_global_object(ctx);
+    duk_push_c_function(ctx, namespaceGet, 1);
+    duk_push_c_function(ctx, namespaceSet, 2);
+    for (const BindingNamespace& ns : bindingNamespaces) {
+        duk_push_string(ctx, ns.name);
+        duk_dup(ctx, -3);
+        duk_dup(ctx, -3);
+        duk_def_prop(ctx, -6, DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_HAVE_SETTER |
+                              DUK_DEFPROP_SET_ENUMERABLE | DUK_DEFPROP_SET_CONFIGURABLE);
+    }
+    duk_pop_3(ctx);
 
     // Store VM index in global object
     duk_push_global_object(ctx);
@@ -586,11 +1553,13 @@ void registerDuktapeBindings(duk_context *ctx, int vmIndex) {
     duk_put_prop_string(ctx, -2, "\xFF\xFFvm_index");
     duk_pop(ctx);
 
-    // Test the bindings
-    String testCode = "print('VM " + String(vmIndex) + " initialized')";
-    duk_push_string(ctx, testCode.c_str());
+    // Test the bindings. This runs on the creating task, not the VM task
+    // that produces into the VM's own log ring, so report as the system.
+    duk_push_string(ctx, "typeof print");
     if (duk_peval(ctx) != 0) {
-        Serial.printf("VM %d initialization failed: %s\n", vmIndex, duk_safe_to_string(ctx, -1));
+        vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "VM %d initialization failed: %s", vmIndex, duk_safe_to_string(ctx, -1));
+    } else {
+        vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "VM %d initialized", vmIndex);
     }
     duk_pop(ctx);
 }
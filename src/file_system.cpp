@@ -1,5 +1,7 @@
 #include "include/file_system.h"
 #include "include/vm_manager.h"
+#include "include/deploy.h"
+#include "include/vm_log.h"
 #include <FFat.h>
 
 // === File System Handling (FFat) === 
@@ -45,6 +47,49 @@ bool initFS() {
   return true;
 }
 
+int createVMFromFile(const String& path) {
+  File file = FFat.open(path, "r");
+  if (!file) {
+    return -1;
+  }
+
+  if (!path.endsWith(".jsbc")) {
+    String content = file.readString();
+    file.close();
+    return createVM(path, content.c_str(), path);
+  }
+
+  size_t size = file.size();
+  uint8_t* bytecode = (uint8_t*)malloc(size);
+  if (!bytecode || file.read(bytecode, size) != size) {
+    free(bytecode);
+    file.close();
+    return -1;
+  }
+  file.close();
+
+  // Duktape trusts bytecode completely, so only load images a signed rollout
+  // installed
+  if (!deployIsTrustedBytecode(bytecode, size)) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Refusing %s: bytecode must be installed by a signed rollout", path.c_str());
+    free(bytecode);
+    return -1;
+  }
+
+  int vmIndex = createVMFromBytecode(path, bytecode, size, path);
+  free(bytecode);
+  return vmIndex;
+}
+
+int relaunchVMFromFile(const String& path) {
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (vms[i].running && vms[i].fullPath == path) {
+      destroyVM(i);
+    }
+  }
+  return createVMFromFile(path);
+}
+
 void checkFileChanges(int vmIndex) {
   if (vmIndex >= 0 && vmIndex < MAX_VMS && vms[vmIndex].running) {
     auto& vm = vms[vmIndex];
@@ -66,22 +111,16 @@ void checkFileChanges(int vmIndex) {
         
         // Stop the current VM first
         stopVM(vmIndex);
-        
-        // Reopen file to read content
-        file = FFat.open(vm.fullPath, "r"); 
-        if (!file) {
-          return;
-        }
-
-        String content = file.readString();
-        file.close();
 
         // Update file info before creating new VM
-        String oldFilename = vm.filename;
         String oldFullPath = vm.fullPath;
+        uint32_t oldStarts = vm.starts;
         
-        // Create new VM
-        createVM(oldFilename, content.c_str(), oldFullPath);
+        // Create new VM, carrying the start count over so reloads show as restarts
+        int newIndex = createVMFromFile(oldFullPath);
+        if (newIndex >= 0) {
+          vms[newIndex].starts += oldStarts;
+        }
       } else {
         // Update file info without reloading
         vm.fileSize = newSize;
@@ -1,497 +1,1353 @@
-#include "../include/ftp_server.h"
+// ftp_server.cpp
+#include "include/ftp_server.h"
+#include "include/vm_log.h"
+#include <WiFi.h>
 #include <FFat.h>
+#include <Preferences.h>
+#include <ff.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <lwip/sockets.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <atomic>
+#include <time.h>
 
-// Static member initialization
-WiFiServer FTPServer::controlServer(21);
-WiFiServer FTPServer::dataServer(2121);
-WiFiClient FTPServer::controlClient;
-WiFiClient FTPServer::dataClient;
-bool FTPServer::initialized = false;
-char FTPServer::cmdBuffer[256];
-char FTPServer::username[32] = "esp32";
-char FTPServer::password[32] = "esp32";
-bool FTPServer::loggedIn = false;
-bool FTPServer::dataMode = false;
-bool FTPServer::passiveMode = false;
-IPAddress FTPServer::dataIp;
-uint16_t FTPServer::dataPort = 0;
-unsigned long FTPServer::lastCmdTime = 0;
-
-void FTPServer::resetState() {
-    loggedIn = false;
-    dataMode = false;
-    passiveMode = false;
-    dataPort = 0;
-    cleanupDataConnection();
-    memset(cmdBuffer, 0, sizeof(cmdBuffer));
-}
-
-void FTPServer::cleanupDataConnection() {
-    if (dataClient) {
-        dataClient.stop();
-    }
-    // Always ensure data server is running for passive mode
-    dataServer.begin();
-}
-
-bool FTPServer::begin(const char* ssid, const char* password) {
-    if (initialized) {
-        return true;
-    }
-
-    // Connect to WiFi
-    WiFi.mode(WIFI_STA);
-    WiFi.begin(ssid, password);
-    
-    // Wait for connection
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-        delay(500);
-        Serial.print(".");
-        attempts++;
-    }
-    
-    if (WiFi.status() != WL_CONNECTED) {
-        Serial.println("\nWiFi connection failed");
-        return false;
-    }
-
-    Serial.println("\nWiFi connected");
-    Serial.print("IP address: ");
-    Serial.println(WiFi.localIP());
-
-    // Start FTP server
-    controlServer.begin();
-    dataServer.begin();
-    
-    Serial.println("FTP server started");
-    Serial.println("Username: esp32");
-    Serial.println("Password: esp32");
-    
-    initialized = true;
-    resetState();
-    return true;
+#define FTP_DEFAULT_CLUSTER_BYTES 4096  // If the FAT volume cannot be asked
+#define FTP_FLASH_POLL_MS 5             // Flash completions checked this often while other sessions stream
+
+enum DataMode : uint8_t {
+  DATA_NONE = 0,
+  DATA_PASSIVE,      // Listening for the client on pasvFd
+  DATA_ACTIVE,       // Connecting to the address from PORT
+};
+
+enum TransferKind : uint8_t {
+  TRANSFER_NONE = 0,
+  TRANSFER_LIST,
+  TRANSFER_NLST,
+  TRANSFER_MLSD,
+  TRANSFER_RETR,
+  TRANSFER_STOR,
+};
+
+enum SlotState : uint8_t {
+  SLOT_EMPTY = 0,    // Free to fill from the socket (STOR) or flash (RETR)
+  SLOT_FLASH,        // Handed to the flash task
+  SLOT_FULL,         // Holding data to send
+};
+
+struct IndexEntry {
+  uint32_t size;
+  time_t modified;
+  uint16_t name;                   // Offset into DirIndex::names
+  bool directory;
+};
+
+// The entries of one directory, read once and shared by every listing of it
+// until something in the directory changes
+struct DirIndex {
+  String path;
+  IndexEntry* entries;
+  char* names;
+  uint16_t count;
+  uint8_t readers;                 // Sessions sending a listing from it
+  bool cached;                     // Found by later listings; freed with its last reader otherwise
+  unsigned long lastUsed;
+};
+
+struct FtpSession {
+  int fd;                          // Control connection, -1 when free
+  char command[FTP_COMMAND_BYTES];
+  size_t commandLength;
+  bool discarding;                 // Skipping the rest of an overlong line
+  char reply[FTP_REPLY_BYTES];
+  size_t replyLength;
+  bool userOk;
+  bool loggedIn;
+  bool closing;                    // Close once the queued replies are sent
+  unsigned long lastActive;
+  String cwd;
+
+  DataMode dataMode;
+  int pasvFd;
+  sockaddr_in activeAddress;
+  int dataFd;
+  bool dataOpen;                   // Accepted, or the active connect completed
+  TransferKind transfer;
+  File file;
+  DirIndex* listing;
+  uint16_t listPosition;
+  String path;
+  uint8_t* buffers[2];             // Allocated for the duration of a transfer
+  size_t bufferSize;
+  size_t length[2];
+  SlotState state[2];
+  uint8_t current;                 // Buffer being filled from or sent to the socket
+  size_t offset;                   // Bytes of the current buffer already sent
+  uint8_t inFlight;                // Buffers the flash task has not returned yet
+  bool sourceDone;                 // End of the file, the listing or the upload reached
+  bool flashFailed;                // A write, or for RETR a read, returned an error
+  size_t bytes;
+  int64_t transferStartUs;
+  int64_t flashWaitUs;
+  unsigned long lastProgress;
+};
+
+// A buffer handed to the flash task and back. While a buffer is in flight,
+// the flash task owns it and the session's file.
+struct FlashJob {
+  FtpSession* session;
+  uint8_t slot;
+  int32_t result;                  // Bytes read or written, -1 on a failed write
+};
+
+// Everything here belongs to the FTP task
+static int listenFd = -1;
+static FtpSession sessions[FTP_MAX_SESSIONS];
+static TaskHandle_t ftpTask = nullptr;
+
+// Cached indexes, plus room for the ones dropped while still being sent
+static DirIndex indexes[FTP_INDEX_DIRS + FTP_MAX_SESSIONS];
+static uint32_t indexGeneration = 0;
+static std::atomic<uint32_t> listingGeneration(0);   // Bumped by ftpServerInvalidateListings()
+
+static TaskHandle_t flashTask = nullptr;
+static QueueHandle_t flashJobs = nullptr;
+static QueueHandle_t flashDone = nullptr;
+
+// Set once in ftpServerBegin()
+static size_t clusterBytes = FTP_DEFAULT_CLUSTER_BYTES;
+static std::atomic<uint32_t> bufferBytes(FTP_BUFFER_BYTES);
+
+static FtpStats stats = {};
+static SemaphoreHandle_t statsMutex = nullptr;
+
+static void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 }
 
-void FTPServer::handle() {
-    if (!initialized) return;
+static void closeFd(int& fd) {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
 
-    // Check for client timeout
-    if (controlClient && controlClient.connected()) {
-        if (millis() - lastCmdTime > CMD_TIMEOUT) {
-            Serial.println("Client timeout, disconnecting");
-            controlClient.stop();
-            resetState();
-            return;
-        }
-    }
+// === Control channel ===
 
-    // Handle disconnected control client
-    if (controlClient && !controlClient.connected()) {
-        Serial.println("Client disconnected");
-        controlClient.stop();
-        resetState();
-        return;
+static void flushReplies(FtpSession& s) {
+  while (s.replyLength > 0) {
+    int sent = send(s.fd, s.reply, s.replyLength, MSG_DONTWAIT);
+    if (sent <= 0) {
+      return;
     }
+    memmove(s.reply, s.reply + sent, s.replyLength - sent);
+    s.replyLength -= sent;
+  }
+}
 
-    // Accept new client if none connected
-    if (!controlClient || !controlClient.connected()) {
-        WiFiClient newClient = controlServer.available();
-        if (newClient) {
-            // If we somehow still have an old client, clean it up
-            if (controlClient) {
-                controlClient.stop();
-            }
-            controlClient = newClient;
-            Serial.println("New client connected");
-            resetState();
-            lastCmdTime = millis();
-            sendResponse(220, "ESP32 FTP Server ready");
-        }
-        return;
-    }
+static void replyRaw(FtpSession& s, const char* text) {
+  size_t length = strlen(text);
+  if (s.replyLength + length > sizeof(s.reply)) {
+    // Only a client that stopped reading gets here
+    s.closing = true;
+    return;
+  }
+  memcpy(s.reply + s.replyLength, text, length);
+  s.replyLength += length;
+  flushReplies(s);
+}
 
-    // Handle client commands
-    if (controlClient.available()) {
-        size_t len = controlClient.readBytesUntil('\n', cmdBuffer, sizeof(cmdBuffer));
-        if (len > 0) {
-            lastCmdTime = millis();
-            
-            // Clean up command string
-            if (len > 1 && cmdBuffer[len-2] == '\r') {
-                len -= 2;
-            } else if (cmdBuffer[len-1] == '\r') {
-                len -= 1;
-            }
-            cmdBuffer[len] = 0;
-            
-            Serial.printf("FTP CMD: %s\n", cmdBuffer);
-            processCommand();
-            memset(cmdBuffer, 0, sizeof(cmdBuffer));  // Clear buffer after processing
-        }
+static void reply(FtpSession& s, int code, const char* format, ...) {
+  char line[FTP_COMMAND_BYTES + 64];
+  int length = snprintf(line, sizeof(line), "%d ", code);
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line + length, sizeof(line) - length - 2, format, args);
+  va_end(args);
+  strcat(line, "\r\n");
+  replyRaw(s, line);
+}
+
+// Resolves argument against the working directory into an absolute path
+// without "." and ".." components; an empty argument is the directory itself
+static bool resolvePath(const FtpSession& s, const char* argument, String& path) {
+  String joined = argument[0] == '/' ? String(argument) : s.cwd + "/" + argument;
+  path = "";
+  int start = 0;
+  while (start <= (int)joined.length()) {
+    int end = joined.indexOf('/', start);
+    if (end < 0) {
+      end = joined.length();
+    }
+    String part = joined.substring(start, end);
+    if (part == "..") {
+      path.remove(max(path.lastIndexOf('/'), 0));
+    } else if (part.length() > 0 && part != ".") {
+      path += "/" + part;
     }
+    start = end + 1;
+  }
+  if (path.length() == 0) {
+    path = "/";
+  }
+  return path.length() < FTP_COMMAND_BYTES;
 }
 
-void FTPServer::sendResponse(int code, const char* message) {
-    char response[256];
-    snprintf(response, sizeof(response), "%d %s\r\n", code, message);
-    controlClient.print(response);
-    Serial.printf("FTP Response: %s", response);
+static String parentOf(const String& path) {
+  int slash = path.lastIndexOf('/');
+  return slash > 0 ? path.substring(0, slash) : String("/");
 }
 
-void FTPServer::processCommand() {
-    char cmd[5] = {0};
-    char arg[251] = {0};
-    
-    if (sscanf(cmdBuffer, "%4s %250s", cmd, arg) < 1) {
-        return;
-    }
+static bool isDirectory(const String& path) {
+  File file = FFat.open(path);
+  bool directory = file && file.isDirectory();
+  if (file) {
+    file.close();
+  }
+  return directory;
+}
 
-    if (strcmp(cmd, "USER") == 0) {
-        if (strcmp(arg, username) == 0) {
-            sendResponse(331, "Password required");
-        } else {
-            sendResponse(530, "Invalid username");
-        }
+// Whether another session is transferring path or something under it. With
+// writersOnly, only uploads count.
+static bool pathBusy(const FtpSession& self, const String& path, bool writersOnly) {
+  for (const FtpSession& other : sessions) {
+    if (&other == &self || other.fd < 0 || (other.transfer != TRANSFER_RETR && other.transfer != TRANSFER_STOR) ||
+        (writersOnly && other.transfer != TRANSFER_STOR)) {
+      continue;
     }
-    else if (strcmp(cmd, "PASS") == 0) {
-        if (strcmp(arg, password) == 0) {
-            loggedIn = true;
-            sendResponse(230, "Login successful");
-        } else {
-            sendResponse(530, "Invalid password");
-        }
+    if (other.path == path || other.path.startsWith(path == "/" ? path : path + "/")) {
+      return true;
     }
-    else if (!loggedIn) {
-        sendResponse(530, "Not logged in");
-    }
-    else if (strcmp(cmd, "AUTH") == 0) {
-        sendResponse(504, "Auth not supported");
-    }
-    else if (strcmp(cmd, "SYST") == 0) {
-        sendResponse(215, "UNIX Type: L8");
-    }
-    else if (strcmp(cmd, "FEAT") == 0) {
-        controlClient.println("211-Features:");
-        controlClient.println(" SIZE");
-        controlClient.println(" MDTM");
-        controlClient.println(" PORT");
-        controlClient.println(" PASV");
-        controlClient.println(" DELE");
-        controlClient.println(" CWD");
-        controlClient.println(" MKD");
-        controlClient.println(" RMD");
-        controlClient.println("211 End");
-    }
-    else if (strcmp(cmd, "PWD") == 0) {
-        sendResponse(257, "\"/\" is current directory");
-    }
-    else if (strcmp(cmd, "CWD") == 0) {
-        // We only support root directory, so any CWD is fine
-        sendResponse(250, "Directory changed to /");
-    }
-    else if (strcmp(cmd, "SIZE") == 0) {
-        String fname = arg;
-        if (!fname.startsWith("/")) {
-            fname = "/" + fname;
-        }
-        File file = FFat.open(fname.c_str(), "r");
-        if (!file) {
-            sendResponse(550, "File not found");
-        } else {
-            char sizeStr[32];
-            snprintf(sizeStr, sizeof(sizeStr), "%d", file.size());
-            sendResponse(213, sizeStr);
-            file.close();
-        }
+  }
+  return false;
+}
+
+// === Directory index ===
+
+static void freeIndex(DirIndex& index) {
+  free(index.entries);
+  free(index.names);
+  index.entries = nullptr;
+  index.names = nullptr;
+  index.count = 0;
+  index.path = String();
+}
+
+static void dropIndex(DirIndex& index) {
+  index.cached = false;
+  if (index.readers == 0) {
+    freeIndex(index);
+  }
+}
+
+static void releaseIndex(DirIndex* index) {
+  if (index && --index->readers == 0 && !index->cached) {
+    freeIndex(*index);
+  }
+}
+
+// Forgets the listing of directory, after something in it changed
+static void invalidateIndex(const String& directory) {
+  for (DirIndex& index : indexes) {
+    if (index.cached && index.path == directory) {
+      dropIndex(index);
+    }
+  }
+}
+
+// Reads the directory into index; false if it is missing or memory ran out
+static bool buildIndex(DirIndex& index, const String& path) {
+  File directory = FFat.open(path);
+  if (!directory || !directory.isDirectory()) {
+    if (directory) {
+      directory.close();
     }
-    else if (strcmp(cmd, "MKD") == 0) {
-        // We don't support directories, just pretend it worked
-        sendResponse(257, "Directory created");
+    return false;
+  }
+
+  size_t capacity = 0, namesCapacity = 0, namesLength = 0;
+  bool ok = true;
+  for (File entry = directory.openNextFile(); entry && ok; entry = directory.openNextFile()) {
+    const char* name = strrchr(entry.name(), '/') ? strrchr(entry.name(), '/') + 1 : entry.name();
+    size_t nameLength = strlen(name) + 1;
+    // Uploads in progress are not listed
+    if (nameLength > 6 && strcmp(name + nameLength - 6, ".part") == 0) {
+      entry.close();
+      continue;
     }
-    else if (strcmp(cmd, "RMD") == 0) {
-        // We don't support directories, just pretend it worked
-        sendResponse(250, "Directory removed");
+
+    if (index.count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      IndexEntry* grown = (IndexEntry*)realloc(index.entries, capacity * sizeof(IndexEntry));
+      ok = grown && capacity <= UINT16_MAX;
+      index.entries = grown ? grown : index.entries;
     }
-    else if (strcmp(cmd, "TYPE") == 0) {
-        sendResponse(200, "Type set to I");
+    if (ok && namesLength + nameLength > namesCapacity) {
+      namesCapacity = max(namesCapacity * 2, namesLength + nameLength + 256);
+      char* grown = (char*)realloc(index.names, namesCapacity);
+      ok = grown && namesCapacity <= UINT16_MAX;
+      index.names = grown ? grown : index.names;
     }
-    else if (strcmp(cmd, "PORT") == 0) {
-        handlePORT();
+    if (ok) {
+      IndexEntry& e = index.entries[index.count++];
+      e.directory = entry.isDirectory();
+      e.size = e.directory ? 0 : entry.size();
+      e.modified = entry.getLastWrite();
+      e.name = namesLength;
+      memcpy(index.names + namesLength, name, nameLength);
+      namesLength += nameLength;
     }
-    else if (strcmp(cmd, "PASV") == 0) {
-        handlePASV();
+    entry.close();
+  }
+  directory.close();
+
+  if (!ok) {
+    freeIndex(index);
+    return false;
+  }
+  index.path = path;
+  return true;
+}
+
+// Returns the index of the directory, building it if it is not cached; the
+// caller releases it with releaseIndex()
+static DirIndex* acquireIndex(const String& path) {
+  uint32_t generation = listingGeneration.load();
+  if (generation != indexGeneration) {
+    indexGeneration = generation;
+    for (DirIndex& index : indexes) {
+      if (index.cached) {
+        dropIndex(index);
+      }
     }
-    else if (strcmp(cmd, "LIST") == 0) {
-        handleLIST();
+  }
+
+  DirIndex* oldest = nullptr;
+  int cachedCount = 0;
+  for (DirIndex& index : indexes) {
+    if (!index.cached) {
+      continue;
     }
-    else if (strcmp(cmd, "RETR") == 0) {
-        handleRETR(arg);
+    if (index.path == path) {
+      index.readers++;
+      index.lastUsed = millis();
+      return &index;
     }
-    else if (strcmp(cmd, "STOR") == 0) {
-        handleSTOR(arg);
+    cachedCount++;
+    if (!oldest || (long)(index.lastUsed - oldest->lastUsed) < 0) {
+      oldest = &index;
     }
-    else if (strcmp(cmd, "DELE") == 0) {
-        handleDELE(arg);
+  }
+  if (cachedCount == FTP_INDEX_DIRS) {
+    dropIndex(*oldest);
+  }
+
+  // Each session holds at most one index, so a free slot is always left
+  for (DirIndex& index : indexes) {
+    if (!index.cached && index.readers == 0) {
+      if (!buildIndex(index, path)) {
+        return nullptr;
+      }
+      index.cached = true;
+      index.readers = 1;
+      index.lastUsed = millis();
+      return &index;
     }
-    else if (strcmp(cmd, "QUIT") == 0) {
-        sendResponse(221, "Goodbye");
-        controlClient.stop();
-        if (dataClient) dataClient.stop();
+  }
+  return nullptr;
+}
+
+// === Flash pipeline ===
+
+static void flashTaskLoop(void* parameter) {
+  FlashJob job;
+  while (true) {
+    if (xQueueReceive(flashJobs, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
     }
-    else {
-        Serial.printf("Unknown command: %s\n", cmd);
-        sendResponse(500, "Unknown command");
+    FtpSession& s = *job.session;
+    uint8_t* buffer = s.buffers[job.slot];
+    if (s.transfer == TRANSFER_STOR) {
+      size_t length = s.length[job.slot];
+      job.result = s.file.write(buffer, length) == length ? (int32_t)length : -1;
+    } else {
+      job.result = s.file.read(buffer, s.bufferSize);
     }
+    xQueueSend(flashDone, &job, portMAX_DELAY);
+  }
 }
 
-void FTPServer::handlePORT() {
-    int ip[4], port[2];
-    if (sscanf(cmdBuffer, "PORT %d,%d,%d,%d,%d,%d",
-               &ip[0], &ip[1], &ip[2], &ip[3], &port[0], &port[1]) != 6) {
-        sendResponse(501, "Invalid PORT command");
-        return;
+static void submitFlash(FtpSession& s, uint8_t slot) {
+  FlashJob job = { &s, slot, 0 };
+  s.state[slot] = SLOT_FLASH;
+  s.inFlight++;
+  xQueueSend(flashJobs, &job, portMAX_DELAY);
+}
+
+static void completeFlash(const FlashJob& job) {
+  FtpSession& s = *job.session;
+  s.inFlight--;
+  s.lastProgress = millis();
+  s.flashFailed |= job.result < 0;
+  if (s.transfer == TRANSFER_STOR) {
+    s.length[job.slot] = 0;
+    s.state[job.slot] = SLOT_EMPTY;
+  } else {
+    // Reads are served in order, so the first short one is the end of the
+    // file; a failed one ends it too, and serviceData() aborts the transfer
+    s.length[job.slot] = job.result > 0 ? job.result : 0;
+    s.state[job.slot] = SLOT_FULL;
+    s.sourceDone |= job.result < (int32_t)s.bufferSize;
+  }
+}
+
+// Handles finished flash jobs, waiting up to wait ticks for the first one
+static void pollFlash(TickType_t wait) {
+  FlashJob job;
+  while (xQueueReceive(flashDone, &job, wait) == pdTRUE) {
+    completeFlash(job);
+    wait = 0;
+  }
+}
+
+// The file and buffers must not be touched while the flash task has them
+static void drainFlash(FtpSession& s) {
+  while (s.inFlight > 0) {
+    pollFlash(portMAX_DELAY);
+  }
+}
+
+// 0 if bytes rounded up is out of range
+static size_t roundToClusters(size_t bytes) {
+  size_t rounded = (bytes + clusterBytes - 1) / clusterBytes * clusterBytes;
+  return rounded <= FTP_MAX_BUFFER_BYTES ? rounded : 0;
+}
+
+static size_t readClusterBytes() {
+  FATFS* fs;
+  DWORD freeClusters;
+  if (f_getfree("0:", &freeClusters, &fs) != FR_OK) {
+    return FTP_DEFAULT_CLUSTER_BYTES;
+  }
+#if FF_MAX_SS != FF_MIN_SS
+  return (size_t)fs->csize * fs->ssize;
+#else
+  return (size_t)fs->csize * FF_MAX_SS;
+#endif
+}
+
+// === Data channel ===
+
+static void recordTransfer(FtpSession& s, bool succeeded) {
+  int64_t elapsedUs = s.dataOpen ? esp_timer_get_time() - s.transferStartUs : 0;
+  bool upload = s.transfer == TRANSFER_STOR;
+  if (succeeded) {
+    unsigned long rate = elapsedUs > 0 ? (uint64_t)s.bytes * 1000000 / elapsedUs / 1024 : 0;
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "FTP: %s %s, %lu bytes in %lu ms (%lu KB/s, flash wait %lu ms)",
+      upload ? "stored" : "sent", s.path.c_str(), (unsigned long)s.bytes, (unsigned long)(elapsedUs / 1000), rate,
+      (unsigned long)(s.flashWaitUs / 1000));
+  }
+
+  xSemaphoreTake(statsMutex, portMAX_DELAY);
+  if (!succeeded) {
+    stats.failed++;
+  } else if (upload) {
+    stats.uploads++;
+    stats.uploadBytes += s.bytes;
+    stats.uploadUs += elapsedUs;
+  } else {
+    stats.downloads++;
+    stats.downloadBytes += s.bytes;
+    stats.downloadUs += elapsedUs;
+  }
+  stats.flashWaitUs += s.flashWaitUs;
+  xSemaphoreGive(statsMutex);
+}
+
+static void endTransfer(FtpSession& s, bool succeeded) {
+  drainFlash(s);
+  if (s.file) {
+    s.file.close();
+  }
+  releaseIndex(s.listing);
+  s.listing = nullptr;
+  if (s.transfer == TRANSFER_STOR) {
+    String part = s.path + ".part";
+    bool replaced = succeeded && (!FFat.exists(s.path) || FFat.remove(s.path)) && FFat.rename(part, s.path);
+    if (!replaced) {
+      FFat.remove(part);
+      succeeded = false;
     }
+    invalidateIndex(parentOf(s.path));
+  }
+  if (s.transfer == TRANSFER_STOR || s.transfer == TRANSFER_RETR) {
+    recordTransfer(s, succeeded);
+  }
+  for (int i = 0; i < 2; i++) {
+    free(s.buffers[i]);
+    s.buffers[i] = nullptr;
+  }
+  closeFd(s.dataFd);
+  closeFd(s.pasvFd);
+  s.dataMode = DATA_NONE;
+  s.dataOpen = false;
+  s.transfer = TRANSFER_NONE;
+  s.path = String();
+  s.lastActive = millis();
+}
 
-    dataIp = IPAddress(ip[0], ip[1], ip[2], ip[3]);
-    dataPort = (port[0] << 8) | port[1];
-    
-    Serial.printf("Active Mode - IP: %s, Port: %d\n", 
-                 dataIp.toString().c_str(), dataPort);
-    
-    passiveMode = false;
-    dataMode = true;
-    sendResponse(200, "PORT command successful");
-}
-
-void FTPServer::handlePASV() {
-    cleanupDataConnection();
-    
-    // Stop any existing data server and restart it
-    dataServer.end();
-    delay(100);  // Give some time for the socket to close
-    dataServer.begin();
-    
-    IPAddress ip = WiFi.localIP();
-    int port = 2121;
-    
-    char response[64];
-    snprintf(response, sizeof(response), "Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
-             ip[0], ip[1], ip[2], ip[3], port >> 8, port & 255);
-    
-    passiveMode = true;
-    dataMode = true;
-    Serial.printf("PASV: Listening on %s:%d\n", ip.toString().c_str(), port);
-    sendResponse(227, response);
-}
-
-bool FTPServer::connectToClient() {
-    if (passiveMode) {
-        Serial.println("Waiting for passive connection...");
-        unsigned long timeout = millis() + 5000;
-        while (!dataClient && millis() < timeout) {
-            dataClient = dataServer.available();
-            if (!dataClient) {
-                delay(1);
-            } else {
-                Serial.printf("Passive client connected from %s:%d\n", 
-                    dataClient.remoteIP().toString().c_str(), 
-                    dataClient.remotePort());
-                return true;
-            }
-        }
-        Serial.println("Passive connection timeout");
-        return false;
-    } else {
-        Serial.printf("Connecting to client %s:%d\n", dataIp.toString().c_str(), dataPort);
-        bool result = dataClient.connect(dataIp, dataPort);
-        if (result) {
-            Serial.println("Active connection established");
-        } else {
-            Serial.println("Active connection failed");
-        }
-        return result;
+static void finishTransfer(FtpSession& s, bool succeeded, int code, const char* text) {
+  endTransfer(s, succeeded);
+  reply(s, code, "%s", text);
+}
+
+static void dataOpened(FtpSession& s) {
+  s.dataOpen = true;
+  s.transferStartUs = esp_timer_get_time();
+  s.lastProgress = millis();
+}
+
+static void startTransfer(FtpSession& s, TransferKind kind) {
+  if (s.dataMode == DATA_NONE) {
+    reply(s, 425, "Use PORT or PASV first");
+    return;
+  }
+
+  s.transfer = kind;
+  s.bufferSize = bufferBytes.load();
+  for (int i = 0; i < 2; i++) {
+    // Internal RAM: the flash driver would copy a PSRAM buffer through a
+    // bounce buffer first
+    s.buffers[i] = (uint8_t*)heap_caps_malloc(s.bufferSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    s.length[i] = 0;
+    s.state[i] = SLOT_EMPTY;
+  }
+  if (!s.buffers[0] || !s.buffers[1]) {
+    reply(s, 451, "Not enough memory for the transfer");
+    endTransfer(s, false);
+    return;
+  }
+  s.current = 0;
+  s.offset = 0;
+  s.inFlight = 0;
+  s.sourceDone = false;
+  s.flashFailed = false;
+  s.bytes = 0;
+  s.flashWaitUs = 0;
+  s.lastProgress = millis();
+
+  if (s.dataMode == DATA_ACTIVE) {
+    s.dataFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s.dataFd < 0) {
+      reply(s, 425, "Can't open data connection");
+      endTransfer(s, false);
+      return;
+    }
+    setNonBlocking(s.dataFd);
+    if (connect(s.dataFd, (sockaddr*)&s.activeAddress, sizeof(s.activeAddress)) == 0) {
+      dataOpened(s);
+    } else if (errno != EINPROGRESS) {
+      reply(s, 425, "Can't open data connection");
+      endTransfer(s, false);
+      return;
     }
+  }
+
+  // Read ahead while the data connection is still being set up
+  if (kind == TRANSFER_RETR) {
+    submitFlash(s, 0);
+    submitFlash(s, 1);
+  }
+  reply(s, 150, "Opening data connection");
 }
 
-void FTPServer::handleLIST() {
-    sendResponse(150, "Opening data connection");
-    
-    if (!connectToClient()) {
-        sendResponse(425, "Can't open data connection");
-        return;
+static void openPassive(FtpSession& s) {
+  endTransfer(s, false);
+
+  // An ephemeral port per PASV, so a new listener never waits for the old
+  // one to close
+  s.pasvFd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t length = sizeof(address);
+  if (s.pasvFd < 0 || bind(s.pasvFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(s.pasvFd, 1) != 0 ||
+      getsockname(s.pasvFd, (sockaddr*)&address, &length) != 0) {
+    closeFd(s.pasvFd);
+    reply(s, 425, "Can't open passive connection");
+    return;
+  }
+  setNonBlocking(s.pasvFd);
+  s.dataMode = DATA_PASSIVE;
+}
+
+// "Mar  5 14:02" for the last six months, "Mar  5  2023" otherwise, like ls
+static void formatListTime(time_t modified, char* out, size_t size) {
+  struct tm parts;
+  gmtime_r(&modified, &parts);
+  time_t now = time(nullptr);
+  bool recent = modified <= now + 3600 && now - modified < 180L * 24 * 3600;
+  strftime(out, size, recent ? "%b %e %H:%M" : "%b %e  %Y", &parts);
+}
+
+// RFC 3659 time-val, always UTC
+static void formatFactTime(time_t modified, char* out, size_t size) {
+  struct tm parts;
+  gmtime_r(&modified, &parts);
+  strftime(out, size, "%Y%m%d%H%M%S", &parts);
+}
+
+static int formatEntry(TransferKind kind, const IndexEntry& entry, const char* name, char* line, size_t size) {
+  char date[20];
+  if (kind == TRANSFER_NLST) {
+    return snprintf(line, size, "%s\r\n", name);
+  }
+  if (kind == TRANSFER_MLSD) {
+    formatFactTime(entry.modified, date, sizeof(date));
+    if (entry.directory) {
+      return snprintf(line, size, "type=dir;modify=%s; %s\r\n", date, name);
     }
-    
-    File root = FFat.open("/");
-    if (!root || !root.isDirectory()) {
-        sendResponse(550, "Failed to open directory");
-        cleanupDataConnection();
-        return;
+    return snprintf(line, size, "type=file;size=%lu;modify=%s; %s\r\n", (unsigned long)entry.size, date, name);
+  }
+  formatListTime(entry.modified, date, sizeof(date));
+  return snprintf(line, size, "%s 1 root root %13lu %s %s\r\n", entry.directory ? "drwxr-xr-x" : "-rw-r--r--",
+    (unsigned long)entry.size, date, name);
+}
+
+// Fills buffer with the next listing lines; 0 once the directory is done
+static size_t fillListing(FtpSession& s, uint8_t* buffer) {
+  size_t filled = 0;
+  char line[FTP_COMMAND_BYTES + 64];
+  while (filled + sizeof(line) <= s.bufferSize && s.listPosition < s.listing->count) {
+    const IndexEntry& entry = s.listing->entries[s.listPosition++];
+    int length = formatEntry(s.transfer, entry, s.listing->names + entry.name, line, sizeof(line));
+    length = min(length, (int)sizeof(line) - 1);
+    memcpy(buffer + filled, line, length);
+    filled += length;
+  }
+  return filled;
+}
+
+// Whether the transfer can make progress on the data socket right now
+static bool wantsSocket(const FtpSession& s) {
+  if (s.transfer == TRANSFER_STOR) {
+    return !s.sourceDone && s.state[s.current] == SLOT_EMPTY;
+  }
+  return s.state[s.current] == SLOT_FULL || s.transfer != TRANSFER_RETR;
+}
+
+static void sendData(FtpSession& s) {
+  uint8_t slot = s.current;
+  int sent = send(s.dataFd, s.buffers[slot] + s.offset, s.length[slot] - s.offset, MSG_DONTWAIT);
+  if (sent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      finishTransfer(s, false, 426, "Connection closed; transfer aborted");
     }
-    
-    File file = root.openNextFile();
-    while (file) {
-        char fileInfo[512];
-        String filename = file.name();
-        if (filename.startsWith("/")) {
-            filename = filename.substring(1);
-        }
-        
-        if (file.isDirectory()) {
-            snprintf(fileInfo, sizeof(fileInfo),
-                "drwxr-xr-x 1 root root %13s Jan 1 2025 %s\r\n",
-                "4096",
-                filename.c_str());
-        } else {
-            snprintf(fileInfo, sizeof(fileInfo),
-                "-rw-r--r-- 1 root root %13d Jan 1 2025 %s\r\n",
-                file.size(),
-                filename.c_str());
-        }
-        dataClient.print(fileInfo);
-        file = root.openNextFile();
+    return;
+  }
+
+  s.offset += sent;
+  s.bytes += sent;
+  s.lastProgress = millis();
+  if (s.offset == s.length[slot]) {
+    s.offset = 0;
+    s.length[slot] = 0;
+    s.state[slot] = SLOT_EMPTY;
+    if (s.transfer == TRANSFER_RETR && !s.sourceDone) {
+      submitFlash(s, slot);
     }
-    
-    root.close();
-    cleanupDataConnection();
-    sendResponse(226, "Transfer complete");
+    s.current ^= 1;
+  }
 }
 
-void FTPServer::handleRETR(const char* filename) {
-    if (!dataMode) {
-        sendResponse(425, "Use PORT or PASV first");
-        return;
+static void receiveData(FtpSession& s) {
+  uint8_t slot = s.current;
+  int length = recv(s.dataFd, s.buffers[slot] + s.length[slot], s.bufferSize - s.length[slot], MSG_DONTWAIT);
+  if (length > 0) {
+    s.length[slot] += length;
+    s.bytes += length;
+    s.lastProgress = millis();
+    // Only whole buffers go to flash until the end, so writes stay cluster-aligned
+    if (s.length[slot] == s.bufferSize) {
+      submitFlash(s, slot);
+      s.current ^= 1;
     }
-    
-    String fname = filename;
-    if (!fname.startsWith("/")) {
-        fname = "/" + fname;
-    }
-    
-    Serial.printf("Preparing to send file: %s\n", fname.c_str());
-    
-    File file = FFat.open(fname.c_str(), "r");
-    if (!file) {
-        Serial.println("File not found");
-        sendResponse(550, "File not found");
-        return;
+  } else if (length == 0) {
+    // The client closes the data connection to mark the end of the file
+    s.sourceDone = true;
+    if (s.length[slot] > 0) {
+      submitFlash(s, slot);
     }
-    
-    sendResponse(150, "Opening data connection for file transfer");
-    
-    if (!connectToClient()) {
-        Serial.println("Data connection failed");
-        sendResponse(425, "Can't open data connection");
-        file.close();
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    finishTransfer(s, false, 426, "Connection closed; transfer aborted");
+  }
+}
+
+static void serviceData(FtpSession& s, bool readable, bool writable, bool listenerReady) {
+  if (!s.dataOpen) {
+    if (s.dataMode == DATA_PASSIVE && listenerReady) {
+      s.dataFd = accept(s.pasvFd, nullptr, nullptr);
+      if (s.dataFd >= 0) {
+        setNonBlocking(s.dataFd);
+        closeFd(s.pasvFd);
+        dataOpened(s);
+      }
+    } else if (s.dataMode == DATA_ACTIVE && writable) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(s.dataFd, SOL_SOCKET, SO_ERROR, &error, &length);
+      if (error) {
+        finishTransfer(s, false, 425, "Can't open data connection");
         return;
+      }
+      dataOpened(s);
     }
-    
-    Serial.printf("Starting file transfer, size: %d bytes\n", file.size());
-    uint8_t buf[1024];
-    size_t totalSent = 0;
-    
-    while (file.available()) {
-        size_t len = file.read(buf, sizeof(buf));
-        if (len > 0) {
-            size_t sent = dataClient.write(buf, len);
-            totalSent += sent;
-            if (sent != len) {
-                Serial.println("Send error - connection broken?");
-                break;
-            }
-        }
+    return;
+  }
+
+  if (s.transfer == TRANSFER_STOR) {
+    if (s.flashFailed) {
+      vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "FTP: write to %s failed", s.path.c_str());
+      finishTransfer(s, false, 452, "Write failed; disk full?");
+    } else if (s.sourceDone && s.inFlight == 0) {
+      finishTransfer(s, true, 226, "Transfer complete");
+    } else if (readable && wantsSocket(s)) {
+      receiveData(s);
     }
-    
+    return;
+  }
+
+  if (s.flashFailed) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "FTP: read from %s failed", s.path.c_str());
+    finishTransfer(s, false, 451, "Read failed; transfer aborted");
+    return;
+  }
+
+  uint8_t slot = s.current;
+  if (s.state[slot] == SLOT_EMPTY && s.transfer != TRANSFER_RETR && !s.sourceDone) {
+    // Listings are short, so they are generated right here
+    s.length[slot] = fillListing(s, s.buffers[slot]);
+    s.sourceDone = s.length[slot] == 0;
+    s.state[slot] = s.sourceDone ? SLOT_EMPTY : SLOT_FULL;
+  }
+  if (s.state[slot] == SLOT_EMPTY && s.sourceDone && s.inFlight == 0) {
+    finishTransfer(s, true, 226, "Transfer complete");
+  } else if (writable && wantsSocket(s)) {
+    sendData(s);
+  }
+}
+
+// === Commands ===
+
+static void handlePort(FtpSession& s, const char* argument) {
+  unsigned int ip[4], port[2];
+  if (sscanf(argument, "%u,%u,%u,%u,%u,%u", &ip[0], &ip[1], &ip[2], &ip[3], &port[0], &port[1]) != 6) {
+    reply(s, 501, "Invalid PORT command");
+    return;
+  }
+  endTransfer(s, false);
+  s.activeAddress = {};
+  s.activeAddress.sin_family = AF_INET;
+  s.activeAddress.sin_port = htons((port[0] << 8) | port[1]);
+  s.activeAddress.sin_addr.s_addr = htonl(ip[0] << 24 | ip[1] << 16 | ip[2] << 8 | ip[3]);
+  s.dataMode = DATA_ACTIVE;
+  reply(s, 200, "PORT command successful");
+}
+
+static void handlePasv(FtpSession& s, bool extended) {
+  openPassive(s);
+  if (s.dataMode != DATA_PASSIVE) {
+    return;
+  }
+  sockaddr_in address;
+  socklen_t length = sizeof(address);
+  getsockname(s.pasvFd, (sockaddr*)&address, &length);
+  uint16_t port = ntohs(address.sin_port);
+  if (extended) {
+    reply(s, 229, "Entering Extended Passive Mode (|||%u|)", port);
+    return;
+  }
+  // The address the client reached us on, which is the one it can connect to
+  length = sizeof(address);
+  getsockname(s.fd, (sockaddr*)&address, &length);
+  uint32_t ip = ntohl(address.sin_addr.s_addr);
+  reply(s, 227, "Entering Passive Mode (%lu,%lu,%lu,%lu,%u,%u)", (unsigned long)(ip >> 24),
+    (unsigned long)((ip >> 16) & 255), (unsigned long)((ip >> 8) & 255), (unsigned long)(ip & 255), port >> 8, port & 255);
+}
+
+// LIST, NLST and MLSD; LIST options such as -la are ignored
+static void handleListing(FtpSession& s, TransferKind kind, const char* argument) {
+  while (kind == TRANSFER_LIST && argument[0] == '-') {
+    argument = strchr(argument, ' ') ? strchr(argument, ' ') + 1 : "";
+  }
+  String path;
+  if (!resolvePath(s, argument, path) || !(s.listing = acquireIndex(path))) {
+    reply(s, 550, "Directory not found");
+    return;
+  }
+  s.listPosition = 0;
+  startTransfer(s, kind);
+  if (s.transfer == TRANSFER_NONE) {
+    releaseIndex(s.listing);
+    s.listing = nullptr;
+  }
+}
+
+static void handleRetr(FtpSession& s, const char* argument) {
+  String path;
+  if (!argument[0] || !resolvePath(s, argument, path) || !(s.file = FFat.open(path, "r")) || s.file.isDirectory()) {
+    if (s.file) {
+      s.file.close();
+    }
+    reply(s, 550, "File not found");
+    return;
+  }
+  if (pathBusy(s, path, true)) {
+    s.file.close();
+    reply(s, 450, "File is being uploaded");
+    return;
+  }
+  s.path = path;
+  startTransfer(s, TRANSFER_RETR);
+  if (s.transfer == TRANSFER_NONE && s.file) {
+    s.file.close();
+    s.path = String();
+  }
+}
+
+static void handleStor(FtpSession& s, const char* argument) {
+  String path;
+  if (!argument[0] || !resolvePath(s, argument, path) || path == "/" || path.endsWith(".part")) {
+    reply(s, 553, "Invalid file name");
+    return;
+  }
+  if (s.dataMode == DATA_NONE) {
+    reply(s, 425, "Use PORT or PASV first");
+    return;
+  }
+  if (pathBusy(s, path, false)) {
+    reply(s, 450, "File is in use");
+    return;
+  }
+  s.file = FFat.open(path + ".part", "w");
+  if (!s.file) {
+    reply(s, 553, "Could not create file");
+    return;
+  }
+  s.path = path;
+  startTransfer(s, TRANSFER_STOR);
+}
+
+static void handleSize(FtpSession& s, const char* argument) {
+  String path;
+  File file;
+  if (!resolvePath(s, argument, path) || !(file = FFat.open(path, "r")) || file.isDirectory()) {
+    reply(s, 550, "File not found");
+  } else {
+    reply(s, 213, "%lu", (unsigned long)file.size());
+  }
+  if (file) {
     file.close();
-    cleanupDataConnection();
-    
-    Serial.printf("Transfer complete, %d bytes sent\n", totalSent);
-    sendResponse(226, "Transfer complete");
+  }
 }
 
-void FTPServer::handleSTOR(const char* filename) {
-    if (!dataMode) {
-        sendResponse(425, "Use PORT or PASV first");
-        return;
+// MDTM and MLST
+static void handleStat(FtpSession& s, const char* argument, bool facts) {
+  String path;
+  File file;
+  if (!resolvePath(s, argument, path) || !(file = FFat.open(path, "r")) || (!facts && file.isDirectory())) {
+    reply(s, 550, "File not found");
+    if (file) {
+      file.close();
     }
-    
-    String fname = filename;
-    if (!fname.startsWith("/")) {
-        fname = "/" + fname;
-    }
-    
-    Serial.printf("Preparing to receive file: %s\n", fname.c_str());
-    
-    File file = FFat.open(fname.c_str(), "w");
-    if (!file) {
-        Serial.println("Failed to create file");
-        sendResponse(553, "Could not create file");
-        return;
+    return;
+  }
+
+  IndexEntry entry = { 0, file.getLastWrite(), 0, file.isDirectory() };
+  entry.size = entry.directory ? 0 : file.size();
+  file.close();
+  if (!facts) {
+    char date[20];
+    formatFactTime(entry.modified, date, sizeof(date));
+    reply(s, 213, "%s", date);
+    return;
+  }
+
+  char line[FTP_COMMAND_BYTES + 64];
+  replyRaw(s, "250- Listing\r\n ");
+  formatEntry(TRANSFER_MLSD, entry, path.c_str(), line, sizeof(line));
+  replyRaw(s, line);
+  reply(s, 250, "End");
+}
+
+static void handleCwd(FtpSession& s, const char* argument) {
+  String path;
+  if (!resolvePath(s, argument, path) || !isDirectory(path)) {
+    reply(s, 550, "Directory not found");
+    return;
+  }
+  s.cwd = path == "/" ? String() : path;
+  reply(s, 250, "Directory changed to %s", path.c_str());
+}
+
+static void handleMkd(FtpSession& s, const char* argument) {
+  String path;
+  if (!argument[0] || !resolvePath(s, argument, path) || FFat.exists(path)) {
+    reply(s, 550, "Already exists or invalid name");
+  } else if (FFat.mkdir(path)) {
+    invalidateIndex(parentOf(path));
+    reply(s, 257, "\"%s\" created", path.c_str());
+  } else {
+    reply(s, 550, "Cannot create directory");
+  }
+}
+
+static void handleRmd(FtpSession& s, const char* argument) {
+  String path;
+  if (!argument[0] || !resolvePath(s, argument, path) || path == "/" || !isDirectory(path)) {
+    reply(s, 550, "Directory not found");
+  } else if (pathBusy(s, path, false)) {
+    reply(s, 450, "Directory is in use");
+  } else if (FFat.rmdir(path)) {
+    invalidateIndex(parentOf(path));
+    invalidateIndex(path);
+    reply(s, 250, "Directory removed");
+  } else {
+    reply(s, 550, "Directory not empty");
+  }
+}
+
+static void handleDele(FtpSession& s, const char* argument) {
+  String path;
+  if (!argument[0] || !resolvePath(s, argument, path) || !FFat.exists(path)) {
+    reply(s, 550, "File not found");
+  } else if (isDirectory(path)) {
+    reply(s, 550, "Is a directory; use RMD");
+  } else if (pathBusy(s, path, false)) {
+    reply(s, 450, "File is in use");
+  } else if (FFat.remove(path)) {
+    invalidateIndex(parentOf(path));
+    reply(s, 250, "File deleted successfully");
+  } else {
+    reply(s, 450, "Failed to delete file");
+  }
+}
+
+static void processCommand(FtpSession& s, char* line) {
+  char* argument = strchr(line, ' ');
+  if (argument) {
+    *argument++ = '\0';
+  } else {
+    argument = line + strlen(line);
+  }
+  for (char* c = line; *c; c++) {
+    *c = toupper(*c);
+  }
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_DEBUG, "FTP CMD: %s", strcmp(line, "PASS") == 0 ? "PASS ****" : line);
+
+  if (strcmp(line, "USER") == 0) {
+    s.userOk = strcmp(argument, FTP_USERNAME) == 0;
+    s.loggedIn = false;
+    reply(s, 331, "Password required");
+  } else if (strcmp(line, "PASS") == 0) {
+    s.loggedIn = s.userOk && strcmp(argument, FTP_PASSWORD) == 0;
+    if (s.loggedIn) {
+      reply(s, 230, "Login successful");
+    } else {
+      reply(s, 530, "Login incorrect");
     }
-    
-    sendResponse(150, "Opening data connection for file transfer");
-    
-    if (!connectToClient()) {
-        Serial.println("Data connection failed");
-        sendResponse(425, "Can't open data connection");
-        file.close();
-        return;
+  } else if (strcmp(line, "QUIT") == 0) {
+    reply(s, 221, "Goodbye");
+    s.closing = true;
+  } else if (strcmp(line, "NOOP") == 0) {
+    reply(s, 200, "OK");
+  } else if (strcmp(line, "AUTH") == 0) {
+    reply(s, 504, "Auth not supported");
+  } else if (!s.loggedIn) {
+    reply(s, 530, "Not logged in");
+  } else if (strcmp(line, "SYST") == 0) {
+    reply(s, 215, "UNIX Type: L8");
+  } else if (strcmp(line, "FEAT") == 0) {
+    replyRaw(s, "211-Features:\r\n SIZE\r\n MDTM\r\n MLST type*;size*;modify*;\r\n PASV\r\n EPSV\r\n UTF8\r\n211 End\r\n");
+  } else if (strcmp(line, "OPTS") == 0) {
+    // Names are passed through as bytes, so UTF-8 needs no switching
+    if (strncasecmp(argument, "UTF8", 4) == 0) {
+      reply(s, 200, "UTF8 is always on");
+    } else {
+      reply(s, 501, "Option not supported");
+    }
+  } else if (strcmp(line, "PWD") == 0) {
+    reply(s, 257, "\"%s\" is current directory", s.cwd.length() ? s.cwd.c_str() : "/");
+  } else if (strcmp(line, "CWD") == 0) {
+    handleCwd(s, argument);
+  } else if (strcmp(line, "CDUP") == 0) {
+    handleCwd(s, "..");
+  } else if (strcmp(line, "MKD") == 0) {
+    handleMkd(s, argument);
+  } else if (strcmp(line, "RMD") == 0) {
+    handleRmd(s, argument);
+  } else if (strcmp(line, "TYPE") == 0) {
+    reply(s, 200, "Type set to I");
+  } else if (strcmp(line, "PORT") == 0) {
+    handlePort(s, argument);
+  } else if (strcmp(line, "PASV") == 0 || strcmp(line, "EPSV") == 0) {
+    handlePasv(s, line[0] == 'E');
+  } else if (strcmp(line, "LIST") == 0) {
+    handleListing(s, TRANSFER_LIST, argument);
+  } else if (strcmp(line, "NLST") == 0) {
+    handleListing(s, TRANSFER_NLST, argument);
+  } else if (strcmp(line, "MLSD") == 0) {
+    handleListing(s, TRANSFER_MLSD, argument);
+  } else if (strcmp(line, "MLST") == 0) {
+    handleStat(s, argument, true);
+  } else if (strcmp(line, "MDTM") == 0) {
+    handleStat(s, argument, false);
+  } else if (strcmp(line, "RETR") == 0) {
+    handleRetr(s, argument);
+  } else if (strcmp(line, "STOR") == 0) {
+    handleStor(s, argument);
+  } else if (strcmp(line, "SIZE") == 0) {
+    handleSize(s, argument);
+  } else if (strcmp(line, "DELE") == 0) {
+    handleDele(s, argument);
+  } else if (strcmp(line, "ABOR") == 0) {
+    reply(s, 225, "No transfer to abort");
+  } else {
+    reply(s, 502, "Command not implemented");
+  }
+}
+
+// Skips the Telnet IP and Synch sequences (IAC IP IAC DM) that clients send
+// ahead of ABOR, RFC 959 section 4.1.3
+static char* skipTelnet(char* line) {
+  while ((uint8_t)line[0] == 0xFF && line[1] && line[1] != '\n') {
+    line += 2;
+  }
+  return line;
+}
+
+// During a transfer, finds an ABOR among the buffered lines, takes it out
+// and aborts. Lines before it stay queued. Returns true if it aborted.
+static bool takeAbort(FtpSession& s) {
+  char* line = s.command;
+  char* end = s.command + s.commandLength;
+  char* newline;
+  // While discarding, the first line is the tail of one that was too long
+  bool skip = s.discarding;
+  while ((newline = (char*)memchr(line, '\n', end - line))) {
+    char* next = newline + 1;
+    char* start = skipTelnet(line);
+    if (!skip && next - start >= 5 && strncasecmp(start, "ABOR", 4) == 0 &&
+        (start[4] == '\r' || start[4] == '\n')) {
+      memmove(line, next, end - next);
+      s.commandLength -= next - line;
+      s.lastActive = millis();
+      finishTransfer(s, false, 426, "Transfer aborted");
+      reply(s, 226, "Abort successful");
+      return true;
     }
-    
-    Serial.println("Starting file transfer");
-    uint8_t buf[1024];
-    int bytesWritten = 0;
-    unsigned long timeout = millis() + 5000; // 5 second timeout for initial data
-    
-    while (dataClient.connected()) {
-        if (dataClient.available()) {
-            size_t len = dataClient.read(buf, sizeof(buf));
-            if (len > 0) {
-                size_t written = file.write(buf, len);
-                bytesWritten += written;
-                timeout = millis() + 5000; // Reset timeout after receiving data
-                if (written != len) {
-                    Serial.println("Write error - disk full?");
-                    break;
-                }
-            }
-        } else if (millis() > timeout) {
-            Serial.println("Transfer timeout");
-            break;
+    skip = false;
+    line = next;
+  }
+  return false;
+}
+
+// Reads and runs complete command lines. Lines that arrive during a transfer
+// stay in the buffer until it ends, except ABOR, which is looked for in every
+// line received; the socket keeps being read until the buffer is full.
+static void receiveCommands(FtpSession& s) {
+  while (true) {
+    if (s.transfer != TRANSFER_NONE && !takeAbort(s)) {
+      if (s.commandLength == sizeof(s.command) && memchr(s.command, '\n', s.commandLength)) {
+        return;
+      }
+    } else {
+      char* newline = (char*)memchr(s.command, '\n', s.commandLength);
+      if (newline) {
+        *newline = '\0';
+        if (newline > s.command && newline[-1] == '\r') {
+          newline[-1] = '\0';
+        }
+        size_t consumed = newline + 1 - s.command;
+        s.lastActive = millis();
+        if (s.discarding) {
+          s.discarding = false;
+          reply(s, 500, "Command line too long");
         } else {
-            delay(1);
+          processCommand(s, skipTelnet(s.command));
         }
+        memmove(s.command, s.command + consumed, s.commandLength - consumed);
+        s.commandLength -= consumed;
+        continue;
+      }
     }
-    
-    file.close();
-    cleanupDataConnection();
-    
-    if (bytesWritten > 0) {
-        Serial.printf("Transfer complete, %d bytes written\n", bytesWritten);
-        sendResponse(226, "Transfer complete");
+
+    if (s.commandLength == sizeof(s.command)) {
+      s.discarding = true;
+      s.commandLength = 0;
+    }
+    int length = recv(s.fd, s.command + s.commandLength, sizeof(s.command) - s.commandLength, MSG_DONTWAIT);
+    if (length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      s.closing = true;
+      s.replyLength = 0;
+      return;
+    }
+    if (length < 0) {
+      return;
+    }
+    s.commandLength += length;
+  }
+}
+
+// === Task ===
+
+static void closeSession(FtpSession& s) {
+  endTransfer(s, false);
+  closeFd(s.fd);
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "FTP: client disconnected");
+}
+
+static FtpSession* freeSession() {
+  for (FtpSession& s : sessions) {
+    if (s.fd < 0) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+// Clients beyond FTP_MAX_SESSIONS wait in the listen backlog rather than
+// taking a socket just to be turned away
+static void acceptClient() {
+  FtpSession* slot = freeSession();
+  int fd = slot ? accept(listenFd, nullptr, nullptr) : -1;
+  if (fd < 0) {
+    return;
+  }
+  setNonBlocking(fd);
+
+  FtpSession& s = *slot;
+  s.fd = fd;
+  s.commandLength = 0;
+  s.discarding = false;
+  s.replyLength = 0;
+  s.userOk = false;
+  s.loggedIn = false;
+  s.closing = false;
+  s.lastActive = millis();
+  s.cwd = String();
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "FTP: client connected (session %d)", (int)(slot - sessions));
+  reply(s, 220, "ESP32 FTP Server ready");
+}
+
+static void checkTimeouts(FtpSession& s) {
+  unsigned long now = millis();
+  if (s.transfer != TRANSFER_NONE && now - s.lastProgress > FTP_DATA_TIMEOUT_MS) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "FTP: data connection timed out");
+    finishTransfer(s, false, s.dataOpen ? 426 : 425, s.dataOpen ? "Transfer timed out" : "Can't open data connection");
+  } else if (s.transfer == TRANSFER_NONE && now - s.lastActive > FTP_IDLE_TIMEOUT_MS) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "FTP: client timeout, disconnecting");
+    reply(s, 421, "Timeout");
+    s.closing = true;
+  }
+}
+
+static void addSession(FtpSession& s, fd_set* readable, fd_set* writable, int* maxFd) {
+  if (s.transfer == TRANSFER_NONE || s.commandLength < sizeof(s.command)) {
+    FD_SET(s.fd, readable);
+  }
+  if (s.replyLength > 0) {
+    FD_SET(s.fd, writable);
+  }
+  *maxFd = max(*maxFd, s.fd);
+  if (s.transfer != TRANSFER_NONE && !s.dataOpen && s.pasvFd >= 0) {
+    FD_SET(s.pasvFd, readable);
+    *maxFd = max(*maxFd, s.pasvFd);
+  }
+  if (s.transfer != TRANSFER_NONE && s.dataFd >= 0 && (!s.dataOpen || wantsSocket(s))) {
+    if (s.transfer == TRANSFER_STOR && s.dataOpen) {
+      FD_SET(s.dataFd, readable);
     } else {
-        Serial.println("Transfer failed - no data received");
-        sendResponse(451, "Transfer failed");
-        FFat.remove(fname.c_str()); // Remove failed file
+      FD_SET(s.dataFd, writable);
     }
+    *maxFd = max(*maxFd, s.dataFd);
+  }
 }
 
-void FTPServer::handleDELE(const char* filename) {
-    String fname = filename;
-    if (!fname.startsWith("/")) {
-        fname = "/" + fname;
+static void serviceSession(FtpSession& s, fd_set* readable, fd_set* writable) {
+  if (FD_ISSET(s.fd, writable)) {
+    flushReplies(s);
+  }
+  if (s.transfer != TRANSFER_NONE) {
+    serviceData(s, s.dataFd >= 0 && FD_ISSET(s.dataFd, readable), s.dataFd >= 0 && FD_ISSET(s.dataFd, writable),
+                s.pasvFd >= 0 && FD_ISSET(s.pasvFd, readable));
+  }
+  if (!s.closing && (FD_ISSET(s.fd, readable) || s.transfer == TRANSFER_NONE)) {
+    receiveCommands(s);
+  }
+  checkTimeouts(s);
+  if (s.closing && s.replyLength == 0) {
+    closeSession(s);
+  } else if (s.closing) {
+    flushReplies(s);
+  }
+}
+
+static void ftpTaskLoop(void* parameter) {
+  while (true) {
+    fd_set readable, writable;
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+    if (freeSession()) {
+      FD_SET(listenFd, &readable);
     }
+    int maxFd = listenFd;
 
-    // Check if file exists first
-    if (!FFat.exists(fname.c_str())) {
-        sendResponse(550, "File not found");
-        return;
+    // Sessions whose data side is stalled on the flash, and whether any
+    // session has socket work or only a 226 left to send
+    int stalled = 0;
+    bool socketWork = false, finishing = false;
+    for (FtpSession& s : sessions) {
+      if (s.fd < 0) {
+        continue;
+      }
+      addSession(s, &readable, &writable, &maxFd);
+      if (s.transfer != TRANSFER_NONE && s.dataOpen) {
+        bool wants = wantsSocket(s);
+        stalled += s.inFlight > 0 && !wants;
+        socketWork |= wants;
+        finishing |= s.sourceDone && s.inFlight == 0;
+      }
     }
 
-    // Try to delete the file
-    if (FFat.remove(fname.c_str())) {
-        sendResponse(250, "File deleted successfully");
-    } else {
-        sendResponse(450, "Failed to delete file");
+    // With every transfer stalled on the flash, wait for the flash task
+    // instead and only check the sockets once it answers. While others
+    // stream, poll it often enough that a stalled one is not held up long.
+    timeval timeout = { 0, FTP_POLL_MS * 1000 };
+    if (stalled && !socketWork) {
+      int64_t waitStart = esp_timer_get_time();
+      pollFlash(pdMS_TO_TICKS(FTP_POLL_MS));
+      int64_t waitedUs = esp_timer_get_time() - waitStart;
+      for (FtpSession& s : sessions) {
+        if (s.fd >= 0 && s.transfer != TRANSFER_NONE && s.dataOpen && s.inFlight > 0) {
+          s.flashWaitUs += waitedUs;
+        }
+      }
+      timeout.tv_usec = 0;
+    } else if (finishing) {
+      timeout.tv_usec = 0;
+    } else if (stalled) {
+      timeout.tv_usec = FTP_FLASH_POLL_MS * 1000;
     }
+    if (select(maxFd + 1, &readable, &writable, nullptr, &timeout) < 0) {
+      vTaskDelay(pdMS_TO_TICKS(FTP_POLL_MS));
+      continue;
+    }
+    pollFlash(0);
+
+    if (FD_ISSET(listenFd, &readable)) {
+      acceptClient();
+    }
+    for (FtpSession& s : sessions) {
+      if (s.fd >= 0) {
+        serviceSession(s, &readable, &writable);
+      }
+    }
+  }
+}
+
+bool ftpServerBegin() {
+  if (ftpTask) {
+    return true;
+  }
+
+  for (FtpSession& s : sessions) {
+    s.fd = -1;
+    s.pasvFd = -1;
+    s.dataFd = -1;
+  }
+
+  clusterBytes = readClusterBytes();
+  uint32_t saved = FTP_BUFFER_BYTES;
+  Preferences prefs;
+  if (prefs.begin("ftp", true)) {
+    saved = prefs.getULong("buffer", FTP_BUFFER_BYTES);
+    prefs.end();
+  }
+  size_t rounded = roundToClusters(saved);
+  bufferBytes.store(rounded ? rounded : clusterBytes);
+
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(FTP_CONTROL_PORT);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (listenFd < 0 || bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listenFd, FTP_MAX_SESSIONS) != 0) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "FTP: cannot listen on port %u (errno %d)", FTP_CONTROL_PORT, errno);
+    closeFd(listenFd);
+    return false;
+  }
+  setNonBlocking(listenFd);
+
+  // Two buffers per transfer, so neither queue can fill up
+  statsMutex = xSemaphoreCreateMutex();
+  flashJobs = xQueueCreate(2 * FTP_MAX_SESSIONS, sizeof(FlashJob));
+  flashDone = xQueueCreate(2 * FTP_MAX_SESSIONS, sizeof(FlashJob));
+  if (!statsMutex || !flashJobs || !flashDone) {
+    closeFd(listenFd);
+    return false;
+  }
+
+  // Below the VMs and loop(), so transfers only use otherwise idle time
+  if (xTaskCreatePinnedToCore(flashTaskLoop, "FTP_Flash", 4096, nullptr, 1, &flashTask, 0) != pdPASS ||
+      xTaskCreatePinnedToCore(ftpTaskLoop, "FTP_Task", 6144, nullptr, 1, &ftpTask, 0) != pdPASS) {
+    closeFd(listenFd);
+    return false;
+  }
+  return true;
+}
+
+bool ftpServerSetBufferSize(size_t bytes) {
+  size_t rounded = roundToClusters(bytes);
+  if (rounded == 0) {
+    return false;
+  }
+  bufferBytes.store(rounded);
+
+  Preferences prefs;
+  if (!prefs.begin("ftp", false)) {
+    return false;
+  }
+  bool saved = prefs.putULong("buffer", rounded) > 0;
+  prefs.end();
+  return saved;
+}
+
+size_t ftpServerBufferSize() {
+  return bufferBytes.load();
+}
+
+size_t ftpServerClusterSize() {
+  return clusterBytes;
+}
+
+void ftpServerGetStats(FtpStats* out) {
+  if (!statsMutex) {
+    *out = {};
+    return;
+  }
+  xSemaphoreTake(statsMutex, portMAX_DELAY);
+  *out = stats;
+  xSemaphoreGive(statsMutex);
+}
+
+void ftpServerInvalidateListings() {
+  listingGeneration.fetch_add(1);
 }
@@ -0,0 +1,102 @@
+// gpio_interrupts.cpp
+#include "include/gpio_interrupts.h"
+#include "include/vm_events.h"
+#include "include/vm_manager.h"
+#include <esp_timer.h>
+#include <hal/gpio_ll.h>
+#include <soc/gpio_struct.h>
+#include <atomic>
+
+struct PinInterrupt {
+  int owner;                        // VM index, -1 when detached
+  uint32_t debounceUs;
+  bool coalesce;
+  int64_t lastEdge;
+  std::atomic<uint16_t> pending;    // Edges folded into the queued event
+};
+
+static PinInterrupt interrupts[NUM_PINS];
+static bool initialized = false;
+
+static void IRAM_ATTR onEdge(void* arg) {
+  int pin = (int)(intptr_t)arg;
+  PinInterrupt& irq = interrupts[pin];
+  int64_t now = esp_timer_get_time();
+
+  if (irq.debounceUs && now - irq.lastEdge < irq.debounceUs) {
+    return;
+  }
+  irq.lastEdge = now;
+
+  if (irq.coalesce && irq.pending.fetch_add(1, std::memory_order_relaxed) != 0) {
+    return;
+  }
+
+  VMEvent event = {};
+  event.type = VM_EVENT_GPIO;
+  event.source = pin;
+  event.count = 1;
+  event.value = gpio_ll_get_level(&GPIO, (gpio_num_t)pin);
+  event.timestamp = now;
+
+  BaseType_t woken = pdFALSE;
+  if (!vmEventPostFromISR(irq.owner, event, &woken) && irq.coalesce) {
+    irq.pending.store(0, std::memory_order_relaxed);
+  }
+  if (woken == pdTRUE) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Runs on the VM task when a GPIO event is dispatched
+static void finalizeEdge(VMEvent* event) {
+  PinInterrupt& irq = interrupts[event->source];
+  if (irq.coalesce) {
+    uint16_t count = irq.pending.exchange(0, std::memory_order_relaxed);
+    event->count = count > 0 ? count : 1;
+  }
+}
+
+bool gpioInterruptAttach(int vmIndex, int pin, int mode, uint32_t debounceUs, bool coalesce) {
+  if (pin < 0 || pin >= NUM_PINS) {
+    return false;
+  }
+
+  if (!initialized) {
+    for (int i = 0; i < NUM_PINS; i++) {
+      interrupts[i].owner = -1;
+    }
+    vmEventsSetFinalizer(VM_EVENT_GPIO, finalizeEdge);
+    initialized = true;
+  }
+
+  PinInterrupt& irq = interrupts[pin];
+  if (irq.owner >= 0 && irq.owner != vmIndex) {
+    return false;
+  }
+
+  detachInterrupt(pin);
+  irq.debounceUs = debounceUs;
+  irq.coalesce = coalesce;
+  irq.lastEdge = 0;
+  irq.pending.store(0);
+  irq.owner = vmIndex;
+
+  attachInterruptArg(pin, onEdge, (void*)(intptr_t)pin, mode);
+  return true;
+}
+
+bool gpioInterruptDetach(int vmIndex, int pin) {
+  if (!initialized || pin < 0 || pin >= NUM_PINS || interrupts[pin].owner != vmIndex) {
+    return false;
+  }
+  detachInterrupt(pin);
+  interrupts[pin].owner = -1;
+  return true;
+}
+
+void gpioInterruptsRelease(int vmIndex) {
+  for (int pin = 0; pin < NUM_PINS; pin++) {
+    gpioInterruptDetach(vmIndex, pin);
+  }
+}
@@ -0,0 +1,979 @@
+// http_server.cpp
+#include "include/http_server.h"
+#include "include/vm_manager.h"
+#include "include/vm_events.h"
+#include "include/vm_log.h"
+#include "include/net_manager.h"
+#include "include/file_system.h"
+#include "include/msg_link.h"
+#include "include/ftp_server.h"
+#include "include/deploy.h"
+#include <FFat.h>
+#include <esp_timer.h>
+#include <mbedtls/sha256.h>
+#include <lwip/sockets.h>
+
+enum HttpState : uint8_t {
+  HTTP_FREE = 0,
+  HTTP_HEADERS,      // Reading the request line and headers
+  HTTP_BODY,         // Streaming the body to an upload, or discarding it
+  HTTP_RESPONDING,
+};
+
+struct HttpConn {
+  HttpState state;
+  int fd;
+  bool keepAlive;
+  unsigned long lastActive;
+  char header[HTTP_HEADER_BYTES];
+  size_t headerLength;      // May run past the headers into the body or the next request
+  size_t bodyRemaining;
+  bool signedRequest;       // The request carried X-Deploy-Counter and X-Deploy-Signature
+  uint64_t counter;
+  uint8_t signature[DEPLOY_TAG_BYTES];
+  File upload;              // Open while a PUT /files body is streamed
+  String uploadPath;
+  bool uploadStart;
+  bool uploadFailed;
+  bool uploadHashed;        // The body is hashed so its signature can be checked
+  mbedtls_sha256_context uploadSha;
+  size_t uploadBytes;
+  int status;
+  const char* contentType;
+  String response;          // Body until the response starts, then head and body
+  size_t sent;
+};
+
+// Everything runs on the loop task, so nothing here needs a lock
+static HttpConn conns[HTTP_MAX_CLIENTS];
+static int listener = -1;
+static uint8_t chunk[HTTP_CHUNK_BYTES];
+
+static const char* statusText(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 422: return "Unprocessable Entity";
+    case 431: return "Request Header Fields Too Large";
+    case 507: return "Insufficient Storage";
+    default: return "Internal Server Error";
+  }
+}
+
+static void jsonString(String& out, const char* text) {
+  out += '"';
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\') {
+      out += '\\';
+      out += *text;
+    } else if ((uint8_t)*text < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", *text);
+      out += escaped;
+    } else {
+      out += *text;
+    }
+  }
+  out += '"';
+}
+
+static void respond(HttpConn& c, int status, const char* contentType, const String& body) {
+  c.status = status;
+  c.contentType = contentType;
+  c.response = body;
+}
+
+// The head is added last, once the body has been read and it is settled
+// whether the connection stays open
+static void startResponse(HttpConn& c) {
+  char head[192];
+  int length = snprintf(head, sizeof(head),
+    "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: %s\r\n\r\n",
+    c.status, statusText(c.status), c.contentType, c.response.length(), c.keepAlive ? "keep-alive" : "close");
+  String body = c.response;
+  c.response = String();
+  c.response.reserve(length + body.length());
+  c.response += head;
+  c.response += body;
+  c.sent = 0;
+  c.state = HTTP_RESPONDING;
+}
+
+static void respondError(HttpConn& c, int status, const char* message) {
+  String body = "{\"error\":";
+  jsonString(body, message);
+  body += "}\n";
+  respond(c, status, "application/json", body);
+}
+
+static void closeConnection(HttpConn& c) {
+  if (c.upload) {
+    c.upload.close();
+    FFat.remove(c.uploadPath + ".part");
+    if (c.uploadHashed) {
+      mbedtls_sha256_free(&c.uploadSha);
+    }
+  }
+  close(c.fd);
+  c.fd = -1;
+  c.state = HTTP_FREE;
+  c.response = String();
+  c.uploadPath = String();
+}
+
+// === Request parsing ===
+
+static size_t findHeaderEnd(const char* data, size_t length) {
+  for (size_t i = 3; i < length; i++) {
+    if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' && data[i - 3] == '\r') {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static void consumeHeader(HttpConn& c, size_t bytes) {
+  memmove(c.header, c.header + bytes, c.headerLength - bytes);
+  c.headerLength -= bytes;
+}
+
+static int hexValue(char digit) {
+  if (digit >= '0' && digit <= '9') return digit - '0';
+  if (digit >= 'a' && digit <= 'f') return digit - 'a' + 10;
+  if (digit >= 'A' && digit <= 'F') return digit - 'A' + 10;
+  return -1;
+}
+
+// Decodes %XX escapes (and '+' in query values) in place
+static void urlDecode(char* text, bool plusIsSpace) {
+  char* out = text;
+  for (; *text; text++) {
+    if (*text == '%' && hexValue(text[1]) >= 0 && hexValue(text[2]) >= 0) {
+      *out++ = (char)(hexValue(text[1]) << 4 | hexValue(text[2]));
+      text += 2;
+    } else if (*text == '+' && plusIsSpace) {
+      *out++ = ' ';
+    } else {
+      *out++ = *text;
+    }
+  }
+  *out = '\0';
+}
+
+// 64 hex digits, as sent in X-Deploy-Signature
+static bool parseSignature(const char* text, uint8_t* signature) {
+  for (int i = 0; i < DEPLOY_TAG_BYTES; i++) {
+    int high = hexValue(text[2 * i]), low = high >= 0 ? hexValue(text[2 * i + 1]) : -1;
+    if (low < 0) {
+      return false;
+    }
+    signature[i] = high << 4 | low;
+  }
+  return text[2 * DEPLOY_TAG_BYTES] == '\r' || text[2 * DEPLOY_TAG_BYTES] == '\0';
+}
+
+static bool queryParam(const char* query, const char* name, char* value, size_t size) {
+  size_t nameLength = strlen(name);
+  while (query && *query) {
+    const char* end = strchr(query, '&');
+    size_t length = end ? (size_t)(end - query) : strlen(query);
+    if (length > nameLength && strncmp(query, name, nameLength) == 0 && query[nameLength] == '=') {
+      strlcpy(value, query + nameLength + 1, min(size, length - nameLength));
+      urlDecode(value, true);
+      return true;
+    }
+    query = end ? end + 1 : nullptr;
+  }
+  return false;
+}
+
+// Scripts live under the FFat root; the path is made absolute and must not
+// climb out of it
+static bool scriptPath(const char* text, String* path) {
+  *path = text[0] == '/' ? String(text) : "/" + String(text);
+  return path->length() > 1 && path->length() < 64 && !path->endsWith("/") && path->indexOf("..") < 0;
+}
+
+// === Handlers ===
+
+static void appendVM(String& out, int i) {
+  char fields[128];
+  snprintf(fields, sizeof(fields), ",\"running\":%s,\"sinceLastRunMs\":%lu,\"heapBytes\":%lu,\"restarts\":%lu}",
+    vms[i].running ? "true" : "false", millis() - vms[i].lastRunTime, (unsigned long)vms[i].memoryAllocated,
+    (unsigned long)(vms[i].starts > 0 ? vms[i].starts - 1 : 0));
+  out += "{\"id\":";
+  out += i;
+  out += ",\"file\":";
+  jsonString(out, vms[i].fullPath.c_str());
+  out += fields;
+}
+
+static void listVMs(HttpConn& c) {
+  String out = "[";
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (vms[i].fullPath.length() > 0) {
+      if (out.length() > 1) {
+        out += ',';
+      }
+      appendVM(out, i);
+    }
+  }
+  out += "]\n";
+  respond(c, 200, "application/json", out);
+}
+
+static void createVMFromQuery(HttpConn& c, const char* query) {
+  char file[64];
+  String path;
+  if (!queryParam(query, "file", file, sizeof(file)) || !scriptPath(file, &path)) {
+    respondError(c, 400, "Expected ?file=<path>");
+    return;
+  }
+
+  if (!FFat.exists(path)) {
+    respondError(c, 404, "No such file");
+    return;
+  }
+
+  int vmId = createVMFromFile(path);
+  if (vmId < 0) {
+    respondError(c, 422, "VM could not be created; see the log");
+    return;
+  }
+  String out;
+  appendVM(out, vmId);
+  out += '\n';
+  respond(c, 201, "application/json", out);
+}
+
+static void controlVM(HttpConn& c, int vmId, const char* action) {
+  if (vmId < 0 || vmId >= MAX_VMS || vms[vmId].fullPath.length() == 0) {
+    respondError(c, 404, "No such VM");
+    return;
+  }
+
+  if (strcmp(action, "stop") == 0) {
+    if (!vms[vmId].running) {
+      respondError(c, 409, "VM is not running");
+      return;
+    }
+    stopVM(vmId);
+  } else if (strcmp(action, "start") == 0) {
+    if (vms[vmId].running) {
+      respondError(c, 409, "VM is already running");
+      return;
+    }
+    if (!vms[vmId].ctx || startVM(vmId) != 0) {
+      respondError(c, 409, "VM cannot be restarted; create it again");
+      return;
+    }
+  } else {
+    respondError(c, 404, "Unknown VM action");
+    return;
+  }
+
+  String out;
+  appendVM(out, vmId);
+  out += '\n';
+  respond(c, 200, "application/json", out);
+}
+
+static void appendFiles(String& out, File dir) {
+  File entry = dir.openNextFile();
+  while (entry) {
+    if (entry.isDirectory()) {
+      appendFiles(out, entry);
+    } else {
+      if (out.length() > 1) {
+        out += ',';
+      }
+      out += "{\"path\":";
+      jsonString(out, entry.path());
+      out += ",\"size\":";
+      out += (unsigned long)entry.size();
+      out += '}';
+    }
+    entry = dir.openNextFile();
+  }
+}
+
+static void listFiles(HttpConn& c) {
+  File root = FFat.open("/");
+  if (!root) {
+    respondError(c, 500, "Cannot open the filesystem");
+    return;
+  }
+  String out = "[";
+  appendFiles(out, root);
+  root.close();
+  out += "]\n";
+  respond(c, 200, "application/json", out);
+}
+
+// The body goes to <path>.part and replaces the file only once complete, so
+// the file watcher never reloads a half-written script. Once a fleet key is
+// set every upload must be signed, since replacing a running script reloads
+// it; a stale counter is refused before the body is read.
+static bool beginUpload(HttpConn& c, const char* target, const char* query) {
+  String path;
+  if (!scriptPath(target, &path)) {
+    respondError(c, 400, "Invalid file path");
+    return false;
+  }
+  if (deployHasKey() && !c.signedRequest) {
+    respondError(c, 401, "A fleet key is set; sign the upload with X-Deploy-Counter and X-Deploy-Signature");
+    return false;
+  }
+  if (deployHasKey() && !deployCounterIsNew(c.counter)) {
+    respondError(c, 403, "X-Deploy-Counter is not newer than the last signed request");
+    return false;
+  }
+  if (c.bodyRemaining > FFat.totalBytes() - FFat.usedBytes()) {
+    respondError(c, 507, "Not enough free space");
+    return false;
+  }
+
+  c.upload = FFat.open(path + ".part", "w");
+  if (!c.upload) {
+    respondError(c, 500, "Cannot create file");
+    return false;
+  }
+
+  char start[8];
+  c.uploadPath = path;
+  c.uploadStart = queryParam(query, "start", start, sizeof(start)) && (strcmp(start, "1") == 0 || strcmp(start, "true") == 0);
+  c.uploadFailed = false;
+  c.uploadBytes = 0;
+  c.uploadHashed = deployHasKey();
+  if (c.uploadHashed) {
+    mbedtls_sha256_init(&c.uploadSha);
+    mbedtls_sha256_starts(&c.uploadSha, 0);
+  }
+  return true;
+}
+
+// The signature is an HMAC-SHA256 under the fleet key of
+// "PUT <path>\n<start 0|1>\n<counter>\n" followed by the body's SHA-256
+static bool uploadSignatureValid(HttpConn& c, const uint8_t* digest) {
+  uint8_t message[128 + DEPLOY_DIGEST_BYTES];
+  int length = snprintf((char*)message, 128, "PUT %s\n%d\n%llu\n", c.uploadPath.c_str(), c.uploadStart ? 1 : 0,
+                        (unsigned long long)c.counter);
+  if (length <= 0 || length >= 128) {
+    return false;
+  }
+  memcpy(message + length, digest, DEPLOY_DIGEST_BYTES);
+  return deployVerifySignature(message, length + DEPLOY_DIGEST_BYTES, c.signature);
+}
+
+static void finishUpload(HttpConn& c) {
+  c.upload.close();
+  uint8_t digest[DEPLOY_DIGEST_BYTES];
+  if (c.uploadHashed) {
+    mbedtls_sha256_finish(&c.uploadSha, digest);
+    mbedtls_sha256_free(&c.uploadSha);
+  }
+  String part = c.uploadPath + ".part";
+  if (c.uploadFailed) {
+    FFat.remove(part);
+    respondError(c, 507, "Write to flash failed");
+    return;
+  }
+  if (c.uploadHashed && !uploadSignatureValid(c, digest)) {
+    FFat.remove(part);
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Upload of %s refused: bad signature", c.uploadPath.c_str());
+    respondError(c, 403, "Bad signature");
+    return;
+  }
+  // Checked again in case another signed request took the counter meanwhile
+  if (c.uploadHashed && !deployAcceptCounter(c.counter)) {
+    FFat.remove(part);
+    respondError(c, 403, "X-Deploy-Counter is not newer than the last signed request");
+    return;
+  }
+  if ((FFat.exists(c.uploadPath) && !FFat.remove(c.uploadPath)) || !FFat.rename(part, c.uploadPath)) {
+    FFat.remove(part);
+    respondError(c, 500, "Cannot replace file");
+    return;
+  }
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "Uploaded %s (%lu bytes)", c.uploadPath.c_str(), (unsigned long)c.uploadBytes);
+  ftpServerInvalidateListings();
+
+  String out = "{\"path\":";
+  jsonString(out, c.uploadPath.c_str());
+  out += ",\"bytes\":";
+  out += (unsigned long)c.uploadBytes;
+
+  if (c.uploadStart) {
+    int vmId = relaunchVMFromFile(c.uploadPath);
+    if (vmId < 0) {
+      respondError(c, 422, "Stored, but the script failed to compile or start; see the log");
+      return;
+    }
+    out += ",\"vm\":";
+    out += vmId;
+  }
+
+  out += "}\n";
+  respond(c, 201, "application/json", out);
+}
+
+// === Metrics ===
+
+static void metricFamily(String& out, const char* name, const char* type, const char* help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+static void metricSample(String& out, const char* name, const char* labels, uint64_t value) {
+  char number[24];
+  snprintf(number, sizeof(number), " %llu\n", (unsigned long long)value);
+  out += name;
+  out += labels;
+  out += number;
+}
+
+// Microseconds printed as seconds without going through a float
+static void metricSeconds(String& out, const char* name, const char* labels, uint64_t us) {
+  char number[32];
+  snprintf(number, sizeof(number), " %llu.%06lu\n",
+    (unsigned long long)(us / 1000000), (unsigned long)(us % 1000000));
+  out += name;
+  out += labels;
+  out += number;
+}
+
+// Quoted label value. The text format only knows the escapes \\, \" and \n.
+static void metricLabel(String& out, const char* text) {
+  out += '"';
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\') {
+      out += '\\';
+      out += *text;
+    } else if (*text == '\n') {
+      out += "\\n";
+    } else {
+      out += *text;
+    }
+  }
+  out += '"';
+}
+
+// One sample line per peer and counter, labelled with the peer's node name
+static void writeLinkMetrics(String& out) {
+  MsgLinkStats links[MSG_LINK_MAX_PEERS];
+  String labels[MSG_LINK_MAX_PEERS];
+  int count = 0;
+  while (count < MSG_LINK_MAX_PEERS && msgLinkGetStats(count, &links[count])) {
+    labels[count] = "{peer=";
+    metricLabel(labels[count], links[count].name);
+    labels[count] += "}";
+    count++;
+  }
+
+  metricFamily(out, "jsvm_link_messages_total", "counter", "Messages to other nodes acknowledged, and messages from them delivered.");
+  for (int i = 0; i < count; i++) {
+    String directed = "{peer=";
+    metricLabel(directed, links[i].name);
+    metricSample(out, "jsvm_link_messages_total", (directed + ",direction=\"sent\"}").c_str(), links[i].sent);
+    metricSample(out, "jsvm_link_messages_total", (directed + ",direction=\"received\"}").c_str(), links[i].received);
+  }
+
+  metricFamily(out, "jsvm_link_retransmits_total", "counter", "Datagrams sent again for lack of an acknowledgement.");
+  for (int i = 0; i < count; i++) {
+    metricSample(out, "jsvm_link_retransmits_total", labels[i].c_str(), links[i].retransmits);
+  }
+
+  metricFamily(out, "jsvm_link_failed_total", "counter", "Messages given up on after every retry.");
+  for (int i = 0; i < count; i++) {
+    metricSample(out, "jsvm_link_failed_total", labels[i].c_str(), links[i].failed);
+  }
+
+  metricFamily(out, "jsvm_link_pending_messages", "gauge", "Messages queued for the peer or awaiting its acknowledgement.");
+  for (int i = 0; i < count; i++) {
+    metricSample(out, "jsvm_link_pending_messages", labels[i].c_str(), links[i].pending);
+  }
+
+  metricFamily(out, "jsvm_link_delivery_seconds", "summary", "Time from sendMessage() to the peer's acknowledgement.");
+  for (int i = 0; i < count; i++) {
+    metricSeconds(out, "jsvm_link_delivery_seconds_sum", labels[i].c_str(), links[i].latencySumUs);
+    metricSample(out, "jsvm_link_delivery_seconds_count", labels[i].c_str(), links[i].sent);
+  }
+}
+
+static void writeFtpMetrics(String& out) {
+  FtpStats ftp;
+  ftpServerGetStats(&ftp);
+
+  metricFamily(out, "jsvm_ftp_transfers_total", "counter", "Completed FTP uploads and downloads.");
+  metricSample(out, "jsvm_ftp_transfers_total", "{direction=\"upload\"}", ftp.uploads);
+  metricSample(out, "jsvm_ftp_transfers_total", "{direction=\"download\"}", ftp.downloads);
+  metricFamily(out, "jsvm_ftp_failed_transfers_total", "counter", "FTP uploads and downloads that failed or were aborted.");
+  metricSample(out, "jsvm_ftp_failed_transfers_total", "", ftp.failed);
+  metricFamily(out, "jsvm_ftp_bytes_total", "counter", "File bytes moved by completed FTP transfers.");
+  metricSample(out, "jsvm_ftp_bytes_total", "{direction=\"upload\"}", ftp.uploadBytes);
+  metricSample(out, "jsvm_ftp_bytes_total", "{direction=\"download\"}", ftp.downloadBytes);
+  metricFamily(out, "jsvm_ftp_transfer_seconds_total", "counter", "Time completed FTP transfers took; bytes over this is the rate.");
+  metricSeconds(out, "jsvm_ftp_transfer_seconds_total", "{direction=\"upload\"}", ftp.uploadUs);
+  metricSeconds(out, "jsvm_ftp_transfer_seconds_total", "{direction=\"download\"}", ftp.downloadUs);
+  metricFamily(out, "jsvm_ftp_flash_wait_seconds_total", "counter", "Time FTP transfers left the network idle waiting for the flash.");
+  metricSeconds(out, "jsvm_ftp_flash_wait_seconds_total", "", ftp.flashWaitUs);
+}
+
+// Prometheus text format. Every VM slot that has held a script is reported,
+// stopped ones too, so restart counts survive a crash loop.
+static void writeMetrics(String& out) {
+  struct Sample {
+    VMEventStats events;
+    NetStats net;
+    VMLogStats log;
+    uint32_t messages;
+    char labels[16];
+  };
+  Sample samples[MAX_VMS];
+  bool known[MAX_VMS];
+  for (int i = 0; i < MAX_VMS; i++) {
+    known[i] = vms[i].fullPath.length() > 0;
+    if (known[i]) {
+      Sample& sample = samples[i];
+      vmEventsGetStats(i, &sample.events);
+      netManagerGetStats(i, &sample.net);
+      vmLogGetStats(i, &sample.log);
+      sample.messages = vms[i].messageQueue ? uxQueueMessagesWaiting(vms[i].messageQueue) : 0;
+      snprintf(sample.labels, sizeof(sample.labels), "{vm=\"%d\"}", i);
+    }
+  }
+
+  out.reserve(3072);
+  metricFamily(out, "jsvm_uptime_seconds", "gauge", "Time since boot.");
+  metricSeconds(out, "jsvm_uptime_seconds", "", esp_timer_get_time());
+  metricFamily(out, "jsvm_heap_free_bytes", "gauge", "Free system heap.");
+  metricSample(out, "jsvm_heap_free_bytes", "", ESP.getFreeHeap());
+  metricFamily(out, "jsvm_heap_min_free_bytes", "gauge", "Lowest free system heap since boot.");
+  metricSample(out, "jsvm_heap_min_free_bytes", "", ESP.getMinFreeHeap());
+
+  metricFamily(out, "jsvm_vm_info", "gauge", "Script loaded in each VM slot.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      String labels = "{vm=\"" + String(i) + "\",file=";
+      metricLabel(labels, vms[i].fullPath.c_str());
+      labels += "}";
+      metricSample(out, "jsvm_vm_info", labels.c_str(), 1);
+    }
+  }
+
+  metricFamily(out, "jsvm_vm_running", "gauge", "Whether the VM task is running.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      metricSample(out, "jsvm_vm_running", samples[i].labels, vms[i].running ? 1 : 0);
+    }
+  }
+
+  metricFamily(out, "jsvm_vm_cpu_seconds_total", "counter",
+    "Time the VM task spent running rather than waiting; an upper bound on CPU time when VMs share a core.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      metricSeconds(out, "jsvm_vm_cpu_seconds_total", samples[i].labels, samples[i].events.busyUs);
+    }
+  }
+
+  metricFamily(out, "jsvm_vm_heap_bytes", "gauge", "Bytes allocated by the VM's JavaScript heap.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      metricSample(out, "jsvm_vm_heap_bytes", samples[i].labels, vms[i].memoryAllocated);
+    }
+  }
+
+  metricFamily(out, "jsvm_vm_restarts_total", "counter", "Times the slot's VM was started again, including file reloads.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      metricSample(out, "jsvm_vm_restarts_total", samples[i].labels, vms[i].starts > 0 ? vms[i].starts - 1 : 0);
+    }
+  }
+
+  metricFamily(out, "jsvm_vm_queue_depth", "gauge", "Items waiting for the VM, by queue.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      char labels[40];
+      snprintf(labels, sizeof(labels), "{vm=\"%d\",queue=\"events\"}", i);
+      metricSample(out, "jsvm_vm_queue_depth", labels, samples[i].events.pending);
+      snprintf(labels, sizeof(labels), "{vm=\"%d\",queue=\"messages\"}", i);
+      metricSample(out, "jsvm_vm_queue_depth", labels, samples[i].messages);
+    }
+  }
+
+  metricFamily(out, "jsvm_vm_queue_bytes", "gauge", "Bytes buffered for or from the VM, by queue.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      char labels[40];
+      snprintf(labels, sizeof(labels), "{vm=\"%d\",queue=\"net\"}", i);
+      metricSample(out, "jsvm_vm_queue_bytes", labels, samples[i].net.pendingBytes);
+      snprintf(labels, sizeof(labels), "{vm=\"%d\",queue=\"log\"}", i);
+      metricSample(out, "jsvm_vm_queue_bytes", labels, samples[i].log.pendingBytes);
+    }
+  }
+
+  metricFamily(out, "jsvm_vm_events_dispatched_total", "counter", "Events handed to JavaScript handlers since the VM started.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      metricSample(out, "jsvm_vm_events_dispatched_total", samples[i].labels, samples[i].events.dispatched);
+    }
+  }
+
+  metricFamily(out, "jsvm_vm_events_dropped_total", "counter", "Events dropped on a full queue since the VM started.");
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (known[i]) {
+      metricSample(out, "jsvm_vm_events_dropped_total", samples[i].labels, samples[i].events.dropped);
+    }
+  }
+
+  writeLinkMetrics(out);
+  writeFtpMetrics(out);
+}
+
+// === Routing ===
+
+// Once a fleet key is set, VM control must be signed like an upload, or
+// anyone on the network could stop the fleet's scripts or start any file on
+// flash. These requests have no body, so the signature covers
+// "POST <target>\n<counter>\n", with the target exactly as sent.
+static bool authorizeControl(HttpConn& c, const char* target) {
+  if (!deployHasKey()) {
+    return true;
+  }
+  if (!c.signedRequest) {
+    respondError(c, 401, "A fleet key is set; sign the request with X-Deploy-Counter and X-Deploy-Signature");
+    return false;
+  }
+  char message[160];
+  int length = snprintf(message, sizeof(message), "POST %s\n%llu\n", target, (unsigned long long)c.counter);
+  if (length <= 0 || length >= (int)sizeof(message) || !deployVerifySignature((const uint8_t*)message, length, c.signature)) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "POST %s refused: bad signature", target);
+    respondError(c, 403, "Bad signature");
+    return false;
+  }
+  if (!deployAcceptCounter(c.counter)) {
+    respondError(c, 403, "X-Deploy-Counter is not newer than the last signed request");
+    return false;
+  }
+  return true;
+}
+
+// Returns true if the request wants its body, i.e. an upload was accepted
+static bool route(HttpConn& c, const char* method, char* target) {
+  char signedTarget[128];
+  strlcpy(signedTarget, target, sizeof(signedTarget));
+  char* query = strchr(target, '?');
+  if (query) {
+    *query++ = '\0';
+  }
+  urlDecode(target, false);
+
+  bool get = strcmp(method, "GET") == 0;
+  bool post = strcmp(method, "POST") == 0;
+  int vmId;
+  char action[8];
+
+  if (strcmp(target, "/metrics") == 0 && get) {
+    String out;
+    writeMetrics(out);
+    respond(c, 200, "text/plain; version=0.0.4", out);
+  } else if (strcmp(target, "/vms") == 0 && get) {
+    listVMs(c);
+  } else if (strcmp(target, "/vms") == 0 && post) {
+    if (authorizeControl(c, signedTarget)) {
+      createVMFromQuery(c, query);
+    }
+  } else if (sscanf(target, "/vms/%d/%7s", &vmId, action) == 2 && post) {
+    if (authorizeControl(c, signedTarget)) {
+      controlVM(c, vmId, action);
+    }
+  } else if (strcmp(target, "/files") == 0 && get) {
+    listFiles(c);
+  } else if (strncmp(target, "/files/", 7) == 0 && strcmp(method, "PUT") == 0) {
+    return beginUpload(c, target + 7, query);
+  } else if (strcmp(target, "/metrics") == 0 || strcmp(target, "/vms") == 0 || strcmp(target, "/files") == 0 ||
+             strncmp(target, "/vms/", 5) == 0 || strncmp(target, "/files/", 7) == 0) {
+    respondError(c, 405, "Method not allowed");
+  } else {
+    respondError(c, 404, "Not found");
+  }
+  return false;
+}
+
+static void finishBody(HttpConn& c) {
+  if (c.upload) {
+    finishUpload(c);
+  }
+  startResponse(c);
+}
+
+static void handleRequest(HttpConn& c, size_t headerBytes) {
+  char method[8], target[128], version[12];
+  c.header[headerBytes - 1] = '\0';
+  int fields = sscanf(c.header, "%7s %127s %11s", method, target, version);
+
+  size_t contentLength = 0;
+  bool chunked = false, expectContinue = false, hasCounter = false, hasSignature = false;
+  c.keepAlive = fields == 3 && strcmp(version, "HTTP/1.1") == 0;
+  for (const char* line = strstr(c.header, "\r\n"); line; line = strstr(line, "\r\n")) {
+    line += 2;
+    const char* value = strchr(line, ':');
+    if (!value) {
+      continue;
+    }
+    for (value++; *value == ' '; value++) {
+    }
+
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      contentLength = strtoul(value, nullptr, 10);
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      if (strncasecmp(value, "close", 5) == 0) {
+        c.keepAlive = false;
+      } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+        c.keepAlive = true;
+      }
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      chunked = strncasecmp(value, "identity", 8) != 0;
+    } else if (strncasecmp(line, "Expect:", 7) == 0) {
+      expectContinue = strncasecmp(value, "100-continue", 12) == 0;
+    } else if (strncasecmp(line, "X-Deploy-Counter:", 17) == 0) {
+      c.counter = strtoull(value, nullptr, 10);
+      hasCounter = true;
+    } else if (strncasecmp(line, "X-Deploy-Signature:", 19) == 0) {
+      hasSignature = parseSignature(value, c.signature);
+    }
+  }
+  c.signedRequest = hasCounter && hasSignature;
+  consumeHeader(c, headerBytes);
+
+  if (fields != 3 || strncmp(version, "HTTP/1.", 7) != 0) {
+    c.keepAlive = false;
+    respondError(c, 400, "Malformed request line");
+    startResponse(c);
+    return;
+  }
+  if (chunked) {
+    // The body length is unknown, so the connection cannot be reused
+    c.keepAlive = false;
+    respondError(c, 411, "Send a Content-Length instead of a chunked body");
+    startResponse(c);
+    return;
+  }
+
+  c.bodyRemaining = contentLength;
+  bool accepted = route(c, method, target);
+  if (expectContinue) {
+    if (accepted) {
+      static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+      send(c.fd, interim, sizeof(interim) - 1, MSG_DONTWAIT);
+    } else {
+      // The client may or may not send the body now, so the connection
+      // cannot be reused
+      c.bodyRemaining = 0;
+      c.keepAlive = false;
+    }
+  }
+
+  if (c.bodyRemaining > 0) {
+    c.state = HTTP_BODY;
+  } else {
+    finishBody(c);
+  }
+}
+
+// === Connection state machine ===
+
+static void readHeaders(HttpConn& c) {
+  while (true) {
+    size_t headerBytes = findHeaderEnd(c.header, c.headerLength);
+    if (headerBytes > 0) {
+      handleRequest(c, headerBytes);
+      return;
+    }
+    if (c.headerLength == HTTP_HEADER_BYTES) {
+      c.keepAlive = false;
+      c.headerLength = 0;
+      respondError(c, 431, "Request headers too large");
+      startResponse(c);
+      return;
+    }
+
+    int length = recv(c.fd, c.header + c.headerLength, HTTP_HEADER_BYTES - c.headerLength, MSG_DONTWAIT);
+    if (length > 0) {
+      c.headerLength += length;
+      c.lastActive = millis();
+    } else {
+      if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        closeConnection(c);
+      }
+      return;
+    }
+  }
+}
+
+static void storeBody(HttpConn& c, const uint8_t* data, size_t length) {
+  if (c.upload && !c.uploadFailed && c.upload.write(data, length) != length) {
+    c.uploadFailed = true;
+  }
+  if (c.upload && c.uploadHashed) {
+    mbedtls_sha256_update(&c.uploadSha, data, length);
+  }
+  c.uploadBytes += length;
+}
+
+static void readBody(HttpConn& c) {
+  size_t budget = HTTP_READ_BUDGET;
+  while (c.bodyRemaining > 0 && budget > 0) {
+    size_t length;
+    if (c.headerLength > 0) {
+      // Body bytes that arrived together with the headers
+      length = min(c.headerLength, c.bodyRemaining);
+      storeBody(c, (const uint8_t*)c.header, length);
+      consumeHeader(c, length);
+    } else {
+      int received = recv(c.fd, chunk, min(c.bodyRemaining, (size_t)HTTP_CHUNK_BYTES), MSG_DONTWAIT);
+      if (received <= 0) {
+        if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+          closeConnection(c);
+        }
+        return;
+      }
+      length = received;
+      storeBody(c, chunk, length);
+      c.lastActive = millis();
+    }
+    c.bodyRemaining -= length;
+    budget -= min(length, budget);
+  }
+
+  if (c.bodyRemaining == 0) {
+    finishBody(c);
+  }
+}
+
+static void writeResponse(HttpConn& c) {
+  while (c.sent < c.response.length()) {
+    int sent = send(c.fd, c.response.c_str() + c.sent, c.response.length() - c.sent, MSG_DONTWAIT);
+    if (sent > 0) {
+      c.sent += sent;
+      c.lastActive = millis();
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else {
+      closeConnection(c);
+      return;
+    }
+  }
+
+  c.response = String();
+  if (!c.keepAlive) {
+    closeConnection(c);
+    return;
+  }
+  c.state = HTTP_HEADERS;
+}
+
+static void serviceConnection(HttpConn& c) {
+  // Runs phases back to back until one has to wait for the socket
+  while (true) {
+    HttpState before = c.state;
+    if (c.state == HTTP_HEADERS) {
+      readHeaders(c);
+    } else if (c.state == HTTP_BODY) {
+      readBody(c);
+    } else if (c.state == HTTP_RESPONDING) {
+      writeResponse(c);
+    }
+    if (c.state == before || c.state == HTTP_FREE) {
+      break;
+    }
+  }
+
+  if (c.state != HTTP_FREE && millis() - c.lastActive > HTTP_IDLE_TIMEOUT_MS) {
+    closeConnection(c);
+  }
+}
+
+// Connections beyond HTTP_MAX_CLIENTS wait in the listen backlog
+static void acceptConnections() {
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    if (conns[i].state != HTTP_FREE) {
+      continue;
+    }
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      return;
+    }
+
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    HttpConn& c = conns[i];
+    c.fd = fd;
+    c.state = HTTP_HEADERS;
+    c.keepAlive = true;
+    c.headerLength = 0;
+    c.bodyRemaining = 0;
+    c.lastActive = millis();
+  }
+}
+
+bool httpServerBegin(uint16_t port) {
+  if (listener >= 0) {
+    return true;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, HTTP_MAX_CLIENTS) != 0) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "HTTP server on port %u failed (errno %d)", port, errno);
+    close(fd);
+    return false;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    conns[i].state = HTTP_FREE;
+    conns[i].fd = -1;
+  }
+  listener = fd;
+  vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "HTTP server listening on port %u", port);
+  return true;
+}
+
+void httpServerHandle() {
+  if (listener < 0) {
+    return;
+  }
+
+  acceptConnections();
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    if (conns[i].state != HTTP_FREE) {
+      serviceConnection(conns[i]);
+    }
+  }
+}
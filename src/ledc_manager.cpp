@@ -0,0 +1,195 @@
+// ledc_manager.cpp
+#include "include/ledc_manager.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+struct LedcTimer {
+  uint32_t frequency;
+  uint8_t resolution;
+  uint8_t users;        // Channels bound to this timer
+};
+
+struct LedcChannel {
+  int owner;            // VM index, -1 when free
+  int timer;            // -1 until set up
+  int pin;              // -1 until attached
+};
+
+static LedcTimer timers[LEDC_TIMER_MAX];
+static LedcChannel channels[LEDC_CHANNEL_MAX];
+static SemaphoreHandle_t ledcMutex = nullptr;
+static bool fadeInstalled = false;
+
+void ledcManagerBegin() {
+  for (int i = 0; i < LEDC_CHANNEL_MAX; i++) {
+    channels[i] = { -1, -1, -1 };
+  }
+  ledcMutex = xSemaphoreCreateMutex();
+}
+
+static bool lockLedc() {
+  return ledcMutex && xSemaphoreTake(ledcMutex, portMAX_DELAY) == pdTRUE;
+}
+
+static void unlockLedc() {
+  xSemaphoreGive(ledcMutex);
+}
+
+static void releaseTimer(int timer) {
+  if (timer >= 0 && timers[timer].users > 0 && --timers[timer].users == 0) {
+    ledc_timer_pause(LEDC_SPEED_MODE, (ledc_timer_t)timer);
+  }
+}
+
+// Finds a running timer with matching settings, or configures an idle one
+static int acquireTimer(uint32_t frequency, uint8_t resolution) {
+  for (int i = 0; i < LEDC_TIMER_MAX; i++) {
+    if (timers[i].users > 0 && timers[i].frequency == frequency && timers[i].resolution == resolution) {
+      timers[i].users++;
+      return i;
+    }
+  }
+
+  for (int i = 0; i < LEDC_TIMER_MAX; i++) {
+    if (timers[i].users == 0) {
+      ledc_timer_config_t config = {};
+      config.speed_mode = LEDC_SPEED_MODE;
+      config.duty_resolution = (ledc_timer_bit_t)resolution;
+      config.timer_num = (ledc_timer_t)i;
+      config.freq_hz = frequency;
+      config.clk_cfg = LEDC_AUTO_CLK;
+      if (ledc_timer_config(&config) != ESP_OK) {
+        return -1;
+      }
+      ledc_timer_resume(LEDC_SPEED_MODE, (ledc_timer_t)i);
+      timers[i] = { frequency, resolution, 1 };
+      return i;
+    }
+  }
+  return -1;
+}
+
+// The table is only valid once ledcManagerBegin() has initialised it
+static bool ownsChannel(int vmIndex, int channel) {
+  return ledcMutex && channel >= 0 && channel < LEDC_CHANNEL_MAX && channels[channel].owner == vmIndex;
+}
+
+int ledcManagerSetup(int vmIndex, int channel, uint32_t frequency, uint8_t resolution) {
+  if (frequency == 0 || resolution < 1 || resolution >= LEDC_TIMER_BIT_MAX || !lockLedc()) {
+    return -1;
+  }
+
+  if (channel < 0) {
+    for (int i = 0; i < LEDC_CHANNEL_MAX && channel < 0; i++) {
+      if (channels[i].owner < 0) {
+        channel = i;
+      }
+    }
+  }
+
+  if (channel < 0 || channel >= LEDC_CHANNEL_MAX ||
+      (channels[channel].owner >= 0 && channels[channel].owner != vmIndex)) {
+    unlockLedc();
+    return -1;
+  }
+
+  // Drop the channel's previous timer first so reconfiguring the only user
+  // of a timer can reuse it
+  LedcChannel& ch = channels[channel];
+  releaseTimer(ch.timer);
+  ch.timer = acquireTimer(frequency, resolution);
+  if (ch.timer < 0) {
+    ch = { -1, -1, -1 };
+    unlockLedc();
+    return -1;
+  }
+  ch.owner = vmIndex;
+  if (ch.pin >= 0) {
+    ledc_bind_channel_timer(LEDC_SPEED_MODE, (ledc_channel_t)channel, (ledc_timer_t)ch.timer);
+  }
+
+  if (!fadeInstalled) {
+    fadeInstalled = ledc_fade_func_install(0) == ESP_OK;
+  }
+
+  unlockLedc();
+  return channel;
+}
+
+bool ledcManagerAttachPin(int vmIndex, int channel, int pin) {
+  if (!lockLedc()) {
+    return false;
+  }
+
+  bool ok = false;
+  if (ownsChannel(vmIndex, channel)) {
+    ledc_channel_config_t config = {};
+    config.gpio_num = pin;
+    config.speed_mode = LEDC_SPEED_MODE;
+    config.channel = (ledc_channel_t)channel;
+    config.timer_sel = (ledc_timer_t)channels[channel].timer;
+    config.duty = 0;
+    config.hpoint = 0;
+    ok = ledc_channel_config(&config) == ESP_OK;
+    if (ok) {
+      channels[channel].pin = pin;
+    }
+  }
+
+  unlockLedc();
+  return ok;
+}
+
+bool ledcManagerWrite(int vmIndex, int channel, uint32_t duty) {
+  if (!ownsChannel(vmIndex, channel)) {
+    return false;
+  }
+  return ledc_set_duty_and_update(LEDC_SPEED_MODE, (ledc_channel_t)channel, duty, 0) == ESP_OK;
+}
+
+// Hardware fade; returns immediately while the LEDC ramps the duty
+bool ledcManagerFade(int vmIndex, int channel, uint32_t duty, uint32_t ms) {
+  if (!fadeInstalled || !ownsChannel(vmIndex, channel)) {
+    return false;
+  }
+  if (ledc_set_fade_with_time(LEDC_SPEED_MODE, (ledc_channel_t)channel, duty, ms) != ESP_OK) {
+    return false;
+  }
+  return ledc_fade_start(LEDC_SPEED_MODE, (ledc_channel_t)channel, LEDC_FADE_NO_WAIT) == ESP_OK;
+}
+
+int ledcManagerWriteMany(int vmIndex, const uint8_t* channelList, const uint32_t* duties, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (!ownsChannel(vmIndex, channelList[i])) {
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    ledc_set_duty(LEDC_SPEED_MODE, (ledc_channel_t)channelList[i], duties[i]);
+  }
+  for (size_t i = 0; i < count; i++) {
+    ledc_update_duty(LEDC_SPEED_MODE, (ledc_channel_t)channelList[i]);
+  }
+  return count;
+}
+
+void ledcManagerRelease(int vmIndex) {
+  if (!lockLedc()) {
+    return;
+  }
+
+  for (int i = 0; i < LEDC_CHANNEL_MAX; i++) {
+    LedcChannel& ch = channels[i];
+    if (ch.owner != vmIndex) {
+      continue;
+    }
+    if (ch.pin >= 0) {
+      ledc_stop(LEDC_SPEED_MODE, (ledc_channel_t)i, 0);
+    }
+    releaseTimer(ch.timer);
+    ch = { -1, -1, -1 };
+  }
+
+  unlockLedc();
+}
@@ -0,0 +1,403 @@
+// log_shipper.cpp
+#include "include/log_shipper.h"
+#include "include/vm_log.h"
+#include <WiFi.h>
+#include <Preferences.h>
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <atomic>
+#include <sys/time.h>
+
+#define LOG_SHIP_FACILITY 16           // local0
+#define LOG_SHIP_REPEAT_FLUSH_MS 1000  // Report a run of repeats after this much quiet
+#define LOG_SHIP_CONNECT_TIMEOUT_MS 2000
+
+// Byte ring of [uint16 length][syslog line] records. The log drain task is
+// the only producer and the shipping task the only consumer. The consumer
+// only advances the tail once a batch has been sent, so nothing is lost
+// while the collector is unreachable.
+static uint8_t buffer[LOG_SHIP_BUFFER_BYTES];
+static std::atomic<uint32_t> head(0);
+static std::atomic<uint32_t> tail(0);
+
+static LogShipConfig config = { LOG_SHIP_OFF, "", 514, 1024, 5000 };
+static SemaphoreHandle_t configMutex = nullptr;
+static std::atomic<bool> reconfigured(false);
+static TaskHandle_t shipTask = nullptr;
+
+static std::atomic<uint32_t> batches(0);
+static std::atomic<uint32_t> lines(0);
+static std::atomic<uint32_t> bytesSent(0);
+static std::atomic<uint32_t> folded(0);
+static std::atomic<uint32_t> dropped(0);
+static std::atomic<uint32_t> sendFailures(0);
+
+// Repeat folding state, owned by the drain task
+struct LastLine {
+  int source;
+  uint32_t hash;
+  uint32_t repeats;
+  uint32_t lastSeen;
+  VMLogLevel level;
+  char tag[VM_LOG_TAG_LENGTH];
+};
+static LastLine last = { -1 };
+
+static uint32_t hashLine(const char* text, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static void copyIn(uint32_t pos, const void* src, size_t length) {
+  const uint8_t* bytes = (const uint8_t*)src;
+  uint32_t offset = pos % LOG_SHIP_BUFFER_BYTES;
+  size_t first = min(length, (size_t)(LOG_SHIP_BUFFER_BYTES - offset));
+  memcpy(&buffer[offset], bytes, first);
+  memcpy(buffer, bytes + first, length - first);
+}
+
+static void copyOut(uint32_t pos, void* dst, size_t length) {
+  uint8_t* bytes = (uint8_t*)dst;
+  uint32_t offset = pos % LOG_SHIP_BUFFER_BYTES;
+  size_t first = min(length, (size_t)(LOG_SHIP_BUFFER_BYTES - offset));
+  memcpy(bytes, &buffer[offset], first);
+  memcpy(bytes + first, buffer, length - first);
+}
+
+static const char* procId(int source) {
+  static const char* names[] = { "vm0", "vm1", "vm2", "vm3", "vm4", "vm5", "vm6", "vm7" };
+  return source == VM_LOG_SYSTEM || source >= 8 ? "system" : names[source];
+}
+
+// Formats an RFC 5424 line and queues it, dropping it if the buffer is full
+static void queueLine(const LogShipConfig& cfg, int source, VMLogLevel level, uint32_t timestamp, const char* tag, const char* text, size_t length) {
+  static const uint8_t severities[] = { 7, 6, 4, 3 };
+  char line[LOG_SHIP_MAX_LINE];
+
+  // Wall-clock time once SNTP has set it, otherwise the nil value
+  char stamp[32] = "-";
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  if (now.tv_sec > 1600000000) {
+    int64_t ms = (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000 - (uint32_t)(millis() - timestamp);
+    time_t seconds = ms / 1000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(stamp + n, sizeof(stamp) - n, ".%03dZ", (int)(ms % 1000));
+  }
+
+  const char* host = WiFi.getHostname();
+  int written = snprintf(line, sizeof(line), "<%d>1 %s %s %s %s - - %.*s",
+    LOG_SHIP_FACILITY * 8 + severities[level & 3], stamp, host && *host ? host : "-",
+    tag && *tag ? tag : "-", procId(source), (int)length, text);
+  if (written <= 0) {
+    return;
+  }
+  uint16_t size = min((size_t)written, sizeof(line) - 1);
+
+  uint32_t h = head.load(std::memory_order_relaxed);
+  if (LOG_SHIP_BUFFER_BYTES - (h - tail.load(std::memory_order_acquire)) < size + sizeof(size)) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  copyIn(h, &size, sizeof(size));
+  copyIn(h + sizeof(size), line, size);
+  head.store(h + sizeof(size) + size, std::memory_order_release);
+
+  if (h + sizeof(size) + size - tail.load(std::memory_order_relaxed) >= cfg.batchBytes && shipTask) {
+    xTaskNotifyGive(shipTask);
+  }
+}
+
+static void flushRepeats(const LogShipConfig& cfg) {
+  if (last.repeats > 0) {
+    char text[48];
+    int length = snprintf(text, sizeof(text), "last message repeated %lu times", (unsigned long)last.repeats);
+    queueLine(cfg, last.source, last.level, last.lastSeen, last.tag, text, length);
+    last.repeats = 0;
+  }
+}
+
+// vm_log sink, runs on the log drain task. Identical consecutive lines from
+// a source are folded into one "repeated" line, which is where chatty loops
+// save the most bandwidth.
+static void onLogLine(int source, VMLogLevel level, uint32_t timestamp, const char* tag, const char* text, size_t length) {
+  // The serial command may reconfigure the shipper while this runs
+  LogShipConfig cfg;
+  logShipperGetConfig(&cfg);
+  if (cfg.transport == LOG_SHIP_OFF) {
+    last.repeats = 0;
+    return;
+  }
+
+  if (source < 0) {
+    if (last.repeats > 0 && millis() - last.lastSeen >= LOG_SHIP_REPEAT_FLUSH_MS) {
+      flushRepeats(cfg);
+    }
+    return;
+  }
+
+  uint32_t hash = hashLine(text, length);
+  if (source == last.source && hash == last.hash) {
+    last.repeats++;
+    last.lastSeen = timestamp;
+    folded.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  flushRepeats(cfg);
+  last.source = source;
+  last.hash = hash;
+  last.lastSeen = timestamp;
+  last.level = level;
+  strlcpy(last.tag, tag, sizeof(last.tag));
+  queueLine(cfg, source, level, timestamp, tag, text, length);
+}
+
+static bool resolve(const LogShipConfig& cfg, sockaddr_in* address) {
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  addrinfo* result = nullptr;
+  if (getaddrinfo(cfg.host, nullptr, &hints, &result) != 0 || !result) {
+    return false;
+  }
+  *address = *(sockaddr_in*)result->ai_addr;
+  address->sin_port = htons(cfg.port);
+  freeaddrinfo(result);
+  return true;
+}
+
+static int openSocket(const LogShipConfig& cfg) {
+  sockaddr_in address;
+  if (!resolve(cfg, &address)) {
+    return -1;
+  }
+
+  int fd = socket(AF_INET, cfg.transport == LOG_SHIP_TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  timeval timeout = { LOG_SHIP_CONNECT_TIMEOUT_MS / 1000, (LOG_SHIP_CONNECT_TIMEOUT_MS % 1000) * 1000 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // SO_SNDTIMEO does not bound a blocking connect(), so connect without
+  // blocking and wait for the handshake with select(). UDP connect() just
+  // fixes the destination for send() and completes at once.
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  bool connected = connect(fd, (sockaddr*)&address, sizeof(address)) == 0;
+  if (!connected && errno == EINPROGRESS) {
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(fd, &writable);
+    int error = 0;
+    socklen_t length = sizeof(error);
+    connected = select(fd + 1, nullptr, &writable, nullptr, &timeout) > 0 &&
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+  }
+  if (!connected) {
+    close(fd);
+    return -1;
+  }
+
+  // Sends stay blocking, bounded by SO_SNDTIMEO
+  fcntl(fd, F_SETFL, flags);
+  return fd;
+}
+
+static bool sendAll(int fd, const uint8_t* data, size_t length) {
+  while (length > 0) {
+    int sent = send(fd, data, length, 0);
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+// Packs queued lines into one send without consuming them: as many
+// octet-counted frames as fit over TCP, but a single message over UDP, where
+// each datagram is one message (RFC 5426). Returns the size and sets
+// *consumed to the ring bytes it covers.
+static size_t buildBatch(const LogShipConfig& cfg, uint8_t* batch, size_t capacity, uint32_t* consumed, uint32_t* count) {
+  uint32_t pos = tail.load(std::memory_order_relaxed);
+  uint32_t end = head.load(std::memory_order_acquire);
+  size_t used = 0;
+  *count = 0;
+
+  while (pos != end) {
+    uint16_t size;
+    copyOut(pos, &size, sizeof(size));
+
+    char prefix[8] = "";
+    int prefixLength = cfg.transport == LOG_SHIP_TCP ? snprintf(prefix, sizeof(prefix), "%u ", size) : 0;
+    if (used + prefixLength + size > capacity) {
+      break;
+    }
+
+    memcpy(&batch[used], prefix, prefixLength);
+    copyOut(pos + sizeof(size), &batch[used + prefixLength], size);
+    used += prefixLength + size;
+    pos += sizeof(size) + size;
+    (*count)++;
+    if (cfg.transport == LOG_SHIP_UDP) {
+      break;
+    }
+  }
+
+  *consumed = pos - tail.load(std::memory_order_relaxed);
+  return used;
+}
+
+static void logShipTask(void* parameter) {
+  static uint8_t batch[LOG_SHIP_MAX_BATCH];
+  static_assert(LOG_SHIP_MAX_BATCH >= LOG_SHIP_MAX_LINE + 8, "batch must hold a full line");
+  int fd = -1;
+  uint32_t lastFlush = millis();
+
+  while (true) {
+    LogShipConfig cfg;
+    logShipperGetConfig(&cfg);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(cfg.flushMs > 0 ? cfg.flushMs : 1000));
+
+    if (reconfigured.exchange(false) && fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+    logShipperGetConfig(&cfg);
+
+    uint32_t pending = head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+    if (cfg.transport == LOG_SHIP_OFF) {
+      tail.store(tail.load(std::memory_order_relaxed) + pending, std::memory_order_release);
+      continue;
+    }
+    if (pending == 0 || (pending < cfg.batchBytes && millis() - lastFlush < cfg.flushMs)) {
+      continue;
+    }
+    // Keep buffering until the network is back
+    if (WiFi.status() != WL_CONNECTED) {
+      continue;
+    }
+
+    if (fd < 0 && (fd = openSocket(cfg)) < 0) {
+      sendFailures.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    lastFlush = millis();
+    // Always room for one full line plus its octet-count prefix
+    size_t capacity = max((size_t)cfg.batchBytes, (size_t)LOG_SHIP_MAX_LINE + 8);
+    uint32_t shipped = 0;
+    while (true) {
+      uint32_t consumed, count;
+      size_t length = buildBatch(cfg, batch, capacity, &consumed, &count);
+      if (length == 0) {
+        break;
+      }
+
+      if (!sendAll(fd, batch, length)) {
+        sendFailures.fetch_add(1, std::memory_order_relaxed);
+        close(fd);
+        fd = -1;
+        break;
+      }
+
+      tail.store(tail.load(std::memory_order_relaxed) + consumed, std::memory_order_release);
+      shipped += count;
+      lines.fetch_add(count, std::memory_order_relaxed);
+      bytesSent.fetch_add(length, std::memory_order_relaxed);
+    }
+    if (shipped > 0) {
+      batches.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+static void loadConfig() {
+  Preferences prefs;
+  if (!prefs.begin("logship", true)) {
+    return;
+  }
+  config.transport = (LogShipTransport)prefs.getUChar("transport", LOG_SHIP_OFF);
+  prefs.getString("host", config.host, sizeof(config.host));
+  config.port = prefs.getUShort("port", 514);
+  config.batchBytes = prefs.getUShort("batch", 1024);
+  config.flushMs = prefs.getULong("flush", 5000);
+  prefs.end();
+}
+
+static void saveConfig(const LogShipConfig& cfg) {
+  Preferences prefs;
+  if (!prefs.begin("logship", false)) {
+    return;
+  }
+  prefs.putUChar("transport", cfg.transport);
+  prefs.putString("host", cfg.host);
+  prefs.putUShort("port", cfg.port);
+  prefs.putUShort("batch", cfg.batchBytes);
+  prefs.putULong("flush", cfg.flushMs);
+  prefs.end();
+}
+
+void logShipperBegin() {
+  if (shipTask) {
+    return;
+  }
+
+  configMutex = xSemaphoreCreateMutex();
+  loadConfig();
+  xTaskCreatePinnedToCore(logShipTask, "Log_Ship", 4096, nullptr, 1, &shipTask, 0);
+  vmLogSetSink(onLogLine);
+}
+
+bool logShipperConfigure(const LogShipConfig& newConfig) {
+  if (newConfig.transport != LOG_SHIP_OFF && (!newConfig.host[0] || newConfig.port == 0)) {
+    return false;
+  }
+  if (!configMutex) {
+    return false;
+  }
+
+  xSemaphoreTake(configMutex, portMAX_DELAY);
+  config = newConfig;
+  config.batchBytes = constrain(config.batchBytes, 64, LOG_SHIP_MAX_BATCH);
+  config.flushMs = max(config.flushMs, (uint32_t)100);
+  xSemaphoreGive(configMutex);
+
+  saveConfig(config);
+  reconfigured.store(true);
+  if (shipTask) {
+    xTaskNotifyGive(shipTask);
+  }
+  return true;
+}
+
+void logShipperGetConfig(LogShipConfig* out) {
+  if (configMutex) {
+    xSemaphoreTake(configMutex, portMAX_DELAY);
+  }
+  *out = config;
+  if (configMutex) {
+    xSemaphoreGive(configMutex);
+  }
+}
+
+void logShipperGetStats(LogShipStats* stats) {
+  stats->batches = batches.load();
+  stats->lines = lines.load();
+  stats->bytes = bytesSent.load();
+  stats->folded = folded.load();
+  stats->dropped = dropped.load();
+  stats->sendFailures = sendFailures.load();
+  stats->pendingBytes = head.load() - tail.load();
+}
@@ -0,0 +1,547 @@
+// msg_link.cpp
+#include "include/msg_link.h"
+#include "include/vm_manager.h"
+#include "include/vm_log.h"
+#include <WiFi.h>
+#include <Preferences.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <freertos/semphr.h>
+
+#define LINK_MAGIC 0x4C56      // "VL"
+#define LINK_VERSION 1
+#define LINK_SPAN 16           // How far a sender may run ahead of its oldest unacknowledged datagram
+#define LINK_RECENT (2 * LINK_SPAN)   // Sequence numbers remembered per peer to drop duplicates
+
+enum LinkType : uint8_t {
+  LINK_DATA = 1,
+  LINK_ACK,
+};
+
+struct __attribute__((packed)) LinkHeader {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t type;
+  uint32_t seq;         // DATA only; starts at a random value on every boot
+};
+
+struct __attribute__((packed)) LinkRecord {
+  uint8_t slot;
+  uint8_t nameLength;
+  uint8_t textLength;
+};
+
+enum SlotState : uint8_t {
+  SLOT_FREE = 0,
+  SLOT_FILLING,    // Collecting messages until the next poll
+  SLOT_IN_FLIGHT,  // Sent, waiting for the ACK
+};
+
+struct LinkSlot {
+  SlotState state;
+  uint8_t attempts;
+  uint16_t length;
+  uint16_t messages;
+  uint32_t seq;
+  unsigned long sentAt;
+  int64_t oldestUs;      // When the first message was queued...
+  int64_t queuedSumUs;   // ...and the sum over all of them, for the mean latency
+  uint8_t data[MSG_LINK_DATAGRAM_BYTES];
+};
+
+struct LinkPeer {
+  char name[MSG_LINK_NAME_LENGTH];   // Empty when the entry is unused
+  uint32_t address;
+  uint16_t port;
+  LinkSlot* slots;                   // MSG_LINK_WINDOW of them, allocated with the peer
+  uint32_t nextSeq;
+  uint32_t recent[LINK_RECENT];
+  uint8_t recentCount;
+  uint8_t recentNext;
+  uint32_t acks[MSG_LINK_MAX_ACKS];
+  uint8_t ackCount;
+  MsgLinkStats stats;
+};
+
+struct SavedPeer {
+  char name[MSG_LINK_NAME_LENGTH];
+  uint32_t address;
+  uint16_t port;
+};
+
+// A running VM as the link sees it. The VM manager's own fields change on
+// the loop task without a lock, so the name and queue are copied here when
+// the VM's task starts and cleared before the queue is deleted.
+struct LocalVM {
+  char name[MSG_LINK_NAME_LENGTH];  // Script name without directory and extension; empty if too long
+  QueueHandle_t queue;              // nullptr while the VM is not running
+};
+
+// VM tasks queue messages; the loop task receives, sends and changes the
+// configuration. Nothing done under the lock blocks.
+static LinkPeer peers[MSG_LINK_MAX_PEERS];
+static LocalVM localVMs[MAX_VMS];
+static char nodeName[MSG_LINK_NAME_LENGTH];
+static SemaphoreHandle_t linkMutex = nullptr;
+
+static void lockLink() {
+  xSemaphoreTake(linkMutex, portMAX_DELAY);
+}
+
+static void unlockLink() {
+  xSemaphoreGive(linkMutex);
+}
+
+static bool validName(const char* name) {
+  size_t length = strlen(name);
+  return length > 0 && length < MSG_LINK_NAME_LENGTH && !strchr(name, ':');
+}
+
+static LinkPeer* findPeer(const char* name, size_t length) {
+  for (int i = 0; i < MSG_LINK_MAX_PEERS; i++) {
+    if (peers[i].name[0] && strlen(peers[i].name) == length && strncmp(peers[i].name, name, length) == 0) {
+      return &peers[i];
+    }
+  }
+  return nullptr;
+}
+
+static bool isSlotNumber(const char* name, size_t length) {
+  return length > 0 && length <= 2 && isdigit(name[0]) && (length == 1 || isdigit(name[1]));
+}
+
+// A slot number, or a running VM whose script is <name>.js or <name>.jsbc
+// in any directory. Called with the lock held.
+static int findLocalVM(const char* name, size_t length) {
+  if (isSlotNumber(name, length)) {
+    int slot = atoi(name);
+    return slot < MAX_VMS && localVMs[slot].queue ? slot : -1;
+  }
+  for (int i = 0; i < MAX_VMS; i++) {
+    if (localVMs[i].queue && strlen(localVMs[i].name) == length && strncmp(localVMs[i].name, name, length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Called with the lock held; the send does not wait for room
+static bool deliverLocal(int vmIndex, const char* text, size_t length) {
+  if (vmIndex < 0 || !localVMs[vmIndex].queue) {
+    return false;
+  }
+  char message[MAX_MESSAGE_LENGTH];
+  length = min(length, (size_t)MAX_MESSAGE_LENGTH - 1);
+  memcpy(message, text, length);
+  message[length] = '\0';
+  return xQueueSend(localVMs[vmIndex].queue, message, 0) == pdTRUE;
+}
+
+static void saveConfig() {
+  SavedPeer saved[MSG_LINK_MAX_PEERS];
+  size_t count = 0;
+  char name[MSG_LINK_NAME_LENGTH];
+  lockLink();
+  strlcpy(name, nodeName, sizeof(name));
+  for (int i = 0; i < MSG_LINK_MAX_PEERS; i++) {
+    if (peers[i].name[0]) {
+      memset(&saved[count], 0, sizeof(saved[count]));
+      strlcpy(saved[count].name, peers[i].name, sizeof(saved[count].name));
+      saved[count].address = peers[i].address;
+      saved[count].port = peers[i].port;
+      count++;
+    }
+  }
+  unlockLink();
+
+  Preferences prefs;
+  if (!prefs.begin("msglink", false)) {
+    return;
+  }
+  prefs.putString("name", name);
+  prefs.putBytes("peers", saved, count * sizeof(SavedPeer));
+  prefs.end();
+}
+
+// Called with the lock held
+static bool addPeer(const char* name, uint32_t address, uint16_t port) {
+  LinkPeer* peer = findPeer(name, strlen(name));
+  if (peer) {
+    peer->address = address;
+    peer->port = port;
+    peer->stats.address = address;
+    peer->stats.port = port;
+    return true;
+  }
+  for (int i = 0; i < MSG_LINK_MAX_PEERS && !peer; i++) {
+    if (!peers[i].name[0]) {
+      peer = &peers[i];
+    }
+  }
+  if (!peer) {
+    return false;
+  }
+  peer->slots = (LinkSlot*)calloc(MSG_LINK_WINDOW, sizeof(LinkSlot));
+  if (!peer->slots) {
+    return false;
+  }
+  strlcpy(peer->name, name, sizeof(peer->name));
+  peer->address = address;
+  peer->port = port;
+  peer->nextSeq = esp_random();
+  peer->recentCount = 0;
+  peer->recentNext = 0;
+  peer->ackCount = 0;
+  memset(peer->recent, 0, sizeof(peer->recent));
+  memset(&peer->stats, 0, sizeof(peer->stats));
+  strlcpy(peer->stats.name, name, sizeof(peer->stats.name));
+  peer->stats.address = address;
+  peer->stats.port = port;
+  return true;
+}
+
+void msgLinkBegin() {
+  if (linkMutex) {
+    return;
+  }
+  linkMutex = xSemaphoreCreateMutex();
+
+  Preferences prefs;
+  SavedPeer saved[MSG_LINK_MAX_PEERS];
+  size_t count = 0;
+  if (prefs.begin("msglink", true)) {
+    prefs.getString("name", nodeName, sizeof(nodeName));
+    count = prefs.getBytes("peers", saved, sizeof(saved)) / sizeof(SavedPeer);
+    prefs.end();
+  }
+  if (!nodeName[0]) {
+    strlcpy(nodeName, WiFi.getHostname(), sizeof(nodeName));
+  }
+
+  lockLink();
+  for (size_t i = 0; i < count; i++) {
+    saved[i].name[MSG_LINK_NAME_LENGTH - 1] = '\0';
+    addPeer(saved[i].name, saved[i].address, saved[i].port);
+  }
+  unlockLink();
+
+  if (!netUdpBind(NET_OWNER_SYSTEM, MSG_LINK_PORT)) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Message link: cannot bind port %u", MSG_LINK_PORT);
+  }
+}
+
+void msgLinkAttachVM(int vmIndex, const char* filename, QueueHandle_t queue) {
+  if (!linkMutex || vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return;
+  }
+  const char* base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+  const char* extension = strrchr(base, '.');
+  size_t length = extension ? extension - base : strlen(base);
+  lockLink();
+  LocalVM& vm = localVMs[vmIndex];
+  vm.name[0] = '\0';
+  if (length < sizeof(vm.name)) {
+    memcpy(vm.name, base, length);
+    vm.name[length] = '\0';
+  }
+  vm.queue = queue;
+  unlockLink();
+}
+
+void msgLinkDetachVM(int vmIndex) {
+  if (!linkMutex || vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return;
+  }
+  lockLink();
+  localVMs[vmIndex].name[0] = '\0';
+  localVMs[vmIndex].queue = nullptr;
+  unlockLink();
+}
+
+bool msgLinkSend(const char* address, const char* text) {
+  if (!linkMutex) {
+    return false;
+  }
+
+  const char* colon = strchr(address, ':');
+  const char* target = colon ? colon + 1 : address;
+  size_t nodeLength = colon ? colon - address : 0;
+  size_t targetLength = strlen(target);
+  lockLink();
+  if (!colon || (nodeLength == strlen(nodeName) && strncmp(address, nodeName, nodeLength) == 0)) {
+    bool delivered = deliverLocal(findLocalVM(target, targetLength), text, strlen(text));
+    unlockLink();
+    return delivered;
+  }
+  unlockLink();
+
+  uint8_t slot = MSG_LINK_BY_NAME;
+  if (isSlotNumber(target, targetLength)) {
+    slot = atoi(target);
+    targetLength = 0;
+  }
+  size_t textLength = min(strlen(text), (size_t)MAX_MESSAGE_LENGTH - 1);
+  size_t recordLength = sizeof(LinkRecord) + targetLength + textLength;
+  if (targetLength >= MSG_LINK_NAME_LENGTH || (slot != MSG_LINK_BY_NAME && slot >= MAX_VMS)) {
+    return false;
+  }
+
+  lockLink();
+  LinkPeer* peer = findPeer(address, nodeLength);
+  LinkSlot* batch = nullptr;
+  for (int i = 0; peer && i < MSG_LINK_WINDOW && !batch; i++) {
+    LinkSlot& candidate = peer->slots[i];
+    if (candidate.state == SLOT_FILLING && candidate.length + recordLength <= MSG_LINK_DATAGRAM_BYTES) {
+      batch = &candidate;
+    }
+  }
+  for (int i = 0; peer && i < MSG_LINK_WINDOW && !batch; i++) {
+    if (peer->slots[i].state == SLOT_FREE) {
+      batch = &peer->slots[i];
+      batch->state = SLOT_FILLING;
+      batch->length = sizeof(LinkHeader);
+      batch->messages = 0;
+      batch->queuedSumUs = 0;
+    }
+  }
+  if (!batch) {
+    unlockLink();
+    return false;
+  }
+
+  int64_t now = esp_timer_get_time();
+  LinkRecord record = { slot, (uint8_t)targetLength, (uint8_t)textLength };
+  uint8_t* out = batch->data + batch->length;
+  memcpy(out, &record, sizeof(record));
+  memcpy(out + sizeof(record), target, targetLength);
+  memcpy(out + sizeof(record) + targetLength, text, textLength);
+  batch->length += recordLength;
+  if (batch->messages++ == 0) {
+    batch->oldestUs = now;
+  }
+  batch->queuedSumUs += now;
+  peer->stats.pending++;
+  unlockLink();
+  return true;
+}
+
+static void sendSlot(LinkPeer& peer, LinkSlot& slot) {
+  slot.sentAt = millis();
+  slot.attempts++;
+  peer.stats.datagrams++;
+  netUdpSend(NET_OWNER_SYSTEM, MSG_LINK_PORT, peer.address, peer.port, slot.data, slot.length);
+}
+
+static void receiveData(LinkPeer& peer, uint32_t seq, const uint8_t* data, size_t length) {
+  // Acknowledge even a duplicate: the peer resent it because our ACK was lost
+  if (peer.ackCount < MSG_LINK_MAX_ACKS) {
+    peer.acks[peer.ackCount++] = seq;
+  }
+  for (int i = 0; i < peer.recentCount; i++) {
+    if (peer.recent[i] == seq) {
+      peer.stats.duplicates++;
+      return;
+    }
+  }
+  peer.recent[peer.recentNext] = seq;
+  peer.recentNext = (peer.recentNext + 1) % LINK_RECENT;
+  peer.recentCount = min(peer.recentCount + 1, LINK_RECENT);
+
+  size_t offset = 0;
+  while (offset + sizeof(LinkRecord) <= length) {
+    LinkRecord record;
+    memcpy(&record, data + offset, sizeof(record));
+    const char* name = (const char*)data + offset + sizeof(record);
+    const char* text = name + record.nameLength;
+    offset += sizeof(record) + record.nameLength + record.textLength;
+    if (offset > length) {
+      break;
+    }
+
+    int vmIndex = record.slot == MSG_LINK_BY_NAME ? findLocalVM(name, record.nameLength)
+                : record.slot < MAX_VMS && localVMs[record.slot].queue ? record.slot : -1;
+    if (deliverLocal(vmIndex, text, record.textLength)) {
+      peer.stats.received++;
+    } else {
+      peer.stats.undeliverable++;
+    }
+  }
+}
+
+static void receiveAcks(LinkPeer& peer, const uint8_t* data, size_t length) {
+  int64_t now = esp_timer_get_time();
+  for (size_t offset = 0; offset + 4 <= length; offset += 4) {
+    uint32_t seq;
+    memcpy(&seq, data + offset, 4);
+    for (int i = 0; i < MSG_LINK_WINDOW; i++) {
+      LinkSlot& slot = peer.slots[i];
+      if (slot.state == SLOT_IN_FLIGHT && slot.seq == seq) {
+        uint32_t oldest = now - slot.oldestUs;
+        peer.stats.sent += slot.messages;
+        peer.stats.pending -= slot.messages;
+        peer.stats.latencySumUs += now * slot.messages - slot.queuedSumUs;
+        peer.stats.latencyMaxUs = max(peer.stats.latencyMaxUs, oldest);
+        slot.state = SLOT_FREE;
+      }
+    }
+  }
+}
+
+void msgLinkHandleDatagram(const NetDatagram& datagram) {
+  LinkHeader header;
+  if (!linkMutex || datagram.length < sizeof(header)) {
+    return;
+  }
+  memcpy(&header, datagram.data, sizeof(header));
+  if (header.magic != LINK_MAGIC || header.version != LINK_VERSION) {
+    return;
+  }
+
+  lockLink();
+  LinkPeer* peer = nullptr;
+  for (int i = 0; i < MSG_LINK_MAX_PEERS && !peer; i++) {
+    if (peers[i].name[0] && peers[i].address == datagram.address && peers[i].port == datagram.port) {
+      peer = &peers[i];
+    }
+  }
+  if (!peer) {
+    unlockLink();
+    char address[16];
+    netFormatAddress(datagram.address, address, sizeof(address));
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Message link: ignoring %s:%u, not a peer", address, datagram.port);
+    return;
+  }
+
+  const uint8_t* payload = datagram.data + sizeof(header);
+  size_t length = datagram.length - sizeof(header);
+  if (header.type == LINK_DATA) {
+    receiveData(*peer, header.seq, payload, length);
+  } else if (header.type == LINK_ACK) {
+    receiveAcks(*peer, payload, length);
+  }
+  unlockLink();
+}
+
+// A retransmission is only recognised while the receiver still remembers its
+// sequence number. Holding new numbers back while the oldest datagram in
+// flight is LINK_SPAN behind means that, until it is acknowledged, fewer than
+// LINK_RECENT others can arrive: LINK_SPAN - 1 on either side of it.
+static bool canNumber(const LinkPeer& peer) {
+  for (int i = 0; i < MSG_LINK_WINDOW; i++) {
+    const LinkSlot& slot = peer.slots[i];
+    if (slot.state == SLOT_IN_FLIGHT && peer.nextSeq - slot.seq >= LINK_SPAN) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void msgLinkPoll() {
+  if (!linkMutex) {
+    return;
+  }
+
+  lockLink();
+  unsigned long now = millis();
+  for (int p = 0; p < MSG_LINK_MAX_PEERS; p++) {
+    LinkPeer& peer = peers[p];
+    if (!peer.name[0]) {
+      continue;
+    }
+
+    if (peer.ackCount > 0) {
+      uint8_t packet[sizeof(LinkHeader) + MSG_LINK_MAX_ACKS * 4];
+      LinkHeader header = { LINK_MAGIC, LINK_VERSION, LINK_ACK, 0 };
+      memcpy(packet, &header, sizeof(header));
+      memcpy(packet + sizeof(header), peer.acks, peer.ackCount * 4);
+      netUdpSend(NET_OWNER_SYSTEM, MSG_LINK_PORT, peer.address, peer.port, packet, sizeof(header) + peer.ackCount * 4);
+      peer.ackCount = 0;
+    }
+
+    for (int i = 0; i < MSG_LINK_WINDOW; i++) {
+      LinkSlot& slot = peer.slots[i];
+      if (slot.state == SLOT_FILLING && canNumber(peer)) {
+        LinkHeader header = { LINK_MAGIC, LINK_VERSION, LINK_DATA, peer.nextSeq++ };
+        memcpy(slot.data, &header, sizeof(header));
+        slot.seq = header.seq;
+        slot.state = SLOT_IN_FLIGHT;
+        slot.attempts = 0;
+        sendSlot(peer, slot);
+      } else if (slot.state == SLOT_IN_FLIGHT && now - slot.sentAt >= (unsigned long)MSG_LINK_RTO_MS << (slot.attempts - 1)) {
+        if (slot.attempts > MSG_LINK_RETRIES) {
+          peer.stats.failed += slot.messages;
+          peer.stats.pending -= slot.messages;
+          slot.state = SLOT_FREE;
+          vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "Message link: %s not answering, dropped %u messages",
+            peer.name, slot.messages);
+        } else {
+          peer.stats.retransmits++;
+          sendSlot(peer, slot);
+        }
+      }
+    }
+  }
+  unlockLink();
+}
+
+bool msgLinkSetName(const char* name) {
+  if (!linkMutex || !validName(name)) {
+    return false;
+  }
+  lockLink();
+  strlcpy(nodeName, name, sizeof(nodeName));
+  unlockLink();
+  saveConfig();
+  return true;
+}
+
+const char* msgLinkName() {
+  return nodeName;
+}
+
+bool msgLinkAddPeer(const char* name, uint32_t address, uint16_t port) {
+  if (!linkMutex || !validName(name) || port == 0) {
+    return false;
+  }
+  lockLink();
+  bool added = addPeer(name, address, port);
+  unlockLink();
+  if (added) {
+    saveConfig();
+  }
+  return added;
+}
+
+bool msgLinkRemovePeer(const char* name) {
+  if (!linkMutex) {
+    return false;
+  }
+  lockLink();
+  LinkPeer* peer = findPeer(name, strlen(name));
+  if (peer) {
+    free(peer->slots);
+    memset(peer, 0, sizeof(*peer));
+  }
+  unlockLink();
+  if (peer) {
+    saveConfig();
+  }
+  return peer != nullptr;
+}
+
+bool msgLinkGetStats(int peer, MsgLinkStats* stats) {
+  if (!linkMutex) {
+    return false;
+  }
+  lockLink();
+  int index = -1;
+  for (int i = 0; i < MSG_LINK_MAX_PEERS; i++) {
+    if (peers[i].name[0] && ++index == peer) {
+      *stats = peers[i].stats;
+      unlockLink();
+      return true;
+    }
+  }
+  unlockLink();
+  return false;
+}
@@ -0,0 +1,756 @@
+// net_manager.cpp
+#include "include/net_manager.h"
+#include "include/vm_log.h"
+#include "include/vm_events.h"
+#include <esp_timer.h>
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/ringbuf.h>
+
+// Prefix stored in front of each datagram in a receive queue
+struct DatagramHeader {
+  uint32_t address;
+  uint16_t port;
+  uint16_t localPort;
+};
+
+struct NetSocket {
+  int fd;
+  int owner;
+  uint16_t port;
+};
+
+struct NetOwner {
+  RingbufHandle_t queue;     // NOSPLIT ring of DatagramHeader + payload items
+  uint32_t received;
+  uint32_t dropped;
+  uint32_t sent;
+  uint32_t sendFailures;
+};
+
+enum TcpState : uint8_t {
+  TCP_FREE = 0,
+  TCP_LISTENING,
+  TCP_CONNECTING,
+  TCP_OPEN,
+  TCP_CLOSING,     // Closed by the script, still flushing its send buffer
+  TCP_CLOSED,      // Closed by the peer or an error, waiting for the script
+};
+
+// rx is filled by the network task and emptied by the VM, tx the other way
+// round. Head and tail are free-running and, like the state, only touched
+// under the lock.
+struct TcpConn {
+  TcpState state;
+  int fd;
+  int owner;
+  uint8_t* rx;
+  uint8_t* tx;
+  uint32_t rxHead, rxTail;
+  uint32_t txHead, txTail;
+  bool dataQueued;     // A VM_EVENT_TCP_DATA event is waiting to be dispatched
+  bool blocked;        // A write came up short; post a drain event once there is room
+};
+
+// The socket table and the queue handles are shared by the network task and
+// the VM tasks. Everything done under the lock is non-blocking.
+static NetSocket sockets[NET_MAX_SOCKETS];
+static NetOwner owners[NET_OWNERS];
+static SemaphoreHandle_t netMutex = nullptr;
+static TaskHandle_t netTask = nullptr;
+static int sendFd = -1;      // Unbound socket for owners that send without binding
+static TcpConn connections[NET_MAX_TCP];
+
+static void lockNet() {
+  xSemaphoreTake(netMutex, portMAX_DELAY);
+}
+
+static void unlockNet() {
+  xSemaphoreGive(netMutex);
+}
+
+static bool validOwner(int owner) {
+  return owner >= 0 && owner < NET_OWNERS && netMutex;
+}
+
+static NetSocket* findSocket(uint16_t port) {
+  for (int i = 0; i < NET_MAX_SOCKETS; i++) {
+    if (sockets[i].fd >= 0 && sockets[i].port == port) {
+      return &sockets[i];
+    }
+  }
+  return nullptr;
+}
+
+// Moves every datagram waiting on a socket into its owner's queue
+static void drainSocket(NetSocket& sock, uint8_t* buffer) {
+  NetOwner& owner = owners[sock.owner];
+
+  while (true) {
+    sockaddr_in from;
+    socklen_t fromLength = sizeof(from);
+    int length = recvfrom(sock.fd, buffer + sizeof(DatagramHeader), NET_MAX_DATAGRAM, MSG_DONTWAIT,
+                          (sockaddr*)&from, &fromLength);
+    if (length < 0) {
+      return;
+    }
+
+    DatagramHeader header = { from.sin_addr.s_addr, ntohs(from.sin_port), sock.port };
+    memcpy(buffer, &header, sizeof(header));
+    if (owner.queue && xRingbufferSend(owner.queue, buffer, sizeof(header) + length, 0) == pdTRUE) {
+      owner.received++;
+    } else {
+      owner.dropped++;
+    }
+  }
+}
+
+static bool postTcpEvent(const TcpConn& conn, int id, uint8_t type, int32_t value) {
+  VMEvent event = {};
+  event.type = type;
+  event.source = id;
+  event.count = 1;
+  event.value = value;
+  event.timestamp = esp_timer_get_time();
+  return vmEventPost(conn.owner, event);
+}
+
+static void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static int findFreeConnection() {
+  for (int id = 0; id < NET_MAX_TCP; id++) {
+    if (connections[id].state == TCP_FREE) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+static bool allocateBuffers(TcpConn& conn) {
+  conn.rx = (uint8_t*)malloc(NET_TCP_BUFFER_BYTES);
+  conn.tx = (uint8_t*)malloc(NET_TCP_BUFFER_BYTES);
+  conn.rxHead = conn.rxTail = conn.txHead = conn.txTail = 0;
+  return conn.rx && conn.tx;
+}
+
+static void freeConnection(TcpConn& conn) {
+  if (conn.fd >= 0) {
+    close(conn.fd);
+  }
+  free(conn.rx);
+  free(conn.tx);
+  conn = {};
+  conn.fd = -1;
+}
+
+// Closes the socket after an error or the peer's FIN. Data already received
+// stays readable until the script closes the id.
+static void dropConnection(TcpConn& conn, int id, int error) {
+  if (conn.state == TCP_CLOSING) {
+    freeConnection(conn);
+    return;
+  }
+  close(conn.fd);
+  conn.fd = -1;
+  conn.state = TCP_CLOSED;
+  conn.txHead = conn.txTail;
+  postTcpEvent(conn, id, VM_EVENT_TCP_CLOSE, error);
+}
+
+static void acceptPending(TcpConn& listener, int listenerId) {
+  while (true) {
+    int fd = accept(listener.fd, nullptr, nullptr);
+    if (fd < 0) {
+      return;
+    }
+
+    int id = findFreeConnection();
+    if (id < 0 || !allocateBuffers(connections[id])) {
+      if (id >= 0) {
+        freeConnection(connections[id]);
+      }
+      close(fd);
+      vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "TCP accept: no free connection for VM %d", listener.owner);
+      continue;
+    }
+
+    TcpConn& conn = connections[id];
+    setNonBlocking(fd);
+    conn.fd = fd;
+    conn.owner = listener.owner;
+    conn.state = TCP_OPEN;
+    postTcpEvent(listener, listenerId, VM_EVENT_TCP_ACCEPT, id);
+  }
+}
+
+static void receiveTcp(TcpConn& conn, int id) {
+  uint32_t used = conn.rxHead - conn.rxTail;
+  uint32_t offset = conn.rxHead & (NET_TCP_BUFFER_BYTES - 1);
+  size_t chunk = min((size_t)(NET_TCP_BUFFER_BYTES - used), (size_t)(NET_TCP_BUFFER_BYTES - offset));
+  if (chunk == 0) {
+    return;
+  }
+
+  int length = recv(conn.fd, conn.rx + offset, chunk, MSG_DONTWAIT);
+  if (length > 0) {
+    conn.rxHead += length;
+    if (!conn.dataQueued) {
+      conn.dataQueued = postTcpEvent(conn, id, VM_EVENT_TCP_DATA, used + length);
+    }
+  } else if (length == 0) {
+    dropConnection(conn, id, 0);
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    dropConnection(conn, id, errno);
+  }
+}
+
+// Sends as much of the tx ring as the socket takes without blocking
+static void flushTcp(TcpConn& conn, int id) {
+  while (conn.txHead != conn.txTail) {
+    uint32_t offset = conn.txTail & (NET_TCP_BUFFER_BYTES - 1);
+    size_t chunk = min((size_t)(conn.txHead - conn.txTail), (size_t)(NET_TCP_BUFFER_BYTES - offset));
+    int sent = send(conn.fd, conn.tx + offset, chunk, MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        dropConnection(conn, id, errno);
+      }
+      return;
+    }
+    conn.txTail += sent;
+  }
+
+  if (conn.state == TCP_CLOSING) {
+    freeConnection(conn);
+  } else if (conn.blocked) {
+    conn.blocked = false;
+    postTcpEvent(conn, id, VM_EVENT_TCP_DRAIN, NET_TCP_BUFFER_BYTES);
+  }
+}
+
+static void serviceTcp(int id, bool readable, bool writable) {
+  TcpConn& conn = connections[id];
+
+  if (conn.state == TCP_LISTENING) {
+    if (readable) {
+      acceptPending(conn, id);
+    }
+    return;
+  }
+
+  if (conn.state == TCP_CONNECTING) {
+    if (!writable) {
+      return;
+    }
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error) {
+      dropConnection(conn, id, error);
+      return;
+    }
+    conn.state = TCP_OPEN;
+  }
+
+  if (readable && conn.state == TCP_OPEN) {
+    receiveTcp(conn, id);
+  }
+  if (writable && (conn.state == TCP_OPEN || conn.state == TCP_CLOSING)) {
+    flushTcp(conn, id);
+  }
+}
+
+static void netTaskLoop(void* parameter) {
+  static uint8_t buffer[sizeof(DatagramHeader) + NET_MAX_DATAGRAM];
+
+  while (true) {
+    fd_set readable, writable;
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+    int maxFd = -1;
+
+    lockNet();
+    for (int i = 0; i < NET_MAX_SOCKETS; i++) {
+      if (sockets[i].fd >= 0) {
+        FD_SET(sockets[i].fd, &readable);
+        maxFd = max(maxFd, sockets[i].fd);
+      }
+    }
+    for (int id = 0; id < NET_MAX_TCP; id++) {
+      TcpConn& conn = connections[id];
+      bool wantRead = conn.state == TCP_LISTENING ||
+                      (conn.state == TCP_OPEN && conn.rxHead - conn.rxTail < NET_TCP_BUFFER_BYTES);
+      bool wantWrite = conn.state == TCP_CONNECTING ||
+                       ((conn.state == TCP_OPEN || conn.state == TCP_CLOSING) && conn.txHead != conn.txTail);
+      if (wantRead) {
+        FD_SET(conn.fd, &readable);
+      }
+      if (wantWrite) {
+        FD_SET(conn.fd, &writable);
+      }
+      if (wantRead || wantWrite) {
+        maxFd = max(maxFd, conn.fd);
+      }
+    }
+    unlockNet();
+
+    if (maxFd < 0) {
+      vTaskDelay(pdMS_TO_TICKS(NET_POLL_MS));
+      continue;
+    }
+
+    // The timeout bounds how long a new socket, or data a VM queued while
+    // its socket was idle, waits to be picked up
+    timeval timeout = { 0, NET_POLL_MS * 1000 };
+    if (select(maxFd + 1, &readable, &writable, nullptr, &timeout) <= 0) {
+      continue;
+    }
+
+    // A socket may have been closed and its descriptor reused since select();
+    // every call below is non-blocking, so the worst case is an empty read
+    lockNet();
+    for (int i = 0; i < NET_MAX_SOCKETS; i++) {
+      if (sockets[i].fd >= 0 && FD_ISSET(sockets[i].fd, &readable)) {
+        drainSocket(sockets[i], buffer);
+      }
+    }
+    for (int id = 0; id < NET_MAX_TCP; id++) {
+      int fd = connections[id].fd;
+      if (connections[id].state != TCP_FREE && fd >= 0) {
+        serviceTcp(id, FD_ISSET(fd, &readable), FD_ISSET(fd, &writable));
+      }
+    }
+    unlockNet();
+  }
+}
+
+// Runs on the VM task just before a data event is handed to JS, so the
+// handler sees everything that arrived while the event was queued
+static void finalizeData(VMEvent* event) {
+  lockNet();
+  TcpConn& conn = connections[event->source];
+  conn.dataQueued = false;
+  event->value = conn.rxHead - conn.rxTail;
+  unlockNet();
+}
+
+void netManagerBegin() {
+  if (netTask) {
+    return;
+  }
+
+  for (int i = 0; i < NET_MAX_SOCKETS; i++) {
+    sockets[i].fd = -1;
+  }
+  for (int id = 0; id < NET_MAX_TCP; id++) {
+    connections[id].fd = -1;
+  }
+  netMutex = xSemaphoreCreateMutex();
+  vmEventsSetFinalizer(VM_EVENT_TCP_DATA, finalizeData);
+  xTaskCreatePinnedToCore(netTaskLoop, "Net_Task", 4096, nullptr, 3, &netTask, 0);
+}
+
+bool netUdpBind(int owner, uint16_t port) {
+  if (!validOwner(owner) || port == 0) {
+    return false;
+  }
+
+  lockNet();
+  NetSocket* existing = findSocket(port);
+  if (existing) {
+    unlockNet();
+    return existing->owner == owner;
+  }
+
+  NetSocket* slot = nullptr;
+  for (int i = 0; i < NET_MAX_SOCKETS && !slot; i++) {
+    if (sockets[i].fd < 0) {
+      slot = &sockets[i];
+    }
+  }
+  if (!slot) {
+    unlockNet();
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "UDP bind %u: no free sockets", port);
+    return false;
+  }
+
+  if (!owners[owner].queue) {
+    owners[owner].queue = xRingbufferCreate(NET_RX_QUEUE_BYTES, RINGBUF_TYPE_NOSPLIT);
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (!owners[owner].queue || fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlockNet();
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "UDP bind %u failed (errno %d)", port, errno);
+    return false;
+  }
+
+  slot->fd = fd;
+  slot->owner = owner;
+  slot->port = port;
+  unlockNet();
+  return true;
+}
+
+bool netUdpUnbind(int owner, uint16_t port) {
+  if (!validOwner(owner)) {
+    return false;
+  }
+
+  lockNet();
+  NetSocket* sock = findSocket(port);
+  bool owned = sock && sock->owner == owner;
+  if (owned) {
+    close(sock->fd);
+    sock->fd = -1;
+  }
+  unlockNet();
+  return owned;
+}
+
+bool netUdpJoinGroup(int owner, uint16_t port, uint32_t group) {
+  if (!validOwner(owner)) {
+    return false;
+  }
+
+  lockNet();
+  NetSocket* sock = findSocket(port);
+  bool joined = false;
+  if (sock && sock->owner == owner) {
+    ip_mreq request = {};
+    request.imr_multiaddr.s_addr = group;
+    request.imr_interface.s_addr = htonl(INADDR_ANY);
+    joined = setsockopt(sock->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) == 0;
+  }
+  unlockNet();
+  return joined;
+}
+
+// Picks the descriptor to send from; called with the lock held
+static int sendSocket(int owner, uint16_t localPort) {
+  for (int i = 0; i < NET_MAX_SOCKETS; i++) {
+    if (sockets[i].fd >= 0 && sockets[i].owner == owner && (localPort == 0 || sockets[i].port == localPort)) {
+      return sockets[i].fd;
+    }
+  }
+  if (localPort != 0) {
+    return -1;
+  }
+  if (sendFd < 0) {
+    sendFd = socket(AF_INET, SOCK_DGRAM, 0);
+  }
+  return sendFd;
+}
+
+int netUdpSend(int owner, uint16_t localPort, uint32_t address, uint16_t port, const void* data, size_t length) {
+  NetBuffer buffer = { data, length };
+  return netUdpSendMany(owner, localPort, address, port, &buffer, 1) == 1 ? (int)length : -1;
+}
+
+int netUdpSendMany(int owner, uint16_t localPort, uint32_t address, uint16_t port, const NetBuffer* buffers, size_t count) {
+  if (!validOwner(owner)) {
+    return 0;
+  }
+
+  sockaddr_in to = {};
+  to.sin_family = AF_INET;
+  to.sin_port = htons(port);
+  to.sin_addr.s_addr = address;
+
+  // lwIP copies each payload into a pbuf inside sendto(), straight from the
+  // caller's buffer
+  lockNet();
+  int fd = sendSocket(owner, localPort);
+  int sent = 0;
+  while (fd >= 0 && sent < (int)count) {
+    const NetBuffer& buffer = buffers[sent];
+    if (buffer.length > NET_MAX_DATAGRAM || sendto(fd, buffer.data, buffer.length, 0, (sockaddr*)&to, sizeof(to)) < 0) {
+      break;
+    }
+    sent++;
+  }
+  owners[owner].sent += sent;
+  if (sent < (int)count) {
+    owners[owner].sendFailures++;
+  }
+  unlockNet();
+  return sent;
+}
+
+bool netUdpReceive(int owner, NetDatagram* datagram, uint32_t timeoutMs) {
+  if (!validOwner(owner) || !owners[owner].queue) {
+    return false;
+  }
+
+  size_t size;
+  uint8_t* item = (uint8_t*)xRingbufferReceive(owners[owner].queue, &size, pdMS_TO_TICKS(timeoutMs));
+  if (!item) {
+    return false;
+  }
+
+  DatagramHeader header;
+  memcpy(&header, item, sizeof(header));
+  datagram->address = header.address;
+  datagram->port = header.port;
+  datagram->localPort = header.localPort;
+  datagram->data = item + sizeof(header);
+  datagram->length = size - sizeof(header);
+  return true;
+}
+
+void netUdpRelease(int owner, const NetDatagram& datagram) {
+  if (validOwner(owner) && owners[owner].queue) {
+    vRingbufferReturnItem(owners[owner].queue, (void*)(datagram.data - sizeof(DatagramHeader)));
+  }
+}
+
+// Connections the script may use; a closing one already belongs to nobody
+static TcpConn* ownedConnection(int owner, int id) {
+  if (id < 0 || id >= NET_MAX_TCP) {
+    return nullptr;
+  }
+  TcpConn& conn = connections[id];
+  if (conn.state == TCP_FREE || conn.state == TCP_CLOSING || conn.owner != owner) {
+    return nullptr;
+  }
+  return &conn;
+}
+
+int netTcpConnect(int owner, const char* host, uint16_t port) {
+  if (!validOwner(owner)) {
+    return -1;
+  }
+
+  // A host name needs a DNS lookup, which blocks the calling task, so it
+  // happens before taking the lock. Addresses are parsed directly.
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  if (!netParseAddress(host, &address.sin_addr.s_addr)) {
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host, nullptr, &hints, &result) != 0 || !result) {
+      vmLogPrintf(owner, VM_LOG_WARN, "TCP connect: cannot resolve %s", host);
+      return -1;
+    }
+    address = *(sockaddr_in*)result->ai_addr;
+    freeaddrinfo(result);
+  }
+  address.sin_port = htons(port);
+
+  lockNet();
+  int id = findFreeConnection();
+  if (id < 0 || !allocateBuffers(connections[id])) {
+    if (id >= 0) {
+      freeConnection(connections[id]);
+    }
+    unlockNet();
+    return -1;
+  }
+
+  TcpConn& conn = connections[id];
+  conn.owner = owner;
+  conn.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (conn.fd >= 0) {
+    setNonBlocking(conn.fd);
+    if (connect(conn.fd, (sockaddr*)&address, sizeof(address)) == 0) {
+      conn.state = TCP_OPEN;
+    } else if (errno == EINPROGRESS) {
+      conn.state = TCP_CONNECTING;
+    }
+  }
+  if (conn.state == TCP_FREE) {
+    freeConnection(conn);
+    id = -1;
+  }
+  unlockNet();
+  return id;
+}
+
+int netTcpListen(int owner, uint16_t port, int backlog) {
+  if (!validOwner(owner)) {
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, backlog) != 0) {
+    vmLogPrintf(owner, VM_LOG_WARN, "TCP listen on %u failed (errno %d)", port, errno);
+    close(fd);
+    return -1;
+  }
+  setNonBlocking(fd);
+
+  lockNet();
+  int id = findFreeConnection();
+  if (id >= 0) {
+    connections[id].fd = fd;
+    connections[id].owner = owner;
+    connections[id].state = TCP_LISTENING;
+  } else {
+    close(fd);
+  }
+  unlockNet();
+  return id;
+}
+
+int netTcpWrite(int owner, int id, const void* data, size_t length) {
+  lockNet();
+  TcpConn* conn = ownedConnection(owner, id);
+  if (!conn || (conn->state != TCP_OPEN && conn->state != TCP_CONNECTING)) {
+    unlockNet();
+    return -1;
+  }
+
+  size_t accepted = min(length, (size_t)(NET_TCP_BUFFER_BYTES - (conn->txHead - conn->txTail)));
+  uint32_t offset = conn->txHead & (NET_TCP_BUFFER_BYTES - 1);
+  size_t first = min(accepted, (size_t)(NET_TCP_BUFFER_BYTES - offset));
+  memcpy(conn->tx + offset, data, first);
+  memcpy(conn->tx, (const uint8_t*)data + first, accepted - first);
+  conn->txHead += accepted;
+  if (accepted < length) {
+    conn->blocked = true;
+  }
+
+  // Start sending right away instead of waiting for the next select()
+  if (conn->state == TCP_OPEN) {
+    flushTcp(*conn, id);
+  }
+  unlockNet();
+  return accepted;
+}
+
+int netTcpRead(int owner, int id, void* data, size_t length) {
+  lockNet();
+  TcpConn* conn = ownedConnection(owner, id);
+  if (!conn || conn->state == TCP_LISTENING) {
+    unlockNet();
+    return -1;
+  }
+
+  uint32_t used = conn->rxHead - conn->rxTail;
+  if (used == 0) {
+    int result = conn->state == TCP_CLOSED ? -1 : 0;
+    unlockNet();
+    return result;
+  }
+
+  size_t copied = min(length, (size_t)used);
+  uint32_t offset = conn->rxTail & (NET_TCP_BUFFER_BYTES - 1);
+  size_t first = min(copied, (size_t)(NET_TCP_BUFFER_BYTES - offset));
+  memcpy(data, conn->rx + offset, first);
+  memcpy((uint8_t*)data + first, conn->rx, copied - first);
+  conn->rxTail += copied;
+  unlockNet();
+  return copied;
+}
+
+int netTcpAvailable(int owner, int id) {
+  lockNet();
+  TcpConn* conn = ownedConnection(owner, id);
+  int available = conn ? (int)(conn->rxHead - conn->rxTail) : -1;
+  unlockNet();
+  return available;
+}
+
+bool netTcpClose(int owner, int id) {
+  lockNet();
+  TcpConn* conn = ownedConnection(owner, id);
+  if (conn) {
+    if (conn->state == TCP_OPEN && conn->txHead != conn->txTail) {
+      conn->state = TCP_CLOSING;
+    } else {
+      freeConnection(*conn);
+    }
+  }
+  unlockNet();
+  return conn != nullptr;
+}
+
+bool netParseAddress(const char* text, uint32_t* address) {
+  in_addr parsed;
+  if (inet_aton(text, &parsed) == 0) {
+    return false;
+  }
+  *address = parsed.s_addr;
+  return true;
+}
+
+void netFormatAddress(uint32_t address, char* text, size_t size) {
+  in_addr value;
+  value.s_addr = address;
+  inet_ntoa_r(value, text, size);
+}
+
+void netManagerRelease(int owner) {
+  if (!validOwner(owner)) {
+    return;
+  }
+
+  lockNet();
+  for (int i = 0; i < NET_MAX_SOCKETS; i++) {
+    if (sockets[i].fd >= 0 && sockets[i].owner == owner) {
+      close(sockets[i].fd);
+      sockets[i].fd = -1;
+    }
+  }
+  for (int id = 0; id < NET_MAX_TCP; id++) {
+    if (connections[id].state != TCP_FREE && connections[id].owner == owner) {
+      freeConnection(connections[id]);
+    }
+  }
+  if (owners[owner].queue) {
+    vRingbufferDelete(owners[owner].queue);
+  }
+  owners[owner] = {};
+  unlockNet();
+}
+
+void netManagerGetStats(int owner, NetStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!validOwner(owner)) {
+    return;
+  }
+
+  lockNet();
+  NetOwner& state = owners[owner];
+  stats->received = state.received;
+  stats->dropped = state.dropped;
+  stats->sent = state.sent;
+  stats->sendFailures = state.sendFailures;
+  if (state.queue) {
+    stats->pendingBytes = NET_RX_QUEUE_BYTES - xRingbufferGetCurFreeSize(state.queue);
+  }
+  for (int i = 0; i < NET_MAX_SOCKETS; i++) {
+    if (sockets[i].fd >= 0 && sockets[i].owner == owner) {
+      stats->sockets++;
+    }
+  }
+  for (int id = 0; id < NET_MAX_TCP; id++) {
+    if (connections[id].state != TCP_FREE && connections[id].owner == owner) {
+      stats->tcpConnections++;
+    }
+  }
+  unlockNet();
+}
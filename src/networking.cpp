@@ -1,10 +1,8 @@
 // networking.cpp
 #include "include/networking.h"
-#include "include/vm_manager.h"
-#include "include/file_system.h"
-
-// Initialize these here as they are declared as extern in the header
-WiFiUDP udp;
+#include "include/net_manager.h"
+#include "include/deploy.h"
+#include "include/msg_link.h"
 
 void initWiFi(const char* ssid, const char* password) {
   WiFi.mode(WIFI_STA);
@@ -22,32 +20,25 @@ void initWiFi(const char* ssid, const char* password) {
 }
 
 void initUDP(uint16_t port) {
-  if (!udp.begin(port)) {
+  netManagerBegin();
+  if (!netUdpBind(NET_OWNER_SYSTEM, port)) {
     Serial.println("Failed to start UDP server");
     return;
   }
 }
 
+// Only datagrams sent to the firmware's own ports reach this queue; ports
+// bound by VMs are delivered to the VMs
 void handleUDP() {
-  int packetSize = udp.parsePacket();
-  if (packetSize) {
-    char incomingPacket[255];
-    int len = udp.read(incomingPacket, 255);
-    if (len > 0) {
-      incomingPacket[len] = 0;
-      
-      // Create a new VM with the received JavaScript code
-      String filename = "udp_" + String(millis()) + ".js";
-      
-      // Write the file to storage
-      File file = FFat.open(filename.c_str(), "w");
-      if (file) {
-        file.write((uint8_t*)incomingPacket, len);
-        file.close();
-        
-        // Create and start the VM
-        createVM(filename, incomingPacket, filename);
-      }
+  NetDatagram datagram;
+  while (netUdpReceive(NET_OWNER_SYSTEM, &datagram, 0)) {
+    if (datagram.localPort == MSG_LINK_PORT) {
+      msgLinkHandleDatagram(datagram);
+    } else {
+      deployHandleDatagram(datagram);
     }
+    netUdpRelease(NET_OWNER_SYSTEM, datagram);
   }
-}
\ No newline at end of file
+  deployPoll();
+  msgLinkPoll();
+}
@@ -0,0 +1,428 @@
+// rmt_output.cpp
+#include "include/rmt_output.h"
+#include "include/vm_log.h"
+#include <driver/rmt_tx.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <atomic>
+#include <math.h>
+
+#define RMT_PIXEL_RESOLUTION_HZ 10000000   // 0.1 us ticks
+#define RMT_MAX_DURATION 32767             // 15-bit symbol duration field
+#define RMT_STAGING_ALIGN 256
+#define RMT_GAMMA 2.8f
+
+struct RmtSlot {
+  int owner;                         // VM index, -1 when free
+  int pin;
+  RmtOutputKind kind;
+  rmt_channel_handle_t channel;
+  rmt_encoder_handle_t encoder;
+  uint8_t* buffers[2];               // Double-buffered staging, internal RAM
+  size_t capacity[2];
+  uint32_t submitted;                // Written by the owning VM
+  std::atomic<uint32_t> completed;   // Written by the TX-done ISR
+  uint8_t brightness;
+  bool gamma;
+  uint8_t levels[256];               // Gamma and brightness folded together
+};
+
+// Bytes encoder for the pixel data followed by a low "reset" symbol, so
+// back-to-back frames always latch
+struct PixelEncoder {
+  rmt_encoder_t base;
+  rmt_encoder_handle_t bytes;
+  rmt_encoder_handle_t copy;
+  rmt_symbol_word_t resetCode;
+  int state;
+};
+
+static RmtSlot slots[RMT_OUTPUT_SLOTS];
+static SemaphoreHandle_t rmtMutex = nullptr;
+static uint8_t gammaTable[256];
+
+void rmtOutputInit() {
+  for (int i = 0; i < RMT_OUTPUT_SLOTS; i++) {
+    slots[i].owner = -1;
+  }
+  for (int i = 0; i < 256; i++) {
+    gammaTable[i] = (uint8_t)(powf(i / 255.0f, RMT_GAMMA) * 255.0f + 0.5f);
+  }
+  rmtMutex = xSemaphoreCreateMutex();
+}
+
+// The slot table is only valid once rmtOutputInit() has initialised it
+static bool lockRmt() {
+  return rmtMutex && xSemaphoreTake(rmtMutex, portMAX_DELAY) == pdTRUE;
+}
+
+static void unlockRmt() {
+  xSemaphoreGive(rmtMutex);
+}
+
+static bool ownsSlot(int vmIndex, int slot) {
+  return rmtMutex && slot >= 0 && slot < RMT_OUTPUT_SLOTS && slots[slot].owner == vmIndex;
+}
+
+static void rebuildLevels(RmtSlot& slot) {
+  for (int i = 0; i < 256; i++) {
+    uint32_t value = slot.gamma ? gammaTable[i] : i;
+    slot.levels[i] = (value * (slot.brightness + 1)) >> 8;
+  }
+}
+
+static size_t encodePixels(rmt_encoder_t* encoder, rmt_channel_handle_t channel, const void* data, size_t size, rmt_encode_state_t* retState) {
+  PixelEncoder* pixel = __containerof(encoder, PixelEncoder, base);
+  rmt_encode_state_t session = RMT_ENCODING_RESET;
+  int state = RMT_ENCODING_RESET;
+  size_t encoded = 0;
+
+  if (pixel->state == 0) {
+    encoded += pixel->bytes->encode(pixel->bytes, channel, data, size, &session);
+    if (session & RMT_ENCODING_COMPLETE) {
+      pixel->state = 1;
+    }
+    if (session & RMT_ENCODING_MEM_FULL) {
+      *retState = RMT_ENCODING_MEM_FULL;
+      return encoded;
+    }
+  }
+
+  encoded += pixel->copy->encode(pixel->copy, channel, &pixel->resetCode, sizeof(pixel->resetCode), &session);
+  if (session & RMT_ENCODING_COMPLETE) {
+    pixel->state = 0;
+    state |= RMT_ENCODING_COMPLETE;
+  }
+  if (session & RMT_ENCODING_MEM_FULL) {
+    state |= RMT_ENCODING_MEM_FULL;
+  }
+  *retState = (rmt_encode_state_t)state;
+  return encoded;
+}
+
+static esp_err_t resetPixels(rmt_encoder_t* encoder) {
+  PixelEncoder* pixel = __containerof(encoder, PixelEncoder, base);
+  rmt_encoder_reset(pixel->bytes);
+  rmt_encoder_reset(pixel->copy);
+  pixel->state = 0;
+  return ESP_OK;
+}
+
+static esp_err_t deletePixels(rmt_encoder_t* encoder) {
+  PixelEncoder* pixel = __containerof(encoder, PixelEncoder, base);
+  rmt_del_encoder(pixel->bytes);
+  rmt_del_encoder(pixel->copy);
+  free(pixel);
+  return ESP_OK;
+}
+
+static rmt_encoder_handle_t newPixelEncoder(RmtOutputKind kind) {
+  PixelEncoder* pixel = (PixelEncoder*)calloc(1, sizeof(PixelEncoder));
+  if (!pixel) {
+    return nullptr;
+  }
+  pixel->base.encode = encodePixels;
+  pixel->base.reset = resetPixels;
+  pixel->base.del = deletePixels;
+
+  // 0: 0.3 us high, 0.9 us low. 1: 0.9 us high, 0.3 us low. Both parts accept these.
+  rmt_bytes_encoder_config_t bytesConfig = {};
+  bytesConfig.bit0.level0 = 1;
+  bytesConfig.bit0.duration0 = 3;
+  bytesConfig.bit0.level1 = 0;
+  bytesConfig.bit0.duration1 = 9;
+  bytesConfig.bit1.level0 = 1;
+  bytesConfig.bit1.duration0 = 9;
+  bytesConfig.bit1.level1 = 0;
+  bytesConfig.bit1.duration1 = 3;
+  bytesConfig.flags.msb_first = 1;
+
+  rmt_copy_encoder_config_t copyConfig = {};
+  if (rmt_new_bytes_encoder(&bytesConfig, &pixel->bytes) != ESP_OK) {
+    free(pixel);
+    return nullptr;
+  }
+  if (rmt_new_copy_encoder(&copyConfig, &pixel->copy) != ESP_OK) {
+    rmt_del_encoder(pixel->bytes);
+    free(pixel);
+    return nullptr;
+  }
+
+  // WS2812B needs 280 us low to latch, SK6812 80 us
+  uint16_t resetTicks = kind == RMT_OUTPUT_SK6812 ? 800 : 2800;
+  pixel->resetCode.level0 = 0;
+  pixel->resetCode.duration0 = resetTicks / 2;
+  pixel->resetCode.level1 = 0;
+  pixel->resetCode.duration1 = resetTicks / 2;
+  return &pixel->base;
+}
+
+static bool IRAM_ATTR onTransmitDone(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t* edata, void* arg) {
+  ((RmtSlot*)arg)->completed.fetch_add(1, std::memory_order_release);
+  return false;
+}
+
+static esp_err_t newChannel(int pin, uint32_t resolutionHz, rmt_channel_handle_t* channel) {
+  rmt_tx_channel_config_t config = {};
+  config.gpio_num = (gpio_num_t)pin;
+  config.clk_src = RMT_CLK_SRC_DEFAULT;
+  config.resolution_hz = resolutionHz;
+  config.trans_queue_depth = 4;
+
+#if SOC_RMT_SUPPORT_DMA
+  // Stream from DMA when the (single) RMT DMA channel is free
+  config.mem_block_symbols = 1024;
+  config.flags.with_dma = true;
+  if (rmt_new_tx_channel(&config, channel) == ESP_OK) {
+    return ESP_OK;
+  }
+  config.flags.with_dma = false;
+#endif
+  config.mem_block_symbols = SOC_RMT_MEM_WORDS_PER_CHANNEL;
+  return rmt_new_tx_channel(&config, channel);
+}
+
+static void freeSlot(RmtSlot& slot) {
+  if (slot.channel) {
+    rmt_tx_wait_all_done(slot.channel, 100);
+    rmt_disable(slot.channel);
+    rmt_del_channel(slot.channel);
+  }
+  if (slot.encoder) {
+    rmt_del_encoder(slot.encoder);
+  }
+  for (int i = 0; i < 2; i++) {
+    free(slot.buffers[i]);
+    slot.buffers[i] = nullptr;
+    slot.capacity[i] = 0;
+  }
+  slot.channel = nullptr;
+  slot.encoder = nullptr;
+  slot.owner = -1;
+}
+
+int rmtOutputBegin(int vmIndex, int pin, RmtOutputKind kind, uint32_t resolutionHz) {
+  if (kind == RMT_OUTPUT_PULSES && resolutionHz == 0) {
+    return -1;
+  }
+  if (!lockRmt()) {
+    return -1;
+  }
+
+  int index = -1;
+  for (int i = 0; i < RMT_OUTPUT_SLOTS && index < 0; i++) {
+    if (slots[i].owner < 0) {
+      index = i;
+    }
+  }
+  if (index < 0) {
+    unlockRmt();
+    return -1;
+  }
+
+  RmtSlot& slot = slots[index];
+  slot.owner = vmIndex;
+  slot.pin = pin;
+  slot.kind = kind;
+  slot.submitted = 0;
+  slot.completed.store(0);
+  slot.brightness = 255;
+  slot.gamma = false;
+  rebuildLevels(slot);
+
+  uint32_t resolution = kind == RMT_OUTPUT_PULSES ? resolutionHz : RMT_PIXEL_RESOLUTION_HZ;
+  bool ok = newChannel(pin, resolution, &slot.channel) == ESP_OK;
+  if (ok && kind == RMT_OUTPUT_PULSES) {
+    rmt_copy_encoder_config_t copyConfig = {};
+    ok = rmt_new_copy_encoder(&copyConfig, &slot.encoder) == ESP_OK;
+  } else if (ok) {
+    slot.encoder = newPixelEncoder(kind);
+    ok = slot.encoder != nullptr;
+  }
+
+  rmt_tx_event_callbacks_t callbacks = {};
+  callbacks.on_trans_done = onTransmitDone;
+  ok = ok && rmt_tx_register_event_callbacks(slot.channel, &callbacks, &slot) == ESP_OK;
+  ok = ok && rmt_enable(slot.channel) == ESP_OK;
+
+  if (!ok) {
+    vmLogPrintf(vmIndex, VM_LOG_ERROR, "Failed to start RMT output on pin %d", pin);
+    freeSlot(slot);
+    index = -1;
+  }
+
+  unlockRmt();
+  return index;
+}
+
+// Waits until the staging buffer about to be reused is off the wire
+static bool waitForBuffer(RmtSlot& slot) {
+  TickType_t start = xTaskGetTickCount();
+  while (slot.submitted - slot.completed.load(std::memory_order_acquire) >= 2) {
+    if (xTaskGetTickCount() - start > pdMS_TO_TICKS(1000)) {
+      return false;
+    }
+    vTaskDelay(1);
+  }
+  return true;
+}
+
+static uint8_t* stagingBuffer(RmtSlot& slot, size_t bytes) {
+  int which = slot.submitted % 2;
+  if (slot.capacity[which] < bytes) {
+    size_t capacity = (bytes + RMT_STAGING_ALIGN - 1) & ~(RMT_STAGING_ALIGN - 1);
+    free(slot.buffers[which]);
+    slot.buffers[which] = (uint8_t*)heap_caps_malloc(capacity, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    slot.capacity[which] = slot.buffers[which] ? capacity : 0;
+  }
+  return slot.buffers[which];
+}
+
+// Input is RGB(W); the wire order is GRB(W)
+static size_t stagePixels(RmtSlot& slot, const uint8_t* in, size_t length, uint8_t** out) {
+  size_t stride = slot.kind == RMT_OUTPUT_SK6812 ? 4 : 3;
+  size_t bytes = length - length % stride;
+  if (bytes == 0 || bytes > RMT_OUTPUT_MAX_BYTES || !(*out = stagingBuffer(slot, bytes))) {
+    return 0;
+  }
+
+  const uint8_t* levels = slot.levels;
+  uint8_t* dst = *out;
+  for (size_t i = 0; i < bytes; i += stride) {
+    dst[i] = levels[in[i + 1]];
+    dst[i + 1] = levels[in[i]];
+    dst[i + 2] = levels[in[i + 2]];
+    if (stride == 4) {
+      dst[i + 3] = levels[in[i + 3]];
+    }
+  }
+  return bytes;
+}
+
+// Durations alternate high/low starting high. Long durations are split
+// across symbol halves; a zero-length half terminates the train.
+static size_t stagePulses(RmtSlot& slot, const uint32_t* durations, size_t count, uint8_t** out) {
+  size_t halves = 0;
+  for (size_t i = 0; i < count; i++) {
+    halves += (durations[i] + RMT_MAX_DURATION - 1) / RMT_MAX_DURATION;
+  }
+  size_t bytes = ((halves + 1) / 2) * sizeof(rmt_symbol_word_t);
+  if (bytes == 0 || bytes > RMT_OUTPUT_MAX_BYTES || !(*out = stagingBuffer(slot, bytes))) {
+    return 0;
+  }
+
+  rmt_symbol_word_t* symbols = (rmt_symbol_word_t*)*out;
+  size_t half = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t level = (i % 2 == 0) ? 1 : 0;
+    for (uint32_t remaining = durations[i]; remaining > 0; half++) {
+      uint32_t chunk = min(remaining, (uint32_t)RMT_MAX_DURATION);
+      rmt_symbol_word_t& symbol = symbols[half / 2];
+      if (half % 2 == 0) {
+        symbol.duration0 = chunk;
+        symbol.level0 = level;
+      } else {
+        symbol.duration1 = chunk;
+        symbol.level1 = level;
+      }
+      remaining -= chunk;
+    }
+  }
+  if (half % 2) {
+    symbols[half / 2].duration1 = 0;
+    symbols[half / 2].level1 = 0;
+  }
+  return bytes;
+}
+
+bool rmtOutputWrite(int vmIndex, int index, const void* data, size_t length) {
+  if (!ownsSlot(vmIndex, index)) {
+    return false;
+  }
+
+  RmtSlot& slot = slots[index];
+  if (!waitForBuffer(slot)) {
+    return false;
+  }
+
+  uint8_t* staged = nullptr;
+  size_t bytes;
+  if (slot.kind == RMT_OUTPUT_PULSES) {
+    bytes = stagePulses(slot, (const uint32_t*)data, length / sizeof(uint32_t), &staged);
+  } else {
+    bytes = stagePixels(slot, (const uint8_t*)data, length, &staged);
+  }
+  if (bytes == 0) {
+    return false;
+  }
+
+  rmt_transmit_config_t config = {};
+  config.loop_count = 0;
+  config.flags.eot_level = 0;
+
+  // Count the transmission before queueing it so the done ISR can never
+  // run ahead of submitted
+  slot.submitted++;
+  if (rmt_transmit(slot.channel, slot.encoder, staged, bytes, &config) != ESP_OK) {
+    slot.submitted--;
+    return false;
+  }
+  return true;
+}
+
+bool rmtOutputSetBrightness(int vmIndex, int index, uint8_t brightness) {
+  if (!ownsSlot(vmIndex, index)) {
+    return false;
+  }
+  slots[index].brightness = brightness;
+  rebuildLevels(slots[index]);
+  return true;
+}
+
+bool rmtOutputSetGamma(int vmIndex, int index, bool enabled) {
+  if (!ownsSlot(vmIndex, index)) {
+    return false;
+  }
+  slots[index].gamma = enabled;
+  rebuildLevels(slots[index]);
+  return true;
+}
+
+bool rmtOutputBusy(int vmIndex, int index) {
+  if (!ownsSlot(vmIndex, index)) {
+    return false;
+  }
+  return slots[index].submitted != slots[index].completed.load(std::memory_order_acquire);
+}
+
+bool rmtOutputWait(int vmIndex, int index, uint32_t timeoutMs) {
+  if (!ownsSlot(vmIndex, index)) {
+    return false;
+  }
+  return rmt_tx_wait_all_done(slots[index].channel, timeoutMs) == ESP_OK;
+}
+
+bool rmtOutputEnd(int vmIndex, int index) {
+  if (!lockRmt()) {
+    return false;
+  }
+  bool ok = ownsSlot(vmIndex, index);
+  if (ok) {
+    freeSlot(slots[index]);
+  }
+  unlockRmt();
+  return ok;
+}
+
+void rmtOutputRelease(int vmIndex) {
+  if (!lockRmt()) {
+    return;
+  }
+  for (int i = 0; i < RMT_OUTPUT_SLOTS; i++) {
+    if (slots[i].owner == vmIndex) {
+      freeSlot(slots[i]);
+    }
+  }
+  unlockRmt();
+}
@@ -2,6 +2,14 @@
 #include "include/serial_handler.h"
 #include "include/vm_manager.h"
 #include "include/file_system.h"
+#include "include/vm_events.h"
+#include "include/vm_log.h"
+#include "include/log_shipper.h"
+#include "include/vm_perf.h"
+#include "include/net_manager.h"
+#include "include/deploy.h"
+#include "include/msg_link.h"
+#include "include/ftp_server.h"
 
 void printVMInfo(int vmIndex) {
   if (vmIndex >= 0 && vmIndex < MAX_VMS) {
@@ -27,6 +35,178 @@ void listFiles(File dir, String prefix = "") {
   }
 }
 
+// log                                  - show per-source counters
+// log <vm|system> level <debug|info|warn|error>
+// log <vm|system> policy <drop|block> [linesPerSecond]
+static void handleLogCommand(const String& args) {
+  if (args.length() == 0) {
+    Serial.println("Log sources:");
+    for (int i = 0; i < VM_LOG_SOURCES; i++) {
+      VMLogStats stats;
+      vmLogGetStats(i, &stats);
+      Serial.printf("%-7s %-16s level %s, %s, %u lines/s max, written %lu, dropped %lu, rate limited %lu, pending %lu bytes\n",
+        i == VM_LOG_SYSTEM ? "system" : ("vm" + String(i)).c_str(), stats.tag, vmLogLevelName(stats.level),
+        stats.policy == VM_LOG_BLOCK ? "block" : "drop", stats.linesPerSecond,
+        stats.written, stats.dropped, stats.rateLimited, stats.pendingBytes);
+    }
+    return;
+  }
+
+  char source[16], setting[16], value[16];
+  unsigned int linesPerSecond = 0;
+  int fields = sscanf(args.c_str(), "%15s %15s %15s %u", source, setting, value, &linesPerSecond);
+  int index = strcmp(source, "system") == 0 ? VM_LOG_SYSTEM : atoi(source);
+  if (fields < 3 || index < 0 || index >= VM_LOG_SOURCES) {
+    Serial.println("Usage: log [<vm_id|system> level <debug|info|warn|error> | policy <drop|block> [lines/s]]");
+    return;
+  }
+
+  VMLogLevel level;
+  if (strcmp(setting, "level") == 0 && vmLogParseLevel(value, &level)) {
+    vmLogSetLevel(index, level);
+  } else if (strcmp(setting, "policy") == 0 && (strcmp(value, "drop") == 0 || strcmp(value, "block") == 0)) {
+    vmLogSetPolicy(index, strcmp(value, "block") == 0 ? VM_LOG_BLOCK : VM_LOG_DROP, linesPerSecond);
+  } else {
+    Serial.println("Unknown log setting");
+    return;
+  }
+  Serial.println("OK");
+}
+
+// logship                                       - show the collector and counters
+// logship off
+// logship <udp|tcp> <host> <port> [batchBytes] [flushMs]
+static void handleLogShipCommand(const String& args) {
+  LogShipConfig config;
+  logShipperGetConfig(&config);
+
+  if (args.length() == 0) {
+    LogShipStats stats;
+    logShipperGetStats(&stats);
+    const char* transports[] = { "off", "udp", "tcp" };
+    Serial.printf("Log shipping: %s %s:%u, batch %u bytes, flush %lu ms\n",
+      transports[config.transport], config.host, config.port, config.batchBytes, config.flushMs);
+    Serial.printf("  batches %lu, lines %lu, bytes %lu, folded %lu, dropped %lu, send failures %lu, pending %lu bytes\n",
+      stats.batches, stats.lines, stats.bytes, stats.folded, stats.dropped, stats.sendFailures, stats.pendingBytes);
+    return;
+  }
+
+  char transport[8];
+  unsigned int port = 0, batchBytes = config.batchBytes;
+  unsigned long flushMs = config.flushMs;
+  int fields = sscanf(args.c_str(), "%7s %63s %u %u %lu", transport, config.host, &port, &batchBytes, &flushMs);
+
+  if (fields >= 1 && strcmp(transport, "off") == 0) {
+    config.transport = LOG_SHIP_OFF;
+  } else if (fields >= 3 && (strcmp(transport, "udp") == 0 || strcmp(transport, "tcp") == 0)) {
+    config.transport = strcmp(transport, "tcp") == 0 ? LOG_SHIP_TCP : LOG_SHIP_UDP;
+    config.port = port;
+    config.batchBytes = batchBytes;
+    config.flushMs = flushMs;
+  } else {
+    Serial.println("Usage: logship [off | <udp|tcp> <host> <port> [batchBytes] [flushMs]]");
+    return;
+  }
+
+  Serial.println(logShipperConfigure(config) ? "OK" : "Invalid log shipping settings");
+}
+
+// rollout                                       - show the group, device id and key state
+// rollout key <64 hex digits>
+// rollout key off
+static void handleRolloutCommand(const String& args) {
+  if (args.length() == 0) {
+    Serial.printf("Rollout group %s:%u, device id %08lx, fleet key %s\n", DEPLOY_GROUP_ADDRESS, DEPLOY_GROUP_PORT,
+      (unsigned long)deployDeviceId(), deployHasKey() ? "set" : "not set");
+    return;
+  }
+
+  if (args == "key off") {
+    Serial.println(deploySetKey(nullptr) ? "OK" : "Failed to save the fleet key");
+    return;
+  }
+
+  uint8_t key[DEPLOY_KEY_BYTES];
+  bool valid = args.startsWith("key ") && args.length() == 4 + DEPLOY_KEY_BYTES * 2;
+  for (int i = 0; valid && i < DEPLOY_KEY_BYTES; i++) {
+    char digits[3] = { args[4 + i * 2], args[5 + i * 2], '\0' };
+    char* end;
+    key[i] = strtoul(digits, &end, 16);
+    valid = isxdigit(digits[0]) && *end == '\0';
+  }
+  if (!valid) {
+    Serial.printf("Usage: rollout [key <%d hex digits> | key off]\n", DEPLOY_KEY_BYTES * 2);
+    return;
+  }
+  Serial.println(deploySetKey(key) ? "OK" : "Failed to save the fleet key");
+}
+
+// ftp                                           - show the buffer size and transfer rates
+// ftp buffer <bytes>
+static void handleFtpCommand(const String& args) {
+  if (args.length() == 0) {
+    FtpStats stats;
+    ftpServerGetStats(&stats);
+    unsigned long uploadRate = stats.uploadUs ? stats.uploadBytes * 1000000 / stats.uploadUs / 1024 : 0;
+    unsigned long downloadRate = stats.downloadUs ? stats.downloadBytes * 1000000 / stats.downloadUs / 1024 : 0;
+    Serial.printf("FTP buffers 2 x %u bytes, cluster %u bytes\n", ftpServerBufferSize(), ftpServerClusterSize());
+    Serial.printf("  uploads %lu, %llu bytes, %lu KB/s; downloads %lu, %llu bytes, %lu KB/s\n",
+      stats.uploads, stats.uploadBytes, uploadRate, stats.downloads, stats.downloadBytes, downloadRate);
+    Serial.printf("  failed %lu, flash wait %lu ms\n", stats.failed, (unsigned long)(stats.flashWaitUs / 1000));
+    return;
+  }
+
+  unsigned long bytes;
+  if (sscanf(args.c_str(), "buffer %lu", &bytes) != 1) {
+    Serial.println("Usage: ftp [buffer <bytes>]");
+    return;
+  }
+  if (ftpServerSetBufferSize(bytes)) {
+    Serial.printf("OK, %u bytes from the next transfer\n", ftpServerBufferSize());
+  } else {
+    Serial.printf("Buffer size must be 1..%d bytes\n", FTP_MAX_BUFFER_BYTES);
+  }
+}
+
+// link                                          - show the node name and per-peer counters
+// link name <node>
+// link add <node> <ip> [port]
+// link remove <node>
+static void handleLinkCommand(const String& args) {
+  if (args.length() == 0) {
+    Serial.printf("Node %s, message link on port %u\n", msgLinkName(), MSG_LINK_PORT);
+    MsgLinkStats stats;
+    for (int i = 0; msgLinkGetStats(i, &stats); i++) {
+      char address[16];
+      netFormatAddress(stats.address, address, sizeof(address));
+      unsigned long averageUs = stats.sent ? stats.latencySumUs / stats.sent : 0;
+      Serial.printf("  %s %s:%u: sent %lu, received %lu, pending %lu, datagrams %lu, retransmits %lu\n",
+        stats.name, address, stats.port, stats.sent, stats.received, stats.pending, stats.datagrams, stats.retransmits);
+      Serial.printf("    failed %lu, undeliverable %lu, duplicates %lu, latency avg %lu.%03lu ms, max %lu.%03lu ms\n",
+        stats.failed, stats.undeliverable, stats.duplicates, averageUs / 1000, averageUs % 1000,
+        stats.latencyMaxUs / 1000, stats.latencyMaxUs % 1000);
+    }
+    return;
+  }
+
+  char action[8], name[MSG_LINK_NAME_LENGTH], host[16];
+  unsigned int port = MSG_LINK_PORT;
+  uint32_t address;
+  int fields = sscanf(args.c_str(), "%7s %15s %15s %u", action, name, host, &port);
+  bool ok;
+  if (fields == 2 && strcmp(action, "name") == 0) {
+    ok = msgLinkSetName(name);
+  } else if (fields >= 3 && strcmp(action, "add") == 0 && netParseAddress(host, &address) && port <= 65535) {
+    ok = msgLinkAddPeer(name, address, port);
+  } else if (fields == 2 && strcmp(action, "remove") == 0) {
+    ok = msgLinkRemovePeer(name);
+  } else {
+    Serial.println("Usage: link [name <node> | add <node> <ip> [port] | remove <node>]");
+    return;
+  }
+  Serial.println(ok ? "OK" : "Invalid name, or no free peer entry");
+}
+
 void handleSerialCommand(const String& command) {
   Serial.printf("Received command: %s\n", command.c_str());
   
@@ -73,17 +253,13 @@ void handleSerialCommand(const String& command) {
       filename = "/" + filename;
     }
 
-    File file = FFat.open(filename, "r");
-    if (!file) {
+    if (!FFat.exists(filename)) {
       Serial.printf("Error: File %s not found\n", filename.c_str());
       return;
     }
 
-    String content = file.readString();
-    file.close();
-
     Serial.printf("Creating VM for file: %s\n", filename.c_str());
-    int vmId = createVM(filename, content.c_str(), filename);
+    int vmId = createVMFromFile(filename);
     
     if (vmId >= 0) {
       Serial.println("VM created successfully:");
@@ -121,6 +297,7 @@ void handleSerialCommand(const String& command) {
 
     file.print(content);
     file.close();
+    ftpServerInvalidateListings();
 
     Serial.printf("Written to file: %s\nContent: %s\n", filename.c_str(), content.c_str());
   }
@@ -136,6 +313,57 @@ void handleSerialCommand(const String& command) {
       }
     }
   }
+  else if (action == "events") {
+    Serial.println("Event queues:");
+    for (int i = 0; i < MAX_VMS; i++) {
+      if (vms[i].running) {
+        VMEventStats stats;
+        vmEventsGetStats(i, &stats);
+        Serial.printf("VM %d: dispatched %lu, dropped %lu, pending %lu, latency avg %lu us, max %lu us\n",
+          i, stats.dispatched, stats.dropped, stats.pending, stats.avgLatencyUs, stats.maxLatencyUs);
+      }
+    }
+  }
+  else if (action == "net") {
+    Serial.println("Network queues:");
+    for (int i = 0; i < NET_OWNERS; i++) {
+      NetStats stats;
+      netManagerGetStats(i, &stats);
+      if (stats.sockets == 0 && stats.tcpConnections == 0 && stats.received == 0 && stats.sent == 0) {
+        continue;
+      }
+      if (i == NET_OWNER_SYSTEM) {
+        Serial.print("system");
+      } else {
+        Serial.printf("VM %d", i);
+      }
+      Serial.printf(": UDP sockets %u, TCP %u, received %lu, dropped %lu, sent %lu, send failures %lu, pending %lu bytes\n",
+        stats.sockets, stats.tcpConnections, stats.received, stats.dropped, stats.sent, stats.sendFailures, stats.pendingBytes);
+    }
+  }
+  else if (action == "perf") {
+    // perf [vm_id] - dump performance.measure() spans
+    for (int i = 0; i < MAX_VMS; i++) {
+      if ((args.length() == 0 && vms[i].running) || (args.length() > 0 && args.toInt() == i)) {
+        vmPerfDump(i, Serial);
+      }
+    }
+  }
+  else if (action == "log") {
+    handleLogCommand(args);
+  }
+  else if (action == "logship") {
+    handleLogShipCommand(args);
+  }
+  else if (action == "link") {
+    handleLinkCommand(args);
+  }
+  else if (action == "ftp") {
+    handleFtpCommand(args);
+  }
+  else if (action == "rollout") {
+    handleRolloutCommand(args);
+  }
   else if (action == "stop") {
     if (args.length() == 0) {
       Serial.println("Usage: stop <vm_id>");
@@ -167,6 +395,14 @@ void handleSerialCommand(const String& command) {
     Serial.println("  create <filename> - Create and start a VM from a JS file");
     Serial.println("  write <filename> <content> - Write content to a file");
     Serial.println("  vms - List all active VMs");
+    Serial.println("  events - Show event queue and latency statistics");
+    Serial.println("  net - Show UDP/TCP sockets and receive queues per VM");
+    Serial.println("  perf [vm_id] - Dump performance.measure() spans");
+    Serial.println("  log [<vm_id|system> level <lvl> | policy <drop|block> [lines/s]] - Show or configure logging");
+    Serial.println("  logship [off | <udp|tcp> <host> <port> [batchBytes] [flushMs]] - Ship logs to a syslog collector");
+    Serial.println("  link [name <node> | add <node> <ip> [port] | remove <node>] - Configure messaging to other nodes");
+    Serial.println("  rollout [key <hex> | key off] - Show rollout settings or set the fleet key");
+    Serial.println("  ftp [buffer <bytes>] - Show FTP transfer rates or set the transfer buffer size");
     Serial.println("  stop <vm_id> - Stop a VM");
     Serial.println("  start <vm_id> - Start a stopped VM");
     Serial.println("  list/ls - List files in FFat filesystem");
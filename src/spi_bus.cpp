@@ -0,0 +1,217 @@
+// spi_bus.cpp
+#include "include/spi_bus.h"
+#include "include/vm_manager.h"
+#include "include/vm_log.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// The bus belongs to the VM that last began it. spiMutex guards the device
+// handle, the owner and the pins the bus claimed, and is held for every
+// transaction so the device cannot be removed while the driver is using it.
+static spi_device_handle_t spiDevice = nullptr;
+static SemaphoreHandle_t spiMutex = nullptr;
+static int spiOwner = -1;
+static int spiPins[4] = { -1, -1, -1, -1 };
+
+void spiBusInit() {
+  spiMutex = xSemaphoreCreateMutex();
+}
+
+// Caller holds spiMutex
+static void removeDevice() {
+  if (spiDevice) {
+    spi_bus_remove_device(spiDevice);
+    spi_bus_free(SPI_BUS_HOST);
+    spiDevice = nullptr;
+  }
+  for (int i = 0; i < 4; i++) {
+    if (spiPins[i] >= 0) {
+      releasePin(spiPins[i], spiOwner);
+      spiPins[i] = -1;
+    }
+  }
+  spiOwner = -1;
+}
+
+// Claims every pin the bus uses and records in claimed[] the ones claimed
+// here; pins the VM already owns stay its own when the bus is removed. If a
+// pin belongs to another VM, only the claims made here are undone.
+static bool claimBusPins(int vmIndex, const int* pins, int* claimed) {
+  for (int i = 0; i < 4; i++) {
+    claimed[i] = -1;
+    if (pins[i] < 0 || getPinOwner(pins[i]) == vmIndex) {
+      continue;
+    }
+    if (!claimPin(pins[i], vmIndex)) {
+      for (int j = 0; j < i; j++) {
+        if (claimed[j] >= 0) {
+          releasePin(claimed[j], vmIndex);
+        }
+      }
+      return false;
+    }
+    claimed[i] = pins[i];
+  }
+  return true;
+}
+
+bool spiBusBegin(int vmIndex, int sck, int miso, int mosi, int ss, uint32_t frequency, uint8_t mode) {
+  if (!spiMutex) {
+    return false;
+  }
+
+  int pins[4] = { sck, miso, mosi, ss };
+  int claimed[4];
+  xSemaphoreTake(spiMutex, portMAX_DELAY);
+  if (spiOwner >= 0 && spiOwner != vmIndex) {
+    xSemaphoreGive(spiMutex);
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "SPI bus is in use by VM %d", spiOwner);
+    return false;
+  }
+  removeDevice();
+  if (!claimBusPins(vmIndex, pins, claimed)) {
+    xSemaphoreGive(spiMutex);
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_WARN, "SPI pins are in use by another VM");
+    return false;
+  }
+
+  spi_bus_config_t busConfig = {};
+  busConfig.sclk_io_num = sck;
+  busConfig.miso_io_num = miso;
+  busConfig.mosi_io_num = mosi;
+  busConfig.quadwp_io_num = -1;
+  busConfig.quadhd_io_num = -1;
+  busConfig.max_transfer_sz = SPI_MAX_TRANSFER;
+
+  spi_device_interface_config_t deviceConfig = {};
+  deviceConfig.mode = mode;
+  deviceConfig.clock_speed_hz = frequency;
+  deviceConfig.spics_io_num = ss;
+  deviceConfig.queue_size = SPI_QUEUE_SIZE;
+
+  bool ok = false;
+  if (spi_bus_initialize(SPI_BUS_HOST, &busConfig, SPI_DMA_CH_AUTO) != ESP_OK) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "SPI bus initialization failed");
+  } else if (spi_bus_add_device(SPI_BUS_HOST, &deviceConfig, &spiDevice) != ESP_OK) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "SPI device registration failed");
+    spi_bus_free(SPI_BUS_HOST);
+    spiDevice = nullptr;
+  } else {
+    ok = true;
+  }
+
+  spiOwner = vmIndex;
+  memcpy(spiPins, claimed, sizeof(spiPins));
+  if (!ok) {
+    removeDevice();
+  }
+  xSemaphoreGive(spiMutex);
+  return ok;
+}
+
+void spiBusRelease(int vmIndex) {
+  if (!spiMutex) {
+    return;
+  }
+  xSemaphoreTake(spiMutex, portMAX_DELAY);
+  if (spiOwner == vmIndex) {
+    removeDevice();
+  }
+  xSemaphoreGive(spiMutex);
+}
+
+// Takes spiMutex if the calling VM owns a configured bus
+static bool lockBus(int vmIndex) {
+  if (!spiMutex) {
+    return false;
+  }
+  xSemaphoreTake(spiMutex, portMAX_DELAY);
+  if (!spiDevice || spiOwner != vmIndex) {
+    xSemaphoreGive(spiMutex);
+    return false;
+  }
+  return true;
+}
+
+static void fillTransaction(spi_transaction_t* t, const uint8_t* tx, uint8_t* rx, size_t length) {
+  memset(t, 0, sizeof(*t));
+  t->length = length * 8;
+  t->rxlength = rx ? length * 8 : 0;
+  t->tx_buffer = tx;
+  t->rx_buffer = rx;
+}
+
+// Buffers are handed to the driver as-is. Word-aligned internal RAM goes
+// straight to DMA; anything else is bounced through a driver-owned copy.
+bool spiBusTransfer(int vmIndex, const uint8_t* tx, uint8_t* rx, size_t length) {
+  if (length == 0 || length > SPI_MAX_TRANSFER) {
+    return false;
+  }
+
+  spi_transaction_t t;
+  fillTransaction(&t, tx, rx, length);
+
+  if (!lockBus(vmIndex)) {
+    return false;
+  }
+  esp_err_t err = length < SPI_POLL_THRESHOLD
+    ? spi_device_polling_transmit(spiDevice, &t)
+    : spi_device_transmit(spiDevice, &t);
+  xSemaphoreGive(spiMutex);
+
+  return err == ESP_OK;
+}
+
+// Runs the segments back to back, keeping up to SPI_QUEUE_SIZE of them queued
+// in the driver so the bus never idles between segments. Returns the number
+// of segments completed, stopping at the first failure.
+int spiBusQueue(int vmIndex, const SpiSegment* segments, size_t count) {
+  spi_transaction_t transactions[SPI_QUEUE_SIZE];
+  size_t queued = 0;
+  size_t completed = 0;
+  bool failed = false;
+
+  if (!lockBus(vmIndex)) {
+    return 0;
+  }
+  while (completed < count && !failed) {
+    while (queued < count && queued - completed < SPI_QUEUE_SIZE) {
+      const SpiSegment& seg = segments[queued];
+      if (seg.length == 0 || seg.length > SPI_MAX_TRANSFER) {
+        failed = true;
+        break;
+      }
+      spi_transaction_t* t = &transactions[queued % SPI_QUEUE_SIZE];
+      fillTransaction(t, seg.tx, seg.rx, seg.length);
+      if (spi_device_queue_trans(spiDevice, t, portMAX_DELAY) != ESP_OK) {
+        failed = true;
+        break;
+      }
+      queued++;
+    }
+
+    if (completed == queued) {
+      break;
+    }
+
+    spi_transaction_t* done;
+    if (spi_device_get_trans_result(spiDevice, &done, portMAX_DELAY) != ESP_OK) {
+      failed = true;
+      break;
+    }
+    completed++;
+  }
+
+  // Segments already queued before a failure still run; wait for them so
+  // the transaction slots are not reused while the driver holds them
+  while (completed < queued) {
+    spi_transaction_t* done;
+    if (spi_device_get_trans_result(spiDevice, &done, portMAX_DELAY) != ESP_OK) {
+      break;
+    }
+    completed++;
+  }
+  xSemaphoreGive(spiMutex);
+
+  return completed;
+}
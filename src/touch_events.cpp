@@ -0,0 +1,167 @@
+// touch_events.cpp
+#include "include/touch_events.h"
+#include "include/vm_events.h"
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#if CONFIG_IDF_TARGET_ESP32
+static const uint8_t touchPins[] = { 4, 0, 2, 15, 13, 12, 14, 27, 33, 32 };
+#define TOUCH_DELTA(raw, baseline) ((int32_t)(baseline) - (int32_t)(raw))   // Touch lowers the reading
+#else
+static const uint8_t touchPins[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14 };
+#define TOUCH_DELTA(raw, baseline) ((int32_t)(raw) - (int32_t)(baseline))   // Touch raises the reading
+#endif
+
+#define TOUCH_PAD_COUNT (sizeof(touchPins) / sizeof(touchPins[0]))
+
+struct TouchPad {
+  int owner;            // VM index, -1 when not attached
+  uint32_t threshold;
+  uint32_t baseline;
+  bool touched;
+};
+
+// padsMutex is held for a whole scan, including the event post, so once
+// detach has taken it no event can reach the former owner
+static TouchPad pads[TOUCH_PAD_COUNT];
+static TaskHandle_t scanTask = nullptr;
+static SemaphoreHandle_t padsMutex = nullptr;
+
+static int padIndex(int pin) {
+  for (size_t i = 0; i < TOUCH_PAD_COUNT; i++) {
+    if (touchPins[i] == pin) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// The hardware interrupt only wakes the scan task early; the decision is
+// made against the software baseline
+static void IRAM_ATTR onTouch(void* arg) {
+  BaseType_t woken = pdFALSE;
+  if (scanTask) {
+    vTaskNotifyGiveFromISR(scanTask, &woken);
+  }
+  if (woken == pdTRUE) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+static void scanPads() {
+  for (size_t i = 0; i < TOUCH_PAD_COUNT; i++) {
+    TouchPad& pad = pads[i];
+    int owner = pad.owner;
+    if (owner < 0) {
+      continue;
+    }
+
+    uint32_t raw = touchRead(touchPins[i]);
+    if (pad.baseline == 0) {
+      pad.baseline = raw;
+      continue;
+    }
+
+    int32_t delta = TOUCH_DELTA(raw, pad.baseline);
+    bool touched = pad.touched ? delta > (int32_t)pad.threshold / 2 : delta > (int32_t)pad.threshold;
+
+    if (!touched) {
+      // Track slow drift (temperature, humidity) only while untouched
+      pad.baseline += ((int32_t)raw - (int32_t)pad.baseline) >> TOUCH_BASELINE_SHIFT;
+    }
+
+    if (touched != pad.touched) {
+      pad.touched = touched;
+
+      VMEvent event = {};
+      event.type = VM_EVENT_TOUCH;
+      event.source = touchPins[i];
+      event.count = 1;
+      event.value = touched ? 1 : 0;
+      event.timestamp = esp_timer_get_time();
+      vmEventPost(owner, event);
+    }
+  }
+}
+
+static void touchScanTask(void* parameter) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TOUCH_SCAN_INTERVAL_MS));
+    xSemaphoreTake(padsMutex, portMAX_DELAY);
+    scanPads();
+    xSemaphoreGive(padsMutex);
+  }
+}
+
+bool touchEventsBegin() {
+  for (size_t i = 0; i < TOUCH_PAD_COUNT; i++) {
+    pads[i].owner = -1;
+  }
+  padsMutex = xSemaphoreCreateMutex();
+  if (!padsMutex) {
+    return false;
+  }
+  if (xTaskCreatePinnedToCore(touchScanTask, "Touch_Scan", 3072, nullptr, 2, &scanTask, 0) != pdPASS) {
+    scanTask = nullptr;
+    return false;
+  }
+  return true;
+}
+
+bool touchEventsAttach(int vmIndex, int pin, uint32_t threshold) {
+  int index = padIndex(pin);
+  if (index < 0 || !scanTask) {
+    return false;
+  }
+
+  bool claimed = false;
+  xSemaphoreTake(padsMutex, portMAX_DELAY);
+  if (pads[index].owner < 0 || pads[index].owner == vmIndex) {
+    pads[index].threshold = threshold;
+    pads[index].baseline = 0;
+    pads[index].touched = false;
+    pads[index].owner = vmIndex;
+    claimed = true;
+  }
+  xSemaphoreGive(padsMutex);
+
+  if (claimed) {
+    touchAttachInterruptArg(pin, onTouch, nullptr, threshold);
+  }
+  return claimed;
+}
+
+bool touchEventsDetach(int vmIndex, int pin) {
+  int index = padIndex(pin);
+  if (index < 0 || !scanTask) {
+    return false;
+  }
+
+  xSemaphoreTake(padsMutex, portMAX_DELAY);
+  bool owned = pads[index].owner == vmIndex;
+  if (owned) {
+    pads[index].owner = -1;
+  }
+  xSemaphoreGive(padsMutex);
+
+  if (owned) {
+    touchDetachInterrupt(pin);
+  }
+  return owned;
+}
+
+void touchEventsRelease(int vmIndex) {
+  for (size_t i = 0; i < TOUCH_PAD_COUNT; i++) {
+    touchEventsDetach(vmIndex, touchPins[i]);
+  }
+}
+
+size_t touchReadAllPads(uint32_t* out, size_t maxPads) {
+  size_t count = min(maxPads, TOUCH_PAD_COUNT);
+  for (size_t i = 0; i < count; i++) {
+    out[i] = touchRead(touchPins[i]);
+  }
+  return count;
+}
@@ -0,0 +1,256 @@
+// vm_events.cpp
+#include "include/vm_events.h"
+#include "include/vm_manager.h"
+#include "include/vm_log.h"
+#include <esp_timer.h>
+#include <atomic>
+
+// Bounded multi-producer / single-consumer ring. Each cell carries a sequence
+// number so producers on either core (or in ISRs) claim slots with one CAS
+// and never block; the VM task is the only consumer.
+struct EventCell {
+  std::atomic<uint32_t> sequence;
+  VMEvent event;
+};
+
+struct EventRing {
+  EventCell cells[VM_EVENT_QUEUE_SIZE];
+  std::atomic<uint32_t> enqueuePos;
+  uint32_t dequeuePos;
+  std::atomic<uint32_t> dropped;
+  std::atomic<TaskHandle_t> task;
+  bool dispatching;
+  uint32_t dispatched;
+  uint64_t latencySum;
+  uint32_t latencyMax;
+  uint64_t busyUs;          // Completed stretches outside vmEventsWait
+  int64_t runningSinceUs;   // Start of the current stretch, 0 while waiting
+};
+
+static EventRing rings[MAX_VMS];
+static VMEventFinalizer finalizers[VM_EVENT_TYPES];
+// Busy time is 64-bit and read from other tasks, so it is updated under a
+// spinlock, once per wait rather than per event
+static portMUX_TYPE busyLock = portMUX_INITIALIZER_UNLOCKED;
+
+void vmEventsSetFinalizer(uint8_t type, VMEventFinalizer finalizer) {
+  if (type < VM_EVENT_TYPES) {
+    finalizers[type] = finalizer;
+  }
+}
+
+void vmEventsAttach(int vmIndex, TaskHandle_t task) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return;
+  }
+
+  EventRing& ring = rings[vmIndex];
+  ring.task.store(nullptr, std::memory_order_relaxed);
+  for (uint32_t i = 0; i < VM_EVENT_QUEUE_SIZE; i++) {
+    ring.cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  ring.enqueuePos.store(0, std::memory_order_relaxed);
+  ring.dequeuePos = 0;
+  ring.dropped.store(0, std::memory_order_relaxed);
+  ring.dispatching = false;
+  ring.dispatched = 0;
+  ring.latencySum = 0;
+  ring.latencyMax = 0;
+  portENTER_CRITICAL(&busyLock);
+  ring.busyUs = 0;
+  ring.runningSinceUs = esp_timer_get_time();
+  portEXIT_CRITICAL(&busyLock);
+  ring.task.store(task, std::memory_order_release);
+}
+
+static void endBusyStretch(EventRing& ring) {
+  portENTER_CRITICAL(&busyLock);
+  if (ring.runningSinceUs) {
+    ring.busyUs += esp_timer_get_time() - ring.runningSinceUs;
+    ring.runningSinceUs = 0;
+  }
+  portEXIT_CRITICAL(&busyLock);
+}
+
+// Producers must be stopped before detaching, so no ISR can still be
+// notifying the task when it is deleted
+void vmEventsDetach(int vmIndex) {
+  if (vmIndex >= 0 && vmIndex < MAX_VMS) {
+    EventRing& ring = rings[vmIndex];
+    ring.task.store(nullptr, std::memory_order_release);
+    endBusyStretch(ring);
+  }
+}
+
+static inline __attribute__((always_inline)) bool ringPush(EventRing& ring, const VMEvent& event) {
+  uint32_t pos = ring.enqueuePos.load(std::memory_order_relaxed);
+  while (true) {
+    EventCell& cell = ring.cells[pos & (VM_EVENT_QUEUE_SIZE - 1)];
+    int32_t diff = (int32_t)(cell.sequence.load(std::memory_order_acquire) - pos);
+    if (diff == 0) {
+      if (ring.enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        cell.event = event;
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      pos = ring.enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+static bool ringPop(EventRing& ring, VMEvent* event) {
+  EventCell& cell = ring.cells[ring.dequeuePos & (VM_EVENT_QUEUE_SIZE - 1)];
+  int32_t diff = (int32_t)(cell.sequence.load(std::memory_order_acquire) - (ring.dequeuePos + 1));
+  if (diff < 0) {
+    return false;
+  }
+  *event = cell.event;
+  cell.sequence.store(ring.dequeuePos + VM_EVENT_QUEUE_SIZE, std::memory_order_release);
+  ring.dequeuePos++;
+  return true;
+}
+
+// The task handle is read once, so a detach between the check and the
+// notify cannot hand a null handle to FreeRTOS
+bool vmEventPost(int vmIndex, const VMEvent& event) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return false;
+  }
+  EventRing& ring = rings[vmIndex];
+  TaskHandle_t task = ring.task.load(std::memory_order_acquire);
+  if (!task || !ringPush(ring, event)) {
+    return false;
+  }
+  xTaskNotifyGive(task);
+  return true;
+}
+
+bool IRAM_ATTR vmEventPostFromISR(int vmIndex, const VMEvent& event, BaseType_t* woken) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return false;
+  }
+  EventRing& ring = rings[vmIndex];
+  TaskHandle_t task = ring.task.load(std::memory_order_acquire);
+  if (!task || !ringPush(ring, event)) {
+    return false;
+  }
+  vTaskNotifyGiveFromISR(task, woken);
+  return true;
+}
+
+// Handlers live in the heap stash, keyed "type:source"
+void vmEventsSetHandler(duk_context* ctx, uint8_t type, uint8_t source, duk_idx_t fnIdx) {
+  fnIdx = duk_normalize_index(ctx, fnIdx);
+
+  duk_push_heap_stash(ctx);
+  if (!duk_get_prop_string(ctx, -1, "eventHandlers")) {
+    duk_pop(ctx);
+    duk_push_object(ctx);
+    duk_dup_top(ctx);
+    duk_put_prop_string(ctx, -3, "eventHandlers");
+  }
+
+  char key[8];
+  snprintf(key, sizeof(key), "%u:%u", type, source);
+  if (duk_is_function(ctx, fnIdx)) {
+    duk_dup(ctx, fnIdx);
+    duk_put_prop_string(ctx, -2, key);
+  } else {
+    duk_del_prop_string(ctx, -1, key);
+  }
+  duk_pop_2(ctx);
+}
+
+// Runs the handlers for every queued event. Returns the number dispatched.
+int vmEventsDispatch(duk_context* ctx, int vmIndex) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return 0;
+  }
+
+  EventRing& ring = rings[vmIndex];
+  if (ring.dispatching) {
+    return 0;  // A handler called wait(); let the outer dispatch continue
+  }
+  ring.dispatching = true;
+
+  int dispatched = 0;
+  VMEvent event;
+  while (dispatched < VM_EVENT_QUEUE_SIZE && ringPop(ring, &event)) {
+    if (event.type < VM_EVENT_TYPES && finalizers[event.type]) {
+      finalizers[event.type](&event);
+    }
+
+    char key[8];
+    snprintf(key, sizeof(key), "%u:%u", event.type, event.source);
+
+    duk_push_heap_stash(ctx);
+    if (duk_get_prop_string(ctx, -1, "eventHandlers")) {
+      if (duk_get_prop_string(ctx, -1, key) && duk_is_function(ctx, -1)) {
+        uint32_t latency = esp_timer_get_time() - event.timestamp;
+        ring.latencySum += latency;
+        ring.latencyMax = max(ring.latencyMax, latency);
+        ring.dispatched++;
+
+        duk_push_number(ctx, (double)event.timestamp);
+        duk_push_int(ctx, event.value);
+        duk_push_uint(ctx, event.count);
+        if (duk_pcall(ctx, 3) != 0) {
+          vmLogPrintf(vmIndex, VM_LOG_ERROR, "Event handler error: %s", duk_safe_to_string(ctx, -1));
+        }
+      }
+      duk_pop(ctx);
+    }
+    duk_pop_2(ctx);
+    dispatched++;
+  }
+
+  ring.dispatching = false;
+  return dispatched;
+}
+
+// Sleeps for ms while running event handlers as events arrive
+void vmEventsWait(duk_context* ctx, int vmIndex, uint32_t ms) {
+  int64_t deadline = esp_timer_get_time() + (int64_t)ms * 1000;
+
+  while (true) {
+    vmEventsDispatch(ctx, vmIndex);
+
+    int64_t remaining = deadline - esp_timer_get_time();
+    if (remaining <= 0) {
+      break;
+    }
+    TickType_t ticks = pdMS_TO_TICKS((remaining + 999) / 1000);
+    EventRing& ring = rings[vmIndex];
+    endBusyStretch(ring);
+    ulTaskNotifyTake(pdTRUE, ticks > 0 ? ticks : 1);
+
+    portENTER_CRITICAL(&busyLock);
+    ring.runningSinceUs = esp_timer_get_time();
+    portEXIT_CRITICAL(&busyLock);
+  }
+}
+
+void vmEventsGetStats(int vmIndex, VMEventStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return;
+  }
+
+  EventRing& ring = rings[vmIndex];
+  stats->dispatched = ring.dispatched;
+  stats->dropped = ring.dropped.load(std::memory_order_relaxed);
+  stats->pending = ring.enqueuePos.load(std::memory_order_relaxed) - ring.dequeuePos;
+  stats->avgLatencyUs = ring.dispatched ? ring.latencySum / ring.dispatched : 0;
+  stats->maxLatencyUs = ring.latencyMax;
+
+  portENTER_CRITICAL(&busyLock);
+  stats->busyUs = ring.busyUs;
+  if (ring.runningSinceUs) {
+    stats->busyUs += esp_timer_get_time() - ring.runningSinceUs;
+  }
+  portEXIT_CRITICAL(&busyLock);
+}
@@ -0,0 +1,321 @@
+// vm_log.cpp
+#include "include/vm_log.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <atomic>
+#include <stdarg.h>
+
+#define LOG_HEADER_BYTES 6          // level, length, 32-bit millis timestamp
+#define LOG_OUTPUT_BYTES 512        // Serial writes are batched up to this size
+#define LOG_DRAIN_INTERVAL_MS 20
+
+// Byte ring of variable-length records. Each VM is the only producer for its
+// own ring and the drain task is the only consumer, so head and tail are the
+// only shared state.
+struct LogRing {
+  uint8_t data[VM_LOG_RING_BYTES];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> written;
+  std::atomic<uint32_t> dropped;
+  std::atomic<uint32_t> rateLimited;
+  uint32_t reportedLosses;     // Drain side: dropped + rateLimited already announced
+  VMLogLevel level;
+  VMLogPolicy policy;
+  uint16_t linesPerSecond;
+  uint32_t tokens;             // Rate limiter budget in thousandths of a line
+  uint32_t lastRefill;
+  char tag[VM_LOG_TAG_LENGTH];
+};
+
+static LogRing rings[VM_LOG_SOURCES];
+static TaskHandle_t drainTask = nullptr;
+static SemaphoreHandle_t systemMutex = nullptr;
+static VMLogSink sink = nullptr;
+
+static const char* levelNames[] = { "debug", "info", "warn", "error" };
+
+static void copyIn(LogRing& ring, uint32_t pos, const void* src, size_t length) {
+  const uint8_t* bytes = (const uint8_t*)src;
+  uint32_t offset = pos & (VM_LOG_RING_BYTES - 1);
+  size_t first = min(length, (size_t)(VM_LOG_RING_BYTES - offset));
+  memcpy(&ring.data[offset], bytes, first);
+  memcpy(ring.data, bytes + first, length - first);
+}
+
+static void copyOut(LogRing& ring, uint32_t pos, void* dst, size_t length) {
+  uint8_t* bytes = (uint8_t*)dst;
+  uint32_t offset = pos & (VM_LOG_RING_BYTES - 1);
+  size_t first = min(length, (size_t)(VM_LOG_RING_BYTES - offset));
+  memcpy(bytes, &ring.data[offset], first);
+  memcpy(bytes + first, ring.data, length - first);
+}
+
+static void wakeDrain() {
+  if (drainTask) {
+    xTaskNotifyGive(drainTask);
+  }
+}
+
+static bool takeToken(LogRing& ring) {
+  if (!ring.linesPerSecond) {
+    return true;
+  }
+
+  uint32_t now = millis();
+  uint32_t elapsed = min(now - ring.lastRefill, (uint32_t)1000);
+  uint32_t capacity = ring.linesPerSecond * 1000;
+  ring.tokens = min(capacity, ring.tokens + elapsed * ring.linesPerSecond);
+  ring.lastRefill = now;
+
+  if (ring.tokens < 1000) {
+    return false;
+  }
+  ring.tokens -= 1000;
+  return true;
+}
+
+static bool ringPush(LogRing& ring, VMLogLevel level, const char* message, size_t length) {
+  size_t record = LOG_HEADER_BYTES + length;
+  uint32_t head = ring.head.load(std::memory_order_relaxed);
+  uint32_t start = millis();
+
+  while (VM_LOG_RING_BYTES - (head - ring.tail.load(std::memory_order_acquire)) < record) {
+    if (ring.policy != VM_LOG_BLOCK || !drainTask || millis() - start >= VM_LOG_BLOCK_MS) {
+      ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    wakeDrain();
+    vTaskDelay(1);
+  }
+
+  uint32_t timestamp = millis();
+  uint8_t header[LOG_HEADER_BYTES] = { level, (uint8_t)length };
+  memcpy(&header[2], &timestamp, sizeof(timestamp));
+  copyIn(ring, head, header, LOG_HEADER_BYTES);
+  copyIn(ring, head + LOG_HEADER_BYTES, message, length);
+  ring.head.store(head + record, std::memory_order_release);
+  ring.written.fetch_add(1, std::memory_order_relaxed);
+
+  // The drain task polls; only hurry it along once the ring is half full
+  if (head + record - ring.tail.load(std::memory_order_relaxed) > VM_LOG_RING_BYTES / 2) {
+    wakeDrain();
+  }
+  return true;
+}
+
+bool vmLogWrite(int source, VMLogLevel level, const char* message, size_t length) {
+  if (source < 0 || source >= VM_LOG_SOURCES) {
+    return false;
+  }
+
+  LogRing& ring = rings[source];
+  if (level < ring.level) {
+    return false;
+  }
+
+  // The drain task ends every line itself
+  while (length > 0 && (message[length - 1] == '\n' || message[length - 1] == '\r')) {
+    length--;
+  }
+  length = min(length, (size_t)VM_LOG_MAX_LINE);
+
+  bool system = source == VM_LOG_SYSTEM && systemMutex;
+  if (system) {
+    xSemaphoreTake(systemMutex, portMAX_DELAY);
+  }
+
+  bool ok = takeToken(ring);
+  if (ok) {
+    ok = ringPush(ring, level, message, length);
+  } else {
+    ring.rateLimited.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  if (system) {
+    xSemaphoreGive(systemMutex);
+  }
+  return ok;
+}
+
+bool vmLogPrintf(int source, VMLogLevel level, const char* format, ...) {
+  if (source < 0 || source >= VM_LOG_SOURCES || level < rings[source].level) {
+    return false;
+  }
+
+  char message[VM_LOG_MAX_LINE + 1];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  if (length < 0) {
+    return false;
+  }
+  return vmLogWrite(source, level, message, min((size_t)length, (size_t)VM_LOG_MAX_LINE));
+}
+
+// Announces lines lost since the last report, so gaps in the output are visible
+static size_t reportLosses(LogRing& ring, char* out, size_t space) {
+  uint32_t dropped = ring.dropped.load(std::memory_order_relaxed);
+  uint32_t limited = ring.rateLimited.load(std::memory_order_relaxed);
+  uint32_t losses = dropped + limited;
+  if (losses == ring.reportedLosses) {
+    return 0;
+  }
+
+  int length = snprintf(out, space, "%s: %lu lines lost (%lu dropped, %lu rate limited in total)\r\n",
+    ring.tag, (unsigned long)(losses - ring.reportedLosses), (unsigned long)dropped, (unsigned long)limited);
+  ring.reportedLosses = losses;
+  return length > 0 ? min((size_t)length, space - 1) : 0;
+}
+
+static void logDrainTask(void* parameter) {
+  static char output[LOG_OUTPUT_BYTES];
+  char text[VM_LOG_MAX_LINE];
+  size_t used = 0;
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_DRAIN_INTERVAL_MS));
+
+    for (int source = 0; source < VM_LOG_SOURCES; source++) {
+      LogRing& ring = rings[source];
+      uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+      uint32_t head = ring.head.load(std::memory_order_acquire);
+
+      while (tail != head) {
+        uint8_t header[LOG_HEADER_BYTES];
+        copyOut(ring, tail, header, LOG_HEADER_BYTES);
+        uint8_t length = header[1];
+        uint32_t timestamp;
+        memcpy(&timestamp, &header[2], sizeof(timestamp));
+        copyOut(ring, tail + LOG_HEADER_BYTES, text, length);
+        tail += LOG_HEADER_BYTES + length;
+        ring.tail.store(tail, std::memory_order_release);
+
+        // Leave room for the longest formatted line before appending
+        if (used > LOG_OUTPUT_BYTES - (VM_LOG_MAX_LINE + VM_LOG_TAG_LENGTH + 24)) {
+          Serial.write((const uint8_t*)output, used);
+          used = 0;
+        }
+        int written = snprintf(&output[used], LOG_OUTPUT_BYTES - used, "%lu.%03lu %c %s: %.*s\r\n",
+          (unsigned long)(timestamp / 1000), (unsigned long)(timestamp % 1000),
+          "DIWE"[header[0] & 3], ring.tag, (int)length, text);
+        if (written > 0) {
+          used += min((size_t)written, LOG_OUTPUT_BYTES - used - 1);
+        }
+        if (sink) {
+          sink(source, (VMLogLevel)(header[0] & 3), timestamp, ring.tag, text, length);
+        }
+      }
+
+      if (used > LOG_OUTPUT_BYTES / 2) {
+        Serial.write((const uint8_t*)output, used);
+        used = 0;
+      }
+      used += reportLosses(ring, &output[used], LOG_OUTPUT_BYTES - used);
+    }
+
+    if (used > 0) {
+      Serial.write((const uint8_t*)output, used);
+      used = 0;
+    }
+    if (sink) {
+      sink(-1, VM_LOG_INFO, millis(), nullptr, nullptr, 0);
+    }
+  }
+}
+
+void vmLogBegin() {
+  if (drainTask) {
+    return;
+  }
+
+  for (int source = 0; source < VM_LOG_SOURCES; source++) {
+    rings[source].level = VM_LOG_INFO;
+    if (source == VM_LOG_SYSTEM) {
+      strlcpy(rings[source].tag, "system", VM_LOG_TAG_LENGTH);
+    } else {
+      snprintf(rings[source].tag, VM_LOG_TAG_LENGTH, "vm%d", source);
+    }
+  }
+
+  systemMutex = xSemaphoreCreateMutex();
+  // Lowest useful priority: logging must never hold up a VM or the network
+  xTaskCreatePinnedToCore(logDrainTask, "Log_Drain", 4096, nullptr, 1, &drainTask, 0);
+}
+
+void vmLogSetSink(VMLogSink newSink) {
+  sink = newSink;
+}
+
+void vmLogAttach(int source, const char* tag) {
+  if (source < 0 || source >= VM_LOG_SOURCES) {
+    return;
+  }
+
+  LogRing& ring = rings[source];
+  ring.level = VM_LOG_INFO;
+  ring.policy = VM_LOG_DROP;
+  ring.linesPerSecond = 0;
+  ring.written.store(0, std::memory_order_relaxed);
+  ring.dropped.store(0, std::memory_order_relaxed);
+  ring.rateLimited.store(0, std::memory_order_relaxed);
+  ring.reportedLosses = 0;
+  vmLogSetTag(source, tag);
+}
+
+void vmLogSetLevel(int source, VMLogLevel level) {
+  if (source >= 0 && source < VM_LOG_SOURCES) {
+    rings[source].level = level;
+  }
+}
+
+void vmLogSetPolicy(int source, VMLogPolicy policy, uint16_t linesPerSecond) {
+  if (source < 0 || source >= VM_LOG_SOURCES) {
+    return;
+  }
+
+  LogRing& ring = rings[source];
+  ring.policy = policy;
+  ring.linesPerSecond = linesPerSecond;
+  ring.tokens = linesPerSecond * 1000;
+  ring.lastRefill = millis();
+}
+
+void vmLogSetTag(int source, const char* tag) {
+  if (source >= 0 && source < VM_LOG_SOURCES && tag && *tag) {
+    strlcpy(rings[source].tag, tag, VM_LOG_TAG_LENGTH);
+  }
+}
+
+bool vmLogParseLevel(const char* name, VMLogLevel* level) {
+  for (int i = 0; i <= VM_LOG_ERROR; i++) {
+    if (strcasecmp(name, levelNames[i]) == 0) {
+      *level = (VMLogLevel)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* vmLogLevelName(VMLogLevel level) {
+  return level <= VM_LOG_ERROR ? levelNames[level] : "?";
+}
+
+void vmLogGetStats(int source, VMLogStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (source < 0 || source >= VM_LOG_SOURCES) {
+    return;
+  }
+
+  LogRing& ring = rings[source];
+  stats->written = ring.written.load(std::memory_order_relaxed);
+  stats->dropped = ring.dropped.load(std::memory_order_relaxed);
+  stats->rateLimited = ring.rateLimited.load(std::memory_order_relaxed);
+  stats->pendingBytes = ring.head.load(std::memory_order_relaxed) - ring.tail.load(std::memory_order_relaxed);
+  stats->level = ring.level;
+  stats->policy = ring.policy;
+  stats->linesPerSecond = ring.linesPerSecond;
+  strlcpy(stats->tag, ring.tag, VM_LOG_TAG_LENGTH);
+}
@@ -3,13 +3,27 @@
 #include "include/networking.h" // For UDP 
 #include "include/file_system.h" // For SPIFFS
 #include "include/duktape_bindings.h"
+#include "include/adc_stream.h"
+#include "include/vm_events.h"
+#include "include/vm_timers.h"
+#include "include/gpio_interrupts.h"
+#include "include/touch_events.h"
+#include "include/ledc_manager.h"
+#include "include/rmt_output.h"
+#include "include/spi_bus.h"
+#include "include/vm_log.h"
+#include "include/vm_perf.h"
+#include "include/net_manager.h"
+#include "include/msg_link.h"
 #include <FFat.h>
+#include <atomic>
 
 // Initialize these here (declared as extern in the header)
 VM vms[MAX_VMS];
 int vmCount = 0;
-SemaphoreHandle_t pinMutexes[40]; 
-bool pinInUse[40] = {false}; // Initialize pinInUse array
+
+// Owner of each pin, stored as vmIndex + 1 so that zero-initialization means free
+static std::atomic<uint8_t> pinOwners[NUM_PINS];
 
 // Helper function to get current time in milliseconds.
 unsigned long get_ms() {
@@ -21,6 +35,49 @@ bool isEnoughMemoryAvailable(size_t memoryNeeded) {
   return ESP.getFreeHeap() > memoryNeeded + 16384; 
 }
 
+// Duktape allocations carry their size in a header so each VM's heap usage
+// is exact. A heap is only used by one task at a time, so memoryAllocated
+// needs no lock.
+#define VM_HEAP_HEADER 8   // Keeps the returned pointer 8-byte aligned
+
+static void* vmHeapAlloc(void* udata, duk_size_t size) {
+  uint8_t* block = (uint8_t*)malloc(size + VM_HEAP_HEADER);
+  if (!block) {
+    return nullptr;
+  }
+  *(size_t*)block = size;
+  ((VM*)udata)->memoryAllocated += size;
+  return block + VM_HEAP_HEADER;
+}
+
+static void vmHeapFree(void* udata, void* ptr) {
+  if (ptr) {
+    uint8_t* block = (uint8_t*)ptr - VM_HEAP_HEADER;
+    ((VM*)udata)->memoryAllocated -= *(size_t*)block;
+    free(block);
+  }
+}
+
+static void* vmHeapRealloc(void* udata, void* ptr, duk_size_t size) {
+  if (!ptr) {
+    return vmHeapAlloc(udata, size);
+  }
+  if (size == 0) {
+    vmHeapFree(udata, ptr);
+    return nullptr;
+  }
+
+  uint8_t* block = (uint8_t*)ptr - VM_HEAP_HEADER;
+  size_t oldSize = *(size_t*)block;
+  block = (uint8_t*)realloc(block, size + VM_HEAP_HEADER);
+  if (!block) {
+    return nullptr;
+  }
+  *(size_t*)block = size;
+  ((VM*)udata)->memoryAllocated += size - oldSize;
+  return block + VM_HEAP_HEADER;
+}
+
 // === VM Management ===
 
 // Interrupt handler for VM execution
@@ -43,10 +100,12 @@ duk_ret_t vm_interrupt_handler(duk_context* ctx) {
   return DUK_EXEC_SUCCESS;
 }
 
-int createVM(const String& filename, const char* content, const String& fullPath) {
+// Claims a slot and sets up its message queue and heap; the script still
+// has to be compiled onto it
+static int prepareVM(const String& filename, const String& fullPath) {
   int vmIndex = findFreeVMSlot();
   if (vmIndex < 0) {
-    Serial.println("No free VM slots");
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "No free VM slots");
     return -1;
   }
 
@@ -59,34 +118,51 @@ int createVM(const String& filename, const char* content, const String& fullPath
   vms[vmIndex].forceTerminate = false;
   vms[vmIndex].lastFileCheckTime = millis();
   vms[vmIndex].lastRunTime = millis();
-  vms[vmIndex].memoryAllocated = 8192;
+  vms[vmIndex].memoryAllocated = 0;
 
   // Create message queue
   vms[vmIndex].messageQueue = xQueueCreate(10, MAX_MESSAGE_LENGTH);
   if (!vms[vmIndex].messageQueue) {
-    Serial.println("Failed to create message queue");
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Failed to create message queue");
     return -1;
   }
 
   // Create Duktape context
-  vms[vmIndex].ctx = duk_create_heap_default();
+  vms[vmIndex].ctx = duk_create_heap(vmHeapAlloc, vmHeapRealloc, vmHeapFree, &vms[vmIndex], nullptr);
   if (!vms[vmIndex].ctx) {
-    Serial.println("Failed to create JS context");
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Failed to create JS context");
     vQueueDelete(vms[vmIndex].messageQueue);
     return -1;
   }
 
-  // Initialize mutex
-  vms[vmIndex].pinMutex = xSemaphoreCreateMutex();
-  if (!vms[vmIndex].pinMutex) {
-    Serial.println("Failed to create pin mutex");
-    vQueueDelete(vms[vmIndex].messageQueue);
-    duk_destroy_heap(vms[vmIndex].ctx);
-    return -1;
-  }
+  // Lines are tagged with the script name, without the leading slash
+  vmLogAttach(vmIndex, filename.startsWith("/") ? filename.c_str() + 1 : filename.c_str());
 
   // Register built-in functions
   registerDuktapeBindings(vms[vmIndex].ctx, vmIndex);
+  return vmIndex;
+}
+
+// Stores the compiled function on top of the stack and starts the VM task
+static int launchVM(int vmIndex) {
+  // Store the compiled function
+  duk_put_global_string(vms[vmIndex].ctx, "\xFF\xFFvm_func");
+
+  // Start the VM task
+  if (startVM(vmIndex) != 0) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Failed to start VM task");
+    destroyVM(vmIndex);
+    return -1;
+  }
+
+  return vmIndex;
+}
+
+int createVM(const String& filename, const char* content, const String& fullPath) {
+  int vmIndex = prepareVM(filename, fullPath);
+  if (vmIndex < 0) {
+    return -1;
+  }
 
   // Load and compile the JavaScript code
   String wrappedCode = "(function() {\n";
@@ -97,7 +173,7 @@ int createVM(const String& filename, const char* content, const String& fullPath
   
   duk_push_string(vms[vmIndex].ctx, wrappedCode.c_str());
   if (duk_peval(vms[vmIndex].ctx) != 0) {
-    Serial.printf("Failed to compile %s: %s\n", 
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Failed to compile %s: %s",
       filename.c_str(), 
       duk_safe_to_string(vms[vmIndex].ctx, -1)
     );
@@ -106,32 +182,68 @@ int createVM(const String& filename, const char* content, const String& fullPath
     return -1;
   }
 
-  // Store the compiled function
-  duk_put_global_string(vms[vmIndex].ctx, "\xFF\xFFvm_func");
+  return launchVM(vmIndex);
+}
 
-  // Start the VM task
-  if (startVM(vmIndex) != 0) {
-    Serial.println("Failed to start VM task");
+static duk_ret_t loadBytecode(duk_context* ctx, void* udata) {
+  duk_load_function(ctx);
+  return 1;
+}
+
+int createVMFromBytecode(const String& filename, const uint8_t* bytecode, size_t length, const String& fullPath) {
+  int vmIndex = prepareVM(filename, fullPath);
+  if (vmIndex < 0) {
+    return -1;
+  }
+
+  duk_context* ctx = vms[vmIndex].ctx;
+  memcpy(duk_push_fixed_buffer(ctx, length), bytecode, length);
+  if (duk_safe_call(ctx, loadBytecode, nullptr, 1, 1) != DUK_EXEC_SUCCESS) {
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_ERROR, "Failed to load bytecode %s: %s",
+      filename.c_str(), duk_safe_to_string(ctx, -1));
+    duk_pop(ctx);
     destroyVM(vmIndex);
     return -1;
   }
 
-  return vmIndex;
+  return launchVM(vmIndex);
+}
+
+// Stops everything a VM may have claimed. Every event source, interrupts,
+// the network task and RMT completions included, goes before the event ring
+// is detached so nothing can post to the VM's task once it is gone.
+static void releaseVMResources(int vmIndex) {
+  msgLinkDetachVM(vmIndex);
+  vmTimersRelease(vmIndex);
+  gpioInterruptsRelease(vmIndex);
+  touchEventsRelease(vmIndex);
+  adcStreamStop(vmIndex);
+  rmtOutputRelease(vmIndex);
+  netManagerRelease(vmIndex);
+  vmEventsDetach(vmIndex);
+  ledcManagerRelease(vmIndex);
+  spiBusRelease(vmIndex);
+  releasePins(vmIndex);
 }
 
 void vmTask(void* parameter) {
   int vmIndex = *((int*)parameter);
   vPortFree(parameter);
+
+  vmEventsAttach(vmIndex, xTaskGetCurrentTaskHandle());
+  vmPerfAttach(vmIndex);
+  msgLinkAttachVM(vmIndex, vms[vmIndex].filename.c_str(), vms[vmIndex].messageQueue);
   
   while (vms[vmIndex].running) {
     if (!vms[vmIndex].needsTermination) {
       executeVM(vmIndex);
-      vTaskDelay(pdMS_TO_TICKS(100));
+      vmEventsWait(vms[vmIndex].ctx, vmIndex, 100);
     } else {
       break;
     }
   }
 
+  releaseVMResources(vmIndex);
   vms[vmIndex].running = false;
   vTaskDelete(NULL);
 }
@@ -147,7 +259,7 @@ void executeVM(int vmIndex) {
     
     if (duk_pcall(vms[vmIndex].ctx, 0) != 0) {
       const char* error = duk_safe_to_string(vms[vmIndex].ctx, -1);
-      Serial.printf("Runtime error in %s: %s\n",
+      vmLogPrintf(vmIndex, VM_LOG_ERROR, "Runtime error in %s: %s",
         vms[vmIndex].filename.c_str(),
         error
       );
@@ -169,6 +281,7 @@ int startVM(int vmIndex) {
   vms[vmIndex].running = true;
   vms[vmIndex].needsTermination = false;
   vms[vmIndex].forceTerminate = false;
+  vms[vmIndex].starts++;
 
   int* taskParam = (int*)pvPortMalloc(sizeof(int));
   if (!taskParam) {
@@ -227,6 +340,8 @@ void stopVM(int vmIndex) {
       timeout--;
     }
     
+    releaseVMResources(vmIndex);
+
     // Force kill if still running
     if (vms[vmIndex].running) {
       vms[vmIndex].forceTerminate = true;
@@ -236,11 +351,6 @@ void stopVM(int vmIndex) {
     }
     
     // Clean up resources
-    if (vms[vmIndex].pinMutex) {
-      vSemaphoreDelete(vms[vmIndex].pinMutex);
-      vms[vmIndex].pinMutex = nullptr;
-    }
-
     if (vms[vmIndex].messageQueue) {
       vQueueDelete(vms[vmIndex].messageQueue);
       vms[vmIndex].messageQueue = nullptr;
@@ -251,7 +361,7 @@ void stopVM(int vmIndex) {
     vms[vmIndex].forceTerminate = false;
     vms[vmIndex].taskHandle = nullptr;
     
-    Serial.printf("Stopped VM %d\n", vmIndex);
+    vmLogPrintf(VM_LOG_SYSTEM, VM_LOG_INFO, "Stopped VM %d", vmIndex);
   }
 }
 
@@ -261,4 +371,47 @@ void monitorAndRescheduleVMs() {
       checkFileChanges(i);
     }
   }
-}
\ No newline at end of file
+}
+
+// === Pin Ownership ===
+
+// Claims a pin for a VM. The common case of a VM touching a pin it already
+// owns is a single atomic load; a pin owned by another VM fails immediately.
+bool claimPin(int pin, int vmIndex) {
+  if (pin < 0 || pin >= NUM_PINS || vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return false;
+  }
+
+  uint8_t self = vmIndex + 1;
+  uint8_t owner = pinOwners[pin].load(std::memory_order_acquire);
+  if (owner == self) {
+    return true;
+  }
+  if (owner != 0) {
+    return false;
+  }
+  return pinOwners[pin].compare_exchange_strong(owner, self, std::memory_order_acq_rel);
+}
+
+bool releasePin(int pin, int vmIndex) {
+  if (pin < 0 || pin >= NUM_PINS || vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return false;
+  }
+
+  uint8_t self = vmIndex + 1;
+  return pinOwners[pin].compare_exchange_strong(self, 0, std::memory_order_acq_rel);
+}
+
+void releasePins(int vmIndex) {
+  for (int pin = 0; pin < NUM_PINS; pin++) {
+    releasePin(pin, vmIndex);
+  }
+}
+
+// Returns the owning VM index, or -1 if the pin is free
+int getPinOwner(int pin) {
+  if (pin < 0 || pin >= NUM_PINS) {
+    return -1;
+  }
+  return (int)pinOwners[pin].load(std::memory_order_acquire) - 1;
+}
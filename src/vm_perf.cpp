@@ -0,0 +1,173 @@
+// vm_perf.cpp
+#include "include/vm_perf.h"
+#include "include/vm_manager.h"
+#include <esp_timer.h>
+
+struct PerfMark {
+  char name[VM_PERF_NAME_LENGTH];
+  int64_t timeUs;
+};
+
+// Marks are private to the VM task. Spans are written by the VM task and read
+// by whoever dumps them, so the span ring is guarded by a spinlock held only
+// for the copy of one record.
+struct PerfState {
+  int64_t originUs;
+  PerfMark marks[VM_PERF_MARKS];
+  uint8_t nextMark;
+  VMPerfSpan spans[VM_PERF_SPANS];
+  uint32_t recorded;
+};
+
+static PerfState states[MAX_VMS];
+static portMUX_TYPE spansLock = portMUX_INITIALIZER_UNLOCKED;
+
+void vmPerfAttach(int vmIndex) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return;
+  }
+
+  PerfState& state = states[vmIndex];
+  portENTER_CRITICAL(&spansLock);
+  state.recorded = 0;
+  portEXIT_CRITICAL(&spansLock);
+  memset(state.marks, 0, sizeof(state.marks));
+  state.nextMark = 0;
+  state.originUs = esp_timer_get_time();
+}
+
+double vmPerfNow(int vmIndex) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return 0;
+  }
+  return (esp_timer_get_time() - states[vmIndex].originUs) / 1000.0;
+}
+
+static PerfMark* findMark(PerfState& state, const char* name) {
+  for (int i = 0; i < VM_PERF_MARKS; i++) {
+    if (state.marks[i].name[0] && strncmp(state.marks[i].name, name, VM_PERF_NAME_LENGTH - 1) == 0) {
+      return &state.marks[i];
+    }
+  }
+  return nullptr;
+}
+
+void vmPerfMark(int vmIndex, const char* name) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS || !*name) {
+    return;
+  }
+
+  int64_t now = esp_timer_get_time();
+  PerfState& state = states[vmIndex];
+  PerfMark* mark = findMark(state, name);
+  if (!mark) {
+    mark = &state.marks[state.nextMark];
+    state.nextMark = (state.nextMark + 1) % VM_PERF_MARKS;
+    strlcpy(mark->name, name, VM_PERF_NAME_LENGTH);
+  }
+  mark->timeUs = now;
+}
+
+int64_t vmPerfMeasure(int vmIndex, const char* name, const char* startMark, const char* endMark) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return -1;
+  }
+
+  int64_t now = esp_timer_get_time();
+  PerfState& state = states[vmIndex];
+  int64_t start = state.originUs;
+  int64_t end = now;
+
+  if (startMark) {
+    PerfMark* mark = findMark(state, startMark);
+    if (!mark) {
+      return -1;
+    }
+    start = mark->timeUs;
+  }
+  if (endMark) {
+    PerfMark* mark = findMark(state, endMark);
+    if (!mark) {
+      return -1;
+    }
+    end = mark->timeUs;
+  }
+
+  int64_t duration = max(end - start, (int64_t)0);
+  VMPerfSpan span;
+  strlcpy(span.name, name, VM_PERF_NAME_LENGTH);
+  span.startUs = start;
+  span.durationUs = (uint32_t)min(duration, (int64_t)UINT32_MAX);
+
+  portENTER_CRITICAL(&spansLock);
+  state.spans[state.recorded & (VM_PERF_SPANS - 1)] = span;
+  state.recorded++;
+  portEXIT_CRITICAL(&spansLock);
+  return duration;
+}
+
+void vmPerfClear(int vmIndex) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return;
+  }
+
+  PerfState& state = states[vmIndex];
+  portENTER_CRITICAL(&spansLock);
+  state.recorded = 0;
+  portEXIT_CRITICAL(&spansLock);
+  memset(state.marks, 0, sizeof(state.marks));
+  state.nextMark = 0;
+}
+
+void vmPerfDump(int vmIndex, Print& out) {
+  if (vmIndex < 0 || vmIndex >= MAX_VMS) {
+    return;
+  }
+
+  // Only the serial console dumps, so one snapshot buffer is enough
+  static VMPerfSpan snapshot[VM_PERF_SPANS];
+  PerfState& state = states[vmIndex];
+
+  portENTER_CRITICAL(&spansLock);
+  uint32_t recorded = state.recorded;
+  uint32_t kept = min(recorded, (uint32_t)VM_PERF_SPANS);
+  portEXIT_CRITICAL(&spansLock);
+
+  for (uint32_t i = 0; i < kept; i++) {
+    portENTER_CRITICAL(&spansLock);
+    snapshot[i] = state.spans[(recorded - kept + i) & (VM_PERF_SPANS - 1)];
+    portEXIT_CRITICAL(&spansLock);
+  }
+
+  out.printf("VM %d: %lu spans measured, last %lu kept\n", vmIndex, (unsigned long)recorded, (unsigned long)kept);
+  for (uint32_t i = 0; i < kept; i++) {
+    const VMPerfSpan& span = snapshot[i];
+    out.printf("  %10.3f ms  %-*s %lu us\n", (span.startUs - state.originUs) / 1000.0,
+      VM_PERF_NAME_LENGTH - 1, span.name, (unsigned long)span.durationUs);
+  }
+
+  // Per-name summary, in order of first appearance
+  for (uint32_t i = 0; i < kept; i++) {
+    bool seen = false;
+    for (uint32_t j = 0; j < i && !seen; j++) {
+      seen = strcmp(snapshot[j].name, snapshot[i].name) == 0;
+    }
+    if (seen) {
+      continue;
+    }
+
+    uint32_t count = 0, minUs = UINT32_MAX, maxUs = 0;
+    uint64_t total = 0;
+    for (uint32_t j = i; j < kept; j++) {
+      if (strcmp(snapshot[j].name, snapshot[i].name) == 0) {
+        uint32_t duration = snapshot[j].durationUs;
+        count++;
+        total += duration;
+        minUs = min(minUs, duration);
+        maxUs = max(maxUs, duration);
+      }
+    }
+    out.printf("  %-*s n %lu, avg %lu us, min %lu us, max %lu us\n", VM_PERF_NAME_LENGTH - 1, snapshot[i].name,
+      (unsigned long)count, (unsigned long)(total / count), (unsigned long)minUs, (unsigned long)maxUs);
+  }
+}
@@ -0,0 +1,149 @@
+// vm_timers.cpp
+#include "include/vm_timers.h"
+#include "include/vm_events.h"
+#include "include/vm_manager.h"
+#include <esp_timer.h>
+#include <hal/gpio_ll.h>
+#include <soc/gpio_struct.h>
+
+#define TIMER_TICK_HZ 1000000   // 1 us resolution
+
+struct TimerSlot {
+  hw_timer_t* timer;
+  int owner;          // VM index, -1 when free
+  int pin;            // Toggle mode pin, -1 in event mode
+  bool oneShot;
+  uint32_t level;
+  uint32_t fired;
+};
+
+static TimerSlot slots[VM_TIMER_COUNT] = {
+  { nullptr, -1, -1, false, 0, 0 },
+  { nullptr, -1, -1, false, 0, 0 },
+  { nullptr, -1, -1, false, 0, 0 },
+  { nullptr, -1, -1, false, 0, 0 },
+};
+static portMUX_TYPE slotsLock = portMUX_INITIALIZER_UNLOCKED;
+
+static void IRAM_ATTR onTimerAlarm(void* arg) {
+  TimerSlot* slot = (TimerSlot*)arg;
+  slot->fired++;
+
+  if (slot->pin >= 0) {
+    slot->level ^= 1;
+    gpio_ll_set_level(&GPIO, (gpio_num_t)slot->pin, slot->level);
+    return;
+  }
+
+  VMEvent event = {};
+  event.type = VM_EVENT_TIMER;
+  event.source = slot - slots;
+  event.count = 1;
+  event.value = slot->fired;
+  event.timestamp = esp_timer_get_time();
+
+  BaseType_t woken = pdFALSE;
+  vmEventPostFromISR(slot->owner, event, &woken);
+  if (woken == pdTRUE) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Reserves a slot for vmIndex; a VM may re-arm a slot it already holds
+static bool claimSlot(int vmIndex, int slot) {
+  if (slot < 0 || slot >= VM_TIMER_COUNT) {
+    return false;
+  }
+
+  bool claimed = false;
+  portENTER_CRITICAL(&slotsLock);
+  if (slots[slot].owner < 0 || slots[slot].owner == vmIndex) {
+    slots[slot].owner = vmIndex;
+    claimed = true;
+  }
+  portEXIT_CRITICAL(&slotsLock);
+  return claimed;
+}
+
+static void freeSlot(int slot) {
+  portENTER_CRITICAL(&slotsLock);
+  slots[slot].owner = -1;
+  portEXIT_CRITICAL(&slotsLock);
+}
+
+static void stopSlot(TimerSlot& slot) {
+  if (slot.timer) {
+    timerStop(slot.timer);
+    timerDetachInterrupt(slot.timer);
+    timerEnd(slot.timer);
+    slot.timer = nullptr;
+  }
+}
+
+// The slot and the pin are both claimed before anything touches hardware,
+// so a call that loses either leaves other VMs' timers and pins alone
+static bool startSlot(int vmIndex, int slot, uint64_t periodUs, bool oneShot, int pin) {
+  if (periodUs == 0 || !claimSlot(vmIndex, slot)) {
+    return false;
+  }
+
+  TimerSlot& s = slots[slot];
+  stopSlot(s);
+  if (pin >= 0) {
+    if (!claimPin(pin, vmIndex)) {
+      freeSlot(slot);
+      return false;
+    }
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, LOW);
+  }
+  s.pin = pin;
+  s.oneShot = oneShot;
+  s.level = 0;
+  s.fired = 0;
+
+  s.timer = timerBegin(TIMER_TICK_HZ);
+  if (!s.timer) {
+    freeSlot(slot);
+    return false;
+  }
+  timerAttachInterruptArg(s.timer, onTimerAlarm, &s);
+  timerAlarm(s.timer, periodUs, !oneShot, 0);
+  return true;
+}
+
+bool vmTimerAttach(int vmIndex, int slot, uint64_t periodUs, bool oneShot) {
+  return startSlot(vmIndex, slot, periodUs, oneShot, -1);
+}
+
+bool vmTimerToggle(int vmIndex, int slot, uint64_t periodUs, int pin) {
+  if (pin < 0) {
+    return false;
+  }
+  return startSlot(vmIndex, slot, periodUs, false, pin);
+}
+
+// Only the owner stops its slot, and the slot stays claimed until the
+// timer is torn down so no other VM can start it in between
+bool vmTimerDetach(int vmIndex, int slot) {
+  if (slot < 0 || slot >= VM_TIMER_COUNT) {
+    return false;
+  }
+
+  portENTER_CRITICAL(&slotsLock);
+  bool owned = slots[slot].owner == vmIndex;
+  portEXIT_CRITICAL(&slotsLock);
+  if (!owned) {
+    return false;
+  }
+
+  stopSlot(slots[slot]);
+  freeSlot(slot);
+  return true;
+}
+
+void vmTimersRelease(int vmIndex) {
+  for (int i = 0; i < VM_TIMER_COUNT; i++) {
+    vmTimerDetach(vmIndex, i);
+  }
+}